@@ -46,6 +46,9 @@ extern "C" {
 
 #define cJSON_IsReference 256
 #define cJSON_StringIsConst 512
+#define cJSON_InArena 1024 /* the item and its strings belong to a cJSON_Arena */
+#define cJSON_InSitu 2048 /* the item's strings point into the buffer it was parsed from */
+#define cJSON_Indexed 4096 /* lookups in the array/object go through an index, see cJSON_EnableIndex */
 
 /* The cJSON structure: */
 typedef struct cJSON {
@@ -67,8 +70,13 @@ typedef struct cJSON {
 
 	/* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
 	char *string;
+
+	/* Lookup index of an array or object with cJSON_Indexed, kept up to date by the functions changing it. */
+	struct cJSON_Index *index;
 } cJSON;
 
+typedef struct cJSON_Index cJSON_Index;
+
 typedef struct cJSON_Hooks {
 	void *(*malloc_fn)(size_t sz);
 	void (*free_fn)(void *ptr);
@@ -76,6 +84,11 @@ typedef struct cJSON_Hooks {
 
 typedef int cJSON_bool;
 
+/* Arrays/objects with fewer items than this are scanned, even with an index enabled. */
+#ifndef CJSON_INDEX_MIN
+#define CJSON_INDEX_MIN 16
+#endif
+
 /* Limits how deeply nested arrays/objects can be before cJSON rejects to parse them.
  * This is to prevent stack overflows.
  */
@@ -93,6 +106,20 @@ cJSON *cJSON_Parse(const char *value);
 /* If you supply a ptr in return_parse_end and parsing fails, then return_parse_end will contain a pointer to the error so will match cJSON_GetErrorPtr(). */
 cJSON *cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated);
 
+/* Arena parsing: all items and strings of the tree come from the arena and are released together by resetting or deleting it, no cJSON_Delete needed.
+ * The arena starts in buffer (size bytes, it keeps its own header there), or with buffer NULL in size bytes from the hooks; it grows from the hooks when full.
+ * cJSON_Delete on an arena tree only frees the items added to it from outside the arena. */
+typedef struct cJSON_Arena cJSON_Arena;
+cJSON_Arena *cJSON_CreateArena(void *buffer, size_t size);
+/* Invalidates every tree parsed into the arena, keeping the memory it grew for the next parse */
+void cJSON_ResetArena(cJSON_Arena *arena);
+void cJSON_DeleteArena(cJSON_Arena *arena);
+cJSON *cJSON_ParseInArena(cJSON_Arena *arena, const char *value, const char **return_parse_end, cJSON_bool require_null_terminated);
+
+/* In situ parsing: strings are decoded in the (writable, null terminated) input and valuestring/string point there, no string is allocated or copied.
+ * The input is clobbered, also by a failed parse, and has to outlive the tree. Items come from the arena if given, else from the hooks as with cJSON_Parse. */
+cJSON *cJSON_ParseInSitu(char *value, cJSON_Arena *arena, const char **return_parse_end, cJSON_bool require_null_terminated);
+
 /* Render a cJSON entity to text for transfer/storage. */
 char *cJSON_Print(const cJSON *item);
 /* Render a cJSON entity to text for transfer/storage without any formatting. */
@@ -113,6 +140,12 @@ cJSON *cJSON_GetArrayItem(const cJSON *array, int index);
 cJSON *cJSON_GetObjectItem(const cJSON * const object, const char * const string);
 cJSON *cJSON_GetObjectItemCaseSensitive(const cJSON * const object, const char * const string);
 cJSON_bool cJSON_HasObjectItem(const cJSON *object, const char *string);
+/* Index the array/object (with recurse, the ones below it too) to make GetArrayItem, GetArraySize and GetObjectItem O(1) on it: built here, then kept
+ * up to date by appending and rebuilt by other changes through the API. Lookups only read it, so threads may share an indexed tree as long as none
+ * changes it. Changing items or names by hand needs cJSON_InvalidateIndex, which rebuilds it. Returns 0 if out of memory, or for arena items and
+ * references, which are not indexed. */
+cJSON_bool cJSON_EnableIndex(cJSON *item, cJSON_bool recurse);
+void cJSON_InvalidateIndex(cJSON *item);
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
 const char *cJSON_GetErrorPtr(void);
 
@@ -1,10 +1,34 @@
 #ifndef _LINUX_KFIFO_H
 #define _LINUX_KFIFO_H
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define KFIFO_CACHELINE_SIZE 64
+#define __kfifo_cacheline_aligned __attribute__((aligned(KFIFO_CACHELINE_SIZE)))
+
+/*
+ * smp_load_acquire()/smp_store_release() pair the index published by one
+ * side with the data it covers, so the other side never sees 'in' move
+ * before the bytes behind it are visible (and vice versa for 'out').
+ */
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 typedef struct spinlock {
     unsigned int count;
 } spinlock_t;
 
+#define SPIN_LOCK_UNLOCKED { 0 }
+
 /*
  * kfifo->size的值总是2的幂，好处--对kfifo->size取模运算可以转化为与运算，如：
  * kfifo->in % kfifo->size 可以转化为 kfifo->in & (kfifo->size – 1)
@@ -18,21 +42,55 @@ struct kfifo {
 	unsigned int   in;	    /* data is added at offset (in % size) */
 	unsigned int   out;	    /* data is extracted from off. (out % size) */
 	spinlock_t    *lock;	/* protects concurrent modifications */
+	unsigned int   mirrored;	/* buffer is mapped twice back-to-back */
 };
 
-#define spin_lock(lock) do {} while (0)
-#define spin_unlock(lock) do {} while (0)
+/*
+ * A NULL lock means the caller guarantees one reader and one writer,
+ * in which case __kfifo_put()/__kfifo_get() are safe on their own.
+ */
+static inline void spin_lock(spinlock_t *lock)
+{
+    if (!lock)
+        return;
 
-#define spin_lock_irqsave(lock) do {} while (0)
-#define spin_unlock_irqrestore(lock) do {} while (0)
+    while (__atomic_exchange_n(&lock->count, 1, __ATOMIC_ACQUIRE)) {
+        while (READ_ONCE(lock->count))
+            cpu_relax();
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    if (lock)
+        smp_store_release(&lock->count, 0);
+}
+
+#define spin_lock_irqsave(lock) spin_lock(lock)
+#define spin_unlock_irqrestore(lock) spin_unlock(lock)
 
 
 extern struct kfifo *kfifo_init(unsigned char *buffer, unsigned int size, spinlock_t *lock);
 extern struct kfifo *kfifo_alloc(unsigned int size, spinlock_t *lock);
+extern struct kfifo *kfifo_alloc_mirrored(unsigned int size, spinlock_t *lock);
 extern void kfifo_free(struct kfifo *fifo);
 extern unsigned int __kfifo_put(struct kfifo *fifo, unsigned char *buffer, unsigned int len);
 extern unsigned int __kfifo_get(struct kfifo *fifo, unsigned char *buffer, unsigned int len);
 
+/*
+ * Zero-copy access: the ring is handed out as up to two iovecs, the
+ * part up to the end of the buffer and the part wrapped to its start.
+ * The producer reserves/commits, the consumer peeks/consumes; like
+ * __kfifo_put()/__kfifo_get() these need no lock with one of each.
+ * On a mirrored fifo vec[0] always covers the whole region.
+ */
+extern unsigned int __kfifo_reserve(struct kfifo *fifo, struct iovec vec[2], unsigned int len);
+extern void __kfifo_commit(struct kfifo *fifo, unsigned int len);
+extern unsigned int __kfifo_peek(struct kfifo *fifo, struct iovec vec[2], unsigned int len);
+extern void __kfifo_consume(struct kfifo *fifo, unsigned int len);
+extern ssize_t kfifo_fill_fd(struct kfifo *fifo, int fd, unsigned int len);
+extern ssize_t kfifo_drain_fd(struct kfifo *fifo, int fd, unsigned int len);
+
 /*
  * __kfifo_reset - removes the entire FIFO contents, no locking version
  * @fifo: the fifo to be emptied.
@@ -93,9 +151,10 @@ static inline unsigned int kfifo_get(struct kfifo *fifo,
     ret = __kfifo_get(fifo, buffer, len);
     /*
 	 * optimization: if the FIFO is empty, set the indices to 0
-	 * so we don't wrap the next time
+	 * so we don't wrap the next time. Only legal under the lock,
+	 * a lockless reader must never touch 'in'.
 	 */
-	if (fifo->in == fifo->out)
+	if (fifo->lock && fifo->in == fifo->out)
         fifo->in = fifo->out = 0;
     spin_unlock_irqrestore(fifo->lock);
 
@@ -108,7 +167,7 @@ static inline unsigned int kfifo_get(struct kfifo *fifo,
  */
 static inline unsigned int __kfifo_len(struct kfifo *fifo)
 {
-    return fifo->in - fifo->out;
+    return smp_load_acquire(&fifo->in) - smp_load_acquire(&fifo->out);
 }            
 
 /*
@@ -141,5 +200,62 @@ static inline int kfifo_is_empty(struct kfifo *fifo)
     return ret == 0;
 }
 
+/*
+ * kfifo_spsc - lock-free single-producer/single-consumer byte FIFO
+ *
+ * 'in' is only written by the producer and 'out' only by the consumer,
+ * each on its own cache line so the two sides never false-share. Each
+ * side also keeps a private copy of the other side's index and only
+ * re-reads the shared one when the cached value says full/empty.
+ */
+struct kfifo_spsc {
+    unsigned char *buffer;	/* the buffer holding the data */
+    unsigned int   size;	/* the size of the allocated buffer */
+
+    unsigned int   in __kfifo_cacheline_aligned;	/* producer index */
+    unsigned int   out_cache;	/* producer's snapshot of 'out' */
+
+    unsigned int   out __kfifo_cacheline_aligned;	/* consumer index */
+    unsigned int   in_cache;	/* consumer's snapshot of 'in' */
+} __kfifo_cacheline_aligned;
+
+extern struct kfifo_spsc *kfifo_spsc_alloc(unsigned int size);
+extern void kfifo_spsc_free(struct kfifo_spsc *fifo);
+extern unsigned int kfifo_spsc_put(struct kfifo_spsc *fifo,
+				   const unsigned char *buffer, unsigned int len);
+extern unsigned int kfifo_spsc_get(struct kfifo_spsc *fifo,
+				   unsigned char *buffer, unsigned int len);
+
+/*
+ * kfifo_spsc_len - returns the number of bytes available in the FIFO
+ * @fifo: the fifo to be used.
+ */
+static inline unsigned int kfifo_spsc_len(struct kfifo_spsc *fifo)
+{
+    return smp_load_acquire(&fifo->in) - smp_load_acquire(&fifo->out);
+}
+
+/*
+ * kfifo_mpmc - bounded multi-producer/multi-consumer record FIFO
+ *
+ * Holds up to 'count' fixed-size records of 'esize' bytes. Every slot
+ * carries a sequence number which tells producers and consumers whose
+ * turn it is, so a slot is claimed with a single CAS on 'in' or 'out'
+ * and no lock is ever taken.
+ */
+struct kfifo_mpmc {
+    unsigned char *cells;	/* count slots of cell_size bytes */
+    unsigned int   mask;	/* count - 1, count is a power of 2 */
+    unsigned int   esize;	/* record size */
+    unsigned int   cell_size;	/* sequence header + record, padded */
+
+    unsigned int   in __kfifo_cacheline_aligned;	/* next slot to fill */
+    unsigned int   out __kfifo_cacheline_aligned;	/* next slot to drain */
+} __kfifo_cacheline_aligned;
+
+extern struct kfifo_mpmc *kfifo_mpmc_alloc(unsigned int count, unsigned int esize);
+extern void kfifo_mpmc_free(struct kfifo_mpmc *fifo);
+extern int kfifo_mpmc_put(struct kfifo_mpmc *fifo, const void *rec);
+extern int kfifo_mpmc_get(struct kfifo_mpmc *fifo, void *rec);
 
 #endif
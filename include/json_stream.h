@@ -0,0 +1,91 @@
+#ifndef _JSON_STREAM_H
+#define _JSON_STREAM_H
+
+#include <stddef.h>
+
+#include <cJSON.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Incremental JSON parsing, see src/json/json_stream.c: input is pushed
+ * in chunks as it arrives and every token is reported as an event, the
+ * document is never held whole.  Memory is bounded by the longest string
+ * or number (max_token) and the nesting (max_depth).  The input is strict
+ * JSON; a stream may hold several values one after the other.
+ */
+typedef struct json_stream json_stream_t;
+
+enum json_event_type {
+	JSON_BEGIN_OBJECT,
+	JSON_END_OBJECT,
+	JSON_BEGIN_ARRAY,
+	JSON_END_ARRAY,
+	JSON_KEY,
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL,
+};
+
+typedef struct {
+	int type;
+	int depth;		/* 0 for a top level value, members are one deeper */
+	const char *text;	/* key or string decoded, number as written; '\0' terminated */
+	size_t len;
+	double number;		/* JSON_NUMBER */
+} json_event_t;
+
+/* text is only valid during the call; return nonzero to stop the stream */
+typedef int (*json_event_func)(const json_event_t *event, void *user_data);
+
+#define JSON_STREAM_MAX_TOKEN	4096
+#define JSON_STREAM_MAX_DEPTH	64
+
+/* 0 for max_token or max_depth takes the defaults above */
+json_stream_t *json_stream_new(json_event_func on_event, void *user_data,
+				size_t max_token, int max_depth);
+void json_stream_free(json_stream_t *stream);
+
+/*
+ * Return 0, or -1 with errno EINVAL for bad JSON, ENOBUFS over a limit,
+ * ECANCELED when on_event stopped it; the stream stays failed after.
+ * finish() tells the input ended, the last value has to be complete.
+ */
+int json_stream_feed(json_stream_t *stream, const void *data, size_t len);
+int json_stream_finish(json_stream_t *stream);
+/* bytes consumed, on failure the offset of the byte at fault */
+unsigned long json_stream_offset(json_stream_t *stream);
+
+/*
+ * Builds cJSON trees for the values at the given paths only, everything
+ * else streams past.  A path is dot separated names, array indexes, or
+ * "*" for any member or element: "devices.*" hands over every element
+ * of the devices array one at a time, "" the whole top level value.
+ * Matches inside a value already selected come with it, not on their own.
+ */
+typedef struct json_select json_select_t;
+
+#define JSON_SELECT_MAX_PATHS	32
+
+/* item is the callee's to cJSON_Delete(); return nonzero to stop */
+typedef int (*json_select_func)(const char *path, cJSON *item, void *user_data);
+
+json_select_t *json_select_new(const char * const *paths, int count,
+				json_select_func on_item, void *user_data,
+				size_t max_token, int max_depth);
+void json_select_free(json_select_t *select);
+
+/* as json_stream_feed() and json_stream_finish(), ENOMEM when building fails */
+int json_select_feed(json_select_t *select, const void *data, size_t len);
+int json_select_finish(json_select_t *select);
+json_stream_t *json_select_stream(json_select_t *select);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
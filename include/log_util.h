@@ -12,6 +12,10 @@
 #define func_enter() printf("%s enter.\n", __FUNCTION__)
 #define func_exit()  printf("%s exit.\n", __FUNCTION__)
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DEBUG_CHECK_PARAMETERS
 /**
   * The assert_param macro is used for function's parameters check.
@@ -46,13 +50,42 @@ void assert_fail(const char *, const char*, unsigned int, const char *);
 		printf("\n"); \
 	} while(0)
 
-extern void sys_debug (int level, char *fmt, ...);
-extern void sys_debug_ext(int level, const char *tag, int line_num, const char *fmt, ...);
+/* What the asynchronous sink queues, see log_async_start_mode(). */
+#define LOG_ASYNC_TEXT		0	/* lines formatted by the caller */
+#define LOG_ASYNC_DEFERRED	1	/* arguments, formatted by the flusher */
+#define LOG_ASYNC_BINARY	2	/* arguments, see log_binary_decode() */
+
+/* Counters of the asynchronous sink, see log_async_start(). */
+typedef struct {
+	unsigned long lines;	/* queued by threads */
+	unsigned long dropped;	/* lost to a full ring */
+	unsigned long bytes;	/* written out */
+	unsigned long writes;	/* writev() calls */
+	unsigned long errors;	/* writev() calls failed */
+} log_stats_t;
+
+extern void sys_debug (int level, char *fmt, ...)
+			__attribute__((format(printf, 2, 3)));
+extern void sys_debug_ext(int level, const char *tag, int line_num, const char *fmt, ...)
+			__attribute__((format(printf, 4, 5)));
+
+extern void log_set_level(int level);
+extern int log_get_level(void);
+extern int log_async_start(const char *path);
+extern int log_async_start_mode(const char *path, int mode);
+extern void log_async_stop(void);
+extern void log_async_flush(void);
+extern void log_get_stats(log_stats_t *stats);
+extern int log_binary_decode(int fd, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
 
 #define debug(x...)   sys_debug(LOG_DEBUG, x)
 #define info(x...)   sys_debug(LOG_INFO, x)
 #define warning(x...) sys_debug(LOG_WARNING, x)
-#define error(x...)   do {sys_debug(LOG_ERROR, x); abort(); } while (0)
+#define error(x...)   do {sys_debug(LOG_ERROR, x); log_async_flush(); abort(); } while (0)
 
 #define ALOGD(x...)   sys_debug_ext(LOG_DEBUG, LOG_TAG, __LINE__, x)
 #define ALOGV(x...)   sys_debug_ext(LOG_INFO, LOG_TAG, __LINE__, x)
@@ -1,5 +1,8 @@
 #ifndef _RWLOCK_UTIL_H
 #define _RWLOCK_UTIL_H
+#include <pthread.h>
+
+#include <mutex.h>
 
 typedef pthread_rwlock_t rwlock_t;
 
@@ -24,5 +27,33 @@ typedef pthread_rwlock_t rwlock_t;
 #define rwlock_unlock(rwlock) \
 	pthread_rwlock_unlock(rwlock)
 
+#define PERCPU_RWLOCK_SLOTS	64	/* a power of 2 */
+
+struct percpu_rwlock_slot {
+	int readers;
+} __attribute__((aligned(64)));
+
+/**
+ * Reader-biased rwlock, within a process.  A reader counts itself on
+ * the counter of the CPU it runs on, so readers on different CPUs do not
+ * share a cache line.  A writer waits for every counter to drain and
+ * holds new readers off until it is done; writers should be rare.
+ *
+ * percpu_rwlock_rdlock() returns the counter to give back to
+ * percpu_rwlock_rdunlock(), the thread may have moved CPUs since.
+ */
+typedef struct {
+	struct percpu_rwlock_slot slot[PERCPU_RWLOCK_SLOTS];
+	int writer;
+	int waiting;		/* readers waiting for the writer */
+	adaptive_mutex_t wlock;	/* between writers */
+} percpu_rwlock_t;
+
+void percpu_rwlock_init(percpu_rwlock_t *rwlock);
+int percpu_rwlock_rdlock(percpu_rwlock_t *rwlock);
+void percpu_rwlock_rdunlock(percpu_rwlock_t *rwlock, int slot);
+void percpu_rwlock_wrlock(percpu_rwlock_t *rwlock);
+void percpu_rwlock_wrunlock(percpu_rwlock_t *rwlock);
+
 #endif
 
@@ -1,5 +1,6 @@
 #ifndef _LINUX_SOCKETS_H
 #define _LINUX_SOCKETS_H
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <net/if.h>
@@ -41,6 +42,9 @@ typedef enum {
 
 typedef socklen_t socketlen_t;
 
+struct mmsghdr;
+struct iovec;
+
 typedef struct {
 	int sock;
 	int domain;
@@ -87,19 +91,59 @@ typedef struct {
 	volatile int running;
 } connection_t;
 
+/* Counters of the connection_t pool behind create_connection(). */
+typedef struct {
+	unsigned long slabs;	/* slabs allocated from the system */
+	unsigned long capacity;	/* connections the slabs hold */
+	unsigned long in_use;
+	unsigned long allocs;	/* create_connection() calls served */
+	unsigned long frees;
+	unsigned long failed;	/* create_connection() calls failed */
+} connection_pool_stats_t;
+
+/*
+ * MSG_ZEROCOPY bookkeeping of one socket: buffers handed to
+ * sock_send_zerocopy() are in use until completed catches up with sent.
+ */
+typedef struct {
+	unsigned int sent;	/* zero-copy sends issued */
+	unsigned int completed;	/* sends the kernel is done with */
+	unsigned long copied;	/* of those, sends it copied after all */
+	int enabled;
+} sock_zerocopy_t;
+
 typedef void (*socket_read_callback)(void *buf, size_t len);
+/* len > 0: data in buf, 0: end of stream, < 0: -errno */
+typedef void (*socket_fds_read_callback)(int sockfd, void *buf, ssize_t len,
+							void *user_data);
+
+struct pollfd;
 
 int sock_valid(const int sockfd);
 int sock_set_blocking(int sockfd, const int block);
 int sock_socket(int domain, int type, int protocol);
 int sock_close(int sockfd);
 int sock_accept(int s, struct sockaddr *addr, socketlen_t *addrlen);
+int sock_accept4(int s, struct sockaddr *addr, socketlen_t *addrlen, int flags);
 int sock_write_bytes(int sockfd, const char *buff, int len);
+ssize_t sock_writev_bytes(int sockfd, struct iovec *iov, int iovcnt);
+ssize_t sock_sendfile(int sockfd, int filefd, off_t *offset, size_t count);
+int sock_zerocopy_init(int sockfd, sock_zerocopy_t *zc);
+ssize_t sock_send_zerocopy(int sockfd, const void *buf, size_t len,
+							sock_zerocopy_t *zc);
+int sock_zerocopy_reap(int sockfd, sock_zerocopy_t *zc, int wait);
 int sock_sendto(int sockfd, const void *buff, size_t len, int flags,
                    const struct sockaddr *dest_addr, socklen_t addrlen);
+int sock_sendmmsg(int sockfd, struct mmsghdr *msgs, unsigned int vlen, int flags);
 int sock_read_loop(int sockfd, socket_read_callback read_callback, int timeout);
+int sock_read_poll(int sockfd, void *buf, size_t size,
+				socket_read_callback read_callback, int timeout);
+int sock_read_fds(struct pollfd *pfds, int nfds, void *buf, size_t size,
+			socket_fds_read_callback read_callback, void *user_data,
+			int timeout);
 
 int sock_get_server_socket(const int type, const int port);
+int sock_get_reuseport_socket(const int type, const int port);
 int sock_connect(const char *srvip, const int port, const int timeout);
 int socket_tcp_get_hostip(int fd,char *buf,int buf_len,const char *prefix);
 int sock_tcp_get_hostmac(int fd,char *buf,int buf_len,const char *prefix);
@@ -111,11 +155,14 @@ char *get_netdev_ip(const char *ifname);
 void setup_tcp_listeners();
 connection_t *create_connection();
 void clean_connection(connection_t *con);
+void connection_set_peer(connection_t *con, const struct sockaddr_in *sin,
+							socklen_t sin_len);
+void connection_pool_stats(connection_pool_stats_t *stats);
 int getip_byhostname(const char *hostname, char ipstr_out[4][16]);
 
 
 
-server_info_t server_info;
+extern server_info_t server_info;
 
 #endif
 
@@ -0,0 +1,36 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A fixed set of worker threads running short tasks, see
+ * src/thread/thread_pool.c.  Tasks may submit further tasks and wait
+ * for them.
+ */
+typedef struct thread_pool thread_pool_t;
+typedef struct thread_future thread_future_t;
+
+typedef void *(*thread_task_func)(void *arg);
+/* called on the worker once the task returned result */
+typedef void (*thread_done_func)(void *result, void *user_data);
+
+thread_pool_t *thread_pool_new(int workers);
+void thread_pool_destroy(thread_pool_t *pool);
+int thread_pool_workers(thread_pool_t *pool);
+
+int thread_pool_submit(thread_pool_t *pool, thread_task_func task, void *arg,
+			thread_done_func done, void *user_data);
+thread_future_t *thread_pool_async(thread_pool_t *pool, thread_task_func task,
+								void *arg);
+
+int thread_future_ready(thread_future_t *future);
+void *thread_future_wait(thread_future_t *future);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
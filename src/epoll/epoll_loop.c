@@ -1,45 +1,147 @@
 /*
  * Epoll demo from Bluetooth protocol stack for Linux
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "epoll_loop.h"
+#include "timer_wheel.h"
+#include "uring.h"
 #include "utils.h"
 #include "log_ext.h"
 
-#define MAX_EPOLL_EVENTS 10
+/* Events fetched per epoll_wait unless epoll_set_batch_size says otherwise. */
+#define DEFAULT_EPOLL_EVENTS 64
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status = EXIT_SUCCESS;
+/* The fd table starts at this size and doubles as higher fds show up. */
+#define MIN_MAINLOOP_ENTRIES 128
+
+/*
+ * Timeouts live on a timer wheel with 1ms ticks, behind a single
+ * timerfd which is armed for the next tick the wheel has work for.
+ * Their ids index timeout_list; freed ids are reused first.
+ */
+#define MIN_TIMEOUT_ENTRIES 64
+
+/*
+ * Receivers read into one loop-wide buffer, or with io_uring into a
+ * ring of provided buffers, RECV_BUF_COUNT of RECV_BUF_SIZE bytes.
+ * RECV_BURST bounds the reads per readiness event so one busy stream
+ * cannot starve the others.
+ */
+#define RECV_BUF_SIZE	16384
+#define RECV_BUF_COUNT	64
+#define RECV_BURST	16
+
+#define URING_ENTRIES	256
+#define URING_BGID	0
+
+enum {
+	FD_WATCH,		/* mainloop_add_fd */
+	FD_ACCEPT,		/* mainloop_add_acceptor */
+	FD_RECV,		/* mainloop_add_receiver */
+};
 
 struct mainloop_data {
 	int fd;
+	int kind;
 	uint32_t events;
 	mainloop_event_func callback;
+	mainloop_accept_func accept_callback;
+	mainloop_recv_func recv_callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
+	int pending;		/* events[] slot + 1 while merging, see poll_between */
+#ifdef HAVE_URING
+	struct list_head zombie;	/* removed, in-flight sqe not done yet */
+	bool armed;			/* a request for it is in flight */
+	bool removed;
+	bool polled;			/* accept/recv run on poll readiness */
+#endif
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
-
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
-
 struct timeout_data {
-	int fd;
+	struct wheel_timer timer;
+	int id;
 	mainloop_timeout_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
 };
 
+struct task_data {
+	struct list_head list;
+	mainloop_task_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+/*
+ * Everything a loop owns.  Only mainloop_post and mainloop_quit may be
+ * called from other threads, everything else belongs to the thread
+ * running the loop (or to whoever sets it up before it runs).
+ */
+struct mainloop {
+	enum mainloop_backend backend;
+	int epoll_fd;
+	int terminate;
+	int exit_status;
+
+	struct epoll_event *events;
+	unsigned int events_size;
+	unsigned int batch;
+	unsigned int budget;	/* callbacks per iteration, 0 = all */
+
+	/* Events returned by the last epoll_wait which are not dispatched yet. */
+	int event_pos;
+	int event_count;
+
+	struct mainloop_data **fd_list;
+	unsigned int fd_list_size;
+
+	struct timer_wheel wheel;
+	int timeout_fd;
+	uint64_t timeout_armed;	/* tick the timerfd is set for, 0 if none */
+	struct timeout_data **timeout_list;
+	unsigned int timeout_list_size;
+	unsigned int *timeout_free_ids;
+	unsigned int timeout_free_count;
+
+	/* Tasks posted from other threads, announced through wake_fd. */
+	pthread_mutex_t task_lock;
+	struct list_head tasks;
+	int wake_fd;
+
+	unsigned char *recv_buf;
+#ifdef HAVE_URING
+	struct uring ring;
+	struct uring_buf_ring bufs;
+	struct list_head zombies;
+#endif
+};
+
+/* The loop behind the epoll_* functions. */
+static struct mainloop default_loop = {
+	.epoll_fd = -1,
+	.timeout_fd = -1,
+	.wake_fd = -1,
+	.task_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct mainloop *current_loop;
+
 struct signal_data {
 	int fd;
 	sigset_t mask;
@@ -50,306 +152,1454 @@ struct signal_data {
 
 static struct signal_data *g_signal_data;
 
-void epoll_init(void)
+static void timeout_cleanup(struct mainloop *loop);
+static uint64_t timeout_now(void);
+static void timeout_callback(int fd, uint32_t events, void *user_data);
+static void wake_callback(int fd, uint32_t events, void *user_data);
+static void task_cleanup(struct mainloop *loop);
+static int wake_setup(struct mainloop *loop);
+static void fd_ready(struct mainloop *loop, struct mainloop_data *data,
+							uint32_t events);
+
+#ifdef HAVE_URING
+static int uring_setup(struct mainloop *loop)
 {
-	unsigned int i;
+	int err;
 
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	err = uring_init(&loop->ring, URING_ENTRIES);
+	if (err < 0) {
+		log_warn("io_uring unavailable (%s), using epoll\n",
+							strerror(-err));
+		return err;
+	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+	INIT_LIST_HEAD(&loop->zombies);
 
-	epoll_terminate = 0;
+	return 0;
 }
+#endif
 
-void epoll_quit(void)
+/* MAINLOOP_BACKEND=io_uring in the environment picks io_uring. */
+static enum mainloop_backend backend_from_env(void)
 {
-	epoll_terminate = 1;
+	const char *name = getenv("MAINLOOP_BACKEND");
+
+	if (name && !strcmp(name, "io_uring"))
+		return MAINLOOP_BACKEND_URING;
+
+	return MAINLOOP_BACKEND_EPOLL;
 }
 
-void epoll_exit_success(void)
+static int loop_init(struct mainloop *loop, enum mainloop_backend backend)
 {
-	exit_status = EXIT_SUCCESS;
-	epoll_terminate = 1;
+	loop->backend = MAINLOOP_BACKEND_EPOLL;
+	loop->epoll_fd = -1;
+	loop->terminate = 0;
+	loop->exit_status = EXIT_SUCCESS;
+
+	loop->events = NULL;
+	loop->events_size = 0;
+	loop->batch = DEFAULT_EPOLL_EVENTS;
+	loop->budget = 0;
+	loop->event_pos = 0;
+	loop->event_count = 0;
+
+	loop->fd_list = NULL;
+	loop->fd_list_size = 0;
+
+	loop->timeout_fd = -1;
+	loop->timeout_armed = 0;
+	loop->timeout_list = NULL;
+	loop->timeout_list_size = 0;
+	loop->timeout_free_ids = NULL;
+	loop->timeout_free_count = 0;
+
+	INIT_LIST_HEAD(&loop->tasks);
+	loop->wake_fd = -1;
+
+	loop->recv_buf = NULL;
+
+#ifdef HAVE_URING
+	if (backend == MAINLOOP_BACKEND_URING && !uring_setup(loop))
+		loop->backend = MAINLOOP_BACKEND_URING;
+#endif
+
+	if (loop->backend == MAINLOOP_BACKEND_EPOLL) {
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd < 0)
+			return -errno;
+	}
+
+	return wake_setup(loop);
 }
 
-void epoll_exit_failure(void)
+static inline bool loop_uring(struct mainloop *loop)
 {
-	exit_status = EXIT_FAILURE;
-	epoll_terminate = 1;
+	return loop->backend == MAINLOOP_BACKEND_URING;
 }
 
-static void signal_callback(int fd, uint32_t events, void *user_data)
+static void loop_cleanup(struct mainloop *loop)
 {
-	struct signal_data *data = user_data;
-	struct signalfd_siginfo si;
-	ssize_t result;
+	unsigned int i;
 
-	if (events & (EPOLLERR | EPOLLHUP)) {
-		epoll_quit();
-		return;
-	}
+	loop->event_pos = 0;
+	loop->event_count = 0;
 
-	result = read(fd, &si, sizeof(si));
-	if (result != sizeof(si))
-		return;
+	timeout_cleanup(loop);
 
-	if (data->callback)
-		data->callback(si.ssi_signo, data->user_data);
-}
+	for (i = 0; i < loop->fd_list_size; i++) {
+		struct mainloop_data *data = loop->fd_list[i];
 
-int epoll_run(void)
-{
-	unsigned int i;
+		loop->fd_list[i] = NULL;
 
-	if (g_signal_data) {
-		if (sigprocmask(SIG_BLOCK, &g_signal_data->mask, NULL) < 0)
-			return EXIT_FAILURE;
+		if (data) {
+			if (!loop_uring(loop))
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL,
+								data->fd, NULL);
 
-		g_signal_data->fd = signalfd(-1, &g_signal_data->mask,
-						SFD_NONBLOCK | SFD_CLOEXEC);
-		if (g_signal_data->fd < 0)
-			return EXIT_FAILURE;
+			if (data->destroy)
+				data->destroy(data->user_data);
 
-		if (epoll_add_fd(g_signal_data->fd, EPOLLIN,
-				signal_callback, g_signal_data, NULL) < 0) {
-			close(g_signal_data->fd);
-			return EXIT_FAILURE;
+			free(data);
 		}
 	}
 
-	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
-
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds < 0)
-			continue;
+	/* the wake fd is gone, drop whatever was posted meanwhile */
+	task_cleanup(loop);
 
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
+#ifdef HAVE_URING
+	if (loop_uring(loop)) {
+		/* closing the ring cancels whatever is still in flight */
+		while (!list_empty(&loop->zombies)) {
+			struct mainloop_data *data;
 
-			data->callback(data->fd, events[n].events,
-							data->user_data);
+			data = list_first_entry(&loop->zombies,
+					struct mainloop_data, zombie);
+			list_del(&data->zombie);
+			free(data);
 		}
+
+		uring_buf_ring_exit(&loop->ring, &loop->bufs);
+		uring_exit(&loop->ring);
+		loop->backend = MAINLOOP_BACKEND_EPOLL;
 	}
+#endif
 
-	if (g_signal_data) {
-		epoll_remove_fd(g_signal_data->fd);
-		close(g_signal_data->fd);
+	free(loop->recv_buf);
+	loop->recv_buf = NULL;
 
-		if (g_signal_data->destroy)
-			g_signal_data->destroy(g_signal_data->user_data);
-	}
+	free(loop->fd_list);
+	loop->fd_list = NULL;
+	loop->fd_list_size = 0;
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
-		struct mainloop_data *data = mainloop_list[i];
+	free(loop->events);
+	loop->events = NULL;
+	loop->events_size = 0;
 
-		mainloop_list[i] = NULL;
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+}
 
-		if (data) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+void epoll_init(void)
+{
+	loop_init(&default_loop, backend_from_env());
+}
 
-			if (data->destroy)
-				data->destroy(data->user_data);
+/*
+ * A new loop on the given backend.  Asking for io_uring falls back to
+ * epoll when the kernel does not support it, see mainloop_get_backend.
+ */
+struct mainloop *mainloop_new_backend(enum mainloop_backend backend)
+{
+	struct mainloop *loop;
 
-			free(data);
-		}
+	loop = malloc(sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+	memset(loop, 0, sizeof(*loop));
+	pthread_mutex_init(&loop->task_lock, NULL);
+
+	if (loop_init(loop, backend) < 0) {
+		loop_cleanup(loop);
+		pthread_mutex_destroy(&loop->task_lock);
+		free(loop);
+		return NULL;
 	}
 
-	close(epoll_fd);
-	epoll_fd = 0;
+	return loop;
+}
 
-	return exit_status;
+/* A new loop, on io_uring if MAINLOOP_BACKEND=io_uring is set. */
+struct mainloop *mainloop_new(void)
+{
+	return mainloop_new_backend(backend_from_env());
 }
 
-int epoll_add_fd(int fd, uint32_t events, mainloop_event_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+enum mainloop_backend mainloop_get_backend(struct mainloop *loop)
 {
-	struct mainloop_data *data;
-	struct epoll_event ev;
-	int err;
+	return loop->backend;
+}
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
-		return -EINVAL;
+/*
+ * Destroy a loop which is not running: every fd, timeout and pending
+ * task still registered gets its destroy callback.
+ */
+void mainloop_free(struct mainloop *loop)
+{
+	if (!loop || loop == &default_loop)
+		return;
 
-	data = malloc(sizeof(*data));
-	if (!data)
-		return -ENOMEM;
+	loop_cleanup(loop);
+	pthread_mutex_destroy(&loop->task_lock);
+	free(loop);
+}
 
-	memset(data, 0, sizeof(*data));
-	data->fd = fd;
-	data->events = events;
-	data->callback = callback;
-	data->destroy = destroy;
-	data->user_data = user_data;
+struct mainloop *mainloop_default(void)
+{
+	return &default_loop;
+}
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = events;
-	ev.data.ptr = data;
+/* The loop running on the calling thread, NULL outside of any. */
+struct mainloop *mainloop_current(void)
+{
+	return current_loop;
+}
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
-	if (err < 0) {
-		free(data);
-		return err;
-	}
+/*
+ * Set how many events a single epoll_wait may return.  Takes effect
+ * the next time the loop waits.
+ */
+int mainloop_set_batch_size(struct mainloop *loop, unsigned int max_events)
+{
+	if (!max_events || max_events > INT_MAX / sizeof(struct epoll_event))
+		return -EINVAL;
 
-	mainloop_list[fd] = data;
+	loop->batch = max_events;
 
 	return 0;
 }
 
-int epoll_modify_fd(int fd, uint32_t events)
+/*
+ * Limit the number of callbacks dispatched per loop iteration.  Events
+ * left over are kept and dispatched in the next iteration, so none is
+ * lost even for edge-triggered fds; in between the loop polls without
+ * blocking and runs due timeouts and posted tasks first.  0 means no
+ * limit.
+ */
+void mainloop_set_dispatch_budget(struct mainloop *loop,
+						unsigned int max_callbacks)
 {
-	struct mainloop_data *data;
-	struct epoll_event ev;
-	int err;
+	loop->budget = max_callbacks;
+}
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
-		return -EINVAL;
+int epoll_set_batch_size(unsigned int max_events)
+{
+	return mainloop_set_batch_size(&default_loop, max_events);
+}
 
-	data = mainloop_list[fd];
-	if (!data)
-		return -ENXIO;
+void epoll_set_dispatch_budget(unsigned int max_callbacks)
+{
+	mainloop_set_dispatch_budget(&default_loop, max_callbacks);
+}
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = events;
-	ev.data.ptr = data;
+static int fd_list_grow(struct mainloop *loop, int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size = loop->fd_list_size;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
-	if (err < 0)
-		return err;
+	if (!size)
+		size = MIN_MAINLOOP_ENTRIES;
+	while (size <= (unsigned int) fd)
+		size *= 2;
 
-	data->events = events;
+	list = realloc(loop->fd_list, size * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	memset(list + loop->fd_list_size, 0,
+		(size - loop->fd_list_size) * sizeof(*list));
+
+	loop->fd_list = list;
+	loop->fd_list_size = size;
 
 	return 0;
 }
 
-int epoll_remove_fd(int fd)
+static int events_resize(struct mainloop *loop)
 {
-	struct mainloop_data *data;
-	int err;
+	struct epoll_event *events;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
-		return -EINVAL;
-
-	data = mainloop_list[fd];
-	if (!data)
-		return -ENXIO;
+	events = realloc(loop->events, loop->batch * sizeof(*events));
+	if (!events)
+		return -ENOMEM;
 
-	mainloop_list[fd] = NULL;
+	loop->events = events;
+	loop->events_size = loop->batch;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+	return 0;
+}
 
-	if (data->destroy)
-		data->destroy(data->user_data);
+/* Drop the pending events of an entry which is going away. */
+static void forget_pending_events(struct mainloop *loop,
+						struct mainloop_data *data)
+{
+	int n;
 
-	free(data);
+	for (n = loop->event_pos; n < loop->event_count; n++) {
+		if (loop->events[n].data.ptr == data)
+			loop->events[n].data.ptr = NULL;
+	}
+}
 
-	return err;
+static inline int loop_terminated(struct mainloop *loop)
+{
+	return __atomic_load_n(&loop->terminate, __ATOMIC_RELAXED);
 }
 
-static void timeout_destroy(void *user_data)
+static void dispatch_events(struct mainloop *loop)
 {
-	struct timeout_data *data = user_data;
+	unsigned int budget = loop->budget;
 
-	close(data->fd);
-	data->fd = -1;
+	while (loop->event_pos < loop->event_count && !loop_terminated(loop)) {
+		struct epoll_event *ev = &loop->events[loop->event_pos++];
+		struct mainloop_data *data = ev->data.ptr;
 
-	if (data->destroy)
-		data->destroy(data->user_data);
+		/* removed by an earlier callback of this batch */
+		if (!data)
+			continue;
 
-	free(data);
+		fd_ready(loop, data, ev->events);
+
+		if (budget && !--budget)
+			break;
+	}
 }
 
-static void timeout_callback(int fd, uint32_t events, void *user_data)
+/*
+ * Between two budgeted slices: run the timeouts which are due and the
+ * posted tasks, which would otherwise wait behind every ready fd (epoll
+ * hands the timerfd and the wake fd out round robin with the others,
+ * io_uring queues their completions behind the rest).
+ */
+static void run_due(struct mainloop *loop)
 {
-	struct timeout_data *data = user_data;
-	uint64_t expired;
-	ssize_t result;
+	uint64_t next;
+	bool tasks;
+
+	if (loop->timeout_fd >= 0 && timer_wheel_next(&loop->wheel, &next) &&
+						next <= timeout_now())
+		timeout_callback(loop->timeout_fd, EPOLLIN, loop);
+
+	pthread_mutex_lock(&loop->task_lock);
+	tasks = !list_empty(&loop->tasks);
+	pthread_mutex_unlock(&loop->task_lock);
+	if (tasks && loop->wake_fd >= 0)
+		wake_callback(loop->wake_fd, EPOLLIN, loop);
+}
 
-	if (events & (EPOLLERR | EPOLLHUP))
-		return;
+/*
+ * After run_due(), poll without blocking into the room left behind the
+ * pending events and fold what is new into them.  An entry still
+ * pending gets the new bits, so an edge is never lost.
+ */
+static void poll_between(struct mainloop *loop)
+{
+	struct epoll_event *events = loop->events;
+	int count, nfds, n;
 
-	result = read(data->fd, &expired, sizeof(expired));
-	if (result != sizeof(expired))
-		return;
+	run_due(loop);
 
-	if (data->callback)
-		data->callback(data->fd, data->user_data);
+	/* entries removed by those are NULL in events[] by now */
+	count = loop->event_count - loop->event_pos;
+	memmove(events, events + loop->event_pos, count * sizeof(*events));
+	loop->event_pos = 0;
+	loop->event_count = count;
+
+	nfds = epoll_wait(loop->epoll_fd, events + count,
+					loop->events_size - count, 0);
+
+	for (n = 0; n < count; n++) {
+		struct mainloop_data *data = events[n].data.ptr;
+
+		if (data)
+			data->pending = n + 1;
+	}
+
+	for (n = 0; n < nfds; n++) {
+		struct epoll_event *ev = &events[count + n];
+		struct mainloop_data *data = ev->data.ptr;
+
+		if (data->pending) {
+			events[data->pending - 1].events |= ev->events;
+		} else {
+			data->pending = loop->event_count + 1;
+			events[loop->event_count++] = *ev;
+		}
+	}
+
+	for (n = 0; n < loop->event_count; n++) {
+		struct mainloop_data *data = events[n].data.ptr;
+
+		if (data)
+			data->pending = 0;
+	}
 }
 
-static inline int timeout_set(int fd, unsigned int msec)
+/* Accept until EAGAIN, or until the callback removes the listener. */
+static void accept_ready(struct mainloop *loop, struct mainloop_data *data)
 {
-	struct itimerspec itimer;
-	unsigned int sec = msec / 1000;
+	int fd = data->fd;
 
-	memset(&itimer, 0, sizeof(itimer));
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_nsec = 0;
-	itimer.it_value.tv_sec = sec;
-	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
+	while (loop->fd_list[fd] == data) {
+		int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* EAGAIN, or out of fds: wait for the next event */
+			break;
+		}
 
-	return timerfd_settime(fd, 0, &itimer, NULL);
+		data->accept_callback(conn, data->user_data);
+	}
 }
 
-int epoll_add_timeout(unsigned int msec, mainloop_timeout_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+/*
+ * Read up to RECV_BURST times into the loop buffer.  End of stream and
+ * errors are passed on as 0 and -errno, then the receiver is removed.
+ */
+static void recv_ready(struct mainloop *loop, struct mainloop_data *data)
 {
-	struct timeout_data *data;
+	int fd = data->fd;
+	int burst;
 
-	if (!callback)
-		return -EINVAL;
+	if (!loop->recv_buf) {
+		loop->recv_buf = malloc(RECV_BUF_SIZE);
+		if (!loop->recv_buf)
+			return;
+	}
 
-	data = malloc(sizeof(*data));
-	if (!data)
-		return -ENOMEM;
+	for (burst = 0; burst < RECV_BURST && loop->fd_list[fd] == data;
+								burst++) {
+		ssize_t len = recv(fd, loop->recv_buf, RECV_BUF_SIZE, 0);
 
-	memset(data, 0, sizeof(*data));
-	data->callback = callback;
-	data->destroy = destroy;
-	data->user_data = user_data;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			len = -errno;
+		}
 
-	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (data->fd < 0) {
-		free(data);
-		return -EIO;
-	}
+		data->recv_callback(fd, len > 0 ? loop->recv_buf : NULL, len,
+							data->user_data);
 
-	if (msec > 0) {
-		if (timeout_set(data->fd, msec) < 0) {
-			close(data->fd);
-			free(data);
-			return -EIO;
+		if (len <= 0) {
+			if (loop->fd_list[fd] == data)
+				mainloop_remove_fd(loop, fd);
+			return;
 		}
 	}
+}
+
+static void fd_ready(struct mainloop *loop, struct mainloop_data *data,
+							uint32_t events)
+{
+	switch (data->kind) {
+	case FD_ACCEPT:
+		accept_ready(loop, data);
+		break;
+	case FD_RECV:
+		recv_ready(loop, data);
+		break;
+	default:
+		data->callback(data->fd, events, data->user_data);
+		break;
+	}
+}
 
-	if (epoll_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
-				timeout_callback, data, timeout_destroy) < 0) {
-		close(data->fd);
-		free(data);
-		return -EIO;
+#ifdef HAVE_URING
+/*
+ * With io_uring every registration is a request in flight, its
+ * user_data pointing at the mainloop_data.  Plain fds and the polled
+ * fallbacks use POLL_ADD: multishot for EPOLLET, otherwise one-shot and
+ * re-armed after each completion, which gives level-triggered behaviour.
+ * Acceptors use multishot accept and receivers multishot recv into the
+ * loop's provided buffer ring.  A removed entry stays on the zombie list
+ * until its final completion arrives.
+ */
+static struct io_uring_sqe *uring_sqe(struct mainloop *loop)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+	if (!sqe) {
+		uring_submit(&loop->ring, 0);
+		sqe = uring_get_sqe(&loop->ring);
 	}
 
-	return data->fd;
+	return sqe;
 }
 
-int epoll_modify_timeout(int id, unsigned int msec)
+static inline bool uring_polled(struct mainloop_data *data)
+{
+	return data->kind == FD_WATCH || data->polled;
+}
+
+static int uring_arm(struct mainloop *loop, struct mainloop_data *data)
 {
-	if (msec > 0) {
-		if (timeout_set(id, msec) < 0)
-			return -EIO;
+	struct io_uring_sqe *sqe = uring_sqe(loop);
+
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->fd = data->fd;
+	sqe->user_data = (uint64_t) (uintptr_t) data;
+
+	if (uring_polled(data)) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = data->events & ~(EPOLLET | EPOLLONESHOT |
+						EPOLLEXCLUSIVE | EPOLLWAKEUP);
+		if (data->events & EPOLLET)
+			sqe->len = IORING_POLL_ADD_MULTI;
+	} else if (data->kind == FD_ACCEPT) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = loop->bufs.bgid;
 	}
 
-	if (epoll_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
-		return -EIO;
+	data->armed = true;
 
 	return 0;
 }
 
-int epoll_remove_timeout(int id)
+/* Unhook an entry; it is freed once nothing is in flight for it. */
+static void uring_forget(struct mainloop *loop, struct mainloop_data *data)
+{
+	data->removed = true;
+
+	if (data->armed) {
+		struct io_uring_sqe *sqe = uring_sqe(loop);
+
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = (uint64_t) (uintptr_t) data;
+		}
+	}
+
+	list_add_tail(&data->zombie, &loop->zombies);
+}
+
+static void uring_recv_done(struct mainloop *loop, struct mainloop_data *data,
+						int res, unsigned int flags)
 {
-	return epoll_remove_fd(id);
+	int fd = data->fd;
+
+	if (res > 0) {
+		void *buf = uring_buf_get(&loop->bufs,
+					flags >> IORING_CQE_BUFFER_SHIFT);
+
+		data->recv_callback(fd, buf, res, data->user_data);
+	} else if (res == -EINVAL) {
+		/* no multishot recv in this kernel */
+		data->polled = true;
+	} else if (res == -ENOBUFS) {
+		/*
+		 * The buffer ring ran dry, all buffers are with other
+		 * streams; read this one into the loop buffer meanwhile
+		 * instead of spinning on re-armed requests.
+		 */
+		recv_ready(loop, data);
+	} else {
+		data->recv_callback(fd, NULL, res, data->user_data);
+		if (!data->removed)
+			mainloop_remove_fd(loop, fd);
+	}
+}
+
+static void uring_complete(struct mainloop *loop, int res, unsigned int flags,
+						struct mainloop_data *data)
+{
+	bool rearm = true;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		data->armed = false;
+
+	if (data->removed) {
+		/* a connection accepted just before the cancel */
+		if (res >= 0 && data->kind == FD_ACCEPT && !data->polled)
+			close(res);
+	} else if (uring_polled(data)) {
+		if (res < 0) {
+			/* the fd is unusable, report it once */
+			rearm = false;
+			if (data->kind == FD_WATCH)
+				data->callback(data->fd, EPOLLERR,
+							data->user_data);
+		} else {
+			fd_ready(loop, data, res);
+			if (data->events & EPOLLONESHOT)
+				rearm = false;
+		}
+	} else if (data->kind == FD_ACCEPT) {
+		if (res >= 0)
+			data->accept_callback(res, data->user_data);
+		else if (res == -EINVAL)
+			/* no multishot accept in this kernel */
+			data->polled = true;
+		else if (res == -EBADF || res == -ENOTSOCK)
+			rearm = false;
+	} else {
+		uring_recv_done(loop, data, res, flags);
+	}
+
+	if (flags & IORING_CQE_F_BUFFER)
+		uring_buf_recycle(&loop->bufs, flags >> IORING_CQE_BUFFER_SHIFT);
+
+	if (rearm && !data->removed && !data->armed)
+		uring_arm(loop, data);
+}
+
+static void uring_reap_zombies(struct mainloop *loop)
+{
+	struct list_head *pos = loop->zombies.next;
+
+	while (pos != &loop->zombies) {
+		struct mainloop_data *data;
+
+		data = list_entry(pos, struct mainloop_data, zombie);
+		pos = pos->next;
+
+		if (!data->armed) {
+			list_del(&data->zombie);
+			free(data);
+		}
+	}
+}
+
+/*
+ * One iteration: submit what was queued since the last one, waiting for
+ * a completion only if none is ready, then handle up to the batch size
+ * (or the dispatch budget, if smaller) of completions.  The rest stay
+ * in the completion queue for the next iteration, due timeouts and
+ * posted tasks run before them.
+ */
+static void uring_iterate(struct mainloop *loop)
+{
+	unsigned int count = loop->batch;
+	struct io_uring_cqe *cqe;
+
+	if (loop->budget && loop->budget < count)
+		count = loop->budget;
+
+	uring_submit(&loop->ring, uring_peek_cqe(&loop->ring) ? 0 : 1);
+
+	while (count && !loop_terminated(loop) &&
+				(cqe = uring_peek_cqe(&loop->ring))) {
+		struct mainloop_data *data;
+		unsigned int flags = cqe->flags;
+		int res = cqe->res;
+
+		data = (struct mainloop_data *) (uintptr_t) cqe->user_data;
+		uring_cqe_seen(&loop->ring);
+
+		/* cancel requests carry no entry */
+		if (!data)
+			continue;
+
+		uring_complete(loop, res, flags, data);
+		count--;
+	}
+
+	/* the budget cut this slice short, see run_due */
+	if (loop->budget && !count && !loop_terminated(loop) &&
+					uring_peek_cqe(&loop->ring))
+		run_due(loop);
+
+	if (!list_empty(&loop->zombies))
+		uring_reap_zombies(loop);
+}
+#endif
+
+/* Kick the loop out of epoll_wait; the caller holds task_lock. */
+static void loop_wakeup(struct mainloop *loop)
+{
+	uint64_t one = 1;
+
+	if (loop->wake_fd >= 0 && write(loop->wake_fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/* May be called from any thread. */
+void mainloop_quit(struct mainloop *loop)
+{
+	__atomic_store_n(&loop->terminate, 1, __ATOMIC_RELAXED);
+
+	if (loop != current_loop) {
+		pthread_mutex_lock(&loop->task_lock);
+		loop_wakeup(loop);
+		pthread_mutex_unlock(&loop->task_lock);
+	}
+}
+
+void epoll_quit(void)
+{
+	mainloop_quit(&default_loop);
+}
+
+void epoll_exit_success(void)
+{
+	default_loop.exit_status = EXIT_SUCCESS;
+	epoll_quit();
+}
+
+void epoll_exit_failure(void)
+{
+	default_loop.exit_status = EXIT_FAILURE;
+	epoll_quit();
+}
+
+static void signal_callback(int fd, uint32_t events, void *user_data)
+{
+	struct signal_data *data = user_data;
+	struct signalfd_siginfo si;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		epoll_quit();
+		return;
+	}
+
+	result = read(fd, &si, sizeof(si));
+	if (result != sizeof(si))
+		return;
+
+	if (data->callback)
+		data->callback(si.ssi_signo, data->user_data);
+}
+
+/*
+ * Run the loop on the calling thread until mainloop_quit.  It can be
+ * run again afterwards; registrations stay until mainloop_free.
+ */
+int mainloop_run(struct mainloop *loop)
+{
+	struct mainloop *previous = current_loop;
+
+	current_loop = loop;
+
+	while (!loop_terminated(loop)) {
+#ifdef HAVE_URING
+		if (loop_uring(loop)) {
+			uring_iterate(loop);
+			continue;
+		}
+#endif
+
+		if (loop->event_pos == loop->event_count) {
+			int nfds;
+
+			if (loop->events_size != loop->batch &&
+						events_resize(loop) < 0) {
+				loop->exit_status = EXIT_FAILURE;
+				break;
+			}
+
+			nfds = epoll_wait(loop->epoll_fd, loop->events,
+						loop->events_size, -1);
+			if (nfds < 0)
+				continue;
+
+			loop->event_pos = 0;
+			loop->event_count = nfds;
+		} else {
+			/* the budget cut the last slice short */
+			poll_between(loop);
+		}
+
+		dispatch_events(loop);
+	}
+
+	__atomic_store_n(&loop->terminate, 0, __ATOMIC_RELAXED);
+	current_loop = previous;
+
+	return loop->exit_status;
+}
+
+int epoll_run(void)
+{
+	int status;
+
+	if (g_signal_data) {
+		if (sigprocmask(SIG_BLOCK, &g_signal_data->mask, NULL) < 0)
+			return EXIT_FAILURE;
+
+		g_signal_data->fd = signalfd(-1, &g_signal_data->mask,
+						SFD_NONBLOCK | SFD_CLOEXEC);
+		if (g_signal_data->fd < 0)
+			return EXIT_FAILURE;
+
+		if (epoll_add_fd(g_signal_data->fd, EPOLLIN,
+				signal_callback, g_signal_data, NULL) < 0) {
+			close(g_signal_data->fd);
+			return EXIT_FAILURE;
+		}
+	}
+
+	status = mainloop_run(&default_loop);
+
+	if (g_signal_data) {
+		epoll_remove_fd(g_signal_data->fd);
+		close(g_signal_data->fd);
+
+		if (g_signal_data->destroy)
+			g_signal_data->destroy(g_signal_data->user_data);
+	}
+
+	loop_cleanup(&default_loop);
+
+	return status;
+}
+
+static struct mainloop_data *fd_data_new(struct mainloop *loop, int fd,
+					int kind, uint32_t events,
+					void *user_data,
+					mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+
+	if ((unsigned int) fd >= loop->fd_list_size &&
+					fd_list_grow(loop, fd) < 0)
+		return NULL;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return NULL;
+
+	memset(data, 0, sizeof(*data));
+	data->fd = fd;
+	data->kind = kind;
+	data->events = events;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	return data;
+}
+
+static int fd_register(struct mainloop *loop, struct mainloop_data *data)
+{
+	struct epoll_event ev;
+	int err;
+
+#ifdef HAVE_URING
+	if (loop_uring(loop))
+		err = uring_arm(loop, data);
+	else
+#endif
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = data->events;
+		ev.data.ptr = data;
+
+		err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	}
+
+	if (err < 0) {
+		free(data);
+		return err;
+	}
+
+	loop->fd_list[data->fd] = data;
+
+	return 0;
+}
+
+int mainloop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	data = fd_data_new(loop, fd, FD_WATCH, events, user_data, destroy);
+	if (!data)
+		return -ENOMEM;
+
+	data->callback = callback;
+
+	return fd_register(loop, data);
+}
+
+/*
+ * Call callback for every connection accepted on the non-blocking
+ * listening socket fd.  The new sockets are non-blocking and
+ * close-on-exec and belong to the callback.  With io_uring this is a
+ * single multishot accept.
+ */
+int mainloop_add_acceptor(struct mainloop *loop, int fd,
+				mainloop_accept_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	data = fd_data_new(loop, fd, FD_ACCEPT, EPOLLIN, user_data, destroy);
+	if (!data)
+		return -ENOMEM;
+
+	data->accept_callback = callback;
+
+	return fd_register(loop, data);
+}
+
+/*
+ * Call callback with the data arriving on the non-blocking stream
+ * socket fd.  The buffer belongs to the loop and is only valid during
+ * the callback.  End of stream is reported with len 0 and a failing
+ * read with -errno, after which the receiver is removed; the socket
+ * itself is left to the caller.  With io_uring this is a multishot recv
+ * into the loop's provided buffers.
+ */
+int mainloop_add_receiver(struct mainloop *loop, int fd,
+				mainloop_recv_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	data = fd_data_new(loop, fd, FD_RECV, EPOLLIN, user_data, destroy);
+	if (!data)
+		return -ENOMEM;
+
+	data->recv_callback = callback;
+
+#ifdef HAVE_URING
+	/* without a buffer ring, fall back to recv on poll readiness */
+	if (loop_uring(loop) && !loop->bufs.br &&
+		uring_buf_ring_init(&loop->ring, &loop->bufs, URING_BGID,
+				RECV_BUF_COUNT, RECV_BUF_SIZE) < 0)
+		data->polled = true;
+#endif
+
+	return fd_register(loop, data);
+}
+
+int mainloop_modify_fd(struct mainloop *loop, int fd, uint32_t events)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err;
+
+	if (fd < 0)
+		return -EINVAL;
+
+	if ((unsigned int) fd >= loop->fd_list_size)
+		return -ENXIO;
+
+	data = loop->fd_list[fd];
+	if (!data)
+		return -ENXIO;
+
+	/* acceptors and receivers always wait for input */
+	if (data->kind != FD_WATCH)
+		return -EINVAL;
+
+#ifdef HAVE_URING
+	if (loop_uring(loop)) {
+		struct mainloop_data *new_data;
+
+		/* swap in a copy, the old request is cancelled */
+		new_data = malloc(sizeof(*new_data));
+		if (!new_data)
+			return -ENOMEM;
+
+		memcpy(new_data, data, sizeof(*new_data));
+		new_data->events = events;
+		new_data->armed = false;
+		new_data->removed = false;
+
+		loop->fd_list[fd] = new_data;
+		uring_forget(loop, data);
+
+		return uring_arm(loop, new_data);
+	}
+#endif
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	if (err < 0)
+		return err;
+
+	data->events = events;
+
+	return 0;
+}
+
+/*
+ * Works for fds added by any of mainloop_add_fd, mainloop_add_acceptor
+ * and mainloop_add_receiver.
+ */
+int mainloop_remove_fd(struct mainloop *loop, int fd)
+{
+	struct mainloop_data *data;
+	int err = 0;
+
+	if (fd < 0)
+		return -EINVAL;
+
+	if ((unsigned int) fd >= loop->fd_list_size)
+		return -ENXIO;
+
+	data = loop->fd_list[fd];
+	if (!data)
+		return -ENXIO;
+
+	loop->fd_list[fd] = NULL;
+
+#ifdef HAVE_URING
+	if (loop_uring(loop)) {
+		uring_forget(loop, data);
+
+		if (data->destroy)
+			data->destroy(data->user_data);
+
+		return 0;
+	}
+#endif
+
+	forget_pending_events(loop, data);
+
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+
+	return err;
+}
+
+int epoll_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_add_fd(&default_loop, fd, events, callback,
+							user_data, destroy);
+}
+
+int epoll_modify_fd(int fd, uint32_t events)
+{
+	return mainloop_modify_fd(&default_loop, fd, events);
+}
+
+int epoll_remove_fd(int fd)
+{
+	return mainloop_remove_fd(&default_loop, fd);
+}
+
+static uint64_t timeout_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Point the timerfd at the next tick the wheel has work for. */
+static void timeout_arm(struct mainloop *loop)
+{
+	struct itimerspec itimer;
+	uint64_t next;
+
+	if (!timer_wheel_next(&loop->wheel, &next))
+		next = 0;
+
+	if (next == loop->timeout_armed)
+		return;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = next / 1000;
+	itimer.it_value.tv_nsec = (next % 1000) * 1000 * 1000;
+
+	if (timerfd_settime(loop->timeout_fd, TFD_TIMER_ABSTIME,
+							&itimer, NULL) < 0)
+		return;
+
+	loop->timeout_armed = next;
+}
+
+static void timeout_callback(int fd, uint32_t events, void *user_data)
+{
+	struct mainloop *loop = user_data;
+	struct list_head expired;
+	uint64_t expirations;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	result = read(fd, &expirations, sizeof(expirations));
+	if (result != sizeof(expirations) && errno != EAGAIN)
+		return;
+
+	/* the timerfd went off and is disarmed */
+	loop->timeout_armed = 0;
+
+	INIT_LIST_HEAD(&expired);
+	timer_wheel_expire(&loop->wheel, timeout_now(), &expired);
+
+	/*
+	 * Callbacks may add, modify or remove any timeout, including the
+	 * ones still on the expired list.
+	 */
+	while (!list_empty(&expired)) {
+		struct timeout_data *data;
+
+		data = list_first_entry(&expired, struct timeout_data,
+								timer.list);
+		timer_wheel_del(&loop->wheel, &data->timer);
+
+		data->callback(data->id, data->user_data);
+	}
+
+	timeout_arm(loop);
+}
+
+static void timeout_fd_destroy(void *user_data)
+{
+	struct mainloop *loop = user_data;
+
+	close(loop->timeout_fd);
+	loop->timeout_fd = -1;
+	loop->timeout_armed = 0;
+}
+
+static int timeout_setup(struct mainloop *loop)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -EIO;
+
+	loop->timeout_fd = fd;
+	if (mainloop_add_fd(loop, fd, EPOLLIN, timeout_callback, loop,
+						timeout_fd_destroy) < 0) {
+		close(fd);
+		loop->timeout_fd = -1;
+		return -EIO;
+	}
+
+	timer_wheel_init(&loop->wheel, timeout_now());
+	loop->timeout_armed = 0;
+
+	return 0;
+}
+
+static int timeout_id_alloc(struct mainloop *loop, struct timeout_data *data)
+{
+	unsigned int id;
+
+	if (!loop->timeout_free_count) {
+		unsigned int size = loop->timeout_list_size ?
+				loop->timeout_list_size * 2 : MIN_TIMEOUT_ENTRIES;
+		struct timeout_data **list;
+		unsigned int *ids;
+
+		if (size > INT_MAX / sizeof(*list))
+			return -ENOMEM;
+
+		list = realloc(loop->timeout_list, size * sizeof(*list));
+		if (!list)
+			return -ENOMEM;
+		loop->timeout_list = list;
+
+		ids = realloc(loop->timeout_free_ids, size * sizeof(*ids));
+		if (!ids)
+			return -ENOMEM;
+		loop->timeout_free_ids = ids;
+
+		/* id 0 is never handed out, callers take it as "none" */
+		for (id = size - 1; id >= loop->timeout_list_size && id > 0; id--) {
+			list[id] = NULL;
+			ids[loop->timeout_free_count++] = id;
+		}
+		list[0] = NULL;
+		loop->timeout_list_size = size;
+	}
+
+	id = loop->timeout_free_ids[--loop->timeout_free_count];
+	loop->timeout_list[id] = data;
+
+	return id;
+}
+
+static struct timeout_data *timeout_lookup(struct mainloop *loop, int id)
+{
+	if (id <= 0 || (unsigned int) id >= loop->timeout_list_size)
+		return NULL;
+
+	return loop->timeout_list[id];
+}
+
+static void timeout_free(struct mainloop *loop, struct timeout_data *data)
+{
+	timer_wheel_del(&loop->wheel, &data->timer);
+
+	loop->timeout_list[data->id] = NULL;
+	loop->timeout_free_ids[loop->timeout_free_count++] = data->id;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static void timeout_cleanup(struct mainloop *loop)
+{
+	unsigned int i;
+
+	for (i = 1; i < loop->timeout_list_size; i++) {
+		if (loop->timeout_list[i])
+			timeout_free(loop, loop->timeout_list[i]);
+	}
+
+	free(loop->timeout_list);
+	loop->timeout_list = NULL;
+	free(loop->timeout_free_ids);
+	loop->timeout_free_ids = NULL;
+	loop->timeout_list_size = 0;
+	loop->timeout_free_count = 0;
+}
+
+static void timeout_schedule(struct mainloop *loop, struct timeout_data *data,
+							unsigned int msec)
+{
+	struct timespec ts;
+	uint64_t expires;
+
+	/* round up, a timeout must never fire early */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	expires = (uint64_t) ts.tv_sec * 1000 +
+				(ts.tv_nsec + 999999) / 1000000 + msec;
+
+	timer_wheel_add(&loop->wheel, &data->timer, expires);
+
+	if (!loop->timeout_armed || expires < loop->timeout_armed)
+		timeout_arm(loop);
+}
+
+int mainloop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct timeout_data *data;
+	int id;
+
+	if (!callback)
+		return -EINVAL;
+
+	if (loop->timeout_fd < 0 && timeout_setup(loop) < 0)
+		return -EIO;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0, sizeof(*data));
+	timer_wheel_init_timer(&data->timer);
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	id = timeout_id_alloc(loop, data);
+	if (id < 0) {
+		free(data);
+		return id;
+	}
+	data->id = id;
+
+	if (msec > 0)
+		timeout_schedule(loop, data, msec);
+
+	return id;
+}
+
+int mainloop_modify_timeout(struct mainloop *loop, int id, unsigned int msec)
+{
+	struct timeout_data *data = timeout_lookup(loop, id);
+
+	if (!data)
+		return -EIO;
+
+	if (msec > 0)
+		timeout_schedule(loop, data, msec);
+
+	return 0;
+}
+
+int mainloop_remove_timeout(struct mainloop *loop, int id)
+{
+	struct timeout_data *data = timeout_lookup(loop, id);
+
+	if (!data)
+		return -ENXIO;
+
+	timeout_free(loop, data);
+
+	return 0;
+}
+
+int epoll_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_add_timeout(&default_loop, msec, callback,
+							user_data, destroy);
+}
+
+int epoll_modify_timeout(int id, unsigned int msec)
+{
+	return mainloop_modify_timeout(&default_loop, id, msec);
+}
+
+int epoll_remove_timeout(int id)
+{
+	return mainloop_remove_timeout(&default_loop, id);
+}
+
+static void task_free(struct task_data *task)
+{
+	if (task->destroy)
+		task->destroy(task->user_data);
+
+	free(task);
+}
+
+static void wake_callback(int fd, uint32_t events, void *user_data)
+{
+	struct mainloop *loop = user_data;
+	struct list_head tasks;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+
+	/* take the whole queue, tasks posted meanwhile wake us again */
+	INIT_LIST_HEAD(&tasks);
+	pthread_mutex_lock(&loop->task_lock);
+	while (!list_empty(&loop->tasks))
+		list_move_tail(loop->tasks.next, &tasks);
+	pthread_mutex_unlock(&loop->task_lock);
+
+	while (!list_empty(&tasks)) {
+		struct task_data *task;
+
+		task = list_first_entry(&tasks, struct task_data, list);
+		list_del(&task->list);
+
+		task->callback(task->user_data);
+		task_free(task);
+	}
+}
+
+static void wake_destroy(void *user_data)
+{
+	struct mainloop *loop = user_data;
+
+	pthread_mutex_lock(&loop->task_lock);
+	close(loop->wake_fd);
+	loop->wake_fd = -1;
+	pthread_mutex_unlock(&loop->task_lock);
+}
+
+static int wake_setup(struct mainloop *loop)
+{
+	int fd, err;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	err = mainloop_add_fd(loop, fd, EPOLLIN, wake_callback, loop,
+								wake_destroy);
+	if (err < 0) {
+		close(fd);
+		return err;
+	}
+
+	loop->wake_fd = fd;
+
+	return 0;
+}
+
+static void task_cleanup(struct mainloop *loop)
+{
+	pthread_mutex_lock(&loop->task_lock);
+	while (!list_empty(&loop->tasks)) {
+		struct task_data *task;
+
+		task = list_first_entry(&loop->tasks, struct task_data, list);
+		list_del(&task->list);
+		task_free(task);
+	}
+	pthread_mutex_unlock(&loop->task_lock);
+}
+
+/*
+ * Run callback on the thread of loop, from any thread.  Tasks run in
+ * the order they were posted; destroy is called once the task ran, or
+ * when it is dropped because the loop goes away first.
+ */
+int mainloop_post(struct mainloop *loop, mainloop_task_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct task_data *task;
+	int was_empty;
+
+	if (!callback)
+		return -EINVAL;
+
+	task = malloc(sizeof(*task));
+	if (!task)
+		return -ENOMEM;
+
+	task->callback = callback;
+	task->destroy = destroy;
+	task->user_data = user_data;
+
+	pthread_mutex_lock(&loop->task_lock);
+
+	if (loop->wake_fd < 0) {
+		pthread_mutex_unlock(&loop->task_lock);
+		free(task);
+		return -ESHUTDOWN;
+	}
+
+	/* one wakeup per batch, the loop drains the whole queue */
+	was_empty = list_empty(&loop->tasks);
+	list_add_tail(&task->list, &loop->tasks);
+	if (was_empty)
+		loop_wakeup(loop);
+
+	pthread_mutex_unlock(&loop->task_lock);
+
+	return 0;
 }
 
 int epoll_set_signal(sigset_t *mask, mainloop_signal_func callback,
@@ -44,14 +44,29 @@ struct epoll_event {
 } EPOLL_PACKED;
 #endif
 
+#ifndef __EPOLL_LOOP_H__
+#define __EPOLL_LOOP_H__
+
 #include <signal.h>
+#include <sys/types.h>
 #include <sys/epoll.h>
 
+struct mainloop;
+
+enum mainloop_backend {
+	MAINLOOP_BACKEND_EPOLL,
+	MAINLOOP_BACKEND_URING,
+};
+
 typedef void (*mainloop_destroy_func) (void *user_data);
 
 typedef void (*mainloop_event_func) (int fd, uint32_t events, void *user_data);
 typedef void (*mainloop_timeout_func) (int id, void *user_data);
 typedef void (*mainloop_signal_func) (int signum, void *user_data);
+typedef void (*mainloop_task_func) (void *user_data);
+typedef void (*mainloop_accept_func) (int fd, void *user_data);
+typedef void (*mainloop_recv_func) (int fd, const void *buf, ssize_t len,
+							void *user_data);
 
 void epoll_init(void);
 void epoll_quit(void);
@@ -59,6 +74,13 @@ void epoll_exit_success(void);
 void epoll_exit_failure(void);
 int epoll_run(void);
 
+int epoll_set_batch_size(unsigned int max_events);
+void epoll_set_dispatch_budget(unsigned int max_callbacks);
+
+/*
+ * events may include EPOLLET; the callback of an edge-triggered fd must
+ * then read or write until EAGAIN, the loop will not report it again.
+ */
 int epoll_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy);
 int epoll_modify_fd(int fd, uint32_t events);
@@ -66,8 +88,59 @@ int epoll_remove_fd(int fd);
 
 int epoll_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 				void *user_data, mainloop_destroy_func destroy);
-int epoll_modify_timeout(int fd, unsigned int msec);
+int epoll_modify_timeout(int id, unsigned int msec);
 int epoll_remove_timeout(int id);
 
 int epoll_set_signal(sigset_t *mask, mainloop_signal_func callback,
 				void *user_data, mainloop_destroy_func destroy);
+
+/*
+ * Loop instances, one per thread.  The epoll_* functions above work on
+ * the default loop.  A loop runs on epoll or, where the kernel supports
+ * it, on io_uring; mainloop_new and epoll_init pick io_uring when
+ * MAINLOOP_BACKEND=io_uring is set in the environment.  Apart from
+ * mainloop_quit and mainloop_post, a loop must only be used by the
+ * thread running it, or before it runs.
+ */
+struct mainloop *mainloop_new(void);
+struct mainloop *mainloop_new_backend(enum mainloop_backend backend);
+enum mainloop_backend mainloop_get_backend(struct mainloop *loop);
+void mainloop_free(struct mainloop *loop);
+struct mainloop *mainloop_default(void);
+struct mainloop *mainloop_current(void);
+
+int mainloop_run(struct mainloop *loop);
+void mainloop_quit(struct mainloop *loop);
+
+int mainloop_set_batch_size(struct mainloop *loop, unsigned int max_events);
+void mainloop_set_dispatch_budget(struct mainloop *loop,
+						unsigned int max_callbacks);
+
+int mainloop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_modify_fd(struct mainloop *loop, int fd, uint32_t events);
+int mainloop_remove_fd(struct mainloop *loop, int fd);
+
+/*
+ * Higher level registrations, which the io_uring backend serves with
+ * multishot requests instead of readiness events.  Both are removed with
+ * mainloop_remove_fd.
+ */
+int mainloop_add_acceptor(struct mainloop *loop, int fd,
+				mainloop_accept_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_add_receiver(struct mainloop *loop, int fd,
+				mainloop_recv_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+
+int mainloop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_modify_timeout(struct mainloop *loop, int id, unsigned int msec);
+int mainloop_remove_timeout(struct mainloop *loop, int id);
+
+int mainloop_post(struct mainloop *loop, mainloop_task_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+
+#endif
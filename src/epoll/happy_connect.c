@@ -0,0 +1,367 @@
+/*
+ * Non-blocking connect racing the addresses of a host (Happy Eyeballs)
+ *
+ * Following RFC 8305, the addresses are tried one after the other but
+ * without waiting for an attempt to finish: when one has not connected
+ * within the attempt delay, the next is started alongside it, and when
+ * one fails the next is started right away.  Address families take
+ * turns, beginning with the family of the first address, so a host
+ * whose IPv6 path is broken connects over IPv4 after the attempt delay
+ * instead of after the connect timeout.  The first attempt to connect
+ * wins and the others are abandoned.
+ *
+ * Everything runs on the loop given; a happy_connect must only be used
+ * from the thread running it.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "happy_connect.h"
+
+struct happy_addr {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int family;
+	int protocol;
+};
+
+struct happy_attempt {
+	int fd;			/* -1 unless connecting */
+	int timer;		/* attempt timeout, 0 if none */
+	struct happy_connect *hc;
+};
+
+struct happy_connect {
+	struct mainloop *loop;
+	struct happy_addr *addrs;	/* in the order they are tried */
+	struct happy_attempt *attempts;	/* one per address */
+	unsigned int count;
+	unsigned int next;		/* address the next attempt uses */
+	unsigned int running;		/* attempts connecting */
+	int delay_timer;
+	unsigned int delay;
+	unsigned int timeout;
+	int last_err;
+	happy_connect_func callback;
+	void *user_data;
+};
+
+/*
+ * Copy the address list, interleaving the families.  Within a family
+ * the resolver's order, which already follows RFC 6724, is kept.
+ */
+static int happy_sort_addrs(struct happy_connect *hc,
+					const struct addrinfo *addrs)
+{
+	const struct addrinfo *ai, *fam[2] = { NULL, NULL };
+	unsigned int count = 0;
+	int first = -1;
+
+	for (ai = addrs; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		if (first < 0)
+			first = ai->ai_family;
+		count++;
+	}
+
+	if (!count)
+		return -EINVAL;
+
+	hc->addrs = calloc(count, sizeof(*hc->addrs));
+	hc->attempts = calloc(count, sizeof(*hc->attempts));
+	if (!hc->addrs || !hc->attempts)
+		return -ENOMEM;
+
+	/* fam[0] walks the first family, fam[1] all the others */
+	fam[0] = fam[1] = addrs;
+	while (hc->count < count) {
+		int turn;
+
+		for (turn = 0; turn < 2 && hc->count < count; turn++) {
+			struct happy_addr *a;
+
+			while (fam[turn] && (fam[turn]->ai_addrlen >
+					sizeof(struct sockaddr_storage) ||
+					(fam[turn]->ai_family == first) != !turn))
+				fam[turn] = fam[turn]->ai_next;
+
+			if (!fam[turn])
+				continue;
+
+			a = &hc->addrs[hc->count];
+			memcpy(&a->addr, fam[turn]->ai_addr, fam[turn]->ai_addrlen);
+			a->addrlen = fam[turn]->ai_addrlen;
+			a->family = fam[turn]->ai_family;
+			a->protocol = fam[turn]->ai_protocol;
+
+			hc->attempts[hc->count].fd = -1;
+			hc->attempts[hc->count].hc = hc;
+			hc->count++;
+
+			fam[turn] = fam[turn]->ai_next;
+		}
+	}
+
+	return 0;
+}
+
+/* Take the attempt off the loop; its socket is left to the caller. */
+static void attempt_stop(struct happy_attempt *a)
+{
+	struct happy_connect *hc = a->hc;
+
+	mainloop_remove_fd(hc->loop, a->fd);
+	if (a->timer > 0) {
+		mainloop_remove_timeout(hc->loop, a->timer);
+		a->timer = 0;
+	}
+
+	hc->running--;
+}
+
+static void happy_free(struct happy_connect *hc)
+{
+	unsigned int i;
+
+	for (i = 0; i < hc->count; i++) {
+		struct happy_attempt *a = &hc->attempts[i];
+
+		if (a->fd >= 0) {
+			attempt_stop(a);
+			close(a->fd);
+		}
+	}
+
+	if (hc->delay_timer > 0)
+		mainloop_remove_timeout(hc->loop, hc->delay_timer);
+
+	free(hc->addrs);
+	free(hc->attempts);
+	free(hc);
+}
+
+static void happy_finish(struct happy_connect *hc, int fd, int err)
+{
+	happy_connect_func callback = hc->callback;
+	void *user_data = hc->user_data;
+
+	happy_free(hc);
+
+	callback(fd, err, user_data);
+}
+
+static int happy_start_next(struct happy_connect *hc);
+
+static void attempt_failed(struct happy_attempt *a, int err)
+{
+	struct happy_connect *hc = a->hc;
+
+	attempt_stop(a);
+	close(a->fd);
+	a->fd = -1;
+	hc->last_err = err;
+
+	/* a failure starts the next attempt without waiting for the delay */
+	if (happy_start_next(hc) < 0 && !hc->running)
+		happy_finish(hc, -1, hc->last_err);
+}
+
+static void attempt_ready(int fd, uint32_t events, void *user_data)
+{
+	struct happy_attempt *a = user_data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	else if (!err && (events & (EPOLLERR | EPOLLHUP)))
+		err = ECONNREFUSED;
+
+	if (err) {
+		attempt_failed(a, err);
+		return;
+	}
+
+	attempt_stop(a);
+	a->fd = -1;
+	happy_finish(a->hc, fd, 0);
+}
+
+static void attempt_timeout(int id, void *user_data)
+{
+	attempt_failed(user_data, ETIMEDOUT);
+}
+
+/*
+ * Start connecting to the next address which does not fail right away,
+ * and schedule the one after it.  Returns -1 once none is left.
+ */
+static int happy_start_next(struct happy_connect *hc)
+{
+	while (hc->next < hc->count) {
+		struct happy_addr *addr = &hc->addrs[hc->next];
+		struct happy_attempt *a = &hc->attempts[hc->next];
+		int fd, err;
+
+		hc->next++;
+
+		fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK |
+					SOCK_CLOEXEC, addr->protocol);
+		if (fd < 0) {
+			hc->last_err = errno;
+			continue;
+		}
+
+		if (connect(fd, (struct sockaddr *) &addr->addr,
+					addr->addrlen) < 0 && errno != EINPROGRESS) {
+			hc->last_err = errno;
+			close(fd);
+			continue;
+		}
+
+		/* writable once connected or failed, even if already connected */
+		err = mainloop_add_fd(hc->loop, fd, EPOLLOUT, attempt_ready, a,
+									NULL);
+		if (err < 0) {
+			hc->last_err = -err;
+			close(fd);
+			continue;
+		}
+
+		a->fd = fd;
+		hc->running++;
+
+		if (hc->timeout) {
+			a->timer = mainloop_add_timeout(hc->loop, hc->timeout,
+						attempt_timeout, a, NULL);
+			if (a->timer < 0)
+				a->timer = 0;
+		}
+
+		if (hc->next < hc->count)
+			mainloop_modify_timeout(hc->loop, hc->delay_timer,
+								hc->delay);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static void happy_delay_expired(int id, void *user_data)
+{
+	struct happy_connect *hc = user_data;
+
+	if (happy_start_next(hc) < 0 && !hc->running)
+		happy_finish(hc, -1, hc->last_err);
+}
+
+/*
+ * Returns NULL with errno set if no attempt could even be started, the
+ * callback is not called then.  Otherwise the callback is called from
+ * the loop, never before this returns.
+ */
+struct happy_connect *happy_connect_start(struct mainloop *loop,
+				const struct addrinfo *addrs,
+				unsigned int attempt_delay,
+				unsigned int attempt_timeout,
+				happy_connect_func callback, void *user_data)
+{
+	struct happy_connect *hc;
+	int err;
+
+	if (!loop || !addrs || !callback) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hc = calloc(1, sizeof(*hc));
+	if (!hc) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	hc->loop = loop;
+	hc->callback = callback;
+	hc->user_data = user_data;
+	hc->timeout = attempt_timeout;
+	hc->delay = attempt_delay ? attempt_delay : HAPPY_CONNECT_ATTEMPT_DELAY;
+	if (hc->delay < HAPPY_CONNECT_MIN_DELAY)
+		hc->delay = HAPPY_CONNECT_MIN_DELAY;
+	hc->last_err = ECONNREFUSED;
+
+	err = happy_sort_addrs(hc, addrs);
+	if (err < 0)
+		goto failed;
+
+	/* added unscheduled, each started attempt schedules it anew */
+	hc->delay_timer = mainloop_add_timeout(loop, 0, happy_delay_expired,
+								hc, NULL);
+	if (hc->delay_timer < 0) {
+		err = hc->delay_timer;
+		hc->delay_timer = 0;
+		goto failed;
+	}
+
+	if (happy_start_next(hc) < 0) {
+		err = -hc->last_err;
+		goto failed;
+	}
+
+	return hc;
+
+failed:
+	happy_free(hc);
+	errno = -err;
+	return NULL;
+}
+
+/*
+ * happy_connect_start() for the addresses of host.  The name is
+ * resolved with getaddrinfo() and blocks the loop while it does, which
+ * numeric addresses never do.
+ */
+struct happy_connect *happy_connect_host(struct mainloop *loop,
+				const char *host, const char *service,
+				unsigned int attempt_delay,
+				unsigned int attempt_timeout,
+				happy_connect_func callback, void *user_data)
+{
+	struct happy_connect *hc;
+	struct addrinfo hints, *addrs;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(host, service, &hints, &addrs);
+	if (err) {
+		if (err != EAI_SYSTEM)
+			errno = ENOENT;
+		return NULL;
+	}
+
+	hc = happy_connect_start(loop, addrs, attempt_delay, attempt_timeout,
+						callback, user_data);
+	err = errno;
+	freeaddrinfo(addrs);
+	errno = err;
+
+	return hc;
+}
+
+/* Abandon all attempts; the callback is not called anymore. */
+void happy_connect_cancel(struct happy_connect *hc)
+{
+	if (hc)
+		happy_free(hc);
+}
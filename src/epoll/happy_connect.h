@@ -0,0 +1,41 @@
+/*
+ * Non-blocking connect racing the addresses of a host (Happy Eyeballs)
+ */
+#ifndef __HAPPY_CONNECT_H__
+#define __HAPPY_CONNECT_H__
+
+#include <netdb.h>
+
+#include "epoll_loop.h"
+
+/* RFC 8305 recommends 250ms between attempts, at least 100ms. */
+#define HAPPY_CONNECT_ATTEMPT_DELAY	250
+#define HAPPY_CONNECT_MIN_DELAY		100
+
+struct happy_connect;
+
+/*
+ * Called once, from the loop: fd is the connected non-blocking socket,
+ * which now belongs to the callee, or -1 with err the errno of the last
+ * attempt that failed.
+ */
+typedef void (*happy_connect_func) (int fd, int err, void *user_data);
+
+/*
+ * attempt_delay is the time one attempt gets before the next address
+ * is tried alongside it, 0 for HAPPY_CONNECT_ATTEMPT_DELAY.  Every
+ * attempt fails after attempt_timeout ms, 0 leaving it to the kernel.
+ */
+struct happy_connect *happy_connect_start(struct mainloop *loop,
+				const struct addrinfo *addrs,
+				unsigned int attempt_delay,
+				unsigned int attempt_timeout,
+				happy_connect_func callback, void *user_data);
+struct happy_connect *happy_connect_host(struct mainloop *loop,
+				const char *host, const char *service,
+				unsigned int attempt_delay,
+				unsigned int attempt_timeout,
+				happy_connect_func callback, void *user_data);
+void happy_connect_cancel(struct happy_connect *hc);
+
+#endif
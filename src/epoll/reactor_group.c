@@ -0,0 +1,382 @@
+/*
+ * Group of event loops, one per thread
+ *
+ * Each reactor is a struct mainloop run by its own thread, optionally
+ * pinned to a CPU.  Connections reach the loops in one of two ways:
+ *
+ *  - reactor_group_accept: the first loop owns a listening socket,
+ *    accepts and hands each connection round-robin to the next loop
+ *    with mainloop_post.
+ *
+ *  - reactor_group_listen: every loop gets its own listening socket
+ *    bound with SO_REUSEPORT, and the kernel spreads the connections.
+ *
+ * Loops, listeners and reactor_group_* calls other than
+ * reactor_group_next are set up and torn down from the thread owning
+ * the group, with the loops stopped.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "reactor_group.h"
+#include "log_ext.h"
+
+struct reactor {
+	struct mainloop *loop;
+	pthread_t thread;
+	int cpu;		/* -1 if not pinned */
+	bool running;
+};
+
+struct reactor_group {
+	struct reactor *reactors;
+	unsigned int count;
+	unsigned int next;
+};
+
+struct listener {
+	int fd;
+	bool reuseport;		/* one socket per loop, closed with it */
+	struct reactor_group *group;
+	reactor_accept_func callback;
+	void *user_data;
+};
+
+struct handoff {
+	int fd;
+	struct listener *listener;
+};
+
+/* count 0 means one loop per online CPU. */
+struct reactor_group *reactor_group_new(unsigned int count, bool pin_cpus)
+{
+	struct reactor_group *group;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	if (cpus < 1)
+		cpus = 1;
+	if (!count)
+		count = cpus;
+
+	group = calloc(1, sizeof(*group));
+	if (!group)
+		return NULL;
+
+	group->reactors = calloc(count, sizeof(*group->reactors));
+	if (!group->reactors) {
+		free(group);
+		return NULL;
+	}
+	group->count = count;
+
+	for (i = 0; i < count; i++) {
+		struct reactor *r = &group->reactors[i];
+
+		r->cpu = pin_cpus ? (int) (i % cpus) : -1;
+		r->loop = mainloop_new();
+		if (!r->loop) {
+			reactor_group_free(group);
+			return NULL;
+		}
+	}
+
+	return group;
+}
+
+void reactor_group_free(struct reactor_group *group)
+{
+	unsigned int i;
+
+	if (!group)
+		return;
+
+	reactor_group_stop(group);
+
+	for (i = 0; i < group->count; i++)
+		mainloop_free(group->reactors[i].loop);
+
+	free(group->reactors);
+	free(group);
+}
+
+static void *reactor_thread(void *arg)
+{
+	struct reactor *r = arg;
+
+	mainloop_run(r->loop);
+
+	return NULL;
+}
+
+int reactor_group_start(struct reactor_group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; i++) {
+		struct reactor *r = &group->reactors[i];
+		pthread_attr_t attr;
+		int err;
+
+		if (r->running)
+			continue;
+
+		pthread_attr_init(&attr);
+		if (r->cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(r->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+
+		err = pthread_create(&r->thread, &attr, reactor_thread, r);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			log_error("reactor %u: %s\n", i, strerror(err));
+			reactor_group_stop(group);
+			return -err;
+		}
+
+		r->running = true;
+	}
+
+	return 0;
+}
+
+/* Quit every loop and wait for its thread.  Registrations are kept. */
+void reactor_group_stop(struct reactor_group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; i++) {
+		if (group->reactors[i].running)
+			mainloop_quit(group->reactors[i].loop);
+	}
+
+	for (i = 0; i < group->count; i++) {
+		struct reactor *r = &group->reactors[i];
+
+		if (!r->running)
+			continue;
+
+		pthread_join(r->thread, NULL);
+		r->running = false;
+	}
+}
+
+unsigned int reactor_group_size(struct reactor_group *group)
+{
+	return group->count;
+}
+
+struct mainloop *reactor_group_loop(struct reactor_group *group,
+							unsigned int index)
+{
+	if (index >= group->count)
+		return NULL;
+
+	return group->reactors[index].loop;
+}
+
+/* Round-robin over the loops, from any thread. */
+struct mainloop *reactor_group_next(struct reactor_group *group)
+{
+	unsigned int n = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED);
+
+	return group->reactors[n % group->count].loop;
+}
+
+static void listener_destroy(void *user_data)
+{
+	struct listener *listener = user_data;
+
+	if (listener->reuseport)
+		close(listener->fd);
+
+	free(listener);
+}
+
+static void handoff_callback(void *user_data)
+{
+	struct handoff *h = user_data;
+	struct listener *listener = h->listener;
+
+	listener->callback(mainloop_current(), h->fd, listener->user_data);
+	h->fd = -1;
+}
+
+static void handoff_destroy(void *user_data)
+{
+	struct handoff *h = user_data;
+
+	/* dropped before it ran */
+	if (h->fd >= 0)
+		close(h->fd);
+
+	free(h);
+}
+
+static void dispatch_connection(struct listener *listener, int fd)
+{
+	struct mainloop *loop = reactor_group_next(listener->group);
+	struct handoff *h;
+
+	if (loop == mainloop_current()) {
+		listener->callback(loop, fd, listener->user_data);
+		return;
+	}
+
+	h = malloc(sizeof(*h));
+	if (!h) {
+		close(fd);
+		return;
+	}
+
+	h->fd = fd;
+	h->listener = listener;
+
+	if (mainloop_post(loop, handoff_callback, h, handoff_destroy) < 0)
+		handoff_destroy(h);
+}
+
+/* The loop accepts until EAGAIN, or with io_uring multishot. */
+static void accept_callback(int conn, void *user_data)
+{
+	struct listener *listener = user_data;
+
+	if (listener->reuseport)
+		listener->callback(mainloop_current(), conn,
+						listener->user_data);
+	else
+		dispatch_connection(listener, conn);
+}
+
+static struct listener *listener_new(struct reactor_group *group, int fd,
+			bool reuseport, reactor_accept_func callback,
+			void *user_data)
+{
+	struct listener *listener;
+
+	listener = malloc(sizeof(*listener));
+	if (!listener)
+		return NULL;
+
+	listener->fd = fd;
+	listener->reuseport = reuseport;
+	listener->group = group;
+	listener->callback = callback;
+	listener->user_data = user_data;
+
+	return listener;
+}
+
+/*
+ * Accept on the first loop and spread the connections over all of them.
+ * listen_fd must be non-blocking and stays owned by the caller.
+ */
+int reactor_group_accept(struct reactor_group *group, int listen_fd,
+			reactor_accept_func callback, void *user_data)
+{
+	struct listener *listener;
+	int err;
+
+	if (listen_fd < 0 || !callback)
+		return -EINVAL;
+
+	listener = listener_new(group, listen_fd, false, callback, user_data);
+	if (!listener)
+		return -ENOMEM;
+
+	err = mainloop_add_acceptor(group->reactors[0].loop, listen_fd,
+				accept_callback, listener, listener_destroy);
+	if (err < 0) {
+		free(listener);
+		return err;
+	}
+
+	return 0;
+}
+
+static int listen_reuseport(const struct sockaddr *addr, socklen_t addrlen)
+{
+	int fd, on = 1;
+
+	fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+		bind(fd, addr, addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+/*
+ * Give every loop its own listening socket on addr with SO_REUSEPORT;
+ * each loop accepts its share of the connections itself.  On failure
+ * the sockets already given to loops are removed again.
+ */
+int reactor_group_listen(struct reactor_group *group,
+			const struct sockaddr *addr, socklen_t addrlen,
+			reactor_accept_func callback, void *user_data)
+{
+	unsigned int i;
+	int *fds, err = 0;
+
+	if (!addr || !callback)
+		return -EINVAL;
+
+	fds = calloc(group->count, sizeof(*fds));
+	if (!fds)
+		return -ENOMEM;
+
+	for (i = 0; i < group->count; i++) {
+		struct listener *listener;
+		int fd;
+
+		fd = listen_reuseport(addr, addrlen);
+		if (fd < 0) {
+			err = fd;
+			break;
+		}
+
+		listener = listener_new(group, fd, true, callback, user_data);
+		if (!listener) {
+			close(fd);
+			err = -ENOMEM;
+			break;
+		}
+
+		err = mainloop_add_acceptor(group->reactors[i].loop, fd,
+				accept_callback, listener, listener_destroy);
+		if (err < 0) {
+			listener_destroy(listener);
+			break;
+		}
+		fds[i] = fd;
+	}
+
+	/* closed by listener_destroy */
+	if (err < 0) {
+		while (i--)
+			mainloop_remove_fd(group->reactors[i].loop, fds[i]);
+	}
+
+	free(fds);
+
+	return err;
+}
@@ -0,0 +1,35 @@
+/*
+ * Group of event loops, one per thread
+ */
+#ifndef __REACTOR_GROUP_H__
+#define __REACTOR_GROUP_H__
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "epoll_loop.h"
+
+struct reactor_group;
+
+/* Runs on the loop the connection was handed to. */
+typedef void (*reactor_accept_func) (struct mainloop *loop, int fd,
+							void *user_data);
+
+struct reactor_group *reactor_group_new(unsigned int count, bool pin_cpus);
+void reactor_group_free(struct reactor_group *group);
+
+int reactor_group_start(struct reactor_group *group);
+void reactor_group_stop(struct reactor_group *group);
+
+unsigned int reactor_group_size(struct reactor_group *group);
+struct mainloop *reactor_group_loop(struct reactor_group *group,
+							unsigned int index);
+struct mainloop *reactor_group_next(struct reactor_group *group);
+
+int reactor_group_accept(struct reactor_group *group, int listen_fd,
+			reactor_accept_func callback, void *user_data);
+int reactor_group_listen(struct reactor_group *group,
+			const struct sockaddr *addr, socklen_t addrlen,
+			reactor_accept_func callback, void *user_data);
+
+#endif
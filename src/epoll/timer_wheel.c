@@ -0,0 +1,203 @@
+/*
+ * Hierarchical timing wheel for the epoll main loop
+ *
+ * WHEEL_LEVELS wheels of WHEEL_SIZE slots each: level 0 holds the timers
+ * due within the next 64 ticks, one slot per tick; level 1 those due
+ * within 64^2 ticks, one slot per 64 ticks; and so on up to 64^6 ticks.
+ * When the lower bits of the clock wrap to zero, the current slot of the
+ * level above is cascaded, i.e. its timers are re-inserted one level
+ * down.  Adding and cancelling a timer are O(1), and a timer is moved at
+ * most WHEEL_LEVELS - 1 times in its life.
+ *
+ * A bitmap of the non-empty slots per level finds the next tick with
+ * work to do, either an expiry on level 0 or a cascade above, so the
+ * caller can sleep until then instead of ticking.
+ */
+#include "timer_wheel.h"
+
+/* The timer sits on an expired list, not in a slot. */
+#define WHEEL_EXPIRED	WHEEL_LEVELS
+
+#define LEVEL_SHIFT(level)	((level) * WHEEL_BITS)
+#define MAX_DELTA		((1ULL << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+	int level, slot;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < WHEEL_SIZE; slot++)
+			INIT_LIST_HEAD(&wheel->slots[level][slot]);
+		wheel->bitmap[level] = 0;
+	}
+
+	wheel->clk = now;
+	wheel->count = 0;
+}
+
+void timer_wheel_init_timer(struct wheel_timer *timer)
+{
+	INIT_LIST_HEAD(&timer->list);
+}
+
+bool timer_wheel_pending(const struct wheel_timer *timer)
+{
+	return !list_empty(&timer->list);
+}
+
+static void enqueue(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	uint64_t delta;
+	int level;
+
+	/* anything overdue runs on the next tick processed */
+	if (timer->expires < wheel->clk)
+		timer->expires = wheel->clk;
+
+	delta = timer->expires - wheel->clk;
+	if (delta > MAX_DELTA) {
+		delta = MAX_DELTA;
+		timer->expires = wheel->clk + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < 1ULL << LEVEL_SHIFT(level + 1))
+			break;
+	}
+
+	timer->level = level;
+	timer->slot = (timer->expires >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+	list_add_tail(&timer->list, &wheel->slots[level][timer->slot]);
+	wheel->bitmap[level] |= 1ULL << timer->slot;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+							uint64_t expires)
+{
+	timer_wheel_del(wheel, timer);
+
+	timer->expires = expires;
+	enqueue(wheel, timer);
+	wheel->count++;
+}
+
+/* Safe on timers which are idle or sitting on an expired list. */
+void timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	if (!timer_wheel_pending(timer))
+		return;
+
+	list_del_init(&timer->list);
+
+	if (timer->level == WHEEL_EXPIRED)
+		return;
+
+	if (list_empty(&wheel->slots[timer->level][timer->slot]))
+		wheel->bitmap[timer->level] &= ~(1ULL << timer->slot);
+
+	wheel->count--;
+}
+
+/*
+ * The first tick at or after the clock at which 'level' visits a
+ * non-empty slot.  For level 0 that is an expiry, above it a cascade,
+ * which happens when all the lower bits of the tick are zero.
+ */
+static uint64_t level_next(const struct timer_wheel *wheel, int level)
+{
+	uint64_t bitmap = wheel->bitmap[level];
+	uint64_t unit = 1ULL << LEVEL_SHIFT(level);
+	uint64_t start = (wheel->clk + unit - 1) & ~(unit - 1);
+	unsigned int idx = (start >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+
+	if (idx)
+		bitmap = (bitmap >> idx) | (bitmap << (WHEEL_SIZE - idx));
+
+	return start + ((uint64_t) __builtin_ctzll(bitmap) << LEVEL_SHIFT(level));
+}
+
+/*
+ * Store in 'when' the next tick at which timer_wheel_expire has work to
+ * do.  That is never later than the earliest expiry, but may be earlier
+ * when a cascade comes first.  Returns false if no timer is pending.
+ */
+bool timer_wheel_next(const struct timer_wheel *wheel, uint64_t *when)
+{
+	uint64_t next = UINT64_MAX;
+	int level;
+
+	if (!wheel->count)
+		return false;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		uint64_t t;
+
+		if (!wheel->bitmap[level])
+			continue;
+
+		t = level_next(wheel, level);
+		if (t < next)
+			next = t;
+	}
+
+	*when = next;
+
+	return true;
+}
+
+static void cascade(struct timer_wheel *wheel, int level, int slot)
+{
+	struct list_head *head = &wheel->slots[level][slot];
+
+	wheel->bitmap[level] &= ~(1ULL << slot);
+
+	while (!list_empty(head)) {
+		struct wheel_timer *timer;
+
+		timer = list_first_entry(head, struct wheel_timer, list);
+		list_del(&timer->list);
+		enqueue(wheel, timer);
+	}
+}
+
+/*
+ * Advance the clock to 'now' and move every timer which expires at or
+ * before it to 'expired', in expiry order.  The caller runs them; it
+ * may add or delete any timer meanwhile, including those still waiting
+ * on 'expired'.
+ */
+void timer_wheel_expire(struct timer_wheel *wheel, uint64_t now,
+						struct list_head *expired)
+{
+	uint64_t next;
+
+	while (timer_wheel_next(wheel, &next) && next <= now) {
+		struct list_head *head;
+		struct wheel_timer *timer;
+		int level, slot;
+
+		wheel->clk = next;
+
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if (next & ((1ULL << LEVEL_SHIFT(level)) - 1))
+				break;
+			slot = (next >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+			cascade(wheel, level, slot);
+		}
+
+		slot = next & WHEEL_MASK;
+		head = &wheel->slots[0][slot];
+		while (!list_empty(head)) {
+			timer = list_first_entry(head, struct wheel_timer, list);
+			timer->level = WHEEL_EXPIRED;
+			list_move_tail(&timer->list, expired);
+			wheel->count--;
+		}
+		wheel->bitmap[0] &= ~(1ULL << slot);
+
+		wheel->clk = next + 1;
+	}
+
+	if (wheel->clk <= now)
+		wheel->clk = now + 1;
+}
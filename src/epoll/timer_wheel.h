@@ -0,0 +1,46 @@
+/*
+ * Hierarchical timing wheel for the epoll main loop
+ */
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "type_def.h"	/* container_of */
+#include "list.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	6
+
+/* Expiry times are in ticks, the wheel does not care about their unit. */
+struct wheel_timer {
+	struct list_head list;
+	uint64_t expires;
+	unsigned char level;
+	unsigned char slot;
+};
+
+struct timer_wheel {
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t bitmap[WHEEL_LEVELS];	/* non-empty slots */
+	uint64_t clk;			/* next tick to process */
+	unsigned int count;		/* timers in the slots */
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_wheel_init_timer(struct wheel_timer *timer);
+bool timer_wheel_pending(const struct wheel_timer *timer);
+
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+							uint64_t expires);
+void timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+bool timer_wheel_next(const struct timer_wheel *wheel, uint64_t *when);
+void timer_wheel_expire(struct timer_wheel *wheel, uint64_t now,
+						struct list_head *expired);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Minimal io_uring wrapper for the main loop
+ *
+ * Just the raw system calls and ring bookkeeping the loop needs, so
+ * there is no dependency on liburing.  One thread owns a ring: sqes are
+ * filled in place, published together and submitted with the next
+ * io_uring_enter, which is also where the loop waits for completions.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+							flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+						unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	int fd;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	fd = sys_io_uring_setup(entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->features = p.features;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			goto fail;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto fail;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned int *) (sq + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	close(fd);
+	ring->fd = -1;
+	return -ENOMEM;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * A zeroed sqe to fill in, or NULL when the submission queue is full
+ * and has to be submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & ring->sq_mask] =
+					ring->sqe_tail & ring->sq_mask;
+	ring->sqe_tail++;
+	ring->sqe_pending++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/*
+ * Submit every sqe handed out so far and, with wait_nr, wait until that
+ * many completions are available.  Returns the number submitted.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	unsigned int pending = ring->sqe_pending;
+	int ret;
+
+	if (!pending && !wait_nr)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, pending, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	ring->sqe_pending -= ret;
+
+	return ret;
+}
+
+/* The oldest unseen completion, or NULL. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return NULL;
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register a ring of provided buffers the kernel picks from for
+ * IOSQE_BUFFER_SELECT requests of group bgid; count is a power of 2.
+ */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bufs,
+			unsigned short bgid, unsigned int count,
+			unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int i;
+
+	memset(bufs, 0, sizeof(*bufs));
+
+	if (posix_memalign((void **) &bufs->br, page,
+					count * sizeof(struct io_uring_buf)))
+		return -ENOMEM;
+
+	bufs->buffers = malloc((size_t) count * size);
+	if (!bufs->buffers) {
+		free(bufs->br);
+		return -ENOMEM;
+	}
+
+	memset(bufs->br, 0, count * sizeof(struct io_uring_buf));
+	bufs->count = count;
+	bufs->size = size;
+	bufs->bgid = bgid;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) bufs->br;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+								&reg, 1) < 0) {
+		int err = -errno;
+
+		free(bufs->buffers);
+		free(bufs->br);
+		memset(bufs, 0, sizeof(*bufs));
+		return err;
+	}
+
+	for (i = 0; i < count; i++)
+		uring_buf_recycle(bufs, i);
+
+	return 0;
+}
+
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bufs)
+{
+	struct io_uring_buf_reg reg;
+
+	if (!bufs->br)
+		return;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = bufs->bgid;
+	if (ring->fd >= 0)
+		sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING,
+								&reg, 1);
+
+	free(bufs->buffers);
+	free(bufs->br);
+	memset(bufs, 0, sizeof(*bufs));
+}
+
+void *uring_buf_get(struct uring_buf_ring *bufs, unsigned int bid)
+{
+	return bufs->buffers + (size_t) bid * bufs->size;
+}
+
+/* Hand buffer bid back to the kernel. */
+void uring_buf_recycle(struct uring_buf_ring *bufs, unsigned int bid)
+{
+	struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & (bufs->count - 1)];
+
+	buf->addr = (unsigned long) uring_buf_get(bufs, bid);
+	buf->len = bufs->size;
+	buf->bid = bid;
+
+	bufs->tail++;
+	__atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_URING */
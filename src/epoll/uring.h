@@ -0,0 +1,79 @@
+/*
+ * Minimal io_uring wrapper for the main loop
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* Headers new enough for multishot recv and provided buffer rings. */
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+#endif
+
+#ifdef HAVE_URING
+
+struct uring {
+	int fd;
+	unsigned int features;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;		/* sqes handed out, not yet published */
+	unsigned int sqe_pending;	/* published, not yet submitted */
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/* A provided buffer ring: 'count' buffers of 'size' bytes, group 'bgid'. */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	unsigned char *buffers;
+	unsigned int count;
+	unsigned int size;
+	unsigned short bgid;
+	unsigned short tail;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_exit(struct uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bufs,
+			unsigned short bgid, unsigned int count,
+			unsigned int size);
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bufs);
+void *uring_buf_get(struct uring_buf_ring *bufs, unsigned int bid);
+void uring_buf_recycle(struct uring_buf_ring *bufs, unsigned int bid);
+
+#endif /* HAVE_URING */
+
+#endif
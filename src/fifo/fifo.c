@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "fifo.h"
 
@@ -23,18 +27,7 @@
 /* use our min/max macro and prevent warnings */
 #include <utils.h>
 
-#define error() printf("opps, crash in file %s line %d\n", __FUNCTION__, __LINE__)
-#define BUG_ON(condition) do { if (condition) { error(); exit(-1); } } while(0)
-
-
-/*
- *  Determine whether some value is a power of two, where zero is
- * *not* considered a power of two.
- */
-static int is_power_of_2(unsigned long n)
-{
-	return (n != 0 && ((n & (n - 1)) == 0));
-}
+#include "fifo_internal.h"
 
 /*
  * kfifo_init - allocates a new FIFO using a preallocated buffer
@@ -59,6 +52,7 @@ struct kfifo *kfifo_init(unsigned char *buffer, unsigned int size, spinlock_t *l
     fifo->size = size;
     fifo->in = fifo->out = 0;
     fifo->lock = lock;
+    fifo->mirrored = 0;
 
     return fifo;
 }
@@ -88,13 +82,71 @@ struct kfifo *kfifo_alloc(unsigned int size, spinlock_t *lock)
     return ret;
 }
 
+/*
+ * kfifo_alloc_mirrored - allocates a FIFO whose buffer is mapped twice
+ * @size: the size of the ring, a power of 2, rounded up to a page.
+ * @lock: the lock to be used to protect the fifo buffer
+ *
+ * The same memfd is mapped at buffer[0, size) and buffer[size, 2 * size),
+ * so any 'size' bytes starting anywhere in the first half are contiguous
+ * in memory. Readers can hand a message that straddles the end of the
+ * ring to a parser as-is and put/get never split their memcpy.
+ *
+ * Returns NULL if the kernel can't provide the mapping, the caller may
+ * then fall back to kfifo_alloc().
+ */
+struct kfifo *kfifo_alloc_mirrored(unsigned int size, spinlock_t *lock)
+{
+    struct kfifo *ret;
+    unsigned char *base;
+    long page = sysconf(_SC_PAGESIZE);
+    int fd;
+
+    /* size must be a power of 2*/
+    BUG_ON(!is_power_of_2(size));
+    if (size < page)
+        size = page;
+
+    fd = memfd_create("kfifo", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) < 0)
+        goto err_fd;
+
+    /* reserve 2 * size of address space, then overlay both halves */
+    base = mmap(NULL, 2 * (size_t) size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto err_fd;
+    if (mmap(base, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        goto err_map;
+    if (mmap(base + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        goto err_map;
+    close(fd);
+
+    ret = kfifo_init(base, size, lock);
+    ret->mirrored = 1;
+
+    return ret;
+
+err_map:
+    munmap(base, 2 * (size_t) size);
+err_fd:
+    close(fd);
+    return NULL;
+}
+
 /*
  * kfifo_free - frees the FIFO
  * @fifo: the fifo to be freed.
  */
 void kfifo_free(struct kfifo *fifo)
 {
-	free(fifo->buffer);
+	if (fifo->mirrored)
+		munmap(fifo->buffer, 2 * (size_t) fifo->size);
+	else
+		free(fifo->buffer);
 	free(fifo);
 }
 
@@ -115,16 +167,23 @@ unsigned int __kfifo_put(struct kfifo *fifo,
 			 unsigned char *buffer, unsigned int len)
 {
     unsigned int l;
-    len = min(len, fifo->size - fifo->in + fifo->out);
+    unsigned int in = fifo->in;
+
+    /*
+     * acquire pairs with the release in __kfifo_get(): the reader is
+     * done with the bytes before we see 'out' move past them
+     */
+    len = min(len, fifo->size - in + smp_load_acquire(&fifo->out));
 
     /* first put the data starting from fifo->in to buffer end */
-    l = min(len, fifo->size - (fifo->in & (fifo->size - 1)));
-    memcpy(fifo->buffer + (fifo->in & (fifo->size - 1)), buffer, l);
+    l = fifo->mirrored ? len : min(len, fifo->size - (in & (fifo->size - 1)));
+    memcpy(fifo->buffer + (in & (fifo->size - 1)), buffer, l);
 
     /* then put the reset(if any) at the begining of the buffer */
     memcpy(fifo->buffer, buffer + l, len - l);
 
-    fifo->in += len;
+    /* make the data visible before the new 'in' */
+    smp_store_release(&fifo->in, in + len);
 
     return len;
 }
@@ -145,18 +204,155 @@ unsigned int __kfifo_get(struct kfifo *fifo,
 			 unsigned char *buffer, unsigned int len)
 {
     unsigned int l;
+    unsigned int out = fifo->out;
 
-    len = min(len, fifo->in - fifo->out);
+    /* acquire pairs with the release in __kfifo_put() */
+    len = min(len, smp_load_acquire(&fifo->in) - out);
 
     /* first get the data from fifo->out until the end of the buffer */
-	l = min(len, fifo->size - (fifo->out & (fifo->size - 1)));
-	memcpy(buffer, fifo->buffer + (fifo->out & (fifo->size - 1)), l);
+	l = fifo->mirrored ? len : min(len, fifo->size - (out & (fifo->size - 1)));
+	memcpy(buffer, fifo->buffer + (out & (fifo->size - 1)), l);
 
     /* then get the rest (if any) from the beginning of the buffer */
     memcpy(buffer + l, fifo->buffer, len - l);
 
-    fifo->out += len;
+    /* we are done reading before the writer may reuse the space */
+    smp_store_release(&fifo->out, out + len);
+
+    return len;
+}
+
+
+/*
+ * kfifo_span - describes 'len' bytes of the ring starting at index 'idx'
+ * as at most two iovecs
+ */
+static void kfifo_span(struct kfifo *fifo, struct iovec vec[2],
+			unsigned int idx, unsigned int len)
+{
+    unsigned int off = idx & (fifo->size - 1);
+    unsigned int l = fifo->mirrored ? len : min(len, fifo->size - off);
+
+    vec[0].iov_base = fifo->buffer + off;
+    vec[0].iov_len = l;
+    vec[1].iov_base = fifo->buffer;
+    vec[1].iov_len = len - l;
+}
+
+/*
+ * __kfifo_reserve - hands out free space for the producer to fill in place
+ * @fifo: the fifo to be used.
+ * @vec: receives the free region, vec[1] is empty unless it wraps.
+ * @len: the most bytes the caller wants to write.
+ *
+ * Returns the number of bytes described by @vec. Nothing becomes
+ * visible to the reader until __kfifo_commit() is called.
+ */
+unsigned int __kfifo_reserve(struct kfifo *fifo, struct iovec vec[2], unsigned int len)
+{
+    unsigned int in = fifo->in;
+
+    len = min(len, fifo->size - in + smp_load_acquire(&fifo->out));
+    kfifo_span(fifo, vec, in, len);
 
     return len;
 }
 
+/*
+ * __kfifo_commit - publishes bytes written into a reserved region
+ * @fifo: the fifo to be used.
+ * @len: the number of bytes actually written, at most the reserved size.
+ */
+void __kfifo_commit(struct kfifo *fifo, unsigned int len)
+{
+    smp_store_release(&fifo->in, fifo->in + len);
+}
+
+/*
+ * __kfifo_peek - hands out queued data for the consumer to use in place
+ * @fifo: the fifo to be used.
+ * @vec: receives the queued region, vec[1] is empty unless it wraps.
+ * @len: the most bytes the caller wants to see.
+ *
+ * Returns the number of bytes described by @vec. The data stays in
+ * the fifo until __kfifo_consume() is called.
+ */
+unsigned int __kfifo_peek(struct kfifo *fifo, struct iovec vec[2], unsigned int len)
+{
+    unsigned int out = fifo->out;
+
+    len = min(len, smp_load_acquire(&fifo->in) - out);
+    kfifo_span(fifo, vec, out, len);
+
+    return len;
+}
+
+/*
+ * __kfifo_consume - releases bytes obtained from __kfifo_peek()
+ * @fifo: the fifo to be used.
+ * @len: the number of bytes the consumer is done with.
+ */
+void __kfifo_consume(struct kfifo *fifo, unsigned int len)
+{
+    smp_store_release(&fifo->out, fifo->out + len);
+}
+
+/*
+ * kfifo_fill_fd - reads from a file descriptor straight into the FIFO
+ * @fifo: the fifo to be used.
+ * @fd: the descriptor to read from, a socket, pipe or file.
+ * @len: the most bytes to read.
+ *
+ * Returns the number of bytes queued, 0 on EOF or when the FIFO is
+ * full, -1 with errno set on error (EAGAIN for a drained non-blocking fd).
+ */
+ssize_t kfifo_fill_fd(struct kfifo *fifo, int fd, unsigned int len)
+{
+    struct iovec vec[2];
+    ssize_t ret;
+    int cnt;
+
+    len = __kfifo_reserve(fifo, vec, len);
+    if (!len)
+        return 0;
+
+    cnt = vec[1].iov_len ? 2 : 1;
+    do {
+        ret = cnt == 1 ? read(fd, vec[0].iov_base, vec[0].iov_len) : readv(fd, vec, cnt);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret > 0)
+        __kfifo_commit(fifo, ret);
+
+    return ret;
+}
+
+/*
+ * kfifo_drain_fd - writes queued data straight from the FIFO to a descriptor
+ * @fifo: the fifo to be used.
+ * @fd: the descriptor to write to.
+ * @len: the most bytes to write.
+ *
+ * Returns the number of bytes consumed, 0 when the FIFO is empty,
+ * -1 with errno set on error. A short write leaves the rest queued.
+ */
+ssize_t kfifo_drain_fd(struct kfifo *fifo, int fd, unsigned int len)
+{
+    struct iovec vec[2];
+    ssize_t ret;
+    int cnt;
+
+    len = __kfifo_peek(fifo, vec, len);
+    if (!len)
+        return 0;
+
+    cnt = vec[1].iov_len ? 2 : 1;
+    do {
+        ret = cnt == 1 ? write(fd, vec[0].iov_base, vec[0].iov_len) : writev(fd, vec, cnt);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret > 0)
+        __kfifo_consume(fifo, ret);
+
+    return ret;
+}
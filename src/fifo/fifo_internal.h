@@ -0,0 +1,21 @@
+#ifndef _LINUX_KFIFO_INTERNAL_H
+#define _LINUX_KFIFO_INTERNAL_H
+
+/* Shared by the kfifo implementations, not part of fifo.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define error() printf("opps, crash in file %s line %d\n", __FUNCTION__, __LINE__)
+#define BUG_ON(condition) do { if (condition) { error(); exit(-1); } } while(0)
+
+/*
+ *  Determine whether some value is a power of two, where zero is
+ * *not* considered a power of two.
+ */
+static inline int is_power_of_2(unsigned long n)
+{
+	return (n != 0 && ((n & (n - 1)) == 0));
+}
+
+#endif
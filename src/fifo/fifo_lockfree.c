@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fifo.h"
+#include <utils.h>
+
+#include "fifo_internal.h"
+
+static void *cacheline_zalloc(size_t size)
+{
+    void *p = NULL;
+
+    if (posix_memalign(&p, KFIFO_CACHELINE_SIZE, size))
+        return NULL;
+    memset(p, 0, size);
+    return p;
+}
+
+/*
+ * kfifo_spsc_alloc - allocates a new single-producer/single-consumer FIFO
+ * @size: the size of the internal buffer, this have to be a power of 2.
+ */
+struct kfifo_spsc *kfifo_spsc_alloc(unsigned int size)
+{
+    struct kfifo_spsc *fifo;
+
+    BUG_ON(!is_power_of_2(size));
+
+    fifo = (struct kfifo_spsc *) cacheline_zalloc(sizeof(struct kfifo_spsc));
+    BUG_ON(!fifo);
+
+    fifo->buffer = (unsigned char *) cacheline_zalloc(size);
+    BUG_ON(!fifo->buffer);
+    fifo->size = size;
+
+    return fifo;
+}
+
+/*
+ * kfifo_spsc_free - frees the FIFO
+ * @fifo: the fifo to be freed.
+ */
+void kfifo_spsc_free(struct kfifo_spsc *fifo)
+{
+    free(fifo->buffer);
+    free(fifo);
+}
+
+/*
+ * kfifo_spsc_put - puts some data into the FIFO, producer side only
+ * @fifo: the fifo to be used.
+ * @buffer: the data to be added.
+ * @len: the length of the data to be added.
+ *
+ * Copies at most 'len' bytes and returns the number of bytes copied.
+ * Must only ever be called from one thread at a time.
+ */
+unsigned int kfifo_spsc_put(struct kfifo_spsc *fifo,
+			    const unsigned char *buffer, unsigned int len)
+{
+    unsigned int l, off;
+    unsigned int in = fifo->in;
+    unsigned int avail = fifo->size - (in - fifo->out_cache);
+
+    if (avail < len) {
+        /* only touch the consumer's cache line when we look full */
+        fifo->out_cache = smp_load_acquire(&fifo->out);
+        avail = fifo->size - (in - fifo->out_cache);
+    }
+    len = min(len, avail);
+    if (!len)
+        return 0;
+
+    off = in & (fifo->size - 1);
+    l = min(len, fifo->size - off);
+    memcpy(fifo->buffer + off, buffer, l);
+    memcpy(fifo->buffer, buffer + l, len - l);
+
+    smp_store_release(&fifo->in, in + len);
+
+    return len;
+}
+
+/*
+ * kfifo_spsc_get - gets some data from the FIFO, consumer side only
+ * @fifo: the fifo to be used.
+ * @buffer: where the data must be copied.
+ * @len: the size of the destination buffer.
+ *
+ * Copies at most 'len' bytes and returns the number of bytes copied.
+ * Must only ever be called from one thread at a time.
+ */
+unsigned int kfifo_spsc_get(struct kfifo_spsc *fifo,
+			    unsigned char *buffer, unsigned int len)
+{
+    unsigned int l, off;
+    unsigned int out = fifo->out;
+    unsigned int used = fifo->in_cache - out;
+
+    if (used < len) {
+        /* only touch the producer's cache line when we look empty */
+        fifo->in_cache = smp_load_acquire(&fifo->in);
+        used = fifo->in_cache - out;
+    }
+    len = min(len, used);
+    if (!len)
+        return 0;
+
+    off = out & (fifo->size - 1);
+    l = min(len, fifo->size - off);
+    memcpy(buffer, fifo->buffer + off, l);
+    memcpy(buffer + l, fifo->buffer, len - l);
+
+    smp_store_release(&fifo->out, out + len);
+
+    return len;
+}
+
+/*
+ * Each mpmc cell is laid out as [seq][record], with the record padded
+ * to 8 bytes so that consecutive sequence words stay naturally aligned.
+ */
+#define MPMC_CELL(fifo, pos) \
+    ((fifo)->cells + (size_t) ((pos) & (fifo)->mask) * (fifo)->cell_size)
+#define MPMC_SEQ(cell) ((unsigned int *) (cell))
+#define MPMC_REC(cell) ((cell) + sizeof(unsigned long long))
+
+/*
+ * kfifo_mpmc_alloc - allocates a new multi-producer/multi-consumer FIFO
+ * @count: the number of records, this have to be a power of 2 (>= 2).
+ * @esize: the size in bytes of one record.
+ */
+struct kfifo_mpmc *kfifo_mpmc_alloc(unsigned int count, unsigned int esize)
+{
+    struct kfifo_mpmc *fifo;
+    unsigned int i;
+
+    BUG_ON(!is_power_of_2(count) || count < 2 || !esize);
+
+    fifo = (struct kfifo_mpmc *) cacheline_zalloc(sizeof(struct kfifo_mpmc));
+    BUG_ON(!fifo);
+
+    fifo->mask = count - 1;
+    fifo->esize = esize;
+    fifo->cell_size = sizeof(unsigned long long) + ((esize + 7) & ~7U);
+    fifo->cells = (unsigned char *) cacheline_zalloc((size_t) count * fifo->cell_size);
+    BUG_ON(!fifo->cells);
+
+    /* slot i is free for the producer which claims position i */
+    for (i = 0; i < count; i++)
+        *MPMC_SEQ(MPMC_CELL(fifo, i)) = i;
+
+    return fifo;
+}
+
+/*
+ * kfifo_mpmc_free - frees the FIFO
+ * @fifo: the fifo to be freed.
+ */
+void kfifo_mpmc_free(struct kfifo_mpmc *fifo)
+{
+    free(fifo->cells);
+    free(fifo);
+}
+
+/*
+ * kfifo_mpmc_put - puts one record into the FIFO
+ * @fifo: the fifo to be used.
+ * @rec: 'esize' bytes to be added.
+ *
+ * Returns 1 if the record was queued, 0 if the FIFO is full.
+ */
+int kfifo_mpmc_put(struct kfifo_mpmc *fifo, const void *rec)
+{
+    unsigned char *cell;
+    unsigned int seq;
+    unsigned int pos = READ_ONCE(fifo->in);
+
+    for (;;) {
+        int dif;
+
+        cell = MPMC_CELL(fifo, pos);
+        seq = smp_load_acquire(MPMC_SEQ(cell));
+        dif = (int) (seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&fifo->in, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            /* 'pos' was reloaded by the failed CAS */
+        } else if (dif < 0) {
+            /* the slot still holds a record from the previous lap */
+            return 0;
+        } else {
+            pos = READ_ONCE(fifo->in);
+        }
+    }
+
+    memcpy(MPMC_REC(cell), rec, fifo->esize);
+    smp_store_release(MPMC_SEQ(cell), pos + 1);
+
+    return 1;
+}
+
+/*
+ * kfifo_mpmc_get - gets one record from the FIFO
+ * @fifo: the fifo to be used.
+ * @rec: where the 'esize' bytes must be copied.
+ *
+ * Returns 1 if a record was dequeued, 0 if the FIFO is empty.
+ */
+int kfifo_mpmc_get(struct kfifo_mpmc *fifo, void *rec)
+{
+    unsigned char *cell;
+    unsigned int seq;
+    unsigned int pos = READ_ONCE(fifo->out);
+
+    for (;;) {
+        int dif;
+
+        cell = MPMC_CELL(fifo, pos);
+        seq = smp_load_acquire(MPMC_SEQ(cell));
+        dif = (int) (seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&fifo->out, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* nothing published at this slot yet */
+            return 0;
+        } else {
+            pos = READ_ONCE(fifo->out);
+        }
+    }
+
+    memcpy(rec, MPMC_REC(cell), fifo->esize);
+    /* hand the slot to the producer of the next lap */
+    smp_store_release(MPMC_SEQ(cell), pos + fifo->mask + 1);
+
+    return 1;
+}
@@ -77,7 +77,28 @@
    "tombstone" marker instead of clearing the cell, and another is to
    recalculate the positions of adjacent cells.  We take the latter
    approach because it results in less bookkeeping garbage and faster
-   retrieval at the (slight) expense of deletion.  */
+   retrieval at the (slight) expense of deletion.
+
+   INCREMENTAL RESIZE:
+   Growing rehashes every cell at once, which on a table of millions of
+   entries stalls the unlucky caller of hash_table_put for milliseconds.
+   When built with HASH_INCREMENTAL_RESIZE, growing only allocates the
+   new array and keeps the old one around.  Every put and remove then
+   moves at least HASH_MIGRATE_CELLS cells of the old array over, and
+   lookups consult the new array first and the old one second.  New keys
+   always go to the new array, so each key lives in exactly one array.
+
+   Cells are migrated a whole cluster (run of occupied cells) at a
+   time, and migration only ever pauses on an empty cell.  That way a
+   lookup in the old array never has to probe past a hole left by a
+   migrated cell.  For the same reason, removing a key from the old
+   array evacuates the rest of its cluster to the new array instead of
+   rehashing it in place.
+
+   Allocating and clearing the new array (faulting in its pages) costs
+   about as much as the rehash itself, so that is spread out too: once
+   the table is two thirds of the way to its resize threshold, the next
+   array is allocated and each put clears another slice of it.  */
 
 /* Maximum allowed fullness: when hash table's fullness exceeds this
    value, the table is resized.  */
@@ -88,6 +109,14 @@
    resizes.  */
 #define HASH_RESIZE_FACTOR 2
 
+#ifdef HASH_INCREMENTAL_RESIZE
+/* Minimum number of old cells migrated by each put/remove during an
+   incremental resize.  The old array is at most 75% full and the new
+   one takes 75% of twice the old size before it grows again, so any
+   value above 1 guarantees the migration is done in time.  */
+#define HASH_MIGRATE_CELLS 64
+#endif
+
 struct cell {
 	void *key;
 	void *value;
@@ -108,6 +137,15 @@ struct hash_table {
 	                               entries, resize the table.  */
 	int prime_offset;             /* the offset of the current prime in
 	                               the prime table. */
+#ifdef HASH_INCREMENTAL_RESIZE
+	struct cell *old_cells;       /* array being migrated, or NULL. */
+	int old_size;                 /* size of old_cells. */
+	int migrate_pos;              /* next old cell to migrate. */
+	int migrate_left;             /* old cells not yet visited. */
+	struct cell *next_cells;      /* array prepared for the next grow. */
+	int next_size;                /* size of next_cells. */
+	int next_cleared;             /* next_cells cleared so far. */
+#endif
 };
 
 /* We use the all-bits-set constant (INVALID_PTR) marker to mean that
@@ -233,6 +271,10 @@ struct hash_table *hash_table_new (int items,
 	/*assert (ht->resize_threshold >= items);*/
 
 	ht->cells = xnew_array(struct cell, ht->size);
+#ifdef HASH_INCREMENTAL_RESIZE
+	ht->old_cells = NULL;
+	ht->next_cells = NULL;
+#endif
 
 	/* Mark cells as empty.  We use 0xff rather than 0 to mark empty
 	 keys because it allows us to use NULL/0 as keys.  */
@@ -245,6 +287,10 @@ struct hash_table *hash_table_new (int items,
 /* Free the data associated with hash table HT. */
 void hash_table_destroy (struct hash_table *ht)
 {
+#ifdef HASH_INCREMENTAL_RESIZE
+	xfree(ht->old_cells);
+	xfree(ht->next_cells);
+#endif
 	xfree(ht->cells);
 	xfree(ht);
 }
@@ -265,6 +311,40 @@ static inline struct cell *find_cell (const struct hash_table *ht, const void *k
 	return c;
 }
 
+#ifdef HASH_INCREMENTAL_RESIZE
+/* Find the cell whose key is equal to KEY in the array being migrated,
+   or NULL if there is none.  */
+static struct cell *find_old_cell (const struct hash_table *ht, const void *key)
+{
+	struct cell *cells = ht->old_cells;
+	int size = ht->old_size;
+	struct cell *c;
+
+	if (!cells)
+		return NULL;
+
+	c = cells + HASH_POSITION (key, ht->hash_function, size);
+	FOREACH_OCCUPIED_ADJACENT (c, cells, size)
+		if (ht->test_function (key, c->key))
+			return c;
+	return NULL;
+}
+
+/* Like find_cell, but also looks in the array being migrated.  Returns
+   an unoccupied cell of the new array if KEY is in neither.  */
+static inline struct cell *lookup_cell (const struct hash_table *ht, const void *key)
+{
+	struct cell *c = find_cell (ht, key);
+	struct cell *old;
+
+	if (!CELL_OCCUPIED (c) && (old = find_old_cell (ht, key)))
+		return old;
+	return c;
+}
+#else
+#define lookup_cell find_cell
+#endif
+
 /* Get the value that corresponds to the key KEY in the hash table HT.
    If no value is found, return NULL.  Note that NULL is a legal value
    for value; if you are storing NULLs in your hash table, you can use
@@ -273,7 +353,7 @@ static inline struct cell *find_cell (const struct hash_table *ht, const void *k
    function.  */
 void *hash_table_get (const struct hash_table *ht, const void *key)
 {
-	struct cell *c = find_cell (ht, key);
+	struct cell *c = lookup_cell (ht, key);
 	if (CELL_OCCUPIED (c))
 		return c->value;
 	else
@@ -285,7 +365,7 @@ void *hash_table_get (const struct hash_table *ht, const void *key)
 int hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
                      void *orig_key, void *value)
 {
-	struct cell *c = find_cell(ht, lookup_key);
+	struct cell *c = lookup_cell(ht, lookup_key);
 	if (CELL_OCCUPIED (c)) {
 		if (orig_key)
 			*(void **)orig_key = c->key;
@@ -300,21 +380,109 @@ int hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
 /* Return 1 if HT contains KEY, 0 otherwise. */
 int hash_table_contains (const struct hash_table *ht, const void *key)
 {
-	struct cell *c = find_cell (ht, key);
+	struct cell *c = lookup_cell (ht, key);
 	return CELL_OCCUPIED (c);
 }
 
+/* Store the entry of cell C in CELLS, an array SIZE large.  We don't
+   need to test for uniqueness of keys because they come from the hash
+   table and are therefore known to be unique.  */
+static inline void move_cell (struct cell *cells, int size, hashfun_t hasher,
+			      const struct cell *c)
+{
+	struct cell *new_c = cells + HASH_POSITION (c->key, hasher, size);
+	FOREACH_OCCUPIED_ADJACENT (new_c, cells, size)
+	;
+	*new_c = *c;
+}
+
+#ifdef HASH_INCREMENTAL_RESIZE
+/* Move at least BUDGET cells of the old array to the new one, going on
+   to the end of the current cluster, and free the old array once it
+   is empty.  Pass INT_MAX to finish the migration.  */
+static void migrate_cells (struct hash_table *ht, int budget)
+{
+	struct cell *old_cells = ht->old_cells;
+
+	if (!old_cells)
+		return;
+
+	while (ht->migrate_left > 0) {
+		struct cell *c = old_cells + ht->migrate_pos;
+
+		if (CELL_OCCUPIED (c)) {
+			move_cell (ht->cells, ht->size, ht->hash_function, c);
+			CLEAR_CELL (c);
+		} else if (budget <= 0)
+			/* only ever pause between clusters */
+			break;
+
+		if (++ht->migrate_pos == ht->old_size)
+			ht->migrate_pos = 0;
+		--ht->migrate_left;
+		--budget;
+	}
+
+	if (!ht->migrate_left)
+		xfree (ht->old_cells);
+}
+
+/* Clear up to COUNT more cells of the array prepared for the next
+   grow, allocating it when the table gets close enough to growing.  */
+static void prepare_next_cells (struct hash_table *ht, int count)
+{
+	int left;
+
+	if (!ht->next_cells) {
+		if (ht->count < ht->resize_threshold / 3 * 2)
+			return;
+		ht->next_size = prime_size (ht->size * HASH_RESIZE_FACTOR, &ht->prime_offset);
+		ht->next_cells = xnew_array (struct cell, ht->next_size);
+		ht->next_cleared = 0;
+	}
+
+	left = ht->next_size - ht->next_cleared;
+	if (count > left)
+		count = left;
+	memset (ht->next_cells + ht->next_cleared, INVALID_PTR_CHAR,
+	        count * sizeof (struct cell));
+	ht->next_cleared += count;
+}
+
+/* Remove the old array's cell C.  The rest of its cluster is moved to
+   the new array rather than rehashed in place, see INCREMENTAL RESIZE
+   above.  */
+static void remove_old_cell (struct hash_table *ht, struct cell *c)
+{
+	struct cell *cells = ht->old_cells;
+	int size = ht->old_size;
+
+	CLEAR_CELL (c);
+	c = NEXT_CELL (c, cells, size);
+	FOREACH_OCCUPIED_ADJACENT (c, cells, size) {
+		move_cell (ht->cells, ht->size, ht->hash_function, c);
+		CLEAR_CELL (c);
+	}
+}
+#endif
+
 /* Grow hash table HT as necessary, and rehash all the key-value
    mappings.  */
 static void grow_hash_table (struct hash_table *ht)
 {
-	hashfun_t hasher = ht->hash_function;
 	struct cell *old_cells = ht->cells;
 	struct cell *old_end   = ht->cells + ht->size;
-	struct cell *c, *cells;
+	struct cell *cells;
 	int newsize;
 
+#ifdef HASH_INCREMENTAL_RESIZE
+	/* the previous migration is normally long done by now */
+	migrate_cells (ht, INT_MAX);
+	prepare_next_cells (ht, INT_MAX);
+	newsize = ht->next_size;
+#else
 	newsize = prime_size(ht->size * HASH_RESIZE_FACTOR, &ht->prime_offset);
+#endif
 #if 0
 	printf ("growing from %d to %d; fullness %.2f%% to %.2f%%\n", ht->size, newsize,
 		100.0 * ht->count / ht->size, 100.0 * ht->count / newsize);
@@ -323,30 +491,46 @@ static void grow_hash_table (struct hash_table *ht)
 	ht->size = newsize;
 	ht->resize_threshold = (int) (newsize * HASH_MAX_FULLNESS);
 
+#ifdef HASH_INCREMENTAL_RESIZE
+	cells = ht->next_cells;
+	ht->next_cells = NULL;
+#else
 	cells = xnew_array (struct cell, newsize);
 	memset (cells, INVALID_PTR_CHAR, newsize * sizeof (struct cell));
+#endif
 	ht->cells = cells;
 
+#ifdef HASH_INCREMENTAL_RESIZE
+	/* Leave the cells where they are; puts and removes will move them.
+	   Start right after an empty cell so no cluster is split.  */
+	ht->old_cells = old_cells;
+	ht->old_size = old_end - old_cells;
+	ht->migrate_pos = 0;
+	while (CELL_OCCUPIED (old_cells + ht->migrate_pos))
+		++ht->migrate_pos;
+	ht->migrate_left = ht->old_size;
+#else
+	struct cell *c;
+
 	for (c = old_cells; c < old_end; c++)
-		if (CELL_OCCUPIED (c)) {
-			struct cell *new_c;
-			/* We don't need to test for uniqueness of keys because they
-			come from the hash table and are therefore known to be
-			unique.  */
-			new_c = cells + HASH_POSITION (c->key, hasher, newsize);
-			FOREACH_OCCUPIED_ADJACENT (new_c, cells, newsize)
-			;
-			*new_c = *c;
-		}
+		if (CELL_OCCUPIED (c))
+			move_cell (cells, newsize, ht->hash_function, c);
 
 	xfree (old_cells);
+#endif
 }
 
 /* Put VALUE in the hash table HT under the key KEY.  This regrows the
    table if necessary.  */
 void hash_table_put (struct hash_table *ht, const void *key, const void *value)
 {
-	struct cell *c = find_cell (ht, key);
+	struct cell *c;
+
+#ifdef HASH_INCREMENTAL_RESIZE
+	migrate_cells (ht, HASH_MIGRATE_CELLS);
+	prepare_next_cells (ht, HASH_MIGRATE_CELLS);
+#endif
+	c = lookup_cell (ht, key);
 	if (CELL_OCCUPIED (c)) {
 		/* update existing item */
 		c->key   = (void *)key; /* const? */
@@ -371,7 +555,21 @@ void hash_table_put (struct hash_table *ht, const void *key, const void *value)
    entry; return 1 if an entry was removed.  */
 int hash_table_remove (struct hash_table *ht, const void *key)
 {
-	struct cell *c = find_cell (ht, key);
+	struct cell *c;
+
+#ifdef HASH_INCREMENTAL_RESIZE
+	struct cell *old;
+
+	migrate_cells (ht, HASH_MIGRATE_CELLS);
+	c = find_cell (ht, key);
+	if (!CELL_OCCUPIED (c) && (old = find_old_cell (ht, key))) {
+		remove_old_cell (ht, old);
+		--ht->count;
+		return 1;
+	}
+#else
+	c = find_cell (ht, key);
+#endif
 	if (!CELL_OCCUPIED (c))
 		return 0;
 	else {
@@ -415,6 +613,9 @@ int hash_table_remove (struct hash_table *ht, const void *key)
    remain unchanged.  */
 void hash_table_clear (struct hash_table *ht)
 {
+#ifdef HASH_INCREMENTAL_RESIZE
+	xfree (ht->old_cells);
+#endif
 	memset (ht->cells, INVALID_PTR_CHAR, ht->size * sizeof (struct cell));
 	ht->count = 0;
 }
@@ -431,8 +632,13 @@ void hash_table_clear (struct hash_table *ht)
    hash_table_iterate.  */
 void hash_table_for_each (struct hash_table *ht, int (*fn) (void *, void *, void *), void *arg)
 {
-	struct cell *c = ht->cells;
-	struct cell *end = ht->cells + ht->size;
+	struct cell *c, *end;
+
+#ifdef HASH_INCREMENTAL_RESIZE
+	migrate_cells (ht, INT_MAX);
+#endif
+	c = ht->cells;
+	end = ht->cells + ht->size;
 
 	for (; c < end; c++) {
 		if (CELL_OCCUPIED (c)) {
@@ -459,6 +665,9 @@ void hash_table_for_each (struct hash_table *ht, int (*fn) (void *, void *, void
    table must not be modified while being iterated over.  */
 void hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 {
+#ifdef HASH_INCREMENTAL_RESIZE
+	migrate_cells (ht, INT_MAX);
+#endif
 	iter->pos = ht->cells;
 	iter->end = ht->cells + ht->size;
 }
@@ -493,142 +702,6 @@ int hash_table_count (const struct hash_table *ht)
 	return ht->count;
 }
 
-/* Functions from this point onward are meant for convenience and
-   don't strictly belong to this file.  However, this is as good a
-   place for them as any.  */
-
-/* Guidelines for creating custom hash and test functions:
-
-   - The test function returns non-zero for keys that are considered
-     "equal", zero otherwise.
-
-   - The hash function returns a number that represents the
-     "distinctness" of the object.  In more precise terms, it means
-     that for any two objects that test "equal" under the test
-     function, the hash function MUST produce the same result.
-
-     This does not mean that all different objects must produce
-     different values (that would be "perfect" hashing), only that
-     non-distinct objects must produce the same values!  For instance,
-     a hash function that returns 0 for any given object is a
-     perfectly valid (albeit extremely bad) hash function.  A hash
-     function that hashes a string by adding up all its characters is
-     another example of a valid (but still quite bad) hash function.
-
-     It is not hard to make hash and test functions agree about
-     equality.  For example, if the test function compares strings
-     case-insensitively, the hash function can lower-case the
-     characters when calculating the hash value.  That ensures that
-     two strings differing only in case will hash the same.
-
-   - To prevent performance degradation, choose a hash function with
-     as good "spreading" as possible.  A good hash function will use
-     all the bits of the input when calculating the hash, and will
-     react to even small changes in input with a completely different
-     output.  But don't make the hash function itself overly slow,
-     because you'll be incurring a non-negligible overhead to all hash
-     table operations.  */
-
-/*
- * Support for hash tables whose keys are strings.
- *
- */
-
-/* Base 31 hash function.  Taken from Gnome's glib, modified to use
-   standard C types.
-
-   We used to use the popular hash function from the Dragon Book, but
-   this one seems to perform much better, both by being faster and by
-   generating less collisions.  */
-static unsigned long hash_string (const void *key)
-{
-	const char *p = key;
-	unsigned int h = *p;
-
-	if (h)
-		for (p += 1; *p != '\0'; p++)
-			h = (h << 5) - h + *p;
-
-	return h;
-}
-
-/* Frontend for strcmp usable for hash tables. */
-static int cmp_string (const void *s1, const void *s2)
-{
-	return !strcmp ((const char *)s1, (const char *)s2);
-}
-
-/* Return a hash table of preallocated to store at least ITEMS items
-   suitable to use strings as keys.  */
-
-struct hash_table *make_string_hash_table (int items)
-{
-	return hash_table_new (items, hash_string, cmp_string);
-}
-
-/*
- * Support for hash tables whose keys are strings, but which are
- * compared case-insensitively.
- *
- */
-
-/* Like hash_string, but produce the same hash regardless of the case. */
-static unsigned long hash_string_nocase (const void *key)
-{
-	const char *p = key;
-	unsigned int h = tolower (*p);
-
-	if (h)
-		for (p += 1; *p != '\0'; p++)
-			h = (h << 5) - h + tolower (*p);
-
-	return h;
-}
-
-/* Like string_cmp, but doing case-insensitive compareison. */
-static int string_cmp_nocase (const void *s1, const void *s2)
-{
-	return !strcasecmp ((const char *)s1, (const char *)s2);
-}
-
-/* Like make_string_hash_table, but uses string_hash_nocase and
-   string_cmp_nocase.  */
-struct hash_table *make_nocase_string_hash_table (int items)
-{
- 	return hash_table_new (items, hash_string_nocase, string_cmp_nocase);
-}
-
-/* Hashing of numeric values, such as pointers and integers.
-
-   This implementation is the Robert Jenkins' 32 bit Mix Function,
-   with a simple adaptation for 64-bit values.  According to Jenkins
-   it should offer excellent spreading of values.  Unlike the popular
-   Knuth's multiplication hash, this function doesn't need to know the
-   hash table size to work.  */
-unsigned long hash_pointer(const void *ptr)
-{
-	uintptr_t key = (uintptr_t) ptr;
-	key += (key << 12);
-	key ^= (key >> 22);
-	key += (key << 4);
-	key ^= (key >> 9);
-	key += (key << 10);
-	key ^= (key >> 2);
-	key += (key << 7);
-	key ^= (key >> 12);
-#if SIZEOF_VOID_P > 4
-	key += (key << 44);
-	key ^= (key >> 54);
-	key += (key << 36);
-	key ^= (key >> 41);
-	key += (key << 42);
-	key ^= (key >> 34);
-	key += (key << 39);
-	key ^= (key >> 44);
-#endif
-	return (unsigned long) key;
-}
-
 static int cmp_pointer (const void *ptr1, const void *ptr2)
 {
 	return ptr1 == ptr2;
@@ -31,5 +31,26 @@ struct hash_table *make_nocase_string_hash_table(int);
 
 unsigned long hash_pointer(const void *);
 
+/* Thread-safe table split into independently locked shards, each one
+   an ordinary hash_table.  See hash_sharded.c.  */
+struct sharded_hash_table;
+
+struct sharded_hash_table *sharded_hash_table_new(int, int, unsigned long (*) (const void *),
+                                                   int (*) (const void *, const void *));
+void sharded_hash_table_destroy(struct sharded_hash_table *);
+
+void *sharded_hash_table_get(struct sharded_hash_table *, const void *);
+int sharded_hash_table_get_pair(struct sharded_hash_table *, const void *, void *, void *);
+int sharded_hash_table_contains(struct sharded_hash_table *, const void *);
+
+void sharded_hash_table_put(struct sharded_hash_table *, const void *, const void *);
+int sharded_hash_table_remove(struct sharded_hash_table *, const void *);
+void sharded_hash_table_clear(struct sharded_hash_table *);
+
+void sharded_hash_table_for_each(struct sharded_hash_table *, int (*) (void *, void *, void *), void *);
+int sharded_hash_table_count(struct sharded_hash_table *);
+
+struct sharded_hash_table *make_sharded_string_hash_table(int, int);
+
 #endif /* HASH_H */
 
@@ -0,0 +1,320 @@
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+
+#include "utils.h"
+#include "hash.h"
+
+/* INTERFACE:
+   This file is a drop-in replacement for hash.c: it implements the
+   very same hash_table_* entry points declared in hash.h, with the
+   same semantics, so a program switches engines simply by linking
+   hash_rh.o instead of hash.o.  See hash.c for the description of
+   each function; only the implementation differs.  */
+
+/* IMPLEMENTATION:
+   Like hash.c, the table is open-addressed with linear probing, but
+   it differs in three ways that matter for large tables:
+
+   1. The size is always a power of two, so the home position of a key
+      is found with a mask instead of a '%' (a division) per lookup.
+      To make up for the weaker spreading of the low bits of the
+      user-supplied hash functions, the hash is first scrambled with a
+      Fibonacci (golden ratio) multiplication.
+
+   2. Every cell stores the 32-bit scrambled hash of its key.  Probes
+      compare that fingerprint first and only call the (comparatively
+      expensive) test function when it matches.  It also means growing
+      the table never has to call the hash function again.  A stored
+      hash of 0 marks the cell as empty.
+
+   3. Insertion uses "Robin Hood" displacement: a key that is further
+      from its home position than the resident of a cell takes the cell
+      and the resident continues probing.  This keeps the variance of
+      probe lengths low, and a lookup can stop as soon as it meets a
+      resident closer to home than the key it is looking for, so
+      misses are about as cheap as hits even at 87.5% fullness.
+
+   Deletion shifts the following cells of the cluster back by one
+   until it meets an empty cell or a cell already at its home
+   position, so no tombstones are ever needed.  */
+
+/* Maximum allowed fullness, expressed as SIZE - SIZE / HASH_FULLNESS_DIV
+   (87.5%).  Robin Hood probing copes with far higher fullness than
+   plain linear probing.  */
+#define HASH_FULLNESS_DIV 8
+
+/* The smallest table ever allocated. */
+#define HASH_MIN_SIZE 16
+
+struct cell {
+	unsigned int hash;            /* scrambled hash, 0 if empty. */
+	void *key;
+	void *value;
+};
+
+typedef unsigned long (*hashfun_t) (const void *);
+typedef int (*testfun_t) (const void *, const void *);
+
+struct hash_table {
+	hashfun_t hash_function;
+	testfun_t test_function;
+
+	struct cell *cells;           /* contiguous array of cells. */
+	int size;                     /* size of the array, a power of 2. */
+	unsigned int mask;            /* size - 1 */
+
+	int count;                    /* number of occupied entries. */
+	int resize_threshold;         /* after size exceeds this number of
+	                               entries, resize the table.  */
+};
+
+/* Whether the cell C is occupied (non-empty). */
+#define CELL_OCCUPIED(c) ((c)->hash != 0)
+
+/* Clear the cell C, i.e. mark it as empty (unoccupied). */
+#define CLEAR_CELL(c) ((c)->hash = 0)
+
+/* How far the cell at POS is from the home position of HASH. */
+#define PROBE_DISTANCE(hash, pos, mask) (((pos) - (hash)) & (mask))
+
+/* Scramble the user hash of KEY into a non-zero 32-bit fingerprint
+   whose low bits give the home position.  */
+static inline unsigned int cell_hash (const struct hash_table *ht, const void *key)
+{
+	uint64_t h = (uint64_t) ht->hash_function (key) * 0x9E3779B97F4A7C15ULL;
+	unsigned int fp = (unsigned int) (h >> 32);
+	return fp ? fp : 1;
+}
+
+static int cmp_pointer (const void *ptr1, const void *ptr2)
+{
+	return ptr1 == ptr2;
+}
+
+static void set_size (struct hash_table *ht, int size)
+{
+	ht->size = size;
+	ht->mask = size - 1;
+	ht->resize_threshold = size - size / HASH_FULLNESS_DIV;
+	ht->cells = xnew0_array (struct cell, size);
+}
+
+struct hash_table *hash_table_new (int items,
+                unsigned long (*hash_function) (const void *),
+                int (*test_function) (const void *, const void *))
+{
+	int size = HASH_MIN_SIZE;
+	struct hash_table *ht = xnew(struct hash_table);
+
+	ht->hash_function = hash_function ? hash_function : hash_pointer;
+	ht->test_function = test_function ? test_function : cmp_pointer;
+
+	while (size - size / HASH_FULLNESS_DIV < items)
+		size <<= 1;
+	set_size (ht, size);
+
+	ht->count = 0;
+	return ht;
+}
+
+void hash_table_destroy (struct hash_table *ht)
+{
+	xfree(ht->cells);
+	xfree(ht);
+}
+
+/* Find the cell holding KEY whose scrambled hash is HASH, or NULL.  */
+static inline struct cell *find_cell (const struct hash_table *ht,
+				      const void *key, unsigned int hash)
+{
+	struct cell *cells = ht->cells;
+	unsigned int mask = ht->mask;
+	unsigned int pos = hash & mask;
+	unsigned int dist = 0;
+	testfun_t equals = ht->test_function;
+
+	for (;; pos = (pos + 1) & mask, dist++) {
+		struct cell *c = cells + pos;
+		/* An empty cell, or a resident closer to its home than we are
+		   to ours, means KEY would have been placed before here.  */
+		if (!CELL_OCCUPIED (c) || PROBE_DISTANCE (c->hash, pos, mask) < dist)
+			return NULL;
+		if (c->hash == hash && equals (key, c->key))
+			return c;
+	}
+}
+
+void *hash_table_get (const struct hash_table *ht, const void *key)
+{
+	struct cell *c = find_cell (ht, key, cell_hash (ht, key));
+	return c ? c->value : NULL;
+}
+
+int hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
+                     void *orig_key, void *value)
+{
+	struct cell *c = find_cell (ht, lookup_key, cell_hash (ht, lookup_key));
+	if (c) {
+		if (orig_key)
+			*(void **)orig_key = c->key;
+		if (value)
+			*(void **)value = c->value;
+		return 1;
+	}
+	else
+	return 0;
+}
+
+int hash_table_contains (const struct hash_table *ht, const void *key)
+{
+	return find_cell (ht, key, cell_hash (ht, key)) != NULL;
+}
+
+/* Place an entry known not to be in the table, displacing residents
+   which are closer to their home than the entry is to its own.  */
+static void insert_cell (struct hash_table *ht, struct cell entry)
+{
+	struct cell *cells = ht->cells;
+	unsigned int mask = ht->mask;
+	unsigned int pos = entry.hash & mask;
+	unsigned int dist = 0;
+
+	for (;; pos = (pos + 1) & mask, dist++) {
+		struct cell *c = cells + pos;
+		unsigned int c_dist;
+
+		if (!CELL_OCCUPIED (c)) {
+			*c = entry;
+			return;
+		}
+		c_dist = PROBE_DISTANCE (c->hash, pos, mask);
+		if (c_dist < dist) {
+			struct cell tmp = *c;
+			*c = entry;
+			entry = tmp;
+			dist = c_dist;
+		}
+	}
+}
+
+/* Double the size of HT.  The stored hashes make this a pure memory
+   operation, the hash function is not called.  */
+static void grow_hash_table (struct hash_table *ht)
+{
+	struct cell *old_cells = ht->cells;
+	struct cell *old_end   = ht->cells + ht->size;
+	struct cell *c;
+
+	set_size (ht, ht->size * 2);
+
+	for (c = old_cells; c < old_end; c++)
+		if (CELL_OCCUPIED (c))
+			insert_cell (ht, *c);
+
+	xfree (old_cells);
+}
+
+void hash_table_put (struct hash_table *ht, const void *key, const void *value)
+{
+	unsigned int hash = cell_hash (ht, key);
+	struct cell *c = find_cell (ht, key, hash);
+	struct cell entry;
+
+	if (c) {
+		/* update existing item */
+		c->key   = (void *)key; /* const? */
+		c->value = (void *)value;
+		return;
+	}
+
+	if (ht->count >= ht->resize_threshold)
+		grow_hash_table (ht);
+
+	/* add new item */
+	++ht->count;
+	entry.hash  = hash;
+	entry.key   = (void *)key;
+	entry.value = (void *)value;
+	insert_cell (ht, entry);
+}
+
+int hash_table_remove (struct hash_table *ht, const void *key)
+{
+	struct cell *c = find_cell (ht, key, cell_hash (ht, key));
+	struct cell *cells = ht->cells;
+	unsigned int mask = ht->mask;
+	unsigned int pos;
+
+	if (!c)
+		return 0;
+
+	/* Backward-shift the rest of the cluster over the hole.  */
+	pos = c - cells;
+	for (;;) {
+		unsigned int next = (pos + 1) & mask;
+		struct cell *n = cells + next;
+
+		if (!CELL_OCCUPIED (n) || PROBE_DISTANCE (n->hash, next, mask) == 0)
+			break;
+		cells[pos] = *n;
+		pos = next;
+	}
+	CLEAR_CELL (cells + pos);
+	--ht->count;
+	return 1;
+}
+
+void hash_table_clear (struct hash_table *ht)
+{
+	memset (ht->cells, 0, ht->size * sizeof (struct cell));
+	ht->count = 0;
+}
+
+void hash_table_for_each (struct hash_table *ht, int (*fn) (void *, void *, void *), void *arg)
+{
+	struct cell *c = ht->cells;
+	struct cell *end = ht->cells + ht->size;
+
+	for (; c < end; c++) {
+		if (CELL_OCCUPIED (c)) {
+			void *key;
+	repeat:
+			key = c->key;
+			if (fn (key, c->value, arg))
+				return;
+			/* hash_table_remove might have shifted the next cell here. */
+			if (c->key != key && CELL_OCCUPIED (c))
+			goto repeat;
+		}
+	}
+}
+
+void hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
+{
+	iter->pos = ht->cells;
+	iter->end = ht->cells + ht->size;
+}
+
+int hash_table_iter_next (hash_table_iterator *iter)
+{
+	struct cell *c = iter->pos;
+	struct cell *end = iter->end;
+	for (; c < end; c++)
+	if (CELL_OCCUPIED (c)) {
+		iter->key = c->key;
+		iter->value = c->value;
+		iter->pos = c + 1;
+		return 1;
+	}
+	return 0;
+}
+
+int hash_table_count (const struct hash_table *ht)
+{
+	return ht->count;
+}
@@ -0,0 +1,222 @@
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "hash.h"
+
+/* INTERFACE:
+   A sharded hash table can be shared by any number of threads.  Its
+   entry points mirror the hash_table_* ones:
+
+     sharded_hash_table_new       -- creates the table.
+     sharded_hash_table_destroy   -- destroys the table.
+     sharded_hash_table_put       -- establishes or updates key->value mapping.
+     sharded_hash_table_get       -- retrieves value of key.
+     sharded_hash_table_get_pair  -- get key/value pair for key.
+     sharded_hash_table_contains  -- test whether the table contains key.
+     sharded_hash_table_remove    -- remove key->value mapping for given key.
+     sharded_hash_table_for_each  -- call function for each table entry.
+     sharded_hash_table_clear     -- clear hash table contents.
+     sharded_hash_table_count     -- return the number of entries.
+
+   As with hash_table, neither keys nor values are copied, and a value
+   returned by sharded_hash_table_get is only as safe to use as the
+   caller's own rules for when values may be freed.  There is no
+   iterator: an iteration could not hold every shard's lock at once
+   without stalling the whole table, use sharded_hash_table_for_each.  */
+
+/* IMPLEMENTATION:
+   The key space is split into a power-of-two number of shards by the
+   top bits of the scrambled key hash.  Each shard is a plain
+   hash_table (whichever engine the program links) guarded by its own
+   read-write lock, so lookups on one shard never wait for writers on
+   another, and lookups on the same shard run in parallel.
+
+   Because every shard grows on its own, a resize only holds the write
+   lock of the one shard being grown, and costs 1/SHARDS of a resize of
+   the whole table.  Shards are padded to a cache line so the lock
+   words of neighbouring shards do not bounce between CPUs.  */
+
+#define SHARD_ALIGN 64
+
+/* Used when the caller passes 0 shards. */
+#define DEFAULT_SHARDS 16
+
+struct shard {
+	pthread_rwlock_t lock;
+	struct hash_table *table;
+} __attribute__((aligned(SHARD_ALIGN)));
+
+struct sharded_hash_table {
+	unsigned long (*hash_function) (const void *);
+	struct shard *shards;
+	int shard_count;              /* a power of 2. */
+	int shard_shift;              /* 64 - log2(shard_count) */
+};
+
+struct sharded_hash_table *sharded_hash_table_new (int items, int shards,
+                unsigned long (*hash_function) (const void *),
+                int (*test_function) (const void *, const void *))
+{
+	struct sharded_hash_table *sht = xnew0(struct sharded_hash_table);
+	int count = 1, bits = 0, i;
+
+	if (shards <= 0)
+		shards = DEFAULT_SHARDS;
+	while (count < shards) {
+		count <<= 1;
+		bits++;
+	}
+
+	sht->hash_function = hash_function ? hash_function : hash_pointer;
+	sht->shard_count = count;
+	sht->shard_shift = 64 - bits;
+	if (posix_memalign ((void **) &sht->shards, SHARD_ALIGN, count * sizeof (struct shard)))
+		abort ();
+
+	for (i = 0; i < count; i++) {
+		pthread_rwlock_init (&sht->shards[i].lock, NULL);
+		sht->shards[i].table = hash_table_new (items / count, sht->hash_function,
+		                                       test_function);
+	}
+	return sht;
+}
+
+void sharded_hash_table_destroy (struct sharded_hash_table *sht)
+{
+	int i;
+
+	for (i = 0; i < sht->shard_count; i++) {
+		hash_table_destroy (sht->shards[i].table);
+		pthread_rwlock_destroy (&sht->shards[i].lock);
+	}
+	xfree (sht->shards);
+	xfree (sht);
+}
+
+/* The shard responsible for KEY.  The high bits of the scrambled hash
+   are used so the choice is independent of the low bits which each
+   shard's own table uses for its cell position.  */
+static inline struct shard *get_shard (const struct sharded_hash_table *sht, const void *key)
+{
+	uint64_t h;
+
+	if (sht->shard_count == 1)
+		return sht->shards;
+	h = (uint64_t) sht->hash_function (key) * 0x9E3779B97F4A7C15ULL;
+	return sht->shards + (h >> sht->shard_shift);
+}
+
+void *sharded_hash_table_get (struct sharded_hash_table *sht, const void *key)
+{
+	struct shard *s = get_shard (sht, key);
+	void *value;
+
+	pthread_rwlock_rdlock (&s->lock);
+	value = hash_table_get (s->table, key);
+	pthread_rwlock_unlock (&s->lock);
+	return value;
+}
+
+int sharded_hash_table_get_pair (struct sharded_hash_table *sht, const void *lookup_key,
+                     void *orig_key, void *value)
+{
+	struct shard *s = get_shard (sht, lookup_key);
+	int ret;
+
+	pthread_rwlock_rdlock (&s->lock);
+	ret = hash_table_get_pair (s->table, lookup_key, orig_key, value);
+	pthread_rwlock_unlock (&s->lock);
+	return ret;
+}
+
+int sharded_hash_table_contains (struct sharded_hash_table *sht, const void *key)
+{
+	struct shard *s = get_shard (sht, key);
+	int ret;
+
+	pthread_rwlock_rdlock (&s->lock);
+	ret = hash_table_contains (s->table, key);
+	pthread_rwlock_unlock (&s->lock);
+	return ret;
+}
+
+void sharded_hash_table_put (struct sharded_hash_table *sht, const void *key, const void *value)
+{
+	struct shard *s = get_shard (sht, key);
+
+	pthread_rwlock_wrlock (&s->lock);
+	hash_table_put (s->table, key, value);
+	pthread_rwlock_unlock (&s->lock);
+}
+
+int sharded_hash_table_remove (struct sharded_hash_table *sht, const void *key)
+{
+	struct shard *s = get_shard (sht, key);
+	int ret;
+
+	pthread_rwlock_wrlock (&s->lock);
+	ret = hash_table_remove (s->table, key);
+	pthread_rwlock_unlock (&s->lock);
+	return ret;
+}
+
+/* Clear the shards one at a time; entries added concurrently to an
+   already cleared shard survive.  */
+void sharded_hash_table_clear (struct sharded_hash_table *sht)
+{
+	int i;
+
+	for (i = 0; i < sht->shard_count; i++) {
+		pthread_rwlock_wrlock (&sht->shards[i].lock);
+		hash_table_clear (sht->shards[i].table);
+		pthread_rwlock_unlock (&sht->shards[i].lock);
+	}
+}
+
+struct for_each_ctx {
+	int (*fn) (void *, void *, void *);
+	void *arg;
+	int stop;
+};
+
+/* Remember whether FN asked to stop, so the next shard isn't visited. */
+static int for_each_shard_fn (void *key, void *value, void *arg)
+{
+	struct for_each_ctx *ctx = arg;
+	return ctx->stop = ctx->fn (key, value, ctx->arg);
+}
+
+/* Call FN for each entry, one shard at a time under that shard's write
+   lock, so FN may remove the entry it is called for (as with
+   hash_table_for_each) but must not touch other keys of the table.  */
+void sharded_hash_table_for_each (struct sharded_hash_table *sht,
+                                  int (*fn) (void *, void *, void *), void *arg)
+{
+	struct for_each_ctx ctx = { fn, arg, 0 };
+	int i;
+
+	for (i = 0; i < sht->shard_count && !ctx.stop; i++) {
+		pthread_rwlock_wrlock (&sht->shards[i].lock);
+		hash_table_for_each (sht->shards[i].table, for_each_shard_fn, &ctx);
+		pthread_rwlock_unlock (&sht->shards[i].lock);
+	}
+}
+
+/* The sum of the shard counts.  With concurrent writers this is only a
+   snapshot, as the shards are not counted at the same instant.  */
+int sharded_hash_table_count (struct sharded_hash_table *sht)
+{
+	int i, count = 0;
+
+	for (i = 0; i < sht->shard_count; i++) {
+		pthread_rwlock_rdlock (&sht->shards[i].lock);
+		count += hash_table_count (sht->shards[i].table);
+		pthread_rwlock_unlock (&sht->shards[i].lock);
+	}
+	return count;
+}
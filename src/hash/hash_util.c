@@ -0,0 +1,152 @@
+/* Hash and test functions for use with hash tables.  They are kept
+   apart from the table itself so that every hash table engine
+   (hash.c, hash_rh.c) shares the same set.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hash.h"
+
+/* Guidelines for creating custom hash and test functions:
+
+   - The test function returns non-zero for keys that are considered
+     "equal", zero otherwise.
+
+   - The hash function returns a number that represents the
+     "distinctness" of the object.  In more precise terms, it means
+     that for any two objects that test "equal" under the test
+     function, the hash function MUST produce the same result.
+
+     This does not mean that all different objects must produce
+     different values (that would be "perfect" hashing), only that
+     non-distinct objects must produce the same values!  For instance,
+     a hash function that returns 0 for any given object is a
+     perfectly valid (albeit extremely bad) hash function.  A hash
+     function that hashes a string by adding up all its characters is
+     another example of a valid (but still quite bad) hash function.
+
+     It is not hard to make hash and test functions agree about
+     equality.  For example, if the test function compares strings
+     case-insensitively, the hash function can lower-case the
+     characters when calculating the hash value.  That ensures that
+     two strings differing only in case will hash the same.
+
+   - To prevent performance degradation, choose a hash function with
+     as good "spreading" as possible.  A good hash function will use
+     all the bits of the input when calculating the hash, and will
+     react to even small changes in input with a completely different
+     output.  But don't make the hash function itself overly slow,
+     because you'll be incurring a non-negligible overhead to all hash
+     table operations.  */
+
+/*
+ * Support for hash tables whose keys are strings.
+ *
+ */
+
+/* Base 31 hash function.  Taken from Gnome's glib, modified to use
+   standard C types.
+
+   We used to use the popular hash function from the Dragon Book, but
+   this one seems to perform much better, both by being faster and by
+   generating less collisions.  */
+static unsigned long hash_string (const void *key)
+{
+	const char *p = key;
+	unsigned int h = *p;
+
+	if (h)
+		for (p += 1; *p != '\0'; p++)
+			h = (h << 5) - h + *p;
+
+	return h;
+}
+
+/* Frontend for strcmp usable for hash tables. */
+static int cmp_string (const void *s1, const void *s2)
+{
+	return !strcmp ((const char *)s1, (const char *)s2);
+}
+
+/* Return a hash table of preallocated to store at least ITEMS items
+   suitable to use strings as keys.  */
+
+struct hash_table *make_string_hash_table (int items)
+{
+	return hash_table_new (items, hash_string, cmp_string);
+}
+
+/* Like make_string_hash_table, but the table is split into SHARDS
+   independently locked shards and may be shared between threads.  */
+
+struct sharded_hash_table *make_sharded_string_hash_table (int items, int shards)
+{
+	return sharded_hash_table_new (items, shards, hash_string, cmp_string);
+}
+
+/*
+ * Support for hash tables whose keys are strings, but which are
+ * compared case-insensitively.
+ *
+ */
+
+/* Like hash_string, but produce the same hash regardless of the case. */
+static unsigned long hash_string_nocase (const void *key)
+{
+	const char *p = key;
+	unsigned int h = tolower (*p);
+
+	if (h)
+		for (p += 1; *p != '\0'; p++)
+			h = (h << 5) - h + tolower (*p);
+
+	return h;
+}
+
+/* Like string_cmp, but doing case-insensitive compareison. */
+static int string_cmp_nocase (const void *s1, const void *s2)
+{
+	return !strcasecmp ((const char *)s1, (const char *)s2);
+}
+
+/* Like make_string_hash_table, but uses string_hash_nocase and
+   string_cmp_nocase.  */
+struct hash_table *make_nocase_string_hash_table (int items)
+{
+ 	return hash_table_new (items, hash_string_nocase, string_cmp_nocase);
+}
+
+/* Hashing of numeric values, such as pointers and integers.
+
+   This implementation is the Robert Jenkins' 32 bit Mix Function,
+   with a simple adaptation for 64-bit values.  According to Jenkins
+   it should offer excellent spreading of values.  Unlike the popular
+   Knuth's multiplication hash, this function doesn't need to know the
+   hash table size to work.  */
+unsigned long hash_pointer(const void *ptr)
+{
+	uintptr_t key = (uintptr_t) ptr;
+	key += (key << 12);
+	key ^= (key >> 22);
+	key += (key << 4);
+	key ^= (key >> 9);
+	key += (key << 10);
+	key ^= (key >> 2);
+	key += (key << 7);
+	key ^= (key >> 12);
+#if SIZEOF_VOID_P > 4
+	key += (key << 44);
+	key ^= (key >> 54);
+	key += (key << 36);
+	key ^= (key >> 41);
+	key += (key << 42);
+	key ^= (key >> 34);
+	key += (key << 39);
+	key ^= (key >> 44);
+#endif
+	return (unsigned long) key;
+}
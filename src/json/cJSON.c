@@ -33,6 +33,16 @@ THE SOFTWARE.
 #include <limits.h>
 #include <ctype.h>
 
+/* vector scanning of the input, CJSON_NO_SIMD leaves it to plain C */
+#if !defined(CJSON_NO_SIMD) && defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define CJSON_SIMD_AVX2
+#define CJSON_SIMD_SSE2
+#elif !defined(CJSON_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define CJSON_SIMD_SSE2
+#endif
+
 #ifdef ENABLE_LOCALES
 #include <locale.h>
 #endif
@@ -178,17 +188,142 @@ void cJSON_Delete(cJSON *item)
 		if (!(item->type & cJSON_IsReference) && (item->child != NULL)) {
 			cJSON_Delete(item->child);
 		}
-		if (!(item->type & cJSON_IsReference) && (item->valuestring != NULL)) {
+		if (!(item->type & (cJSON_IsReference | cJSON_InArena | cJSON_InSitu)) && (item->valuestring != NULL)) {
 			global_hooks.deallocate(item->valuestring);
 		}
 		if (!(item->type & cJSON_StringIsConst) && (item->string != NULL)) {
 			global_hooks.deallocate(item->string);
 		}
-		global_hooks.deallocate(item);
+		if (item->index != NULL) {
+			global_hooks.deallocate(item->index);
+		}
+		if (!(item->type & cJSON_InArena)) {
+			global_hooks.deallocate(item);
+		}
 		item = next;
 	}
 }
 
+/* Arena: bump allocation from a chain of blocks, all released at once. */
+#define ARENA_ALIGN 8
+#define ARENA_MIN_GROW 4096
+#define arena_round(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct arena_block {
+	struct arena_block *next;
+	unsigned char *start;
+	size_t size;
+	size_t used;
+} arena_block;
+
+struct cJSON_Arena {
+	arena_block *current; /* the block allocating now */
+	arena_block first; /* the memory the arena was created in */
+	cJSON_bool owned; /* the first block came from the hooks */
+	internal_hooks hooks;
+};
+
+cJSON_Arena *cJSON_CreateArena(void *buffer, size_t size)
+{
+	cJSON_Arena *arena = NULL;
+	size_t header = arena_round(sizeof(cJSON_Arena));
+	cJSON_bool owned = false;
+
+	if (buffer == NULL) {
+		if (size < header + ARENA_MIN_GROW)
+			size = header + ARENA_MIN_GROW;
+		buffer = global_hooks.allocate(size);
+		if (buffer == NULL)
+			return NULL;
+		owned = true;
+	} else {
+		/* the arena lives at the start of the caller's buffer */
+		size_t skew = (size_t)buffer & (ARENA_ALIGN - 1);
+		if (skew != 0) {
+			skew = ARENA_ALIGN - skew;
+			if (size < skew)
+				return NULL;
+			buffer = (unsigned char*)buffer + skew;
+			size -= skew;
+		}
+		if (size < header)
+			return NULL;
+	}
+
+	arena = (cJSON_Arena*)buffer;
+	arena->first.next = NULL;
+	arena->first.start = (unsigned char*)buffer + header;
+	arena->first.size = size - header;
+	arena->first.used = 0;
+	arena->current = &arena->first;
+	arena->owned = owned;
+	arena->hooks = global_hooks;
+
+	return arena;
+}
+
+/* Keeps the blocks grown so far, a steady load stops allocating */
+void cJSON_ResetArena(cJSON_Arena *arena)
+{
+	if (arena == NULL)
+		return;
+
+	arena->first.used = 0;
+	arena->current = &arena->first;
+}
+
+void cJSON_DeleteArena(cJSON_Arena *arena)
+{
+	arena_block *block = NULL;
+	arena_block *next = NULL;
+
+	if (arena == NULL)
+		return;
+
+	for (block = arena->first.next; block != NULL; block = next) {
+		next = block->next;
+		arena->hooks.deallocate(block);
+	}
+	if (arena->owned)
+		arena->hooks.deallocate(arena);
+}
+
+static void *arena_allocate(cJSON_Arena * const arena, size_t size)
+{
+	arena_block *block = arena->current;
+	void *memory = NULL;
+
+	size = arena_round(size);
+	while ((block->size - block->used) < size) {
+		if (block->next == NULL) {
+			/* double up, keeping the blocks few */
+			size_t grow = block->size * 2;
+			arena_block *next = NULL;
+
+			if (grow < size)
+				grow = size;
+			if (grow < ARENA_MIN_GROW)
+				grow = ARENA_MIN_GROW;
+			next = (arena_block*)arena->hooks.allocate(arena_round(sizeof(arena_block)) + grow);
+			if (next == NULL)
+				return NULL;
+			next->next = NULL;
+			next->start = (unsigned char*)next + arena_round(sizeof(arena_block));
+			next->size = grow;
+			block->next = next;
+		}
+		/* blocks after the current one are left from before a reset */
+		block = block->next;
+		block->used = 0;
+	}
+
+	arena->current = block;
+	memory = block->start + block->used;
+	block->used += size;
+
+	return memory;
+}
+
 /* get the decimal point character of the current locale */
 static unsigned char get_decimal_point(void)
 {
@@ -206,6 +341,8 @@ typedef struct {
 	size_t offset;
 	size_t depth; /* How deeply nested (in arrays/objects) is the input at the current offset. */
 	internal_hooks hooks;
+	cJSON_Arena *arena; /* nodes and strings come from here instead of the hooks if set */
+	cJSON_bool in_situ; /* content is writable, strings are decoded where they are */
 } parse_buffer;
 
 /* check if the given size is left to read in a given parse buffer (starting with 1) */
@@ -216,19 +353,254 @@ typedef struct {
 /* get a pointer to the buffer at the position */
 #define buffer_at_offset(buffer) ((buffer)->content + (buffer)->offset)
 
+static void *parse_allocate(parse_buffer * const buffer, size_t size)
+{
+	if (buffer->arena != NULL)
+		return arena_allocate(buffer->arena, size);
+
+	return buffer->hooks.allocate(size);
+}
+
+static cJSON *parse_new_item(parse_buffer * const buffer)
+{
+	cJSON *node = NULL;
+
+	if (buffer->arena == NULL)
+		return cJSON_New_Item(&buffer->hooks);
+
+	node = (cJSON*)arena_allocate(buffer->arena, sizeof(cJSON));
+	if (node) {
+		memset(node, '\0', sizeof(cJSON));
+	}
+
+	return node;
+}
+
+/* Frees what a failed parse built, unless the arena has it */
+static void parse_delete(parse_buffer * const buffer, cJSON *item)
+{
+	if (buffer->arena == NULL)
+		cJSON_Delete(item);
+}
+
+/* Flags what a parsed item does not own: its memory if in the arena, its strings if in situ */
+static void parse_mark(parse_buffer * const buffer, cJSON * const item, cJSON_bool named)
+{
+	int flags = 0;
+
+	if (buffer->arena != NULL)
+		flags |= cJSON_InArena;
+	if (buffer->in_situ)
+		flags |= cJSON_InSitu;
+	/* every path renaming an item leaves const names alone */
+	if (named && flags)
+		flags |= cJSON_StringIsConst;
+
+	item->type |= flags;
+}
+
+/* Length of the whitespace (anything up to ' ') starting at input, at most up to end */
+static size_t whitespace_run(const unsigned char * const input, const unsigned char * const end)
+{
+	const unsigned char *p = input;
+
+#ifdef CJSON_SIMD_AVX2
+	{
+		const __m256i space = _mm256_set1_epi8(' ');
+		while ((end - p) >= 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)p);
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, space), space));
+			if (mask != 0xFFFFFFFFU) {
+				return (size_t)(p - input) + (size_t)__builtin_ctz(~mask);
+			}
+			p += 32;
+		}
+	}
+#endif
+#ifdef CJSON_SIMD_SSE2
+	{
+		const __m128i space = _mm_set1_epi8(' ');
+		while ((end - p) >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space));
+			if (mask != 0xFFFFU) {
+				return (size_t)(p - input) + (size_t)__builtin_ctz(~mask);
+			}
+			p += 16;
+		}
+	}
+#endif
+	while ((p < end) && (*p <= 32)) {
+		p++;
+	}
+
+	return (size_t)(p - input);
+}
+
+/* First '\"' or '\\' from input on, end if there is none */
+static const unsigned char *find_quote_or_backslash(const unsigned char *p, const unsigned char * const end)
+{
+#ifdef CJSON_SIMD_AVX2
+	{
+		const __m256i quote = _mm256_set1_epi8('\"');
+		const __m256i backslash = _mm256_set1_epi8('\\');
+		while ((end - p) >= 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)p);
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+			if (mask != 0) {
+				return p + __builtin_ctz(mask);
+			}
+			p += 32;
+		}
+	}
+#endif
+#ifdef CJSON_SIMD_SSE2
+	{
+		const __m128i quote = _mm_set1_epi8('\"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		while ((end - p) >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+			if (mask != 0) {
+				return p + __builtin_ctz(mask);
+			}
+			p += 16;
+		}
+	}
+#else
+	{
+		/* eight bytes at a time: a byte equal to c turns zero in word ^ c */
+		const unsigned long long ones = 0x0101010101010101ULL;
+		const unsigned long long highs = 0x8080808080808080ULL;
+		while ((end - p) >= 8) {
+			unsigned long long word;
+			unsigned long long q;
+			unsigned long long b;
+			memcpy(&word, p, sizeof(word));
+			q = word ^ (ones * '\"');
+			b = word ^ (ones * '\\');
+			if ((((q - ones) & ~q) | ((b - ones) & ~b)) & highs) {
+				break; /* somewhere in these eight */
+			}
+			p += 8;
+		}
+	}
+#endif
+	while ((p < end) && (*p != '\"') && (*p != '\\')) {
+		p++;
+	}
+
+	return p;
+}
+
+/* Where one rounding of an exact double gives the correctly rounded result */
+#if defined(FLT_EVAL_METHOD) && ((FLT_EVAL_METHOD == 0) || (FLT_EVAL_METHOD == 1))
+#define CJSON_EXACT_POWERS 22
+#else
+#define CJSON_EXACT_POWERS 0 /* excess precision (x87) would round twice */
+#endif
+
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* The common numbers without strtod: up to 19 digits whose significand and
+ * power of ten are exact doubles, so one multiplication or division rounds
+ * like strtod does. Returns the length parsed, 0 leaves the number to strtod. */
+static size_t parse_number_fast(const unsigned char * const input, const unsigned char * const end, double * const number)
+{
+	const unsigned char *p = input;
+	unsigned long long significand = 0;
+	int digits = 0;
+	int exponent = 0;
+	int exponent_value = 0;
+	cJSON_bool negative = false;
+	cJSON_bool exponent_negative = false;
+	double value = 0;
+
+#define is_digit(c) (((c) >= '0') && ((c) <= '9'))
+	if ((p < end) && (*p == '-')) {
+		negative = true;
+		p++;
+	}
+	if ((p >= end) || !is_digit(*p)) {
+		return 0;
+	}
+	for (; (p < end) && is_digit(*p); p++, digits++) {
+		significand = significand * 10 + (unsigned long long)(*p - '0');
+	}
+	if ((p < end) && (*p == '.')) {
+		p++;
+		if ((p >= end) || !is_digit(*p)) {
+			return 0;
+		}
+		for (; (p < end) && is_digit(*p); p++, digits++, exponent--) {
+			significand = significand * 10 + (unsigned long long)(*p - '0');
+		}
+	}
+	if (digits > 19) {
+		return 0; /* the significand wrapped */
+	}
+	if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+		p++;
+		if ((p < end) && ((*p == '+') || (*p == '-'))) {
+			exponent_negative = (*p == '-');
+			p++;
+		}
+		if ((p >= end) || !is_digit(*p)) {
+			return 0;
+		}
+		for (; (p < end) && is_digit(*p); p++) {
+			if (exponent_value > 10000) {
+				return 0;
+			}
+			exponent_value = exponent_value * 10 + (*p - '0');
+		}
+		exponent += exponent_negative ? -exponent_value : exponent_value;
+	}
+	/* whatever strtod would make of more number characters, it decides */
+	if ((p < end) && (is_digit(*p) || (*p == '.') || (*p == 'e') || (*p == 'E') || (*p == '+') || (*p == '-'))) {
+		return 0;
+	}
+#undef is_digit
+
+	if ((significand > (1ULL << 53)) || (exponent < -CJSON_EXACT_POWERS) || (exponent > CJSON_EXACT_POWERS)) {
+		return 0;
+	}
+
+	value = (double)significand;
+	if (exponent < 0) {
+		value /= exact_powers_of_ten[-exponent];
+	} else if (exponent > 0) {
+		value *= exact_powers_of_ten[exponent];
+	}
+	*number = negative ? -value : value;
+
+	return (size_t)(p - input);
+}
+
 /* Parse the input text to generate a number, and populate the result into item. */
 static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
 {
 	double number = 0;
 	unsigned char *after_end = NULL;
 	unsigned char number_c_string[64];
-	unsigned char decimal_point = get_decimal_point();
+	unsigned char decimal_point = 0;
 	size_t i = 0;
 
 	if ((input_buffer == NULL) || (input_buffer->content == NULL)) {
 		return false;
 	}
 
+	i = parse_number_fast(buffer_at_offset(input_buffer), input_buffer->content + input_buffer->length, &number);
+	if (i > 0) {
+		input_buffer->offset += i;
+		goto done;
+	}
+
+	decimal_point = get_decimal_point();
+
 	/* copy the number into a temporary buffer and replace '.' with the decimal point
 	* of the current locale (for strtod)
 	* This also takes care of '\0' not necessarily being available for marking the end of the input */
@@ -266,7 +638,9 @@ loop_end:
 	if (number_c_string == after_end) {
 		return false; /* parse_error */
 	}
+	input_buffer->offset += (size_t)(after_end - number_c_string);
 
+done:
 	item->valuedouble = number;
 
 	/* use saturation in case of overflow */
@@ -280,7 +654,6 @@ loop_end:
 
 	item->type = cJSON_Number;
 
-	input_buffer->offset += (size_t)(after_end - number_c_string);
 	return true;
 }
 
@@ -583,27 +956,45 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
 		/* calculate approximate size of the output (overestimate) */
 		size_t allocation_length = 0;
 		size_t skipped_bytes = 0;
-		while (((size_t)(input_end - input_buffer->content) < input_buffer->length) && (*input_end != '\"')) {
-			/* is escape sequence */
-			if (input_end[0] == '\\') {
-				if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length) {
-					/* prevent buffer overflow when last input character is a backslash */
-					goto fail;
-				}
-				skipped_bytes++;
-				input_end++;
+		const unsigned char *content_end = input_buffer->content + input_buffer->length;
+		for (;;) {
+			input_end = find_quote_or_backslash(input_end, content_end);
+			if (input_end >= content_end) {
+				goto fail; /* string ended unexpectedly */
 			}
-			input_end++;
-		}
-		if (((size_t)(input_end - input_buffer->content) >= input_buffer->length) || (*input_end != '\"')) {
-			goto fail; /* string ended unexpectedly */
+			if (*input_end == '\"') {
+				break;
+			}
+			/* escape sequence, the escaped character can't end the string */
+			if ((input_end + 1) >= content_end) {
+				/* prevent buffer overflow when last input character is a backslash */
+				goto fail;
+			}
+			skipped_bytes++;
+			input_end += 2;
 		}
 
-		/* This is at most how much we need for the output */
-		allocation_length = (size_t)(input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
-		output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
-		if (output == NULL) {
-			goto fail; /* allocation failure */
+		if (input_buffer->in_situ) {
+			/* decoding only ever shrinks the string, it fits where it is, the quote makes room for the '\0' */
+			output = (unsigned char*)input_pointer;
+			if (skipped_bytes == 0) {
+				output_pointer = output + (input_end - input_pointer);
+				input_pointer = input_end;
+				goto done;
+			}
+		} else {
+			/* This is at most how much we need for the output */
+			allocation_length = (size_t)(input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
+			output = (unsigned char*)parse_allocate(input_buffer, allocation_length + sizeof(""));
+			if (output == NULL) {
+				goto fail; /* allocation failure */
+			}
+			if (skipped_bytes == 0) {
+				memcpy(output, input_pointer, (size_t)(input_end - input_pointer));
+				output_pointer = output + (input_end - input_pointer);
+				input_pointer = input_end;
+				goto done;
+			}
 		}
 	}
 
@@ -611,7 +1002,12 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
 	/* loop through the string literal */
 	while (input_pointer < input_end) {
 		if (*input_pointer != '\\')	{
-			*output_pointer++ = *input_pointer++;
+			/* the run up to the next escape, in situ it moves down over itself */
+			const unsigned char *escape = (const unsigned char*)memchr(input_pointer, '\\', (size_t)(input_end - input_pointer));
+			size_t run = (size_t)((escape != NULL ? escape : input_end) - input_pointer);
+			memmove(output_pointer, input_pointer, run);
+			output_pointer += run;
+			input_pointer += run;
 		} else {
 			/* escape sequence */
 			unsigned char sequence_length = 2;
@@ -656,6 +1052,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
 		}
 	}
 
+done:
 	/* zero terminate the output */
 	*output_pointer = '\0';
 
@@ -668,7 +1065,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
 	return true;
 
 fail:
-	if (output != NULL) {
+	if ((output != NULL) && (input_buffer->arena == NULL) && !input_buffer->in_situ) {
 		input_buffer->hooks.deallocate(output);
 	}
 
@@ -808,9 +1205,9 @@ static parse_buffer *buffer_skip_whitespace(parse_buffer * const buffer)
 		return NULL;
 	}
 
-	/* 32 == (space )*/
-	while (can_access_at_index(buffer, 0) && (buffer_at_offset(buffer)[0] <= 32)) {
-		buffer->offset++;
+	/* 32 == (space ), most tokens are followed by none */
+	if (can_access_at_index(buffer, 0) && (buffer_at_offset(buffer)[0] <= 32)) {
+		buffer->offset += whitespace_run(buffer_at_offset(buffer), buffer->content + buffer->length);
 	}
 
 	if (buffer->offset == buffer->length) {
@@ -835,9 +1232,9 @@ static parse_buffer *skip_utf8_bom(parse_buffer * const buffer)
 }
 
 /* Parse an object - create a new root, and populate. */
-cJSON *cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
+static cJSON *parse_root(cJSON_Arena *arena, cJSON_bool in_situ, const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
 {
-	parse_buffer buffer = { 0, 0, 0, 0,{ 0, 0, 0 } };
+	parse_buffer buffer = { 0, 0, 0, 0,{ 0, 0, 0 }, 0, 0 };
 	cJSON *item = NULL;
 
 	/* reset error position */
@@ -851,14 +1248,17 @@ cJSON *cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJS
 	buffer.length = strlen((const char*)value) + sizeof("");
 	buffer.offset = 0;
 	buffer.hooks = global_hooks;
+	buffer.arena = arena;
+	buffer.in_situ = in_situ;
 
-	item = cJSON_New_Item(&global_hooks);
+	item = parse_new_item(&buffer);
 	if (item == NULL) /* memory fail */
 		goto fail;
 
 	if (!parse_value(item, buffer_skip_whitespace(skip_utf8_bom(&buffer))))
 		/* parse failure. ep is set. */
 		goto fail;
+	parse_mark(&buffer, item, false);
 
 	/* if we require null-terminated JSON without appended garbage, skip and then check for a null terminator */
 	if (require_null_terminated) {
@@ -875,7 +1275,7 @@ cJSON *cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJS
 
 fail:
 	if (item != NULL) {
-		cJSON_Delete(item);
+		parse_delete(&buffer, item);
 	}
 
 	if (value != NULL) {
@@ -899,6 +1299,24 @@ fail:
 	return NULL;
 }
 
+cJSON *cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+	return parse_root(NULL, false, value, return_parse_end, require_null_terminated);
+}
+
+cJSON *cJSON_ParseInArena(cJSON_Arena *arena, const char *value, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+	if (arena == NULL)
+		return NULL;
+
+	return parse_root(arena, false, value, return_parse_end, require_null_terminated);
+}
+
+cJSON *cJSON_ParseInSitu(char *value, cJSON_Arena *arena, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+	return parse_root(arena, true, value, return_parse_end, require_null_terminated);
+}
+
 /* Default options for cJSON_Parse */
 cJSON *cJSON_Parse(const char *value)
 {
@@ -1160,7 +1578,7 @@ static cJSON_bool parse_array(cJSON * const item, parse_buffer * const input_buf
 	/* loop through the comma separated array elements */
 	do {
 		/* allocate next item */
-		cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+		cJSON *new_item = parse_new_item(input_buffer);
 		if (new_item == NULL) {
 			goto fail; /* allocation failure */
 		}
@@ -1182,6 +1600,7 @@ static cJSON_bool parse_array(cJSON * const item, parse_buffer * const input_buf
 		if (!parse_value(current_item, input_buffer)) {
 			goto fail; /* failed to parse value */
 		}
+		parse_mark(input_buffer, current_item, false);
 		buffer_skip_whitespace(input_buffer);
 	} while (can_access_at_index(input_buffer, 0) && (buffer_at_offset(input_buffer)[0] == ','));
 
@@ -1201,7 +1620,7 @@ success:
 
 fail:
 	if (head != NULL) {
-		cJSON_Delete(head);
+		parse_delete(input_buffer, head);
 	}
 
 	return false;
@@ -1291,7 +1710,7 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
 	/* loop through the comma separated array elements */
 	do {
 		/* allocate next item */
-		cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+		cJSON *new_item = parse_new_item(input_buffer);
 		if (new_item == NULL) {
 			goto fail; /* allocation failure */
 		}
@@ -1318,6 +1737,8 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
 		/* swap valuestring and string, because we parsed the name */
 		current_item->string = current_item->valuestring;
 		current_item->valuestring = NULL;
+		/* a name in situ is not ours to free, even if the rest fails */
+		parse_mark(input_buffer, current_item, true);
 
 		if (cannot_access_at_index(input_buffer, 0) || (buffer_at_offset(input_buffer)[0] != ':')) {
 			goto fail; /* invalid object */
@@ -1329,6 +1750,8 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
 		if (!parse_value(current_item, input_buffer)) {
 			goto fail; /* failed to parse value */
 		}
+		/* the value set the type, mark it again */
+		parse_mark(input_buffer, current_item, true);
 		buffer_skip_whitespace(input_buffer);
 	} while (can_access_at_index(input_buffer, 0) && (buffer_at_offset(input_buffer)[0] == ','));
 
@@ -1347,7 +1770,7 @@ success:
 
 fail:
 	if (head != NULL) {
-		cJSON_Delete(head);
+		parse_delete(input_buffer, head);
 	}
 
 	return false;
@@ -1448,6 +1871,135 @@ static cJSON_bool print_object(const cJSON * const item, printbuffer * const out
 	return true;
 }
 
+/* Lookup index of an array or object: the children in order, and for
+ * objects a linear probing hash table of them by lowercased name. Same
+ * names hash alike and probe in list order, so the first match still wins. */
+typedef struct index_slot {
+	size_t hash;
+	cJSON *item;
+} index_slot;
+
+struct cJSON_Index {
+	size_t count;
+	size_t capacity; /* appending keeps the index up to here */
+	size_t mask; /* hash slots - 1, 0 for arrays */
+	cJSON **items;
+	index_slot *slots;
+};
+
+static size_t hash_name(const unsigned char *name)
+{
+	size_t hash = (size_t)2166136261U;
+
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (size_t)tolower(*name)) * (size_t)16777619U;
+	}
+
+	return hash;
+}
+
+static void index_insert(cJSON_Index * const index, cJSON * const item)
+{
+	size_t hash = 0;
+	size_t slot = 0;
+
+	index->items[index->count++] = item;
+	if ((index->mask == 0) || (item->string == NULL))
+		return;
+
+	hash = hash_name((const unsigned char*)item->string);
+	for (slot = hash & index->mask; index->slots[slot].item != NULL; slot = (slot + 1) & index->mask);
+	index->slots[slot].hash = hash;
+	index->slots[slot].item = item;
+}
+
+static cJSON_Index *build_index(cJSON * const container)
+{
+	cJSON_Index *index = NULL;
+	cJSON *child = NULL;
+	size_t count = 0;
+	size_t slots = CJSON_INDEX_MIN;
+	cJSON_bool object = ((container->type & 0xFF) == cJSON_Object);
+
+	for (child = container->child; child != NULL; child = child->next) {
+		count++;
+	}
+	if (count < CJSON_INDEX_MIN)
+		return NULL; /* a scan is as quick */
+
+	/* twice the children, the table stays at most half full up to capacity */
+	while (slots < (count * 2)) {
+		slots <<= 1;
+	}
+	index = (cJSON_Index*)global_hooks.allocate(sizeof(cJSON_Index) + (slots / 2) * sizeof(cJSON*) + (object ? slots * sizeof(index_slot) : 0));
+	if (index == NULL)
+		return NULL;
+
+	index->count = 0;
+	index->capacity = slots / 2;
+	index->items = (cJSON**)(index + 1);
+	index->mask = object ? slots - 1 : 0;
+	index->slots = object ? (index_slot*)(index->items + index->capacity) : NULL;
+	if (object) {
+		memset(index->slots, '\0', slots * sizeof(index_slot));
+	}
+	for (child = container->child; child != NULL; child = child->next) {
+		index_insert(index, child);
+	}
+
+	container->index = index;
+	return index;
+}
+
+static cJSON_bool wants_index(const cJSON * const container)
+{
+	return (container->type & cJSON_Indexed) && !(container->type & (cJSON_IsReference | cJSON_InArena));
+}
+
+/* Lookups only read the index: only the functions changing the container
+ * build it, so readers may share a tree. Without one they scan. */
+static cJSON_Index *get_index(const cJSON * const container)
+{
+	return container->index;
+}
+
+void cJSON_InvalidateIndex(cJSON *item)
+{
+	if (item == NULL)
+		return;
+
+	if (item->index != NULL) {
+		global_hooks.deallocate(item->index);
+		item->index = NULL;
+	}
+	if (wants_index(item))
+		build_index(item);
+}
+
+cJSON_bool cJSON_EnableIndex(cJSON *item, cJSON_bool recurse)
+{
+	cJSON *child = NULL;
+
+	if ((item == NULL) || (item->type & (cJSON_IsReference | cJSON_InArena)))
+		return false;
+
+	if (((item->type & 0xFF) == cJSON_Array) || ((item->type & 0xFF) == cJSON_Object)) {
+		item->type |= cJSON_Indexed;
+		/* built now, readers sharing the tree need not race to build it */
+		if ((item->index == NULL) && (build_index(item) == NULL) && (cJSON_GetArraySize(item) >= CJSON_INDEX_MIN))
+			return false;
+	}
+
+	if (recurse) {
+		for (child = item->child; child != NULL; child = child->next) {
+			if ((child->child != NULL) && !cJSON_EnableIndex(child, true))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 /* Get Array size/item / object item. */
 int cJSON_GetArraySize(const cJSON *array)
 {
@@ -1457,6 +2009,9 @@ int cJSON_GetArraySize(const cJSON *array)
 	if (array == NULL)
 		return 0;
 
+	if (array->index != NULL)
+		return (int)array->index->count;
+
 	child = array->child;
 
 	while (child != NULL) {
@@ -1472,10 +2027,15 @@ int cJSON_GetArraySize(const cJSON *array)
 static cJSON* get_array_item(const cJSON *array, size_t index)
 {
 	cJSON *current_child = NULL;
+	cJSON_Index *lookup = NULL;
 
 	if (array == NULL)
 		return NULL;
 
+	lookup = get_index(array);
+	if (lookup != NULL)
+		return (index < lookup->count) ? lookup->items[index] : NULL;
+
 	current_child = array->child;
 	while ((current_child != NULL) && (index > 0)) {
 		index--;
@@ -1497,10 +2057,26 @@ cJSON *cJSON_GetArrayItem(const cJSON *array, int index)
 static cJSON *get_object_item(const cJSON * const object, const char * const name, const cJSON_bool case_sensitive)
 {
 	cJSON *current_element = NULL;
+	cJSON_Index *lookup = NULL;
 
 	if ((object == NULL) || (name == NULL))
 		return NULL;
 
+	lookup = get_index(object);
+	if ((lookup != NULL) && (lookup->mask != 0)) {
+		size_t hash = hash_name((const unsigned char*)name);
+		size_t slot = 0;
+
+		for (slot = hash & lookup->mask; lookup->slots[slot].item != NULL; slot = (slot + 1) & lookup->mask) {
+			current_element = lookup->slots[slot].item;
+			if ((lookup->slots[slot].hash == hash) &&
+				((case_sensitive ? strcmp(name, current_element->string) : case_insensitive_strcmp((const unsigned char*)name, (const unsigned char*)current_element->string)) == 0))
+				return current_element;
+		}
+
+		return NULL;
+	}
+
 	current_element = object->child;
 	if (case_sensitive) {
 		while ((current_element != NULL) && (strcmp(name, current_element->string) != 0)) {
@@ -1551,6 +2127,7 @@ static cJSON *create_reference(const cJSON *item, const internal_hooks * const h
 
 	memcpy(reference, item, sizeof(cJSON));
 	reference->string = NULL;
+	reference->index = NULL;
 	reference->type |= cJSON_IsReference;
 	reference->next = reference->prev = NULL;
 	return reference;
@@ -1560,10 +2137,25 @@ static cJSON *create_reference(const cJSON *item, const internal_hooks * const h
 void cJSON_AddItemToArray(cJSON *array, cJSON *item)
 {
 	cJSON *child = NULL;
+	size_t count = 1;
 
 	if ((item == NULL) || (array == NULL))
 		return;
 
+	/* appending keeps the index while it has room, the end is known */
+	if (get_index(array) != NULL) {
+		cJSON_Index *index = array->index;
+
+		if (index->count < index->capacity) {
+			suffix_object(index->items[index->count - 1], item);
+			index_insert(index, item);
+			return;
+		}
+		/* full, built again below with room to grow */
+		global_hooks.deallocate(index);
+		array->index = NULL;
+	}
+
 	child = array->child;
 
 	if (child == NULL) {
@@ -1573,9 +2165,15 @@ void cJSON_AddItemToArray(cJSON *array, cJSON *item)
 		/* append to the end */
 		while (child->next) {
 			child = child->next;
+			count++;
 		}
 		suffix_object(child, item);
+		count++;
 	}
+
+	/* the walk counted the items, an index pays off from here on */
+	if ((count >= CJSON_INDEX_MIN) && wants_index(array))
+		build_index(array);
 }
 
 void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item)
@@ -1659,6 +2257,8 @@ cJSON *cJSON_DetachItemViaPointer(cJSON *parent, cJSON * const item)
 	item->prev = NULL;
 	item->next = NULL;
 
+	cJSON_InvalidateIndex(parent);
+
 	return item;
 }
 
@@ -1721,6 +2321,7 @@ void cJSON_InsertItemInArray(cJSON *array, int which, cJSON *newitem)
 		array->child = newitem;
 	else
 		newitem->prev->next = newitem;
+	cJSON_InvalidateIndex(array);
 }
 
 cJSON_bool cJSON_ReplaceItemViaPointer(cJSON * const parent, cJSON * const item, cJSON * replacement)
@@ -1742,6 +2343,7 @@ cJSON_bool cJSON_ReplaceItemViaPointer(cJSON * const parent, cJSON * const item,
 
 	if (parent->child == item)
 		parent->child = replacement;
+	cJSON_InvalidateIndex(parent);
 
 	item->next = NULL;
 	item->prev = NULL;
@@ -2029,7 +2631,7 @@ cJSON *cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
 		goto fail;
 
 	/* Copy over all vars */
-	newitem->type = item->type & (~cJSON_IsReference);
+	newitem->type = item->type & (~(cJSON_IsReference | cJSON_InArena | cJSON_InSitu));
 	newitem->valueint = item->valueint;
 	newitem->valuedouble = item->valuedouble;
 	if (item->valuestring) {
@@ -2039,7 +2641,11 @@ cJSON *cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
 		}
 	}
 	if (item->string) {
-		newitem->string = (item->type&cJSON_StringIsConst) ? item->string : (char*)cJSON_strdup((unsigned char*)item->string, &global_hooks);
+		if (item->type & (cJSON_InArena | cJSON_InSitu)) {
+			/* the copy may outlive the arena */
+			newitem->type &= ~cJSON_StringIsConst;
+		}
+		newitem->string = (newitem->type&cJSON_StringIsConst) ? item->string : (char*)cJSON_strdup((unsigned char*)item->string, &global_hooks);
 		if (!newitem->string) {
 			goto fail;
 		}
@@ -2067,6 +2673,8 @@ cJSON *cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
 		}
 		child = child->next;
 	}
+	if (wants_index(newitem))
+		build_index(newitem);
 
 	return newitem;
 
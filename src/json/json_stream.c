@@ -0,0 +1,845 @@
+/*
+ * Incremental (push) JSON parser
+ *
+ * A byte at a time state machine: chunks are fed as they arrive, cut
+ * anywhere, and tokens come out as events.  A string or number split
+ * over chunks is collected in a buffer of max_token bytes, nesting is a
+ * bit per level (object or array) up to max_depth; nothing else grows
+ * with the input.
+ *
+ * json_select sits on top: it follows the path of the current value
+ * with a bitmask per level of the paths still matching, and builds
+ * cJSON items only for the values a path selects.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <json_stream.h>
+
+enum {
+	ST_VALUE,		/* a value, at the top level or after ':' or ',' */
+	ST_VALUE_OR_END,	/* after '[' */
+	ST_KEY_OR_END,		/* after '{' */
+	ST_KEY,			/* after ',' in an object */
+	ST_COLON,
+	ST_COMMA_OR_END,	/* after a member or element */
+	ST_STRING,
+	ST_ESCAPE,
+	ST_HEX,			/* \uXXXX */
+	ST_LOW_BACKSLASH,	/* a high surrogate wants a low one next */
+	ST_LOW_U,
+	ST_NUMBER,
+	ST_LITERAL,		/* true, false, null */
+};
+
+/* where a number is in -int.frac[eE][+-]exp */
+enum {
+	NUM_MINUS,
+	NUM_ZERO,
+	NUM_INT,
+	NUM_DOT,
+	NUM_FRAC,
+	NUM_E,
+	NUM_E_SIGN,
+	NUM_EXP,
+};
+
+struct json_stream {
+	json_event_func on_event;
+	void *user_data;
+
+	int state;
+	int error;			/* errno once failed */
+	unsigned long offset;
+	unsigned long values;		/* complete top level values */
+
+	int depth;
+	int max_depth;
+	unsigned char *objects;		/* a bit per level, set for objects */
+
+	char *token;			/* string or number so far */
+	size_t len;
+	size_t max_token;
+	int is_key;
+	int number;			/* NUM_* */
+	const char *literal;
+	int literal_pos;
+	int literal_event;
+	unsigned int hex;
+	int hex_digits;
+	unsigned int high;		/* surrogate waiting for its pair */
+};
+
+#define is_space(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define in_object(s) ((s)->objects[((s)->depth - 1) / 8] & (1 << (((s)->depth - 1) % 8)))
+
+static int stream_fail(json_stream_t *stream, int error)
+{
+	stream->error = error;
+	return -1;
+}
+
+static int emit(json_stream_t *stream, int type, int depth)
+{
+	json_event_t event;
+
+	event.type = type;
+	event.depth = depth;
+	event.text = NULL;
+	event.len = 0;
+	event.number = 0;
+
+	switch (type) {
+	case JSON_KEY:
+	case JSON_STRING:
+	case JSON_NUMBER:
+		stream->token[stream->len] = '\0';
+		event.text = stream->token;
+		event.len = stream->len;
+		if (type == JSON_NUMBER)
+			event.number = strtod(stream->token, NULL);
+		break;
+	}
+
+	if (stream->on_event(&event, stream->user_data))
+		return stream_fail(stream, ECANCELED);
+
+	return 0;
+}
+
+static int value_done(json_stream_t *stream)
+{
+	if (stream->depth == 0) {
+		stream->values++;
+		stream->state = ST_VALUE;
+	} else {
+		stream->state = ST_COMMA_OR_END;
+	}
+
+	return 0;
+}
+
+static int put(json_stream_t *stream, const void *data, size_t len)
+{
+	if (stream->max_token - stream->len < len)
+		return stream_fail(stream, ENOBUFS);
+
+	memcpy(stream->token + stream->len, data, len);
+	stream->len += len;
+	return 0;
+}
+
+static int begin_container(json_stream_t *stream, int object)
+{
+	int depth = stream->depth;
+
+	if (depth >= stream->max_depth)
+		return stream_fail(stream, ENOBUFS);
+
+	if (emit(stream, object ? JSON_BEGIN_OBJECT : JSON_BEGIN_ARRAY, depth) < 0)
+		return -1;
+
+	if (object)
+		stream->objects[depth / 8] |= 1 << (depth % 8);
+	else
+		stream->objects[depth / 8] &= ~(1 << (depth % 8));
+	stream->depth++;
+	stream->state = object ? ST_KEY_OR_END : ST_VALUE_OR_END;
+
+	return 0;
+}
+
+static int end_container(json_stream_t *stream)
+{
+	int object = in_object(stream);
+
+	stream->depth--;
+	if (emit(stream, object ? JSON_END_OBJECT : JSON_END_ARRAY, stream->depth) < 0)
+		return -1;
+
+	return value_done(stream);
+}
+
+static int begin_literal(json_stream_t *stream, const char *literal, int event)
+{
+	stream->literal = literal;
+	stream->literal_pos = 1;
+	stream->literal_event = event;
+	stream->state = ST_LITERAL;
+
+	return 0;
+}
+
+static int begin_value(json_stream_t *stream, unsigned char c)
+{
+	switch (c) {
+	case '{':
+		return begin_container(stream, 1);
+	case '[':
+		return begin_container(stream, 0);
+	case '"':
+		stream->is_key = 0;
+		stream->len = 0;
+		stream->state = ST_STRING;
+		return 0;
+	case 't':
+		return begin_literal(stream, "true", JSON_TRUE);
+	case 'f':
+		return begin_literal(stream, "false", JSON_FALSE);
+	case 'n':
+		return begin_literal(stream, "null", JSON_NULL);
+	case '-':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		stream->len = 0;
+		stream->number = c == '-' ? NUM_MINUS : c == '0' ? NUM_ZERO : NUM_INT;
+		stream->state = ST_NUMBER;
+		return put(stream, &c, 1);
+	}
+
+	return stream_fail(stream, EINVAL);
+}
+
+static int end_string(json_stream_t *stream)
+{
+	if (stream->is_key) {
+		stream->state = ST_COLON;
+		return emit(stream, JSON_KEY, stream->depth);
+	}
+
+	if (emit(stream, JSON_STRING, stream->depth) < 0)
+		return -1;
+	return value_done(stream);
+}
+
+/* The next number state after c, -1 if c does not go on the number */
+static int number_next(int number, unsigned char c)
+{
+	int digit = c >= '0' && c <= '9';
+
+	switch (number) {
+	case NUM_MINUS:
+		return c == '0' ? NUM_ZERO : digit ? NUM_INT : -1;
+	case NUM_ZERO:
+		return c == '.' ? NUM_DOT : (c == 'e' || c == 'E') ? NUM_E : -1;
+	case NUM_INT:
+		return digit ? NUM_INT : c == '.' ? NUM_DOT :
+					(c == 'e' || c == 'E') ? NUM_E : -1;
+	case NUM_DOT:
+		return digit ? NUM_FRAC : -1;
+	case NUM_FRAC:
+		return digit ? NUM_FRAC : (c == 'e' || c == 'E') ? NUM_E : -1;
+	case NUM_E:
+		return (c == '+' || c == '-') ? NUM_E_SIGN : digit ? NUM_EXP : -1;
+	case NUM_E_SIGN:
+	case NUM_EXP:
+		return digit ? NUM_EXP : -1;
+	}
+
+	return -1;
+}
+
+static int end_number(json_stream_t *stream)
+{
+	switch (stream->number) {
+	case NUM_ZERO:
+	case NUM_INT:
+	case NUM_FRAC:
+	case NUM_EXP:
+		break;
+	default:
+		return stream_fail(stream, EINVAL);	/* "-", "1.", "1e" */
+	}
+
+	if (emit(stream, JSON_NUMBER, stream->depth) < 0)
+		return -1;
+	return value_done(stream);
+}
+
+/* \uXXXX complete: pair surrogates, store as UTF-8 */
+static int end_hex(json_stream_t *stream)
+{
+	unsigned int code = stream->hex;
+	unsigned char utf8[4];
+	size_t len;
+
+	if (stream->high) {
+		if (code < 0xDC00 || code > 0xDFFF)
+			return stream_fail(stream, EINVAL);
+		code = 0x10000 + (((stream->high & 0x3FF) << 10) | (code & 0x3FF));
+		stream->high = 0;
+	} else if (code >= 0xD800 && code <= 0xDBFF) {
+		stream->high = code;
+		stream->state = ST_LOW_BACKSLASH;
+		return 0;
+	} else if (code >= 0xDC00 && code <= 0xDFFF) {
+		return stream_fail(stream, EINVAL);
+	}
+
+	if (code < 0x80) {
+		utf8[0] = code;
+		len = 1;
+	} else if (code < 0x800) {
+		utf8[0] = 0xC0 | (code >> 6);
+		utf8[1] = 0x80 | (code & 0x3F);
+		len = 2;
+	} else if (code < 0x10000) {
+		utf8[0] = 0xE0 | (code >> 12);
+		utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+		utf8[2] = 0x80 | (code & 0x3F);
+		len = 3;
+	} else {
+		utf8[0] = 0xF0 | (code >> 18);
+		utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+		utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+		utf8[3] = 0x80 | (code & 0x3F);
+		len = 4;
+	}
+
+	stream->state = ST_STRING;
+	return put(stream, utf8, len);
+}
+
+static int stream_char(json_stream_t *stream, unsigned char c)
+{
+	int next;
+
+again:
+	switch (stream->state) {
+	case ST_VALUE_OR_END:
+		if (c == ']')
+			return end_container(stream);
+		/* fall through */
+	case ST_VALUE:
+		if (is_space(c))
+			return 0;
+		return begin_value(stream, c);
+
+	case ST_KEY_OR_END:
+		if (c == '}')
+			return end_container(stream);
+		/* fall through */
+	case ST_KEY:
+		if (is_space(c))
+			return 0;
+		if (c != '"')
+			return stream_fail(stream, EINVAL);
+		stream->is_key = 1;
+		stream->len = 0;
+		stream->state = ST_STRING;
+		return 0;
+
+	case ST_COLON:
+		if (is_space(c))
+			return 0;
+		if (c != ':')
+			return stream_fail(stream, EINVAL);
+		stream->state = ST_VALUE;
+		return 0;
+
+	case ST_COMMA_OR_END:
+		if (is_space(c))
+			return 0;
+		if (c == ',') {
+			stream->state = in_object(stream) ? ST_KEY : ST_VALUE;
+			return 0;
+		}
+		if (c == (in_object(stream) ? '}' : ']'))
+			return end_container(stream);
+		return stream_fail(stream, EINVAL);
+
+	case ST_STRING:
+		if (c == '"')
+			return end_string(stream);
+		if (c == '\\') {
+			stream->state = ST_ESCAPE;
+			return 0;
+		}
+		if (c < 0x20)
+			return stream_fail(stream, EINVAL);
+		return put(stream, &c, 1);
+
+	case ST_ESCAPE:
+		stream->state = ST_STRING;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			break;
+		case 'b':
+			c = '\b';
+			break;
+		case 'f':
+			c = '\f';
+			break;
+		case 'n':
+			c = '\n';
+			break;
+		case 'r':
+			c = '\r';
+			break;
+		case 't':
+			c = '\t';
+			break;
+		case 'u':
+			stream->hex = 0;
+			stream->hex_digits = 0;
+			stream->state = ST_HEX;
+			return 0;
+		default:
+			return stream_fail(stream, EINVAL);
+		}
+		return put(stream, &c, 1);
+
+	case ST_HEX:
+		if (c >= '0' && c <= '9')
+			stream->hex = stream->hex << 4 | (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			stream->hex = stream->hex << 4 | (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			stream->hex = stream->hex << 4 | (c - 'A' + 10);
+		else
+			return stream_fail(stream, EINVAL);
+		if (++stream->hex_digits == 4)
+			return end_hex(stream);
+		return 0;
+
+	case ST_LOW_BACKSLASH:
+		if (c != '\\')
+			return stream_fail(stream, EINVAL);
+		stream->state = ST_LOW_U;
+		return 0;
+
+	case ST_LOW_U:
+		if (c != 'u')
+			return stream_fail(stream, EINVAL);
+		stream->hex = 0;
+		stream->hex_digits = 0;
+		stream->state = ST_HEX;
+		return 0;
+
+	case ST_NUMBER:
+		next = number_next(stream->number, c);
+		if (next >= 0) {
+			stream->number = next;
+			return put(stream, &c, 1);
+		}
+		/* c is the first byte after the number */
+		if (end_number(stream) < 0)
+			return -1;
+		goto again;
+
+	case ST_LITERAL:
+		if (c != (unsigned char) stream->literal[stream->literal_pos])
+			return stream_fail(stream, EINVAL);
+		if (stream->literal[++stream->literal_pos] != '\0')
+			return 0;
+		if (emit(stream, stream->literal_event, stream->depth) < 0)
+			return -1;
+		return value_done(stream);
+	}
+
+	return stream_fail(stream, EINVAL);
+}
+
+json_stream_t *json_stream_new(json_event_func on_event, void *user_data,
+				size_t max_token, int max_depth)
+{
+	json_stream_t *stream;
+
+	if (!on_event || max_depth < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!max_token)
+		max_token = JSON_STREAM_MAX_TOKEN;
+	if (!max_depth)
+		max_depth = JSON_STREAM_MAX_DEPTH;
+
+	stream = (json_stream_t *) calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->objects = (unsigned char *) calloc(1, (max_depth + 7) / 8);
+	stream->token = (char *) malloc(max_token + 1);
+	if (!stream->objects || !stream->token) {
+		json_stream_free(stream);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	stream->on_event = on_event;
+	stream->user_data = user_data;
+	stream->max_token = max_token;
+	stream->max_depth = max_depth;
+	stream->state = ST_VALUE;
+
+	return stream;
+}
+
+void json_stream_free(json_stream_t *stream)
+{
+	if (!stream)
+		return;
+
+	free(stream->objects);
+	free(stream->token);
+	free(stream);
+}
+
+int json_stream_feed(json_stream_t *stream, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + len;
+
+	if (stream->error) {
+		errno = stream->error;
+		return -1;
+	}
+
+	while (p < end) {
+		/* the plain run of a string in one go */
+		if (stream->state == ST_STRING) {
+			const unsigned char *run = p;
+
+			while (run < end && *run != '"' && *run != '\\' && *run >= 0x20)
+				run++;
+			if (run > p) {
+				if (put(stream, p, run - p) < 0)
+					break;
+				stream->offset += run - p;
+				p = run;
+				continue;
+			}
+		}
+
+		if (stream_char(stream, *p) < 0)
+			break;
+		stream->offset++;
+		p++;
+	}
+
+	if (stream->error) {
+		errno = stream->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+int json_stream_finish(json_stream_t *stream)
+{
+	if (!stream->error && stream->state == ST_NUMBER && stream->depth == 0)
+		end_number(stream);
+
+	if (!stream->error && (stream->state != ST_VALUE || stream->depth != 0 ||
+							!stream->values))
+		stream->error = EINVAL;	/* ended inside a value, or no value */
+
+	if (stream->error) {
+		errno = stream->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned long json_stream_offset(json_stream_t *stream)
+{
+	return stream->offset;
+}
+
+struct select_path {
+	const char *path;
+	char *copy;			/* the parts point in here */
+	char **parts;
+	int count;
+};
+
+struct json_select {
+	json_stream_t *stream;
+	json_select_func on_item;
+	void *user_data;
+
+	struct select_path *paths;
+	int count;
+
+	/* per level: the paths matching so far, arrays and the next index */
+	unsigned int *alive;
+	char *is_array;
+	long *index;
+	unsigned int pending;		/* the paths matching the key just read */
+
+	/* the value being built, base is its depth */
+	cJSON *root;
+	const char *root_path;
+	int base;
+	cJSON **last;			/* per level: container, then last child */
+	cJSON **parent;
+	char *key;
+	int error;
+};
+
+static int part_matches(const char *part, const char *key, long index)
+{
+	char *end;
+
+	if (!strcmp(part, "*"))
+		return 1;
+	if (key)
+		return !strcmp(part, key);
+
+	return *part && strtol(part, &end, 10) == index && *end == '\0';
+}
+
+/* Paths alive at the level above depth whose next part matches */
+static unsigned int select_match(json_select_t *select, int depth,
+						const char *key, long index)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for (i = 0; i < select->count; i++)
+		if ((select->alive[depth - 1] & (1U << i)) &&
+		    part_matches(select->paths[i].parts[depth - 1], key, index))
+			mask |= 1U << i;
+
+	return mask;
+}
+
+static int select_fail(json_select_t *select, int error)
+{
+	select->error = error;
+	return -1;
+}
+
+static int select_deliver(json_select_t *select)
+{
+	cJSON *root = select->root;
+
+	select->root = NULL;
+	return select->on_item(select->root_path, root, select->user_data);
+}
+
+/* One more item of the value being built, linked in place: O(1) for long arrays */
+static int select_build(json_select_t *select, const json_event_t *event)
+{
+	int level = event->depth - select->base;
+	cJSON *item;
+
+	switch (event->type) {
+	case JSON_BEGIN_OBJECT:
+		item = cJSON_CreateObject();
+		break;
+	case JSON_BEGIN_ARRAY:
+		item = cJSON_CreateArray();
+		break;
+	case JSON_STRING:
+		item = cJSON_CreateString(event->text);
+		break;
+	case JSON_NUMBER:
+		item = cJSON_CreateNumber(event->number);
+		break;
+	case JSON_TRUE:
+		item = cJSON_CreateTrue();
+		break;
+	case JSON_FALSE:
+		item = cJSON_CreateFalse();
+		break;
+	default:
+		item = cJSON_CreateNull();
+		break;
+	}
+	if (!item)
+		return select_fail(select, ENOMEM);
+
+	if (level == 0) {
+		select->root = item;
+	} else {
+		cJSON *parent = select->parent[level - 1];
+		cJSON *last = select->last[level - 1];
+
+		if (cJSON_IsObject(parent)) {
+			item->string = (char *) cJSON_malloc(strlen(select->key) + 1);
+			if (!item->string) {
+				cJSON_Delete(item);
+				return select_fail(select, ENOMEM);
+			}
+			strcpy(item->string, select->key);
+		}
+		if (last) {
+			last->next = item;
+			item->prev = last;
+		} else {
+			parent->child = item;
+		}
+		select->last[level - 1] = item;
+	}
+
+	if (event->type == JSON_BEGIN_OBJECT || event->type == JSON_BEGIN_ARRAY) {
+		select->parent[level] = item;
+		select->last[level] = NULL;
+		return 0;
+	}
+
+	return level == 0 ? select_deliver(select) : 0;
+}
+
+static int select_event(const json_event_t *event, void *user_data)
+{
+	json_select_t *select = (json_select_t *) user_data;
+	int depth = event->depth;
+	unsigned int mask;
+	int i;
+
+	switch (event->type) {
+	case JSON_KEY:
+		if (select->root) {
+			memcpy(select->key, event->text, event->len + 1);
+			return 0;
+		}
+		select->pending = select_match(select, depth, event->text, -1);
+		return 0;
+
+	case JSON_END_OBJECT:
+	case JSON_END_ARRAY:
+		if (select->root && depth == select->base)
+			return select_deliver(select);
+		return 0;
+	}
+
+	/* a value starts */
+	if (select->root)
+		return select_build(select, event);
+
+	if (depth == 0)
+		mask = select->count < 32 ? (1U << select->count) - 1 : ~0U;
+	else if (select->is_array[depth - 1])
+		mask = select_match(select, depth, NULL, select->index[depth - 1]++);
+	else
+		mask = select->pending;
+
+	for (i = 0; i < select->count; i++)
+		if ((mask & (1U << i)) && select->paths[i].count == depth) {
+			select->root_path = select->paths[i].path;
+			select->base = depth;
+			return select_build(select, event);
+		}
+
+	if (event->type == JSON_BEGIN_OBJECT || event->type == JSON_BEGIN_ARRAY) {
+		/* the paths that can still match deeper */
+		for (i = 0; i < select->count; i++)
+			if (select->paths[i].count <= depth)
+				mask &= ~(1U << i);
+		select->alive[depth] = mask;
+		select->is_array[depth] = event->type == JSON_BEGIN_ARRAY;
+		select->index[depth] = 0;
+	}
+
+	return 0;
+}
+
+json_select_t *json_select_new(const char * const *paths, int count,
+				json_select_func on_item, void *user_data,
+				size_t max_token, int max_depth)
+{
+	json_select_t *select;
+	int i, levels;
+
+	if (!paths || count <= 0 || count > JSON_SELECT_MAX_PATHS || !on_item) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	select = (json_select_t *) calloc(1, sizeof(*select));
+	if (!select)
+		return NULL;
+
+	select->stream = json_stream_new(select_event, select, max_token, max_depth);
+	if (!select->stream)
+		goto fail;
+	levels = select->stream->max_depth + 1;
+	select->on_item = on_item;
+	select->user_data = user_data;
+
+	select->alive = (unsigned int *) calloc(levels, sizeof(*select->alive));
+	select->is_array = (char *) calloc(levels, 1);
+	select->index = (long *) calloc(levels, sizeof(*select->index));
+	select->last = (cJSON **) calloc(levels, sizeof(*select->last));
+	select->parent = (cJSON **) calloc(levels, sizeof(*select->parent));
+	select->key = (char *) malloc(select->stream->max_token + 1);
+	select->paths = (struct select_path *) calloc(count, sizeof(*select->paths));
+	if (!select->alive || !select->is_array || !select->index || !select->last ||
+	    !select->parent || !select->key || !select->paths)
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		struct select_path *path = &select->paths[i];
+		char *part, *save;
+
+		select->count++;
+		path->path = paths[i];
+		path->copy = strdup(paths[i]);
+		path->parts = (char **) calloc(strlen(paths[i]) / 2 + 1, sizeof(char *));
+		if (!path->copy || !path->parts)
+			goto fail;
+		for (part = strtok_r(path->copy, ".", &save); part;
+					part = strtok_r(NULL, ".", &save))
+			path->parts[path->count++] = part;
+	}
+
+	return select;
+
+fail:
+	json_select_free(select);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void json_select_free(json_select_t *select)
+{
+	int i;
+
+	if (!select)
+		return;
+
+	cJSON_Delete(select->root);
+	for (i = 0; i < select->count; i++) {
+		free(select->paths[i].copy);
+		free(select->paths[i].parts);
+	}
+	free(select->paths);
+	free(select->alive);
+	free(select->is_array);
+	free(select->index);
+	free(select->last);
+	free(select->parent);
+	free(select->key);
+	json_stream_free(select->stream);
+	free(select);
+}
+
+int json_select_feed(json_select_t *select, const void *data, size_t len)
+{
+	int ret = json_stream_feed(select->stream, data, len);
+
+	if (ret < 0 && select->error)
+		errno = select->error;
+	return ret;
+}
+
+int json_select_finish(json_select_t *select)
+{
+	int ret = json_stream_finish(select->stream);
+
+	if (ret < 0 && select->error)
+		errno = select->error;
+	return ret;
+}
+
+json_stream_t *json_select_stream(json_select_t *select)
+{
+	return select->stream;
+}
@@ -81,14 +81,14 @@ signed long query_tag(FILE *iofile)
   if (fgetpos(iofile, &save_position) == -1)
     return 0;
 
-  ALOGD("save_position: %d", save_position);
+  ALOGD("save_position: %ld", ftell(iofile));
 
   size = id3_tag_query(query, fread(query, 1, sizeof(query), iofile));
 
   if (fsetpos(iofile, &save_position) == -1)
     return 0;
 
-  ALOGD("query_tag size: %d", size);
+  ALOGD("query_tag size: %ld", size);
   return size;
 }
 
@@ -207,9 +207,9 @@ struct id3_tag *add_tag(struct id3_file *file, id3_length_t length)
   struct filetag filetag;
   struct id3_tag *tag;
 
-  ALOGD("add_tag length: %d", length);
+  ALOGD("add_tag length: %lu", length);
   location = ftell(file->iofile);
-  ALOGD("add_tag location: %d", location);
+  ALOGD("add_tag location: %ld", location);
   if (location == -1)
     return 0;
 
@@ -219,8 +219,8 @@ struct id3_tag *add_tag(struct id3_file *file, id3_length_t length)
 
     begin1 = location;
     end1   = begin1 + length;
-	ALOGD("add_tag begin1: %d", begin1);
-	ALOGD("add_tag end1: %d", end1);
+	ALOGD("add_tag begin1: %lu", begin1);
+	ALOGD("add_tag end1: %lu", end1);
 	ALOGD("add_tag ntags: %d", file->ntags);
 
     for (i = 0; i < file->ntags; ++i) {
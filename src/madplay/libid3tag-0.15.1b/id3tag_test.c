@@ -363,7 +363,7 @@ void show_id3(struct id3_tag const *tag)
 
   if (0) {
   fail:
-    error("id3", _("not enough memory to display tag"));
+    error("id3: %s", _("not enough memory to display tag"));
   }
 }
 
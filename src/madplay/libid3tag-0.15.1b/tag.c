@@ -305,7 +305,7 @@ signed long id3_tag_query(id3_byte_t const *data, id3_length_t length)
   case TAGTYPE_ID3V2:
   	dump(data, length);
     parse_header(&data, &version, &flags, &size);
-	ALOGD("id3_tag_query version: %04x, flag: %x, size: %x\n", version, flags, size);
+	ALOGD("id3_tag_query version: %04x, flag: %x, size: %lx\n", version, flags, size);
     if (flags & ID3_TAG_FLAG_FOOTERPRESENT)
       size += 10;
 
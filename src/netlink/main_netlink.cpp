@@ -47,6 +47,10 @@ int main()
     NetlinkManager *nm;
     FwmarkServer* fwmarkServer;
 
+    // log calls only queue their arguments, the flusher formats them
+    if (log_async_start_mode(NULL, LOG_ASYNC_DEFERRED) == 0)
+        atexit(log_async_stop);
+
     ALOGI("Netd 1.0 starting");
     blockSigpipe();
 
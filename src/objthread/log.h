@@ -1,12 +1,15 @@
 #ifndef _UTILS_LOG_H
 #define _UTILS_LOG_H
 
-#define LOG_ERROR    0
-#define LOG_WARNING  1
-#define LOG_INFO	 2
-#define LOG_DEBUG    3
+/*
+ * ALOG*, SLOG* and the rest go to sys_debug_ext() in src/util/log_util.c,
+ * as in the C code, so the asynchronous and deferred modes started with
+ * log_async_start_mode() cover these call sites too.
+ */
+#include "log_util.h"
 
-#define DEFAULT_LOG_LEVEL LOG_DEBUG
+/* log_util.h's dump(buf, len) would take over any dump() method */
+#undef dump
 
 #define hex_dump(buf, len)	\
 	do { \
@@ -20,24 +23,15 @@
 		printf("\n"); \
 	} while(0)
 
-void sys_debug(int level, const char *tag, int line_num, const char *fmt, ...);
-
-#define debug(x...)   sys_debug(LOG_DEBUG, LOG_TAG, __LINE__, x)
-#define info(x...)    sys_debug(LOG_INFO, LOG_TAG, __LINE__, x)
-#define warning(x...) sys_debug(LOG_WARNING, LOG_TAG, __LINE__, x)
-#define error(x...)   sys_debug(LOG_ERROR, LOG_TAG, __LINE__, x)
-
-#define ALOGD(x...)   sys_debug(LOG_DEBUG, LOG_TAG, __LINE__, x)
-#define ALOGV(x...)   sys_debug(LOG_INFO, LOG_TAG, __LINE__, x)
-#define ALOGI(x...)   sys_debug(LOG_INFO, LOG_TAG, __LINE__, x)
-#define ALOGW(x...)   sys_debug(LOG_WARNING, LOG_TAG, __LINE__, x)
-#define ALOGE(x...)   sys_debug(LOG_ERROR, LOG_TAG, __LINE__, x)
-
-#define SLOGD(x...)   sys_debug(LOG_DEBUG, LOG_TAG, __LINE__, x)
-#define SLOGI(x...)   sys_debug(LOG_INFO, LOG_TAG, __LINE__, x)
-#define SLOGV(x...)   sys_debug(LOG_INFO, LOG_TAG, __LINE__, x)
-#define SLOGW(x...)   sys_debug(LOG_WARNING, LOG_TAG, __LINE__, x)
-#define SLOGE(x...)   sys_debug(LOG_ERROR, LOG_TAG, __LINE__, x)
+/* These take the tag and line here, and error() does not abort. */
+#undef debug
+#undef info
+#undef warning
+#undef error
+#define debug(x...)   sys_debug_ext(LOG_DEBUG, LOG_TAG, __LINE__, x)
+#define info(x...)    sys_debug_ext(LOG_INFO, LOG_TAG, __LINE__, x)
+#define warning(x...) sys_debug_ext(LOG_WARNING, LOG_TAG, __LINE__, x)
+#define error(x...)   sys_debug_ext(LOG_ERROR, LOG_TAG, __LINE__, x)
 
 /*
  * Assertion that generates a log message when the assertion fails.
@@ -47,10 +41,9 @@ void sys_debug(int level, const char *tag, int line_num, const char *fmt, ...);
 //#define ALOG_ASSERT(cond, ...) LOG_FATAL_IF(!(cond), ## __VA_ARGS__)
 #define ALOG_ASSERT(cond, x...) do { \
 		if (!(cond)) { \
-			sys_debug(LOG_ERROR, LOG_TAG, __LINE__, x); \
+			sys_debug_ext(LOG_ERROR, LOG_TAG, __LINE__, x); \
 		} \
 	} while (0)
 #endif
 
 #endif
-
@@ -56,10 +56,9 @@ static connection_t *create_tcp_client()
 
 static inline void destroy_tcp_client(connection_t *client)
 {
-	if (client) {
-		sock_close(client->sock);
+	/* clean_connection() closes the socket as well */
+	if (client)
 		clean_connection(client);
-	}
 }
 
 static void *socket_tcp_client_thread(void *arg)
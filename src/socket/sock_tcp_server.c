@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -10,6 +11,7 @@
 #include <sockets.h>
 #include <utils.h>
 #include <delay.h>
+#include <mutex.h>
 #include <log_util.h>
 
 
@@ -48,11 +50,77 @@ void setup_tcp_listeners()
 	}
 }
 
+/*
+ * Connections come from a pool: slabs of CONN_SLAB_SIZE entries carved
+ * up once and recycled through a freelist, each entry carrying the peer
+ * address and host string inline, so accepting and closing a connection
+ * does not go through malloc.  Slabs are kept for the life of the
+ * process, the pool only grows to the peak number of connections.
+ */
+#define CONN_SLAB_SIZE 64
+
+struct conn_entry {
+	connection_t con;
+	struct sockaddr_in sin;
+	char host[INET_ADDRSTRLEN];
+	struct conn_entry *next_free;
+};
+
+static struct conn_entry *conn_free_list;
+static connection_pool_stats_t conn_stats;
+static adaptive_mutex_t conn_pool_lock = ADAPTIVE_MUTEX_INITIALIZER;
+
+static inline struct conn_entry *conn_entry_of(connection_t *con)
+{
+	return container_of(con, struct conn_entry, con);
+}
+
+/* Called with conn_pool_lock held. */
+static int conn_pool_grow(void)
+{
+	struct conn_entry *slab;
+	int i;
+
+	slab = (struct conn_entry *) malloc(CONN_SLAB_SIZE * sizeof(*slab));
+	if (!slab)
+		return -1;
+
+	for (i = CONN_SLAB_SIZE - 1; i >= 0; i--) {
+		slab[i].next_free = conn_free_list;
+		conn_free_list = &slab[i];
+	}
+
+	conn_stats.slabs++;
+	conn_stats.capacity += CONN_SLAB_SIZE;
+	return 0;
+}
+
+void connection_pool_stats(connection_pool_stats_t *stats)
+{
+	adaptive_mutex_lock(&conn_pool_lock);
+	*stats = conn_stats;
+	adaptive_mutex_unlock(&conn_pool_lock);
+}
+
 connection_t *create_connection()
 {
-	connection_t *con = (connection_t *) xmalloc(sizeof (connection_t));
-	if (!con) return NULL;
+	struct conn_entry *entry;
+	connection_t *con;
 
+	adaptive_mutex_lock(&conn_pool_lock);
+	if (!conn_free_list && conn_pool_grow() < 0) {
+		conn_stats.failed++;
+		adaptive_mutex_unlock(&conn_pool_lock);
+		return NULL;
+	}
+
+	entry = conn_free_list;
+	conn_free_list = entry->next_free;
+	conn_stats.allocs++;
+	conn_stats.in_use++;
+	adaptive_mutex_unlock(&conn_pool_lock);
+
+	con = &entry->con;
 	con->type = SOCK_TYPE_UNKNOWN;
     con->connect_time = 0;
     con->read_statistics = 0;
@@ -65,24 +133,69 @@ connection_t *create_connection()
 	return con;
 }
 
+/* inet_ntop() for AF_INET without its generic overhead. */
+static void format_ipv4(const struct in_addr *in, char *host)
+{
+	const unsigned char *b = (const unsigned char *) &in->s_addr;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned int v = b[i];
+
+		if (v >= 100)
+			*host++ = '0' + v / 100;
+		if (v >= 10)
+			*host++ = '0' + v / 10 % 10;
+		*host++ = '0' + v % 10;
+		*host++ = i < 3 ? '.' : '\0';
+	}
+}
+
+/*
+ * Record the peer of an accepted connection in the buffers inline in
+ * the pooled entry: con->sin and con->host point there afterwards.
+ */
+void connection_set_peer(connection_t *con, const struct sockaddr_in *sin,
+							socklen_t sin_len)
+{
+	struct conn_entry *entry = conn_entry_of(con);
+
+	if (sin_len > sizeof(entry->sin))
+		sin_len = sizeof(entry->sin);
+
+	memcpy(&entry->sin, sin, sin_len);
+	con->sin = &entry->sin;
+	con->sinlen = sin_len;
+
+	format_ipv4(&entry->sin.sin_addr, entry->host);
+	con->host = entry->host;
+}
+
 void clean_connection(connection_t *con)
 {
+	struct conn_entry *entry;
+
 	if (!con) return;
-	if (con->host) {
+	entry = conn_entry_of(con);
+
+	/* release everything the connection owns; the inline buffers stay */
+	if (con->host != entry->host)
 		free(con->host);
-	} else if (con->hostname) {
-		free(con->hostname);
-	} else if (con->hostip) {
-		free(con->hostip);
-	}  else if (con->sin) {
+	free(con->hostname);
+	free(con->hostip);
+	if (con->sin != &entry->sin)
 		free(con->sin);
-	} else if (con->sock >= 0) {
+	if (con->sock >= 0) {
 		sock_close(con->sock);
 		con->sock = -1;
-	} else {
 	}
 
-	free(con);
+	adaptive_mutex_lock(&conn_pool_lock);
+	entry->next_free = conn_free_list;
+	conn_free_list = entry;
+	conn_stats.frees++;
+	conn_stats.in_use--;
+	adaptive_mutex_unlock(&conn_pool_lock);
 }
 
 static void handle_recv(const connection_t *new_connection)
@@ -221,13 +334,7 @@ static connection_t *get_connection(int sock)
 
 		if (!con) {
 			sys_debug(1, "ERROR: NULL create_connection");
-			return NULL;
-		}
-
-		con->sin = (struct sockaddr_in *) xmalloc(sizeof(struct sockaddr_in));
-		if (!con->sin) {
-			sys_debug(1, "WARNING: Weird stuff in create_connection. nmalloc returned NULL sin");
-			clean_connection(con);
+			sock_close(sockfd);
 			return NULL;
 		}
 
@@ -235,9 +342,7 @@ static connection_t *get_connection(int sock)
         con->connect_time = get_time();
         con->read_statistics = 0;
 		con->sock = sockfd;
-		memcpy((void *)con->sin, (void *)&sin, sin_len);
-		con->sinlen = sin_len;
-		con->host = make_host(&(sin.sin_addr));
+		connection_set_peer(con, &sin, sin_len);
 		sys_debug(2, "DEBUG: Getting new connection on socket %d from host %s, connect time %s",
 					sockfd, con->host == NULL ? "(null)" : con->host, get_ctime(&con->connect_time));
 		return con;
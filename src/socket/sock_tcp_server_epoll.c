@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
@@ -11,10 +15,27 @@
 #include <sockets.h>
 #include <utils.h>
 #include <delay.h>
+#include <list.h>
 #include <log_util.h>
 
 #define MAX_EPOLL_FDS	(1024 * 10)
 
+/* Events fetched per epoll_wait. */
+#define EPOLL_BATCH	256
+
+/*
+ * Replies wait in a per-connection output queue until the socket takes
+ * them.  Once more than OUT_HIGH_WATER bytes are queued the connection
+ * is not read anymore, so a client which does not read its replies
+ * cannot make the server buffer without bound; reading resumes when
+ * the queue drained below OUT_LOW_WATER.
+ */
+#define OUT_HIGH_WATER	(256 * 1024)
+#define OUT_LOW_WATER	(64 * 1024)
+
+/* Queue chunks written per writev. */
+#define OUT_IOV_MAX	64
+
 #if 0
 typedef union epoll_data {
    void        *ptr;
@@ -29,52 +50,294 @@ struct epoll_event {
 };
 #endif
 
-static connection_t *get_connection(int sock)
-{
-	int sockfd = -1;
-	connection_t *con = NULL;
+struct out_chunk {
+	struct list_head list;
+	size_t len;
+	size_t sent;
+	char data[];
+};
 
-	socklen_t sin_len;
-	struct sockaddr_in sin;
+struct epoll_client {
+	connection_t *con;
+	struct list_head out_queue;	/* struct out_chunk, oldest first */
+	size_t out_bytes;		/* queued and not sent yet */
+	uint32_t events;		/* registered with epoll */
+	bool closing;
+};
 
-	/* setup sockaddr structure */
-	sin_len = sizeof(struct sockaddr_in);
-	memset(&sin, 0, sin_len);
+/*
+ * Listener and clients both travel in epoll_data.ptr; the listener is
+ * told apart by this tag, as data.fd would alias the pointer.
+ */
+static int listener_tag;
 
-	/* try to accept a connection */
-	sockfd = sock_accept(sock, (struct sockaddr *)&sin, &sin_len);
-	assert_return(sockfd >= 0);
+static connection_t *get_connection(int sockfd, struct sockaddr_in *sin,
+							socklen_t sin_len)
+{
+	connection_t *con = NULL;
 
 	con = create_connection();
-	assert_return(con);
+	if (!con)
+		return NULL;
 
-	con->sin = (struct sockaddr_in *) xmalloc(sizeof(struct sockaddr_in));
-	assert_return(con->sin);
 	con->type = SOCK_TYPE_TCP;
-    con->connect_time = get_time();
-    con->read_statistics = 0;
+	con->connect_time = get_time();
+	con->read_statistics = 0;
 	con->sock = sockfd;
-	memcpy((void *)con->sin, (void *)&sin, sin_len);
-	con->sinlen = sin_len;
-	con->host = make_host(&(sin.sin_addr));
-	sys_debug(2, "DEBUG: Getting new connection on socket %d from host %s, connect time %s",
-				 sockfd, con->host == NULL ? "(null)" : con->host, get_ctime(&con->connect_time));
+	connection_set_peer(con, sin, sin_len);
 	return con;
 }
 
+static int client_update_events(int epfd, struct epoll_client *client,
+							uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (events == client->events)
+		return 0;
+
+	ev.events = events;
+	ev.data.ptr = client;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, client->con->sock, &ev) != 0)
+		return -1;
+
+	client->events = events;
+	return 0;
+}
+
+static void client_free(int epfd, struct epoll_client *client)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->con->sock, NULL);
+
+	while (!list_empty(&client->out_queue)) {
+		struct out_chunk *chunk;
+
+		chunk = list_first_entry(&client->out_queue, struct out_chunk, list);
+		list_del(&chunk->list);
+		free(chunk);
+	}
+
+	clean_connection(client->con);
+	free(client);
+}
+
+/*
+ * Write out as much of the queue as the socket takes.
+ * Returns 0, or -1 if the connection is broken.
+ */
+static int client_flush(struct epoll_client *client)
+{
+	while (!list_empty(&client->out_queue)) {
+		struct iovec iov[OUT_IOV_MAX];
+		struct out_chunk *chunk;
+		struct list_head *pos;
+		ssize_t nw;
+		int n = 0;
+
+		list_for_each(pos, &client->out_queue) {
+			chunk = list_entry(pos, struct out_chunk, list);
+			iov[n].iov_base = chunk->data + chunk->sent;
+			iov[n].iov_len = chunk->len - chunk->sent;
+			if (++n == OUT_IOV_MAX)
+				break;
+		}
+
+		nw = writev(client->con->sock, iov, n);
+		if (nw < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			sys_debug(1, "ERROR, sent data to TCP client occurs \"%s\"",
+							strerror(errno));
+			return -1;
+		}
+
+		client->out_bytes -= nw;
+
+		/* drop what went out, partially sent chunks stay at the head */
+		while (nw > 0) {
+			size_t left;
+
+			chunk = list_first_entry(&client->out_queue, struct out_chunk, list);
+			left = chunk->len - chunk->sent;
+			if ((size_t) nw < left) {
+				chunk->sent += nw;
+				break;
+			}
+
+			nw -= left;
+			list_del(&chunk->list);
+			free(chunk);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Queue len bytes for the client and try to send them right away.
+ * Returns 0, or -1 if the connection is broken.
+ */
+static int client_send(struct epoll_client *client, const char *buf, size_t len)
+{
+	struct out_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + len);
+	if (!chunk)
+		return -1;
+
+	chunk->len = len;
+	chunk->sent = 0;
+	memcpy(chunk->data, buf, len);
+	list_add_tail(&chunk->list, &client->out_queue);
+	client->out_bytes += len;
+
+	/* nothing was waiting before, the socket is likely writable */
+	if (client->out_bytes == len)
+		return client_flush(client);
+
+	return 0;
+}
+
+static void handle_input(struct epoll_client *client, const char *buf, ssize_t nr)
+{
+	connection_t *con = client->con;
+	char wb[64];
+	int nw;
+
+	con->read_statistics += nr;
+
+	nw = snprintf(wb, sizeof(wb), "data received: %ld\n", con->read_statistics);
+	if (client_send(client, wb, nw) < 0)
+		client->closing = true;
+}
+
+/*
+ * Read until EAGAIN as the socket is edge-triggered, but stop early
+ * once the output queue passes the high-water mark.
+ */
+static void client_read(struct epoll_client *client, char *buff)
+{
+	while (!client->closing && client->out_bytes < OUT_HIGH_WATER) {
+		/**
+		 * length of message in bytes that received,
+		 * 0 if no messages are available and peer has done an orderly shutdown,
+		 * or −1 on error
+		 */
+		ssize_t nr = recv(client->con->sock, buff, BUFSIZE, 0);
+
+		if (nr > 0) {
+			handle_input(client, buff, nr);
+		} else if (nr == 0) {
+			client->closing = true;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno != EINTR) {
+			/* recv() error */
+			sys_debug(1, "recv() errno,, %s", strerror(errno));
+			client->closing = true;
+		}
+	}
+}
+
+/*
+ * EPOLLIN is dropped while the queue is above the high-water mark and
+ * EPOLLOUT is only wanted while something is queued.  Modifying the
+ * registration re-arms the edge, so input left in the socket when
+ * reading paused is reported again once it resumes.
+ */
+static uint32_t client_wanted_events(struct epoll_client *client)
+{
+	uint32_t events = EPOLLET | EPOLLRDHUP;
+
+	if (client->out_bytes)
+		events |= EPOLLOUT;
+
+	if (client->out_bytes < OUT_LOW_WATER ||
+		((client->events & EPOLLIN) && client->out_bytes < OUT_HIGH_WATER))
+		events |= EPOLLIN;
+
+	return events;
+}
+
+static void handle_client(int epfd, struct epoll_client *client,
+						uint32_t events, char *buff)
+{
+	if (events & EPOLLERR)
+		client->closing = true;
+
+	if (!client->closing && (events & EPOLLOUT) && client_flush(client) < 0)
+		client->closing = true;
+
+	if (!client->closing && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+		client_read(client, buff);
+
+	if (client->closing ||
+		client_update_events(epfd, client, client_wanted_events(client)) < 0) {
+		client_free(epfd, client);
+	}
+}
+
+/* The listener is edge-triggered: accept until the backlog is empty. */
+static void handle_accept(int epfd, int listen_sock)
+{
+	for (;;) {
+		struct epoll_client *client;
+		struct epoll_event ev;
+		struct sockaddr_in sin;
+		socklen_t sin_len = sizeof(sin);
+		int sockfd;
+
+		memset(&sin, 0, sin_len);
+		sockfd = sock_accept4(listen_sock, (struct sockaddr *) &sin,
+					&sin_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				/* out of fds: the backlog waits for the next edge */
+				sys_debug(1, "WARNING: accept() failed on socket %d: %s",
+						listen_sock, strerror(errno));
+			break;
+		}
+
+		client = malloc(sizeof(*client));
+		if (client)
+			client->con = get_connection(sockfd, &sin, sin_len);
+		if (!client || !client->con) {
+			free(client);
+			sock_close(sockfd);
+			continue;
+		}
+
+		INIT_LIST_HEAD(&client->out_queue);
+		client->out_bytes = 0;
+		client->closing = false;
+		client->events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+
+		ev.events = client->events;
+		ev.data.ptr = client;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) != 0) {
+			sys_debug(1, "ERROR: epoll_ctl() EPOLL_CTL_ADD error");
+			clean_connection(client->con);
+			free(client);
+		}
+	}
+}
+
 static void *socket_tcp_epoll_thread(void *arg)
 {
-	connection_t *con = NULL;
-	char buff[BUFSIZE] = {0};
-	struct epoll_event ev, events[MAX_EPOLL_FDS];
+	char buff[BUFSIZE];
+	struct epoll_event ev, events[EPOLL_BATCH];
 	int epfd, nready_fds;
-	int ret, i;
-	ssize_t nr;
+	int i;
 	func_enter();
 
 	/* Setup listeners */
 	setup_tcp_listeners();
-	bzero(&events, sizeof(struct epoll_event) * MAX_EPOLL_FDS);
+	if (server_info.tcp_running != SERVER_RUNNING)
+		return NULL;
 
 	/*
 	 * epoll_create() creates an epoll instance. Since Linux 2.6.8, the
@@ -84,8 +347,11 @@ static void *socket_tcp_epoll_thread(void *arg)
      * On error, -1 is returned, and errno is set to indicate the error.
 	 */
 	epfd = epoll_create(MAX_EPOLL_FDS);
-	assert_return(epfd != -1);
-	ev.data.fd = server_info.tcp_listen_sock;
+	if (epfd < 0) {
+		sys_debug(1, "ERROR: epoll_create() failed: %s", strerror(errno));
+		goto stop_listener;
+	}
+	ev.data.ptr = &listener_tag;
 	ev.events = EPOLLIN | EPOLLET;
 	/*
 	 * register epoll events
@@ -93,10 +359,12 @@ static void *socket_tcp_epoll_thread(void *arg)
 	 * On success, returns zero.
 	 * On error, returns -1 and errno is set appropriately.
 	 */
-	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, server_info.tcp_listen_sock, &ev);
-	assert_return(ret == 0);
-	//ret = epoll_ctl(epfd, EPOLL_CTL_DEL, server_info.tcp_listen_sock, &ev);
-	//assert_return(ret == 0);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_info.tcp_listen_sock, &ev) != 0) {
+		sys_debug(1, "ERROR: epoll_ctl() EPOLL_CTL_ADD of the listener failed: %s",
+				strerror(errno));
+		close(epfd);
+		goto stop_listener;
+	}
 
 	while (server_info.tcp_running == SERVER_RUNNING) {
 		/*
@@ -107,115 +375,23 @@ static void *socket_tcp_epoll_thread(void *arg)
 		               or zero if no file descriptor became ready during the requested timeout milliseconds.
 		 * On error, returns -1 and errno is set appropriately.
 		 */
-		nready_fds = epoll_wait(epfd, events, MAX_EPOLL_FDS, 1500);
-		sys_debug(3, "DEBUG: nready_fds %d", nready_fds);
+		nready_fds = epoll_wait(epfd, events, EPOLL_BATCH, 1500);
 		for (i = 0; i < nready_fds; i ++) {
-			if (events[i].data.fd == server_info.tcp_listen_sock) {
-				con = get_connection(server_info.tcp_listen_sock);
-
-				if (con) {
-					//pthread_t ptid;
-					/* handle the new connection it in a new thread */
-					//thread_create(&ptid, handle_connection, (void *) con);
-					sock_set_blocking(con->sock, SOCKET_NONBLOCK);
-					ev.data.ptr = con;
-					/* The default behavior for epoll is Level Triggered
-					 * In this mode we will got 'EPOLLIN' continuously, even when
-					 * the socket closed by the clients
-					 */
-					ev.events = EPOLLIN | EPOLLET;
-					ret = epoll_ctl(epfd, EPOLL_CTL_ADD, con->sock, &ev);
-					if (ret != 0) {
-						sys_debug(1,
-			 				"ERROR: epoll_ctl() EPOLL_CTL_ADD error");
-						clean_connection(con);
-						ev.data.ptr = NULL;
-						con = NULL;
-					}
-				}
-			} else if (events[i].events & EPOLLIN) {
-				printf("epoll IN event\n");
-				if (events[i].data.fd <= 0)
-					continue;
-				if (events[i].data.ptr) {
-					con = (connection_t *) events[i].data.ptr;
-					/**
-					 * length of message in bytes that received,
-					 * 0 if no messages are available and peer has done an orderly shutdown,
-					 * or −1 on error
-					 */
-					nr = recv(con->sock, buff, BUFSIZE, 0);
-					if (nr > 0) {
-		                con->read_statistics += nr;
-						for (i = 0; i < nr; i ++) {
-							printf("%c", buff[i]);
-						}
-						memset(buff, 0, BUFSIZE);
-						printf("\n");
-						char wb[BUFSIZE] = {0};
-						int nw = snprintf(wb, BUFSIZE, "data received: %ld\n", con->read_statistics);
-		                if (sock_write_bytes(con->sock, wb, nw) < 0) {
-							sys_debug(1, "ERROR, sent data to TCP client occurs \"%s\"", strerror(errno));
-						}
-		                printf("-------------------------\n"
-		                       "data received: %ld\n"
-		                       "-------------------------\n\n", con->read_statistics);
-					} else if (nr == 0) {
-						//con->running = CLIENT_DYING;
-						sys_debug(1, "peer has done an orderly shutdown");
-						/* recycle */
-						clean_connection(con);
-						events[i].data.ptr = NULL;
-						con = NULL;
-					} else {
-						/* recv() error */
-						if (EAGAIN == errno) {
-							sys_debug(1, "recv() got EAGAIN");
-						} else {
-							//con->running = CLIENT_DYING;
-							sys_debug(1, "recv() errno,, %s", strerror(errno));
-							/* recycle */
-							clean_connection(con);
-							events[i].data.ptr = NULL;
-							con = NULL;
-						}
-					}
-				}
-
-				if (con != NULL) {
-					#if 0
-					ev.data.fd = con->sock;
-					/* register send event */
-					ev.events = EPOLLOUT | EPOLLET;
-					ret = epoll_ctl(epfd, EPOLL_CTL_MOD, con->sock, &ev);
-					if (ret != 0) {
-						sys_debug(1,
-			 				"ERROR: epoll_ctl() EPOLL_CTL_ADD error");
-						clean_connection(con);
-						ev.data.ptr = NULL;
-						con = NULL;
-					}
-					#endif
-				}
-			} else if (events[i].events & EPOLLOUT) {
-				printf("epoll OUT event\n");
-				#if 0
-				int sockfd = events[i].data.fd;
-				write(sockfd, "ssssss", strlen("ssssss"));
-				ev.data.fd = sockfd;
-				ev.data.ptr = events[i].data.ptr;
-				ev.events = EPOLLIN | EPOLLET;
-				/* register recv event */
-				epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &ev);
-				#endif
-			}
+			if (events[i].data.ptr == &listener_tag)
+				handle_accept(epfd, server_info.tcp_listen_sock);
+			else
+				handle_client(epfd, events[i].data.ptr,
+						events[i].events, buff);
 		}
 	}
 
-	if (con) {
-		clean_connection(con);
-		con = NULL;
-	}
+	close(epfd);
+	return NULL;
+
+stop_listener:
+	/* nothing would ever accept on it */
+	sock_close(server_info.tcp_listen_sock);
+	server_info.tcp_running = SERVER_DYING;
 	return NULL;
 }
 
@@ -234,4 +410,3 @@ void socket_tcp_server_epoll_test_entry()
 
 	func_exit();
 }
-
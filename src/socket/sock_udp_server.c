@@ -1,7 +1,12 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -12,6 +17,21 @@
 #include <delay.h>
 #include <log_util.h>
 
+/*
+ * Batched mode: datagrams are received with recvmmsg() and echoed with
+ * sendmmsg(), UDP_BATCH at a time, into buffers set up once per worker.
+ */
+#define UDP_BATCH	64
+#define UDP_MAX_WORKERS	64
+
+struct udp_worker {
+	int sock;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_in addrs[UDP_BATCH];
+	char bufs[UDP_BATCH][BUFSIZE];
+};
+
 static void setup_udp_listeners()
 {
 	server_info.udp_listen_sock = sock_get_server_socket(SOCK_TYPE_UDP, server_info.udp_port);
@@ -65,7 +85,7 @@ static void handle_udp_connection(int sock)
 	if (ret >= 0) {
 		char *client = make_host(&(sin.sin_addr));
 		sys_debug(2, "DEBUG: recv data from client %s", client == NULL ? "unknown client" : client);
-		sock_sendto(sock, buf, strlen(buf), 0, (struct sockaddr *) &sin, sin_len);
+		sock_sendto(sock, buf, ret, 0, (struct sockaddr *) &sin, sin_len);
 
 		memset(buf, 0, BUFSIZE);
 		if (client) {
@@ -96,6 +116,132 @@ static void *socket_udp_server_thread(void *arg)
 	return NULL;
 }
 
+static void udp_worker_reset(struct udp_worker *w)
+{
+	int i;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		w->iovs[i].iov_base = w->bufs[i];
+		w->iovs[i].iov_len = BUFSIZE;
+		w->msgs[i].msg_hdr.msg_name = &w->addrs[i];
+		w->msgs[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+		w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+		w->msgs[i].msg_hdr.msg_iovlen = 1;
+		w->msgs[i].msg_hdr.msg_control = NULL;
+		w->msgs[i].msg_hdr.msg_controllen = 0;
+		w->msgs[i].msg_hdr.msg_flags = 0;
+	}
+}
+
+/*
+ * Receive what is queued, UDP_BATCH datagrams per syscall, and echo each
+ * batch back with one sendmmsg() reusing the same headers.
+ * Returns when the socket is drained.
+ */
+static void udp_worker_drain(struct udp_worker *w)
+{
+	for (;;) {
+		int i, n;
+
+		n = recvmmsg(w->sock, w->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && !is_recoverable(errno))
+				sys_debug(1, "WARNING: recvmmsg() failed on socket %d: %s",
+						w->sock, strerror(errno));
+			return;
+		}
+
+		/* the reply is the datagram itself, to the address it came from */
+		for (i = 0; i < n; i++)
+			w->iovs[i].iov_len = w->msgs[i].msg_len;
+
+		sock_sendmmsg(w->sock, w->msgs, n, 0);
+
+		for (i = 0; i < n; i++) {
+			w->iovs[i].iov_len = BUFSIZE;
+			w->msgs[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+		}
+
+		if (n < UDP_BATCH)
+			return;
+	}
+}
+
+static void *socket_udp_batch_thread(void *arg)
+{
+	struct udp_worker *w = (struct udp_worker *) arg;
+	struct pollfd pfd;
+
+	udp_worker_reset(w);
+	pfd.fd = w->sock;
+	pfd.events = POLLIN;
+
+	while (server_info.udp_running == SERVER_RUNNING) {
+		/* bounded wait so the worker notices the server stopping */
+		if (poll(&pfd, 1, 100) > 0)
+			udp_worker_drain(w);
+	}
+
+	sock_close(w->sock);
+	free(w);
+	return NULL;
+}
+
+/*
+ * Start the batched UDP server on server_info.udp_port.  One worker
+ * serves the listening socket; with more, each worker binds its own
+ * SO_REUSEPORT socket and the kernel spreads the clients across them.
+ * The sockets are set up before this returns.
+ */
+void socket_udp_server_batch_entry(int workers)
+{
+	struct udp_worker *w;
+	pthread_t tid;
+	int i;
+
+	func_enter();
+	if (workers < 1)
+		workers = 1;
+	else if (workers > UDP_MAX_WORKERS)
+		workers = UDP_MAX_WORKERS;
+
+	server_info.udp_running = SERVER_RUNNING;
+	for (i = 0; i < workers; i++) {
+		w = (struct udp_worker *) malloc(sizeof(*w));
+		if (!w)
+			break;
+
+		if (workers == 1)
+			w->sock = sock_get_server_socket(SOCK_TYPE_UDP, server_info.udp_port);
+		else
+			w->sock = sock_get_reuseport_socket(SOCK_TYPE_UDP, server_info.udp_port);
+		if (w->sock == INVALID_SOCKET) {
+			free(w);
+			break;
+		}
+
+		if (i == 0)
+			server_info.udp_listen_sock = w->sock;
+
+		if (thread_create(&tid, socket_udp_batch_thread, w)) {
+			sock_close(w->sock);
+			free(w);
+			break;
+		}
+	}
+
+	if (i == 0) {
+		printf("start UDP batch server failed!\n");
+		server_info.udp_running = SERVER_DYING;
+	} else if (i < workers) {
+		sys_debug(1, "WARNING: UDP batch server runs %d of %d workers", i, workers);
+	}
+
+	func_exit();
+}
+
 void socket_udp_server_test_entry()
 {
 	func_enter();
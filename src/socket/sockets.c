@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -8,9 +12,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <sys/time.h>
 #include <netdb.h>
 #include <sys/ioctl.h>
@@ -21,6 +30,7 @@
 #include <utils.h>
 #include <log_util.h>
 
+server_info_t server_info;
 
 int sock_valid(const int sockfd)
 {
@@ -193,6 +203,28 @@ int sock_accept(int s, struct sockaddr *addr, socketlen_t *addrlen)
 	return rs;
 }
 
+/*
+ * accept4() wrapper: flags may carry SOCK_NONBLOCK and SOCK_CLOEXEC,
+ * saving the fcntl calls per connection.  Unlike sock_accept() it stays
+ * quiet, it runs once per connection in accept loops.
+ */
+int sock_accept4(int s, struct sockaddr *addr, socketlen_t *addrlen, int flags)
+{
+	int rs = accept4(s, addr, addrlen, flags);
+
+	if (sock_valid(rs)) {
+		/*
+		 * Turn on KEEPALIVE to detect crashed hosts 
+		 */
+		sock_set_keepalive(rs, 1);
+#ifdef SO_LINGER
+		sock_set_no_linger(rs);
+#endif
+	}
+
+	return rs;
+}
+
 #if 0
 /* 
  * Write len bytes from buff to the client. Kick him on network errors.
@@ -243,6 +275,22 @@ sock_write_bytes_or_kick(int sockfd, connection_t * clicon,
 }
 #endif
 
+/*
+ * A non-blocking socket whose send buffer is full: wait until it takes
+ * more instead of retrying the send in a busy loop.
+ */
+static int sock_wait_writable(int sockfd)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -1 : 0;
+}
+
 /*
  * Write len bytes from buf to the socket.
  * Returns the return value from send()
@@ -263,9 +311,11 @@ int sock_write_bytes(int sockfd, const char *buff, int len)
 	}
 
 	for(t = 0 ; len > 0 ; ) {
-		int n = send(sockfd, buff + t, len, 0);
+		int n = send(sockfd, buff + t, len, MSG_NOSIGNAL);
 		if (n < 0) {
-			if (is_recoverable(errno))
+			if (errno == EINTR)
+				continue;
+			if (is_recoverable(errno) && sock_wait_writable(sockfd) == 0)
 				continue;
 			error("socket send() error: %s", strerror(errno));
 		    return -1;
@@ -277,58 +327,407 @@ int sock_write_bytes(int sockfd, const char *buff, int len)
 	return t;
 }
 
-/**
- * @timeout in mili-seconed
+/*
+ * Gather-write all iovcnt buffers to the socket with as few sendmsg()
+ * calls as it takes, so a header and a body need not be copied into one
+ * buffer first.  A short write resumes where it stopped; iov is updated
+ * in place for that.  Returns the number of bytes written, or -1 with
+ * errno set if the connection broke.
  */
-int sock_read_loop(int sockfd, socket_read_callback read_callback, int timeout)
+ssize_t sock_writev_bytes(int sockfd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t t = 0;
+
+	if (!iov || iovcnt < 0) {
+		error("sock_writev_bytes() called with no buffers");
+		return -1;
+	} else if (!sock_valid(sockfd)) {
+		error("sock_writev_bytes() called with invalid socket");
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+
+	while (iovcnt > 0) {
+		ssize_t n;
+
+		/* skip what is sent already, and empty buffers */
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+		n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (is_recoverable(errno) && sock_wait_writable(sockfd) == 0)
+				continue;
+			warning("socket sendmsg() error: %s", strerror(errno));
+			return -1;
+		}
+
+		t += n;
+		while (n > 0) {
+			if ((size_t) n < iov->iov_len) {
+				iov->iov_base = (char *) iov->iov_base + n;
+				iov->iov_len -= n;
+				break;
+			}
+			n -= iov->iov_len;
+			iov->iov_len = 0;
+			iov++;
+			iovcnt--;
+		}
+	}
+
+	return t;
+}
+
+/*
+ * Send count bytes of the file filefd, starting at *offset, without
+ * copying them through user space.  *offset is advanced past what was
+ * sent; with a NULL offset the file position is used and advanced.
+ * Returns the number of bytes sent, which is short only at the end of
+ * the file, or -1 with errno set.
+ */
+ssize_t sock_sendfile(int sockfd, int filefd, off_t *offset, size_t count)
+{
+	ssize_t t = 0;
+
+	if (filefd < 0) {
+		error("sock_sendfile() called with invalid file");
+		return -1;
+	} else if (!sock_valid(sockfd)) {
+		error("sock_sendfile() called with invalid socket");
+		return -1;
+	}
+
+	while (count > 0) {
+		ssize_t n = sendfile(sockfd, filefd, offset, count);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (is_recoverable(errno) && sock_wait_writable(sockfd) == 0)
+				continue;
+			warning("socket sendfile() error: %s", strerror(errno));
+			return (t == 0) ? -1 : t;
+		}
+
+		/* end of file */
+		if (n == 0)
+			break;
+
+		t += n;
+		count -= n;
+	}
+
+	return t;
+}
+
+/*
+ * MSG_ZEROCOPY: the kernel sends straight from the caller's pages and
+ * reports on the socket error queue when it is done with them.  Each
+ * successful send is numbered, starting at 0, and a notification covers
+ * a range of those numbers; a buffer may only be reused once the send
+ * it went out with is covered.  Worth it for large writes only, the
+ * page pinning and the notification cost more than copying a few KB.
+ */
+int sock_zerocopy_init(int sockfd, sock_zerocopy_t *zc)
+{
+	memset(zc, 0, sizeof(*zc));
+
+#ifdef SO_ZEROCOPY
+	{
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+			zc->enabled = 1;
+			return 0;
+		}
+	}
+#endif
+
+	debug("MSG_ZEROCOPY not available on socket %d, copying", sockfd);
+	return -1;
+}
+
+/*
+ * Write len bytes like sock_write_bytes(), with MSG_ZEROCOPY if the
+ * socket supports it.  buf must stay untouched until
+ * sock_zerocopy_reap() reports all sends complete.
+ */
+ssize_t sock_send_zerocopy(int sockfd, const void *buf, size_t len,
+							sock_zerocopy_t *zc)
+{
+	int flags = MSG_NOSIGNAL;
+	size_t t = 0;
+
+	if (!buf || !zc) {
+		error("sock_send_zerocopy() called with NULL data");
+		return -1;
+	} else if (!sock_valid(sockfd)) {
+		error("sock_send_zerocopy() called with invalid socket");
+		return -1;
+	}
+
+#ifdef MSG_ZEROCOPY
+	if (zc->enabled)
+		flags |= MSG_ZEROCOPY;
+#endif
+
+	while (t < len) {
+		ssize_t n = send(sockfd, (const char *) buf + t, len - t, flags);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* ENOBUFS: too many pages pinned, let completions in */
+			if (errno == ENOBUFS && zc->enabled &&
+					sock_zerocopy_reap(sockfd, zc, 1) >= 0)
+				continue;
+			if (is_recoverable(errno) && sock_wait_writable(sockfd) == 0)
+				continue;
+			warning("socket send() error: %s", strerror(errno));
+			return (t == 0) ? -1 : (ssize_t) t;
+		}
+
+		if (zc->enabled)
+			zc->sent++;
+		t += n;
+	}
+
+	return t;
+}
+
+/*
+ * Collect the completion notifications queued on the socket, waiting
+ * for more while wait is set and sends are outstanding.  Returns the
+ * number of sends whose buffers are still in use, 0 meaning all of them
+ * may be reused, or -1 on error.
+ */
+int sock_zerocopy_reap(int sockfd, sock_zerocopy_t *zc, int wait)
 {
-	fd_set rfds;
-	struct timeval tv;
-	int ret, nr;
-	char buf[BUFSIZE] = {0};
-
-	bzero(&tv, sizeof(tv));
-	FD_ZERO(&rfds);
-	FD_SET(sockfd, &rfds);
-
-	tv.tv_sec = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
-	ret = select(sockfd + 1, &rfds, NULL, NULL, &tv);
-	if (ret > 0) {
-		if (FD_ISSET(sockfd, &rfds)) {
-			/**
-			 * length of message in bytes that received,
-			 * 0 if no messages are available and peer has done an orderly shutdown,
-			 * or −1 on error
-			 */
-			memset(buf, 0, sizeof(buf));
-			nr = recv(sockfd, buf, BUFSIZE, 0);
-			if (nr > 0) {
-				if (read_callback)
-					(*read_callback)(buf, nr);
-			} else if (0 == nr) {
-				/**
-				 * The return value will be 0 when the peer has performed an
-       			 * orderly shutdown.
-       			 */
-				debug("peer has done an orderly shutdown");
+	while (zc->completed != zc->sent) {
+		char control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			struct pollfd pfd = { .fd = sockfd, .events = 0 };
+
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
 				return -1;
-			} else {
-				/* recv() error */
-				if (is_recoverable(errno)) {
-					warning("recv() got %s", strerror(errno));
-				} else {
-					error("recv() errno, %s", strerror(errno));
-					return -1;
-				}
+			if (!wait)
+				break;
+			/* the error queue is signalled by POLLERR */
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr;
+
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+					serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ee_info..ee_data is the range of sends completed */
+			zc->completed = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+
+	return (int) (zc->sent - zc->completed);
+}
+
+/*
+ * Read once from a socket poll() found readable.  Returns the recv()
+ * result with errno set; a recoverable error (a spurious wakeup of a
+ * non-blocking socket) counts as no data, not as a failure.
+ */
+static ssize_t sock_recv_ready(int sockfd, void *buf, size_t size)
+{
+	ssize_t nr;
+
+	do {
+		/**
+		 * length of message in bytes that received,
+		 * 0 if no messages are available and peer has done an orderly shutdown,
+		 * or −1 on error
+		 */
+		nr = recv(sockfd, buf, size, 0);
+	} while (nr < 0 && errno == EINTR);
+
+	if (nr < 0 && is_recoverable(errno)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return nr;
+}
+
+/*
+ * Wait up to timeout milliseconds (-1: forever) for sockfd to become
+ * readable and hand what one recv() got to read_callback.  buf is the
+ * caller's and is reused as it is, the data is not NUL-terminated.
+ * Returns 0 after a read or a timeout, -1 once the peer closed the
+ * connection or it failed.  Unlike select() any fd number works.
+ */
+int sock_read_poll(int sockfd, void *buf, size_t size,
+				socket_read_callback read_callback, int timeout)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	ssize_t nr;
+	int ret;
+
+	if (!buf || size == 0) {
+		error("sock_read_poll() called with no buffer");
+		return -1;
+	}
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret == 0)
+		return 0;
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		warning("poll() complains: %s", strerror(errno));
+		return -1;
+	}
+
+	nr = sock_recv_ready(sockfd, buf, size);
+	if (nr > 0) {
+		if (read_callback)
+			(*read_callback)(buf, nr);
+	} else if (nr == 0) {
+		/**
+		 * The return value will be 0 when the peer has performed an
+		 * orderly shutdown.
+		 */
+		debug("peer has done an orderly shutdown");
+		return -1;
+	} else if (errno != EAGAIN) {
+		warning("recv() errno, %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * sock_read_poll() for a set of sockets: one poll() over all of pfds,
+ * then one recv() into buf for each readable socket.  The callback gets
+ * the data, or len 0 at end of stream and -errno on failure; after those
+ * the entry's fd is set to -1, which poll() skips, so the caller can
+ * keep passing the same array.  Returns the number of sockets serviced,
+ * 0 on timeout, or -1 if poll() failed.
+ */
+int sock_read_fds(struct pollfd *pfds, int nfds, void *buf, size_t size,
+			socket_fds_read_callback read_callback, void *user_data,
+			int timeout)
+{
+	int i, ret, serviced = 0;
+
+	if (!pfds || !buf || size == 0 || !read_callback) {
+		error("sock_read_fds() called with invalid arguments");
+		return -1;
+	}
+
+	for (i = 0; i < nfds; i++)
+		pfds[i].events = POLLIN;
+
+	ret = poll(pfds, nfds, timeout);
+	if (ret <= 0) {
+		if (ret < 0 && errno == EINTR)
+			return 0;
+		return ret;
+	}
+
+	for (i = 0; i < nfds && serviced < ret; i++) {
+		int fd = pfds[i].fd;
+		ssize_t nr;
+
+		if (fd < 0 || !pfds[i].revents)
+			continue;
+
+		serviced++;
+
+		if (pfds[i].revents & POLLNVAL) {
+			nr = -EBADF;
+		} else {
+			nr = sock_recv_ready(fd, buf, size);
+			if (nr < 0) {
+				if (errno == EAGAIN)
+					continue;
+				nr = -errno;
 			}
 		}
-	} else if (ret == 0) {
-		/* time expires, send data */
-		// debug("no data in %d mili-seconds", timeout);
-	} else {
-		/* error occurs*/
-		error("select() complains: %s", strerror(errno));
+
+		read_callback(fd, nr > 0 ? buf : NULL, nr, user_data);
+
+		if (nr <= 0)
+			pfds[i].fd = -1;
+	}
+
+	return serviced;
+}
+
+/**
+ * @timeout in mili-seconed
+ *
+ * The callback gets text terminated after the data, as it has always
+ * done; terminating costs one byte, not clearing the whole buffer.
+ * Returns 0 after a read or a timeout, -1 once the peer closed the
+ * connection, or recv() or poll() failed.
+ */
+int sock_read_loop(int sockfd, socket_read_callback read_callback, int timeout)
+{
+	char buf[BUFSIZE];
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	ssize_t nr;
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret == 0)
+		return 0;
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		warning("poll() complains: %s", strerror(errno));
+		return -1;
+	}
+
+	nr = sock_recv_ready(sockfd, buf, BUFSIZE - 1);
+	if (nr > 0) {
+		buf[nr] = '\0';
+		if (read_callback)
+			(*read_callback)(buf, nr);
+	} else if (nr == 0) {
+		debug("peer has done an orderly shutdown");
+		return -1;
+	} else if (errno != EAGAIN) {
+		warning("recv() errno, %s", strerror(errno));
+		return -1;
 	}
 
 	return 0;
@@ -376,12 +775,62 @@ int sock_sendto(int sockfd, const void *buff, size_t len, int flags,
 	return t;
 }
 
+/*
+ * Send a batch of datagrams with as few sendmmsg() calls as the socket
+ * allows.  A blocking socket sends them all unless an error occurs.
+ * Returns the number of messages sent, or -1 if not even the first one
+ * went out.
+ */
+int sock_sendmmsg(int sockfd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+	unsigned int t;
+
+	if (!msgs) {
+		error("sock_sendmmsg() called with NULL messages");
+		return -1;
+	} else if (!sock_valid(sockfd)) {
+		error("sock_sendmmsg() called with invalid socket");
+		return -1;
+	}
+
+	for (t = 0; t < vlen; ) {
+		int n = sendmmsg(sockfd, msgs + t, vlen - t, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!is_recoverable(errno))
+				warning("socket sendmmsg() error: %s", strerror(errno));
+			return (t == 0) ? n : (int) t;
+		}
+		t += n;
+	}
+
+	return t;
+}
+
+static int sock_get_server_socket_opt(int type, const int port, int reuseport);
+
 /*
  * Create a socket for all incoming requests on specified port.
  * Bind it to INADDR_ANY (all available interfaces).
  * Return the socket for bound socket, or INVALID_SOCKET if failed.
  */
 int sock_get_server_socket(int type, const int port)
+{
+	return sock_get_server_socket_opt(type, port, 0);
+}
+
+/*
+ * Like sock_get_server_socket() but with SO_REUSEPORT set, so that
+ * several sockets, typically one per worker thread, bind the same port
+ * and the kernel spreads the incoming traffic across them.
+ */
+int sock_get_reuseport_socket(int type, const int port)
+{
+	return sock_get_server_socket_opt(type, port, 1);
+}
+
+static int sock_get_server_socket_opt(int type, const int port, int reuseport)
 {
 	struct sockaddr_in sin;
 	int sin_len, error;
@@ -426,6 +875,17 @@ int sock_get_server_socket(int type, const int port)
 			sys_debug(1, "ERROR: setsockopt() failed to set SO_BROADCAST flag.");
 		}
 	}
+#endif
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		int val = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				(const void *) &val, sizeof (val)) != 0) {
+			sys_debug(1, "ERROR: setsockopt() failed to set SO_REUSEPORT flag.");
+			sock_close(sockfd);
+			return INVALID_SOCKET;
+		}
+	}
 #endif
 	/*
 	 * setup sockaddr structure 
@@ -455,6 +915,9 @@ int sock_get_server_socket(int type, const int port)
  * @srvip Specific the server IP and specified port
  * @port server listen port with
  * @timeout in miliseconds for connect() method
+ *
+ * Blocks, and tries the one IPv4 address given.  Event loop clients
+ * connecting to many hosts use happy_connect_start() in src/epoll.
  */
 int sock_connect(const char *srvip, const int port,
 			const int timeout)
@@ -516,19 +979,12 @@ int sock_connect(const char *srvip, const int port,
 	             * case lwp sig handler redirects any process signals to
 	             * this thread.
 	             */
-				fd_set wr, ex;
-                struct timeval t;
-
-                t.tv_sec = timeout / 1000;
-                t.tv_usec = (timeout % 1000) * 1000;
-
-                FD_ZERO(&wr);
-                FD_SET(sockfd, &wr);
-                FD_ZERO(&ex);
-                FD_SET(sockfd, &ex);
+				struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
 
-				ret = select(sockfd+1, 0, &wr, &ex, &t);
-				errno_backup = errno;
+				do {
+					ret = poll(&pfd, 1, timeout);
+				} while (ret < 0 && errno == EINTR);
+				errno_backup = ret == 0 ? ETIMEDOUT : errno;
 				if (ret <= 0) {
 					error("#3 connect() failed: %s", strerror(errno_backup));
 					break;
@@ -1,10 +1,33 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <pthread.h>
 #include <time.h>
+#include <linux/futex.h>
 
 #include <mutex.h>
+#include <rwlock_util.h>
+
+#define MUTEX_SPIN_MAX  100     /* rounds before sleeping at most */
+
+/* tell the CPU this is a spin loop */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define mutex_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define mutex_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
 
 /**
  * @mutex the mutex to be initialized,
@@ -32,3 +55,142 @@ void mutex_destroy(mutex_t *mutex)
     pthread_mutex_destroy(mutex);
 }
 
+
+static void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Spinning only pays when the holder runs on another CPU. */
+static int mutex_spin_max(void)
+{
+    static int cpus;
+    int n = mutex_load(&cpus);
+
+    if (!n) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1)
+            n = 1;
+        mutex_store(&cpus, n);
+    }
+
+    return n > 1 ? MUTEX_SPIN_MAX : 0;
+}
+
+void adaptive_mutex_init(adaptive_mutex_t *mutex)
+{
+    mutex->state = 0;
+    mutex->spins = 0;
+}
+
+/**
+ * The mutex is held: spin up to twice what it took lately, within
+ * MUTEX_SPIN_MAX, then mark it waited for and sleep until woken.
+ */
+void adaptive_mutex_lock_slow(adaptive_mutex_t *mutex)
+{
+    int spins = mutex_load(&mutex->spins);
+    int limit = spins * 2 + 10;
+    int n, c;
+
+    if (limit > mutex_spin_max())
+        limit = mutex_spin_max();
+
+    for (n = 0; n < limit; n++) {
+        cpu_relax();
+        c = 0;
+        if (!mutex_load(&mutex->state) &&
+            __atomic_compare_exchange_n(&mutex->state, &c, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            mutex_store(&mutex->spins, spins + (n - spins) / 8);
+            return;
+        }
+    }
+    if (limit)
+        mutex_store(&mutex->spins, spins + (limit - spins) / 8);
+
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE))
+        futex_wait(&mutex->state, 2);
+}
+
+/* Someone may sleep on the mutex, it was 2 */
+void adaptive_mutex_unlock_slow(adaptive_mutex_t *mutex)
+{
+    __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+    futex_wake(&mutex->state, 1);
+}
+
+void percpu_rwlock_init(percpu_rwlock_t *rwlock)
+{
+    int i;
+
+    for (i = 0; i < PERCPU_RWLOCK_SLOTS; i++)
+        rwlock->slot[i].readers = 0;
+    rwlock->writer = 0;
+    rwlock->waiting = 0;
+    adaptive_mutex_init(&rwlock->wlock);
+}
+
+int percpu_rwlock_rdlock(percpu_rwlock_t *rwlock)
+{
+    int slot;
+
+    for (;;) {
+        slot = sched_getcpu();
+        slot = (slot < 0 ? 0 : slot) & (PERCPU_RWLOCK_SLOTS - 1);
+
+        /* count first, then look: a writer setting writer does the reverse */
+        __atomic_add_fetch(&rwlock->slot[slot].readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&rwlock->writer, __ATOMIC_SEQ_CST))
+            return slot;
+
+        /* back off and wait the writer out */
+        percpu_rwlock_rdunlock(rwlock, slot);
+        __atomic_add_fetch(&rwlock->waiting, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&rwlock->writer, __ATOMIC_SEQ_CST))
+            futex_wait(&rwlock->writer, 1);
+        __atomic_sub_fetch(&rwlock->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void percpu_rwlock_rdunlock(percpu_rwlock_t *rwlock, int slot)
+{
+    int *readers = &rwlock->slot[slot].readers;
+
+    if (!__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&rwlock->writer, __ATOMIC_SEQ_CST))
+        futex_wake(readers, 1);
+}
+
+void percpu_rwlock_wrlock(percpu_rwlock_t *rwlock)
+{
+    int i, n, r;
+
+    adaptive_mutex_lock(&rwlock->wlock);
+    __atomic_store_n(&rwlock->writer, 1, __ATOMIC_SEQ_CST);
+
+    /* readers in their sections drain, the ones coming in back off */
+    for (i = 0; i < PERCPU_RWLOCK_SLOTS; i++) {
+        int *readers = &rwlock->slot[i].readers;
+
+        for (n = 0; (r = __atomic_load_n(readers, __ATOMIC_SEQ_CST)); n++) {
+            if (n < mutex_spin_max())
+                cpu_relax();
+            else
+                futex_wait(readers, r);
+        }
+    }
+}
+
+void percpu_rwlock_wrunlock(percpu_rwlock_t *rwlock)
+{
+    __atomic_store_n(&rwlock->writer, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rwlock->waiting, __ATOMIC_SEQ_CST))
+        futex_wake(&rwlock->writer, INT_MAX);
+    adaptive_mutex_unlock(&rwlock->wlock);
+}
@@ -0,0 +1,575 @@
+/*
+ * Thread pool with work stealing
+ *
+ * A fixed set of workers, each with a Chase-Lev deque of its own: the
+ * worker pushes and pops tasks at the bottom without a lock, idle
+ * workers steal from the top of the others'.  Tasks submitted by a task
+ * go onto its worker's deque, so a task fanning out work keeps it local
+ * until someone is idle; tasks submitted from outside the pool go
+ * through a shared injection queue.  Workers with nothing to do spin a
+ * little, then sleep until something is queued.
+ *
+ * A task reports back through a callback on the worker, or a future
+ * the submitter waits on.  A worker waiting on a future runs other
+ * tasks meanwhile, so tasks may wait for the tasks they submitted.
+ *
+ * thread_pool_destroy() is graceful: it waits for everything queued,
+ * including what tasks submit while it waits, then joins the workers.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <thread_pool.h>
+
+#define POOL_DEQUE_SIZE		256	/* first slots per worker, a power of 2 */
+#define POOL_SPIN		64	/* rounds without work before sleeping */
+#define POOL_CACHELINE_SIZE	64
+
+/* steal() lost a race, the deque may still have tasks */
+#define POOL_RETRY		((struct pool_task *) -1)
+
+struct pool_task {
+	thread_task_func func;
+	void *arg;
+	thread_done_func done;
+	void *user_data;
+	struct pool_task *next;		/* in the injection queue */
+};
+
+struct pool_array {
+	long size;
+	struct pool_array *retired;	/* the one it replaced */
+	struct pool_task *slots[];
+};
+
+/*
+ * Chase-Lev deque, as in "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le et al., 2013).  Arrays replaced when it grows are
+ * kept until the pool goes, a thief may still be reading one.
+ */
+struct pool_deque {
+	long top __attribute__((aligned(POOL_CACHELINE_SIZE)));
+	long bottom __attribute__((aligned(POOL_CACHELINE_SIZE)));
+	struct pool_array *array;
+};
+
+struct pool_worker {
+	struct pool_deque deque;
+	thread_pool_t *pool;
+	pthread_t thread;
+	unsigned int seed;		/* where stealing starts */
+} __attribute__((aligned(POOL_CACHELINE_SIZE)));
+
+struct thread_pool {
+	struct pool_worker *workers;
+	int count;
+
+	/* tasks from outside the pool */
+	pthread_mutex_t inject_lock;
+	struct pool_task *inject_head;
+	struct pool_task *inject_tail;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	long queued;			/* not taken by a worker yet */
+	long active;			/* not finished yet */
+	int sleeping;
+	int stopping;
+};
+
+struct thread_future {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	thread_pool_t *pool;
+	void *result;
+	int ready;
+};
+
+static __thread struct pool_worker *pool_self;
+
+#define pool_load(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define pool_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define pool_inc(p)		__atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define pool_dec(p)		__atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define pool_cas(p, old, v)	__atomic_compare_exchange_n((p), (old), (v), 0, \
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+#define pool_slot(a, i)		((a)->slots + ((i) & ((a)->size - 1)))
+
+static struct pool_array *pool_array_new(long size)
+{
+	struct pool_array *a;
+
+	a = malloc(sizeof(*a) + size * sizeof(a->slots[0]));
+	if (!a)
+		return NULL;
+
+	a->size = size;
+	a->retired = NULL;
+	return a;
+}
+
+/* Owner only.  Returns -1 if the deque is full and cannot grow. */
+static int deque_push(struct pool_deque *d, struct pool_task *task)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct pool_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+	if (b - t > a->size - 1) {
+		struct pool_array *grown = pool_array_new(a->size * 2);
+		long i;
+
+		if (!grown)
+			return -1;
+
+		for (i = t; i < b; i++)
+			__atomic_store_n(pool_slot(grown, i), __atomic_load_n(
+				pool_slot(a, i), __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		grown->retired = a;
+		__atomic_store_n(&d->array, grown, __ATOMIC_RELEASE);
+		a = grown;
+	}
+
+	__atomic_store_n(pool_slot(a, b), task, __ATOMIC_RELAXED);
+	/* publishes the slot and the task to thieves */
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Owner only, takes the task pushed last. */
+static struct pool_task *deque_pop(struct pool_deque *d)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	struct pool_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+	struct pool_task *task = NULL;
+	long t;
+
+	/* claim the slot before looking at what thieves took */
+	pool_store(&d->bottom, b);
+	t = pool_load(&d->top);
+
+	if (t <= b) {
+		task = __atomic_load_n(pool_slot(a, b), __ATOMIC_RELAXED);
+		if (t == b) {
+			/* the last one, a thief may be taking it too */
+			if (!pool_cas(&d->top, &t, t + 1))
+				task = NULL;
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return task;
+}
+
+/* Anyone, takes the task pushed first.  NULL if empty, or POOL_RETRY. */
+static struct pool_task *deque_steal(struct pool_deque *d)
+{
+	long t = pool_load(&d->top);
+	long b = pool_load(&d->bottom);
+	struct pool_array *a;
+	struct pool_task *task;
+
+	if (t >= b)
+		return NULL;
+
+	a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+	task = __atomic_load_n(pool_slot(a, t), __ATOMIC_RELAXED);
+	if (!pool_cas(&d->top, &t, t + 1))
+		return POOL_RETRY;
+
+	return task;
+}
+
+static void pool_wake(thread_pool_t *pool)
+{
+	/* pairs with the sleeping count going up before queued is read */
+	if (pool_load(&pool->sleeping)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wakeup);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void pool_task_finished(thread_pool_t *pool)
+{
+	if (pool_dec(&pool->active) == 0 && pool_load(&pool->stopping)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wakeup);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static struct pool_task *pool_take_injected(thread_pool_t *pool)
+{
+	struct pool_task *task;
+
+	if (!__atomic_load_n(&pool->inject_head, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&pool->inject_lock);
+	task = pool->inject_head;
+	if (task) {
+		__atomic_store_n(&pool->inject_head, task->next, __ATOMIC_RELAXED);
+		if (!task->next)
+			pool->inject_tail = NULL;
+	}
+	pthread_mutex_unlock(&pool->inject_lock);
+
+	return task;
+}
+
+/* Own deque first, then the injection queue, then the other workers. */
+static struct pool_task *pool_find(struct pool_worker *self)
+{
+	thread_pool_t *pool = self->pool;
+	struct pool_task *task;
+	int i, start;
+
+	task = deque_pop(&self->deque);
+	if (task)
+		return task;
+
+	task = pool_take_injected(pool);
+	if (task)
+		return task;
+
+	self->seed = self->seed * 1103515245 + 12345;
+	start = (self->seed >> 16) % pool->count;
+	for (i = 0; i < pool->count; i++) {
+		struct pool_worker *victim = &pool->workers[(start + i) % pool->count];
+
+		if (victim == self)
+			continue;
+
+		do {
+			task = deque_steal(&victim->deque);
+		} while (task == POOL_RETRY);
+
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+static void pool_run(thread_pool_t *pool, struct pool_task *task)
+{
+	void *result;
+
+	pool_dec(&pool->queued);
+
+	result = task->func(task->arg);
+	if (task->done)
+		task->done(result, task->user_data);
+	free(task);
+
+	pool_task_finished(pool);
+}
+
+static void *pool_worker_thread(void *arg)
+{
+	struct pool_worker *self = arg;
+	thread_pool_t *pool = self->pool;
+	int idle = 0;
+
+	pool_self = self;
+
+	for (;;) {
+		struct pool_task *task = pool_find(self);
+		int done;
+
+		if (task) {
+			pool_run(pool, task);
+			idle = 0;
+			continue;
+		}
+
+		if (++idle < POOL_SPIN) {
+			sched_yield();
+			continue;
+		}
+		idle = 0;
+
+		pthread_mutex_lock(&pool->lock);
+		pool_inc(&pool->sleeping);
+		while (!pool_load(&pool->queued) &&
+			!(pool_load(&pool->stopping) && !pool_load(&pool->active)))
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+		pool_dec(&pool->sleeping);
+		done = pool_load(&pool->stopping) && !pool_load(&pool->active);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (done)
+			break;
+	}
+
+	pool_self = NULL;
+	return NULL;
+}
+
+static int pool_push(thread_pool_t *pool, struct pool_task *task)
+{
+	struct pool_worker *self = pool_self;
+	int inside = self && self->pool == pool;
+
+	/* tasks may still submit while the pool drains, nobody else */
+	pool_inc(&pool->active);
+	if (!inside && pool_load(&pool->stopping)) {
+		pool_task_finished(pool);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+
+	pool_inc(&pool->queued);
+	if (!inside || deque_push(&self->deque, task) < 0) {
+		task->next = NULL;
+		pthread_mutex_lock(&pool->inject_lock);
+		if (pool->inject_tail)
+			pool->inject_tail->next = task;
+		else
+			__atomic_store_n(&pool->inject_head, task, __ATOMIC_RELAXED);
+		pool->inject_tail = task;
+		pthread_mutex_unlock(&pool->inject_lock);
+	}
+
+	pool_wake(pool);
+	return 0;
+}
+
+static void pool_free(thread_pool_t *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		struct pool_array *a = pool->workers[i].deque.array;
+
+		while (a) {
+			struct pool_array *retired = a->retired;
+
+			free(a);
+			a = retired;
+		}
+	}
+
+	pthread_mutex_destroy(&pool->inject_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wakeup);
+	free(pool->workers);
+	free(pool);
+}
+
+/*
+ * A pool of worker threads, as many as CPUs online if workers is 0.
+ * Returns NULL with errno set if it could not be set up.
+ */
+thread_pool_t *thread_pool_new(int workers)
+{
+	thread_pool_t *pool;
+	int i, err;
+
+	if (workers <= 0) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers <= 0)
+			workers = 1;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	if (posix_memalign((void **) &pool->workers, POOL_CACHELINE_SIZE,
+					workers * sizeof(*pool->workers))) {
+		free(pool);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(pool->workers, 0, workers * sizeof(*pool->workers));
+
+	pthread_mutex_init(&pool->inject_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+
+	for (i = 0; i < workers; i++) {
+		struct pool_worker *w = &pool->workers[i];
+
+		w->deque.array = pool_array_new(POOL_DEQUE_SIZE);
+		if (!w->deque.array) {
+			pool->count = i;
+			pool_free(pool);
+			errno = ENOMEM;
+			return NULL;
+		}
+		w->pool = pool;
+		w->seed = i + 1;
+	}
+	pool->count = workers;
+
+	for (i = 0; i < workers; i++) {
+		err = pthread_create(&pool->workers[i].thread, NULL,
+					pool_worker_thread, &pool->workers[i]);
+		if (err) {
+			/* the ones running have nothing to do and leave */
+			pthread_mutex_lock(&pool->lock);
+			pool_store(&pool->stopping, 1);
+			pthread_cond_broadcast(&pool->wakeup);
+			pthread_mutex_unlock(&pool->lock);
+			while (i--)
+				pthread_join(pool->workers[i].thread, NULL);
+			pool_free(pool);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/*
+ * Run everything submitted, also what tasks submit meanwhile, then stop
+ * the workers and free the pool.  Submitting from outside the pool
+ * fails once this started.  Must not be called from a task.
+ */
+void thread_pool_destroy(thread_pool_t *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool_store(&pool->stopping, 1);
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->count; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	pool_free(pool);
+}
+
+int thread_pool_workers(thread_pool_t *pool)
+{
+	return pool->count;
+}
+
+/*
+ * Run task(arg) on a worker, then done(result, user_data) if done is
+ * not NULL.  Returns 0, or -1 with errno set.
+ */
+int thread_pool_submit(thread_pool_t *pool, thread_task_func task, void *arg,
+			thread_done_func done, void *user_data)
+{
+	struct pool_task *t;
+
+	if (!pool || !task) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return -1;
+
+	t->func = task;
+	t->arg = arg;
+	t->done = done;
+	t->user_data = user_data;
+
+	if (pool_push(pool, t) < 0) {
+		free(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void future_complete(void *result, void *user_data)
+{
+	thread_future_t *future = user_data;
+
+	pthread_mutex_lock(&future->lock);
+	future->result = result;
+	__atomic_store_n(&future->ready, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&future->cond);
+	pthread_mutex_unlock(&future->lock);
+}
+
+/*
+ * Run task(arg) on a worker; thread_future_wait() on what this returns
+ * gives its result.  Returns NULL with errno set if it failed.
+ */
+thread_future_t *thread_pool_async(thread_pool_t *pool, thread_task_func task,
+								void *arg)
+{
+	thread_future_t *future = calloc(1, sizeof(*future));
+
+	if (!future)
+		return NULL;
+
+	pthread_mutex_init(&future->lock, NULL);
+	pthread_cond_init(&future->cond, NULL);
+	future->pool = pool;
+
+	if (thread_pool_submit(pool, task, arg, future_complete, future) < 0) {
+		int err = errno;
+
+		pthread_mutex_destroy(&future->lock);
+		pthread_cond_destroy(&future->cond);
+		free(future);
+		errno = err;
+		return NULL;
+	}
+
+	return future;
+}
+
+/* Whether thread_future_wait() would return right away. */
+int thread_future_ready(thread_future_t *future)
+{
+	return __atomic_load_n(&future->ready, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The result of the task, once it returned.  Frees the future.  Called
+ * from a task of the same pool it runs other tasks until then.
+ */
+void *thread_future_wait(thread_future_t *future)
+{
+	struct pool_worker *self = pool_self;
+	void *result;
+
+	if (self && self->pool == future->pool) {
+		while (!thread_future_ready(future)) {
+			struct pool_task *task = pool_find(self);
+
+			if (task)
+				pool_run(self->pool, task);
+			else
+				sched_yield();
+		}
+	}
+
+	/* also waits for future_complete() to let go of it */
+	pthread_mutex_lock(&future->lock);
+	while (!future->ready)
+		pthread_cond_wait(&future->cond, &future->lock);
+	result = future->result;
+	pthread_mutex_unlock(&future->lock);
+
+	pthread_mutex_destroy(&future->lock);
+	pthread_cond_destroy(&future->cond);
+	free(future);
+
+	return result;
+}
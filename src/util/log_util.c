@@ -1,9 +1,22 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #include <log_util.h>
@@ -18,16 +31,1349 @@ struct log_tm {
 static int log_level = DEFAULT_LOG_LEVEL;
 static const char *log_level_string[8] = { "ERROR", "WARNING", "INFO", "DEBUG" };
 
-static void log_time(struct log_tm *ltm)
+/*
+ * Asynchronous sink
+ *
+ * Once log_async_start() ran, a message is formatted on the calling
+ * thread into a ring of that thread's own, and a flusher thread writes
+ * the rings out, many lines per writev().  A ring has one producer,
+ * its thread, and one consumer, the flusher, so neither side takes a
+ * lock.  Threads push their ring onto log_rings the first time they
+ * log.  Rings are never freed, so the list can be walked without a
+ * lock: once the thread owning one exited and the flusher drained it,
+ * the next new thread takes it over.  A full ring drops the message
+ * and counts it rather than stall the thread.  Errors are waited for,
+ * error() aborts right after logging one.
+ *
+ * What goes through the rings depends on the mode the sink runs in:
+ * formatted lines (LOG_ASYNC_TEXT) or binary records of the arguments,
+ * see "Deferred formatting" below.
+ */
+#define LOG_RING_SIZE		(64 * 1024)	/* per thread, a power of 2 */
+#define LOG_FLUSH_INTERVAL	10		/* ms between flusher rounds */
+#define LOG_IOV_MAX		64
+#define LOG_FLUSH_WAIT		1000		/* ms log_async_flush() waits at most */
+
+#define LOG_CACHELINE_SIZE	64
+
+enum {
+	LOG_RING_LIVE,		/* owned by a thread */
+	LOG_RING_DEAD,		/* its thread exited, maybe not drained yet */
+	LOG_RING_IDLE,		/* drained, free to take over */
+};
+
+struct log_ring {
+	struct log_ring *next;
+	int state;
+
+	/* producer side */
+	unsigned int in __attribute__((aligned(LOG_CACHELINE_SIZE)));
+	unsigned long lines;
+	unsigned long dropped;
+
+	/* consumer side */
+	unsigned int out __attribute__((aligned(LOG_CACHELINE_SIZE)));
+
+	char buf[LOG_RING_SIZE] __attribute__((aligned(8)));
+};
+
+static struct log_ring *log_rings;
+static __thread struct log_ring *log_my_ring;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+static int log_async_running;
+static int log_async_mode;
+static int log_async_fd = -1;
+static pthread_t log_flusher;
+/* initialized once and never destroyed, threads may post to it late */
+static sem_t log_wakeup;
+static pthread_once_t log_wakeup_once = PTHREAD_ONCE_INIT;
+static int log_wakeup_error;
+
+/* counts of the flusher */
+static unsigned long log_bytes;
+static unsigned long log_writes;
+static unsigned long log_write_errors;
+
+#define log_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define log_store(p, v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+/* counters have a single writer, log_get_stats() may read them any time */
+#define log_add(p, n)		__atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+#define log_count(p)		log_add(p, 1)
+#define log_counter(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/*
+ * Deferred formatting
+ *
+ * In the LOG_ASYNC_DEFERRED and LOG_ASYNC_BINARY modes the caller
+ * formats nothing: it copies the format pointer and the raw arguments
+ * into a record on its ring.  The flusher formats the records
+ * (LOG_ASYNC_DEFERRED), or writes them out as they are, each string a
+ * pointer refers to once, for log_binary_decode() to format offline
+ * (LOG_ASYNC_BINARY).  The types of the arguments come from parsing the
+ * format, once per format and thread.  Format strings and tags must
+ * outlive the call, so the pointers are only kept for those in a
+ * read-only segment, which string literals are.  Any other call, or one
+ * whose format has a conversion which cannot be deferred, is formatted
+ * right away and queued as a record of the format "%s".
+ */
+#define LOG_MAX_ARGS		16
+#define LOG_REC_MAX		2048		/* holds a BUFSIZE line */
+#define LOG_SIG_CACHE		64		/* formats per thread, a power of 2 */
+#define LOG_MAX_RANGES		64
+#define LOG_STAGE_SIZE		(64 * 1024)
+#define LOG_STAGE_NEED		(3 * LOG_REC_MAX)	/* a record and its strings */
+
+#define LOG_BIN_MAGIC		"LOGBIN1\n"	/* starts every session */
+
+/* record kinds besides the log levels */
+#define LOG_REC_PAD		0xff		/* the rest of the ring is unused */
+#define LOG_REC_STRING		0xfe		/* binary files: the string at fmt */
+
+#define LOG_PREC_ARG		-2		/* %.*s */
+
+#define LOG_ALIGN8(n)		(((n) + 7) & ~(size_t) 7)
+
+enum {
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_LDOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+};
+
+struct log_rec {
+	uint32_t size;		/* the whole record, a multiple of 8 */
+	uint8_t level;		/* or LOG_REC_PAD, LOG_REC_STRING */
+	uint8_t nargs;
+	uint16_t unused;
+	int32_t line;		/* < 0 from sys_debug(), no prefix */
+	int32_t err;		/* errno of the call, for %m */
+	int64_t usec;		/* gettimeofday() of the call */
+	uint64_t fmt;
+	uint64_t tag;
+	uint64_t args[];	/* %s: the length, the strings follow */
+};
+
+struct log_sig {
+	const char *fmt;
+	const char *tag;
+	int deferred;		/* the call can be recorded */
+	int nargs;
+	unsigned char types[LOG_MAX_ARGS];
+	int precs[LOG_MAX_ARGS];	/* %s: the precision, -1 if none */
+};
+
+struct log_dict_entry {
+	uint64_t key;		/* 0 if unused */
+	char *str;
+};
+
+/* Strings by the address they had in the logging process. */
+struct log_dict {
+	struct log_dict_entry *entries;
+	size_t size;		/* a power of 2 */
+	size_t count;
+};
+
+static struct {
+	uintptr_t start;
+	uintptr_t end;
+} log_ranges[LOG_MAX_RANGES];
+static int log_range_count;
+static __thread struct log_sig log_sigs[LOG_SIG_CACHE];
+static const char log_fmt_line[] = "%s";
+
+/* flusher side */
+static char log_stage[LOG_STAGE_SIZE] __attribute__((aligned(8)));
+static size_t log_stage_len;
+static struct {
+	struct log_ring *ring;
+	unsigned int out;
+} log_staged[LOG_IOV_MAX];		/* ring->out once the stage is written */
+static int log_staged_count;
+static struct log_dict log_written;	/* strings in the binary file */
+
+/* localtime_r() takes a lock, so it runs once a second per thread */
+static void log_time(const struct timeval *tv, struct log_tm *ltm)
+{
+	static __thread time_t last_sec = -1;
+	static __thread struct tm tm;
+	if (tv->tv_sec != last_sec) {
+		localtime_r((time_t *) &tv->tv_sec, &tm);
+		last_sec = tv->tv_sec;
+	}
+	ltm->tm_hour = tm.tm_hour;
+	ltm->tm_min = tm.tm_min;
+	ltm->tm_sec = tm.tm_sec;
+	ltm->tm_usec = tv->tv_usec;
+}
+
+static char *log_put_uint(char *p, unsigned int v, int width)
+{
+	char digits[12], *d = digits + sizeof(digits);
+
+	do {
+		*--d = '0' + v % 10;
+		v /= 10;
+	} while (v || digits + sizeof(digits) - d < width);
+
+	memcpy(p, d, digits + sizeof(digits) - d);
+	return p + (digits + sizeof(digits) - d);
+}
+
+/* "[tag(line)_LEVEL hh:mm:ss.us] ", returns its length within size */
+static int log_format_prefix(char *buf, size_t size, int level,
+			const char *tag, int line, const struct timeval *tv)
+{
+	size_t tag_len = strlen(tag);
+	struct log_tm ltm;
+	char *p = buf;
+	int len;
+
+	log_time(tv, &ltm);
+
+	/* snprintf() takes longer than the rest of a deferred line */
+	if (line >= 0 && tag_len + 64 <= size) {
+		*p++ = '[';
+		memcpy(p, tag, tag_len);
+		p += tag_len;
+		*p++ = '(';
+		p = log_put_uint(p, line, 1);
+		*p++ = ')';
+		*p++ = '_';
+		len = strlen(log_level_string[level]);
+		memcpy(p, log_level_string[level], len);
+		p += len;
+		*p++ = ' ';
+		p = log_put_uint(p, ltm.tm_hour, 2);
+		*p++ = ':';
+		p = log_put_uint(p, ltm.tm_min, 2);
+		*p++ = ':';
+		p = log_put_uint(p, ltm.tm_sec, 2);
+		*p++ = '.';
+		p = log_put_uint(p, ltm.tm_usec, 1);
+		*p++ = ']';
+		*p++ = ' ';
+		*p = '\0';
+		return p - buf;
+	}
+
+	len = snprintf(buf, size, "[%s(%d)_%s %02d:%02d:%02d.%d] ", tag, line,
+			log_level_string[level], ltm.tm_hour, ltm.tm_min,
+			ltm.tm_sec, ltm.tm_usec);
+	if (len < 0)
+		return 0;
+
+	return len < (int) size ? len : (int) size - 1;
+}
+
+void log_set_level(int level)
+{
+	log_level = level;
+}
+
+int log_get_level(void)
+{
+	return log_level;
+}
+
+static void log_wakeup_init(void)
+{
+	if (sem_init(&log_wakeup, 0, 0) < 0)
+		log_wakeup_error = errno;
+}
+
+/* Hurry the flusher up, if there is one. */
+static void log_wake(void)
+{
+	if (log_load(&log_async_running))
+		sem_post(&log_wakeup);
+}
+
+static void log_ring_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	/* a later destructor which logs gets a new ring */
+	log_my_ring = NULL;
+	log_store(&ring->state, LOG_RING_DEAD);
+	log_wake();
+}
+
+static void log_ring_key_init(void)
+{
+	pthread_key_create(&log_ring_key, log_ring_exit);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = log_my_ring;
+
+	if (ring)
+		return ring;
+
+	pthread_once(&log_ring_once, log_ring_key_init);
+
+	for (ring = log_load(&log_rings); ring; ring = ring->next) {
+		int idle = LOG_RING_IDLE;
+
+		if (__atomic_compare_exchange_n(&ring->state, &idle,
+					LOG_RING_LIVE, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+			goto found;
+	}
+
+	if (posix_memalign((void **) &ring, LOG_CACHELINE_SIZE, sizeof(*ring)))
+		return NULL;
+	memset(ring, 0, offsetof(struct log_ring, buf));
+
+	ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+found:
+	pthread_setspecific(log_ring_key, ring);
+	log_my_ring = ring;
+	return ring;
+}
+
+/* Hand an empty ring whose thread exited over to the next new thread. */
+static void log_ring_drained(struct log_ring *ring, unsigned int in)
+{
+	/* only the exited thread could have added more */
+	if (log_load(&ring->state) == LOG_RING_DEAD && log_load(&ring->in) == in)
+		log_store(&ring->state, LOG_RING_IDLE);
+}
+
+static void log_ring_full(struct log_ring *ring)
+{
+	log_count(&ring->dropped);
+	log_wake();
+}
+
+/*
+ * Publish what was queued up to end; used is what the ring held before.
+ */
+static void log_ring_commit(struct log_ring *ring, int level,
+				unsigned int used, unsigned int end)
+{
+	unsigned int len = end - ring->in;
+
+	log_store(&ring->in, end);
+	log_count(&ring->lines);
+
+	/* the flusher comes by every few ms, only hurry it up when needed */
+	if (level == LOG_ERROR ||
+			(used <= LOG_RING_SIZE / 2 && used + len > LOG_RING_SIZE / 2))
+		log_wake();
+}
+
+/*
+ * Wait until the flusher has written what this thread queued, error()
+ * calls it before it aborts.  Gives up after LOG_FLUSH_WAIT ms.
+ */
+void log_async_flush(void)
 {
+	struct log_ring *ring = log_my_ring;
+	unsigned int end;
+	int waited;
+
+	if (!ring || !log_load(&log_async_running))
+		return;
+
+	end = ring->in;
+	log_wake();
+	for (waited = 0; waited < LOG_FLUSH_WAIT &&
+			(int) (log_load(&ring->out) - end) < 0 &&
+			log_load(&log_async_running); waited++)
+		usleep(1000);
+}
+
+/*
+ * Room for a record of size bytes, NULL if the ring is full.  Records
+ * do not wrap around, a LOG_REC_PAD record fills the end of the ring
+ * instead.  They start 8-aligned, a ring which carried lines before may
+ * need to skip a few bytes first.  end is what ring->in becomes.
+ */
+static struct log_rec *log_rec_reserve(struct log_ring *ring,
+			unsigned int size, unsigned int *used, unsigned int *end)
+{
+	unsigned int in = LOG_ALIGN8(ring->in);
+	unsigned int off = in & (LOG_RING_SIZE - 1);
+	unsigned int pad = LOG_RING_SIZE - off < size ? LOG_RING_SIZE - off : 0;
+
+	*used = ring->in - log_load(&ring->out);
+	if (in - ring->in + pad + size > LOG_RING_SIZE - *used) {
+		log_ring_full(ring);
+		return NULL;
+	}
+
+	if (pad) {
+		struct log_rec *rec = (struct log_rec *) (ring->buf + off);
+
+		rec->size = pad;
+		rec->level = LOG_REC_PAD;
+		off = 0;
+	}
+
+	*end = in + pad + size;
+	return (struct log_rec *) (ring->buf + off);
+}
+
+static void log_rec_init(struct log_rec *rec, unsigned int size, int level,
+			int nargs, int line, const char *fmt, const char *tag)
+{
+	rec->size = size;
+	rec->level = level;
+	rec->nargs = nargs;
+	rec->unused = 0;
+	rec->line = line;
+	rec->err = 0;
+	rec->usec = 0;
+	rec->fmt = (uintptr_t) fmt;
+	rec->tag = (uintptr_t) tag;
+}
+
+/* Copy a string after the arguments, returns where the next one goes. */
+static char *log_rec_string(char *p, const char *str, size_t len)
+{
+	/* clear the padding, it is written out in binary files */
+	memset(p + LOG_ALIGN8(len + 1) - 8, 0, 8);
+	memcpy(p, str, len);
+	p[len] = '\0';
+	return p + LOG_ALIGN8(len + 1);
+}
+
+static void log_write_sync(const char *line, size_t len)
+{
+	fwrite(line, 1, len, stderr);
+	fflush(stderr);
+}
+
+/* Queue one formatted line on the thread's ring. */
+static void log_emit(int level, const char *line, size_t len)
+{
+	struct log_ring *ring;
+	struct log_rec *rec;
+	unsigned int in, used, off, n, end;
+
+	if (!log_load(&log_async_running) || !(ring = log_ring_get())) {
+		log_write_sync(line, len);
+		return;
+	}
+
+	if (log_load(&log_async_mode) != LOG_ASYNC_TEXT) {
+		/* the flusher adds the newline */
+		len--;
+		if (len > LOG_REC_MAX - sizeof(*rec) - 16)
+			len = LOG_REC_MAX - sizeof(*rec) - 16;
+
+		n = sizeof(*rec) + sizeof(uint64_t) + LOG_ALIGN8(len + 1);
+		rec = log_rec_reserve(ring, n, &used, &end);
+		if (!rec)
+			return;
+
+		log_rec_init(rec, n, level, 1, -1, log_fmt_line, NULL);
+		rec->args[0] = len;
+		log_rec_string((char *) &rec->args[1], line, len);
+		log_ring_commit(ring, level, used, end);
+		return;
+	}
+
+	in = ring->in;
+	used = in - log_load(&ring->out);
+	if (len > LOG_RING_SIZE - used) {
+		log_ring_full(ring);
+		return;
+	}
+
+	off = in & (LOG_RING_SIZE - 1);
+	n = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+	memcpy(ring->buf + off, line, n);
+	memcpy(ring->buf, line + n, len - n);
+	log_ring_commit(ring, level, used, in + len);
+}
+
+/*
+ * Work out the type of every argument fmt takes, and for strings the
+ * precision.  Returns the number of arguments, or -1 if fmt has a
+ * conversion which cannot be deferred.
+ */
+static int log_parse_format(const char *fmt, unsigned char *types, int *precs)
+{
+	int n = 0;
+
+	while ((fmt = strchr(fmt, '%'))) {
+		int lng = 0, prec = -1;
+
+		if (*++fmt == '%') {
+			fmt++;
+			continue;
+		}
+
+		fmt += strspn(fmt, "-+ #0'I");
+		if (*fmt == '*') {
+			if (n == LOG_MAX_ARGS)
+				return -1;
+			types[n++] = LOG_ARG_INT;
+			fmt++;
+		} else {
+			fmt += strspn(fmt, "0123456789");
+			/* positional arguments */
+			if (*fmt == '$')
+				return -1;
+		}
+
+		if (*fmt == '.') {
+			if (*++fmt == '*') {
+				if (n == LOG_MAX_ARGS)
+					return -1;
+				types[n++] = LOG_ARG_INT;
+				prec = LOG_PREC_ARG;
+				fmt++;
+			} else {
+				prec = atoi(fmt);
+				fmt += strspn(fmt, "0123456789");
+			}
+		}
+
+		for (;; fmt++) {
+			if (*fmt == 'l')
+				lng++;
+			else if (*fmt == 'j' || *fmt == 'z' || *fmt == 'Z' ||
+								*fmt == 't')
+				lng = 1;
+			else if (*fmt == 'q' || *fmt == 'L')
+				lng = 2;
+			else if (*fmt != 'h')
+				break;
+		}
+
+		if (*fmt == 'm') {
+			fmt++;
+			continue;
+		}
+
+		if (n == LOG_MAX_ARGS)
+			return -1;
+
+		switch (*fmt) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			types[n++] = !lng ? LOG_ARG_INT :
+				lng == 1 ? LOG_ARG_LONG : LOG_ARG_LLONG;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			types[n++] = lng == 2 ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+			break;
+		case 'p':
+			types[n++] = LOG_ARG_PTR;
+			break;
+		case 'c':
+		case 's':
+			/* wide characters would need converting */
+			if (lng)
+				return -1;
+			if (*fmt == 'c') {
+				types[n++] = LOG_ARG_INT;
+				break;
+			}
+			if (precs)
+				precs[n] = prec;
+			types[n++] = LOG_ARG_STR;
+			break;
+		default:
+			/* %n, or a broken format */
+			return -1;
+		}
+		fmt++;
+	}
+
+	return n;
+}
+
+static int log_add_range(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+		if (ph->p_type != PT_LOAD || (ph->p_flags & PF_W))
+			continue;
+		if (log_range_count == LOG_MAX_RANGES)
+			return 1;
+
+		log_ranges[log_range_count].start = info->dlpi_addr + ph->p_vaddr;
+		log_ranges[log_range_count].end = info->dlpi_addr + ph->p_vaddr +
+								ph->p_memsz;
+		log_range_count++;
+	}
+
+	return 0;
+}
+
+/* in a read-only segment, which stays mapped as long as the process */
+static int log_readonly(const void *p)
+{
+	uintptr_t addr = (uintptr_t) p;
+	int i;
+
+	for (i = 0; i < log_range_count; i++) {
+		if (addr >= log_ranges[i].start && addr < log_ranges[i].end)
+			return 1;
+	}
+
+	return 0;
+}
+
+static const struct log_sig *log_sig_get(const char *fmt, const char *tag)
+{
+	uintptr_t key = (uintptr_t) fmt;
+	struct log_sig *sig = &log_sigs[(key ^ (key >> 6)) & (LOG_SIG_CACHE - 1)];
+
+	if (sig->fmt != fmt || sig->tag != tag) {
+		sig->nargs = log_parse_format(fmt, sig->types, sig->precs);
+		sig->deferred = sig->nargs >= 0 && log_readonly(fmt) &&
+						(!tag || log_readonly(tag));
+		sig->fmt = fmt;
+		sig->tag = tag;
+	}
+
+	return sig;
+}
+
+/*
+ * Queue a record of the call on the thread's ring.  Returns -1 if the
+ * call has to be formatted right away, ap is used up then too.
+ */
+static int log_defer(int level, const char *tag, int line, const char *fmt,
+								va_list ap)
+{
+	uint64_t args[LOG_MAX_ARGS];
+	const char *strs[LOG_MAX_ARGS];
+	size_t lens[LOG_MAX_ARGS];
+	const struct log_sig *sig;
+	struct log_ring *ring;
+	struct log_rec *rec;
+	unsigned int size, used, end;
 	struct timeval tv;
-	struct tm *tm;
+	int err = errno;
+	int i, n = 0;
+	char *p;
+
+	if (!log_load(&log_async_running))
+		return -1;
+
+	sig = log_sig_get(fmt, tag);
+	if (!sig->deferred || !(ring = log_ring_get()))
+		goto eager;
+
+	size = sizeof(*rec) + sig->nargs * sizeof(uint64_t);
+	for (i = 0; i < sig->nargs; i++) {
+		long double ld;
+		double d;
+
+		switch (sig->types[i]) {
+		case LOG_ARG_INT:
+			args[i] = (uint64_t) va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			args[i] = (uint64_t) va_arg(ap, long);
+			break;
+		case LOG_ARG_LLONG:
+			args[i] = (uint64_t) va_arg(ap, long long);
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&args[i], &d, sizeof(d));
+			break;
+		case LOG_ARG_LDOUBLE:
+			/* kept as a double */
+			ld = va_arg(ap, long double);
+			d = ld;
+			memcpy(&args[i], &d, sizeof(d));
+			break;
+		case LOG_ARG_PTR:
+			args[i] = (uintptr_t) va_arg(ap, void *);
+			break;
+		case LOG_ARG_STR:
+			strs[n] = va_arg(ap, const char *);
+			if (!strs[n])
+				strs[n] = "(null)";
+			/* only as much as the precision prints */
+			if (sig->precs[i] >= 0)
+				lens[n] = strnlen(strs[n], sig->precs[i]);
+			else if (sig->precs[i] == LOG_PREC_ARG && (int) args[i - 1] >= 0)
+				lens[n] = strnlen(strs[n], (int) args[i - 1]);
+			else
+				lens[n] = strlen(strs[n]);
+			if (lens[n] > LOG_REC_MAX)
+				goto eager;
+			args[i] = lens[n];
+			size += LOG_ALIGN8(lens[n] + 1);
+			n++;
+			break;
+		}
+	}
+
+	if (size > LOG_REC_MAX)
+		goto eager;
+
+	rec = log_rec_reserve(ring, size, &used, &end);
+	if (!rec)
+		return 0;
+
 	gettimeofday(&tv, NULL);
-	tm = localtime((time_t *) &tv.tv_sec);
-	ltm->tm_hour = tm->tm_hour;
-	ltm->tm_min = tm->tm_min;
-	ltm->tm_sec = tm->tm_sec;
-	ltm->tm_usec = tv.tv_usec;
+	log_rec_init(rec, size, level, sig->nargs, line, fmt, tag);
+	rec->err = err;
+	rec->usec = tv.tv_sec * 1000000LL + tv.tv_usec;
+	memcpy(rec->args, args, sig->nargs * sizeof(uint64_t));
+
+	p = (char *) &rec->args[sig->nargs];
+	for (i = 0; i < n; i++)
+		p = log_rec_string(p, strs[i], lens[i]);
+
+	log_ring_commit(ring, level, used, end);
+	return 0;
+
+eager:
+	errno = err;
+	return -1;
+}
+
+/* %d, %u and their longer kinds without flags, the common case, by hand */
+static int log_format_int(char *out, size_t size, const char *spec,
+							int type, uint64_t v)
+{
+	char digits[24], *p = digits + sizeof(digits);
+	size_t len = strspn(spec + 1, "l");
+	int neg = 0;
+
+	if (spec[len + 2] || !strchr("diu", spec[len + 1]))
+		return -1;
+
+	if (spec[len + 1] != 'u') {
+		int64_t s = type == LOG_ARG_INT ? (int) v :
+			type == LOG_ARG_LONG ? (long) v : (long long) v;
+
+		neg = s < 0;
+		v = neg ? -(uint64_t) s : (uint64_t) s;
+	} else if (type == LOG_ARG_INT) {
+		v = (unsigned int) v;
+	}
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (neg)
+		*--p = '-';
+
+	len = digits + sizeof(digits) - p;
+	memcpy(out, p, len < size ? len : size - 1);
+	return len;
+}
+
+#define LOG_PRINT(...)							\
+	(stars == 0 ? snprintf(out + len, size - len, spec, ##__VA_ARGS__) : \
+	 stars == 1 ? snprintf(out + len, size - len, spec, star[0],	\
+							##__VA_ARGS__) :	\
+	 snprintf(out + len, size - len, spec, star[0], star[1], ##__VA_ARGS__))
+
+/*
+ * Format the message of rec, whose arguments have the given types,
+ * into out.  Returns the length, at most size - 1.
+ */
+static size_t log_format_args(char *out, size_t size, const char *fmt,
+			const struct log_rec *rec, const unsigned char *types)
+{
+	const char *strs = (const char *) &rec->args[rec->nargs];
+	size_t len = 0;
+	int a = 0;
+
+	while (*fmt && len + 1 < size) {
+		const char *pct = strchr(fmt, '%');
+		size_t n = pct ? (size_t) (pct - fmt) : strlen(fmt);
+		int star[2], stars = 0, ret = 0;
+		char spec[32], *p;
+		double d;
+
+		if (n > size - 1 - len)
+			n = size - 1 - len;
+		memcpy(out + len, fmt, n);
+		len += n;
+		if (!pct || len + 1 >= size)
+			break;
+
+		if (pct[1] == '%') {
+			out[len++] = '%';
+			fmt = pct + 2;
+			continue;
+		}
+
+		/* one conversion, printed on its own */
+		n = strcspn(pct + 1, "diouxXeEfFgGaAcspm") + 2;
+		if (!pct[n - 1] || n >= sizeof(spec))
+			break;
+		memcpy(spec, pct, n);
+		spec[n] = '\0';
+		fmt = pct + n;
+
+		for (p = spec; stars < 2 && (p = strchr(p, '*')); p++)
+			star[stars++] = a < rec->nargs ? (int) rec->args[a++] : 0;
+
+		if (spec[n - 1] == 'm') {
+			errno = rec->err;
+			ret = LOG_PRINT();
+		} else if (a < rec->nargs) {
+			uint64_t v = rec->args[a];
+
+			if (types[a] <= LOG_ARG_LLONG && !stars &&
+				(ret = log_format_int(out + len, size - len, spec,
+							types[a], v)) >= 0) {
+				a++;
+				goto printed;
+			}
+
+			switch (types[a++]) {
+			case LOG_ARG_INT:
+				ret = LOG_PRINT((int) v);
+				break;
+			case LOG_ARG_LONG:
+				ret = LOG_PRINT((long) v);
+				break;
+			case LOG_ARG_LLONG:
+				ret = LOG_PRINT((long long) v);
+				break;
+			case LOG_ARG_DOUBLE:
+				memcpy(&d, &v, sizeof(d));
+				ret = LOG_PRINT(d);
+				break;
+			case LOG_ARG_LDOUBLE:
+				memcpy(&d, &v, sizeof(d));
+				ret = LOG_PRINT((long double) d);
+				break;
+			case LOG_ARG_PTR:
+				ret = LOG_PRINT((void *) (uintptr_t) v);
+				break;
+			case LOG_ARG_STR:
+				ret = LOG_PRINT(strs);
+				strs += LOG_ALIGN8(v + 1);
+				break;
+			}
+		}
+
+printed:
+		if (ret > 0)
+			len += (size_t) ret < size - len ? (size_t) ret : size - 1 - len;
+	}
+
+	return len;
+}
+
+/* One line for rec, whose format and tag pointers referred to fmt and tag. */
+static size_t log_format_record(char *out, size_t size, const struct log_rec *rec,
+			const char *fmt, const char *tag, const unsigned char *types)
+{
+	size_t len = 0;
+
+	if (rec->line >= 0) {
+		struct timeval tv;
+
+		tv.tv_sec = rec->usec / 1000000;
+		tv.tv_usec = rec->usec % 1000000;
+		len = log_format_prefix(out, size - 1, rec->level, tag, rec->line,
+									&tv);
+	}
+
+	len += log_format_args(out + len, size - 1 - len, fmt, rec, types);
+	out[len++] = '\n';
+	return len;
+}
+
+static struct log_dict_entry *log_dict_probe(struct log_dict *dict,
+								uint64_t key)
+{
+	size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for (;; i++) {
+		struct log_dict_entry *e = &dict->entries[i & (dict->size - 1)];
+
+		if (e->key == key || !e->key)
+			return e;
+	}
+}
+
+/* The entry of key, or the unused one to put it in.  NULL without memory. */
+static struct log_dict_entry *log_dict_slot(struct log_dict *dict, uint64_t key)
+{
+	size_t i;
+
+	if ((dict->count + 1) * 2 > dict->size) {
+		struct log_dict grown;
+
+		grown.size = dict->size ? dict->size * 2 : 256;
+		grown.count = 0;
+		grown.entries = calloc(grown.size, sizeof(*grown.entries));
+		if (!grown.entries)
+			return NULL;
+
+		for (i = 0; i < dict->size; i++) {
+			struct log_dict_entry *e = &dict->entries[i];
+
+			if (e->key)
+				*log_dict_probe(&grown, e->key) = *e;
+		}
+		grown.count = dict->count;
+
+		free(dict->entries);
+		*dict = grown;
+	}
+
+	return log_dict_probe(dict, key);
+}
+
+static const char *log_dict_get(struct log_dict *dict, uint64_t key)
+{
+	struct log_dict_entry *e;
+
+	if (!dict->size)
+		return NULL;
+
+	e = log_dict_probe(dict, key);
+	return e->key == key ? e->str : NULL;
+}
+
+static void log_dict_clear(struct log_dict *dict)
+{
+	size_t i;
+
+	for (i = 0; i < dict->size; i++)
+		free(dict->entries[i].str);
+	free(dict->entries);
+	memset(dict, 0, sizeof(*dict));
+}
+
+static void log_writev_all(struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t n = writev(log_async_fd, iov, cnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_count(&log_write_errors);
+			return;
+		}
+
+		log_add(&log_bytes, n);
+		log_count(&log_writes);
+
+		while (cnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/* Write out everything queued, in writev batches of LOG_IOV_MAX. */
+static void log_flush_rings(void)
+{
+	struct log_ring *batch[LOG_IOV_MAX];
+	unsigned int ends[LOG_IOV_MAX];
+	struct iovec iov[LOG_IOV_MAX];
+	struct log_ring *ring;
+	int cnt = 0, rings = 0, i;
+
+	for (ring = log_load(&log_rings); ring; ring = ring->next) {
+		unsigned int out = ring->out;
+		unsigned int in = log_load(&ring->in);
+		unsigned int off = out & (LOG_RING_SIZE - 1);
+		unsigned int len = in - out;
+
+		if (!len) {
+			log_ring_drained(ring, in);
+			continue;
+		}
+
+		if (cnt + 2 > LOG_IOV_MAX) {
+			log_writev_all(iov, cnt);
+			for (i = 0; i < rings; i++)
+				log_store(&batch[i]->out, ends[i]);
+			cnt = rings = 0;
+		}
+
+		iov[cnt].iov_base = ring->buf + off;
+		iov[cnt].iov_len = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+		if (iov[cnt].iov_len < len) {
+			iov[cnt + 1].iov_base = ring->buf;
+			iov[cnt + 1].iov_len = len - iov[cnt].iov_len;
+			cnt++;
+		}
+		cnt++;
+
+		batch[rings] = ring;
+		ends[rings++] = in;
+	}
+
+	if (cnt)
+		log_writev_all(iov, cnt);
+	for (i = 0; i < rings; i++)
+		log_store(&batch[i]->out, ends[i]);
+}
+
+/*
+ * Write out the stage.  Only then are the records it came from taken
+ * off their rings, an error waits until it is in the file.
+ */
+static void log_stage_flush(void)
+{
+	struct iovec iov;
+	int i;
+
+	if (log_stage_len) {
+		iov.iov_base = log_stage;
+		iov.iov_len = log_stage_len;
+		log_writev_all(&iov, 1);
+		log_stage_len = 0;
+	}
+
+	for (i = 0; i < log_staged_count; i++)
+		log_store(&log_staged[i].ring->out, log_staged[i].out);
+	log_staged_count = 0;
+}
+
+static void log_stage_done(struct log_ring *ring, unsigned int out)
+{
+	if (log_staged_count == LOG_IOV_MAX)
+		log_stage_flush();
+
+	log_staged[log_staged_count].ring = ring;
+	log_staged[log_staged_count].out = out;
+	log_staged_count++;
+}
+
+/* The string at key, ahead of the first record referring to it. */
+static void log_stage_string(uint64_t key)
+{
+	struct log_dict_entry *e = log_dict_slot(&log_written, key);
+	struct log_rec *rec;
+	size_t len, size;
+
+	if (!e || e->key == key)
+		return;
+	e->key = key;
+	log_written.count++;
+
+	len = strlen((const char *) (uintptr_t) key);
+	if (len > LOG_REC_MAX - sizeof(*rec) - 8)
+		len = LOG_REC_MAX - sizeof(*rec) - 8;
+	size = sizeof(*rec) + LOG_ALIGN8(len + 1);
+
+	rec = (struct log_rec *) (log_stage + log_stage_len);
+	log_rec_init(rec, size, LOG_REC_STRING, 0, len, NULL, NULL);
+	rec->fmt = key;
+	log_rec_string((char *) rec->args, (const char *) (uintptr_t) key, len);
+	log_stage_len += size;
+}
+
+static void log_stage_record(const struct log_rec *rec)
+{
+	const char *fmt = (const char *) (uintptr_t) rec->fmt;
+	const char *tag = (const char *) (uintptr_t) rec->tag;
+
+	if (log_async_mode == LOG_ASYNC_BINARY) {
+		log_stage_string(rec->fmt);
+		if (rec->line >= 0)
+			log_stage_string(rec->tag);
+		memcpy(log_stage + log_stage_len, rec, rec->size);
+		log_stage_len += rec->size;
+		return;
+	}
+
+	log_stage_len += log_format_record(log_stage + log_stage_len, BUFSIZE,
+				rec, fmt, tag, log_sig_get(fmt, tag)->types);
+}
+
+/* Format or copy out everything queued, in writes of LOG_STAGE_SIZE. */
+static void log_flush_records(void)
+{
+	struct log_ring *ring;
+
+	for (ring = log_load(&log_rings); ring; ring = ring->next) {
+		unsigned int out = ring->out;
+		unsigned int in = log_load(&ring->in);
+
+		if (out == in) {
+			log_ring_drained(ring, in);
+			continue;
+		}
+
+		/* lines queued before may have left it unaligned */
+		for (out = LOG_ALIGN8(out); out != in; ) {
+			const struct log_rec *rec = (const struct log_rec *)
+				(ring->buf + (out & (LOG_RING_SIZE - 1)));
+
+			if (rec->level != LOG_REC_PAD) {
+				if (LOG_STAGE_SIZE - log_stage_len < LOG_STAGE_NEED) {
+					log_stage_done(ring, out);
+					log_stage_flush();
+				}
+				log_stage_record(rec);
+			}
+			out += rec->size;
+		}
+
+		log_stage_done(ring, out);
+	}
+
+	log_stage_flush();
+}
+
+static void log_flush(void)
+{
+	if (log_async_mode == LOG_ASYNC_TEXT)
+		log_flush_rings();
+	else
+		log_flush_records();
+}
+
+static void *log_flusher_thread(void *arg)
+{
+	while (log_load(&log_async_running)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		sem_timedwait(&log_wakeup, &ts);
+
+		log_flush();
+	}
+
+	/* what was queued before logging went synchronous again */
+	log_flush();
+	return NULL;
+}
+
+/*
+ * Send log lines through the asynchronous sink into path, appended to,
+ * or stderr if path is NULL.  mode is what the rings carry, and for
+ * LOG_ASYNC_BINARY what is written.  Returns 0, or -1 with errno set.
+ */
+int log_async_start_mode(const char *path, int mode)
+{
+	int fd = STDERR_FILENO;
+
+	if (log_load(&log_async_running))
+		return 0;
+
+	if (mode < LOG_ASYNC_TEXT || mode > LOG_ASYNC_BINARY) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (path) {
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -1;
+	}
+
+	pthread_once(&log_wakeup_once, log_wakeup_init);
+	if (log_wakeup_error) {
+		if (fd != STDERR_FILENO)
+			close(fd);
+		errno = log_wakeup_error;
+		return -1;
+	}
+
+	/* libraries loaded later log their lines formatted */
+	if (mode != LOG_ASYNC_TEXT && !log_range_count)
+		dl_iterate_phdr(log_add_range, NULL);
+
+	if (mode == LOG_ASYNC_BINARY) {
+		memcpy(log_stage, LOG_BIN_MAGIC, strlen(LOG_BIN_MAGIC));
+		log_stage_len = strlen(LOG_BIN_MAGIC);
+	}
+
+	log_async_fd = fd;
+	log_store(&log_async_mode, mode);
+	log_store(&log_async_running, 1);
+
+	errno = pthread_create(&log_flusher, NULL, log_flusher_thread, NULL);
+	if (errno) {
+		log_store(&log_async_running, 0);
+		log_store(&log_async_mode, LOG_ASYNC_TEXT);
+		log_stage_len = 0;
+		if (fd != STDERR_FILENO)
+			close(fd);
+		log_async_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int log_async_start(const char *path)
+{
+	return log_async_start_mode(path, LOG_ASYNC_TEXT);
+}
+
+/*
+ * Write out what is queued and go back to logging synchronously.
+ * Lines logged by other threads while this runs may be lost.
+ */
+void log_async_stop(void)
+{
+	if (!log_load(&log_async_running))
+		return;
+
+	log_store(&log_async_running, 0);
+	sem_post(&log_wakeup);
+	pthread_join(log_flusher, NULL);
+
+	log_store(&log_async_mode, LOG_ASYNC_TEXT);
+	log_dict_clear(&log_written);
+	if (log_async_fd != STDERR_FILENO)
+		close(log_async_fd);
+	log_async_fd = -1;
+}
+
+void log_get_stats(log_stats_t *stats)
+{
+	struct log_ring *ring;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (ring = log_load(&log_rings); ring; ring = ring->next) {
+		stats->lines += log_counter(&ring->lines);
+		stats->dropped += log_counter(&ring->dropped);
+	}
+
+	stats->bytes = log_counter(&log_bytes);
+	stats->writes = log_counter(&log_writes);
+	stats->errors = log_counter(&log_write_errors);
+}
+
+/*
+ * Format what a LOG_ASYNC_BINARY sink wrote to fd into out, the lines
+ * the flusher would have written in LOG_ASYNC_DEFERRED mode.  The file
+ * must come from a machine of the same architecture.  Returns the
+ * number of lines, or -1 with errno set.
+ */
+int log_binary_decode(int fd, FILE *out)
+{
+	struct log_dict dict = { NULL, 0, 0 };
+	char *data = NULL, line[BUFSIZE];
+	size_t size = 0, len = 0, pos = 0;
+	int lines = 0, ret = -1;
+
+	for (;;) {
+		ssize_t n;
+
+		if (len == size) {
+			char *grown = realloc(data, size ? size * 2 : LOG_STAGE_SIZE);
+
+			if (!grown)
+				goto out;
+			data = grown;
+			size = size ? size * 2 : LOG_STAGE_SIZE;
+		}
+
+		n = read(fd, data + len, size - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		if (!n)
+			break;
+		len += n;
+	}
+
+	while (pos < len) {
+		unsigned char types[LOG_MAX_ARGS];
+		const struct log_rec *rec;
+		struct log_dict_entry *e;
+		const char *fmt, *tag;
+		size_t strs;
+		int i, nargs;
+
+		if (len - pos >= strlen(LOG_BIN_MAGIC) &&
+			!memcmp(data + pos, LOG_BIN_MAGIC, strlen(LOG_BIN_MAGIC))) {
+			/* a new session, the addresses may mean other strings */
+			log_dict_clear(&dict);
+			pos += strlen(LOG_BIN_MAGIC);
+			continue;
+		}
+
+		rec = (const struct log_rec *) (data + pos);
+		if (len - pos < sizeof(*rec) || rec->size < sizeof(*rec) ||
+				rec->size % 8 || rec->size > len - pos ||
+				rec->nargs > (rec->size - sizeof(*rec)) / 8) {
+			errno = EINVAL;
+			goto out;
+		}
+		pos += rec->size;
+
+		if (rec->level == LOG_REC_STRING) {
+			e = log_dict_slot(&dict, rec->fmt);
+			if (!e)
+				goto out;
+			if (e->key != rec->fmt) {
+				e->key = rec->fmt;
+				dict.count++;
+			}
+			free(e->str);
+			e->str = strndup((const char *) rec->args,
+						rec->size - sizeof(*rec));
+			continue;
+		}
+
+		if (rec->level > LOG_DEBUG)
+			continue;
+
+		fmt = log_dict_get(&dict, rec->fmt);
+		tag = log_dict_get(&dict, rec->tag);
+
+		/* the arguments must match the format, the strings fit */
+		nargs = fmt ? log_parse_format(fmt, types, NULL) : -1;
+		strs = sizeof(*rec) + rec->nargs * 8;
+		for (i = 0; i < nargs && nargs == rec->nargs; i++) {
+			if (types[i] != LOG_ARG_STR)
+				continue;
+			if (rec->args[i] >= rec->size)
+				strs = rec->size + 1;
+			else
+				strs += LOG_ALIGN8(rec->args[i] + 1);
+		}
+		if (nargs != rec->nargs || strs > rec->size)
+			fmt = "(unknown format)";
+
+		fwrite(line, 1, log_format_record(line, sizeof(line), rec, fmt,
+						tag ? tag : "?", types), out);
+		lines++;
+	}
+
+	ret = lines;
+out:
+	free(data);
+	log_dict_clear(&dict);
+	return ret;
 }
 
 /*
@@ -41,19 +1387,37 @@ void assert_fail(const char *assertion, const char *file,
 	abort();
 }
 
+/*
+ * Both return before formatting anything for a level which is off.
+ * Format strings are checked at compile time now, see log_util.h.
+ */
 void sys_debug (int level, char *fmt, ...)
 {
 	char buf[BUFSIZE];
 	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(buf, BUFSIZE, fmt, ap);
-	if (strstr (buf, "%s") != NULL) {
-		fprintf (stderr, "WARNING, xa_debug() called with '%%s' formatted string [%s]!", buf);
+	int len;
+
+	if (level > log_level || level < 0)
 		return;
+
+	if (log_load(&log_async_mode) != LOG_ASYNC_TEXT) {
+		va_start(ap, fmt);
+		len = log_defer(level, NULL, -1, fmt, ap);
+		va_end(ap);
+		if (!len)
+			return;
 	}
 
-	fprintf (stderr, "%s\n", buf);
+	va_start(ap, fmt);
+	len = vsnprintf(buf, BUFSIZE - 1, fmt, ap);
 	va_end (ap);
+	if (len < 0)
+		return;
+	if (len > BUFSIZE - 2)
+		len = BUFSIZE - 2;
+
+	buf[len++] = '\n';
+	log_emit(level, buf, len);
 }
 
 void sys_debug_ext(int level, const char *tag, int line_num, const char *fmt, ...)
@@ -61,23 +1425,31 @@ void sys_debug_ext(int level, const char *tag, int line_num, const char *fmt, ..
 	if (level > log_level || level < 0)
 		return;
 
-	char buf[512] = { 0 };
-	struct log_tm ltm;
+	char buf[BUFSIZE];
+	struct timeval tv;
 	va_list ap;
-	va_start(ap, fmt);
+	int len, n;
 
-	log_time(&ltm);
-	vsnprintf(buf, sizeof(buf)-1, fmt, ap);
-	if (strstr (buf, "%s") != NULL) {
-		fprintf (stderr, "WARNING, xa_debug() called with '%%s' formatted string [%s]!", buf);
-		goto exit;
+	if (log_load(&log_async_mode) != LOG_ASYNC_TEXT) {
+		va_start(ap, fmt);
+		n = log_defer(level, tag, line_num, fmt, ap);
+		va_end(ap);
+		if (!n)
+			return;
 	}
 
-	fprintf(stderr, "[%s(%d)_%s %02d:%02d:%02d.%d] %s\n", tag, line_num, log_level_string[level],
-			ltm.tm_hour, ltm.tm_min, ltm.tm_sec, ltm.tm_usec, buf);
-	fflush(stderr);
-exit:
+	gettimeofday(&tv, NULL);
+	len = log_format_prefix(buf, BUFSIZE - 1, level, tag, line_num, &tv);
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, BUFSIZE - 1 - len, fmt, ap);
 	va_end (ap);
-	//unlock(log_mutex);
-}
+	if (n < 0)
+		return;
+	len += n;
+	if (len > BUFSIZE - 2)
+		len = BUFSIZE - 2;
 
+	buf[len++] = '\n';
+	log_emit(level, buf, len);
+}
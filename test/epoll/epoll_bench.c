@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "epoll_loop.h"
+#include "reactor_group.h"
+
+#define PAIR_COUNT  10000
+#define EVENT_COUNT (500 * 1000)
+#define TIMER_COUNT (100 * 1000)
+#define TIMER_SPAN  1000		/* msec */
+#define POST_COUNT  (1000 * 1000)
+#define CONN_COUNT  5000
+#define REACTORS    4
+
+/*
+ * Both ends of every pair are registered with the loop and bounce a
+ * single token between them, so all pairs stay busy and every callback
+ * is one event.
+ */
+static int (*pairs)[2];
+static int pair_count;
+static long dispatched;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pair_cb(int fd, uint32_t events, void *user_data)
+{
+	char buf[64];
+	ssize_t n;
+
+	/* drain until EAGAIN so edge-triggered mode sees every token */
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (write(fd, buf, n) != n)
+			mainloop_quit(mainloop_current());
+	}
+
+	if (++dispatched >= EVENT_COUNT)
+		mainloop_quit(mainloop_current());
+}
+
+static void pair_recv_cb(int fd, const void *buf, ssize_t len, void *user_data)
+{
+	if (len > 0 && write(fd, buf, len) != len)
+		mainloop_quit(mainloop_current());
+
+	if (++dispatched >= EVENT_COUNT)
+		mainloop_quit(mainloop_current());
+}
+
+/*
+ * A task which posts itself again, standing for the loop's own work: the
+ * gap between two runs is how long timeouts and posted tasks wait behind
+ * the fd callbacks.
+ */
+static double task_last, task_gap_max;
+static long task_runs;
+
+static void gap_task(void *user_data)
+{
+	double now = now_sec();
+
+	if (now - task_last > task_gap_max)
+		task_gap_max = now - task_last;
+	task_last = now;
+	task_runs++;
+
+	if (dispatched < EVENT_COUNT)
+		mainloop_post(mainloop_current(), gap_task, NULL, NULL);
+}
+
+static int make_pairs(void)
+{
+	struct rlimit rl;
+	int i;
+
+	/* two fds per pair, keep some for stdio, the loops and sockets */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	pair_count = PAIR_COUNT;
+	if ((rlim_t) pair_count * 2 + 64 > rl.rlim_cur)
+		pair_count = (rl.rlim_cur - 64) / 2;
+
+	pairs = calloc(pair_count, sizeof(*pairs));
+	for (i = 0; i < pair_count; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pairs[i]) < 0) {
+			perror("socketpair");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void bench_loop(const char *what, unsigned int batch,
+			unsigned int budget, uint32_t flags)
+{
+	double start;
+	int i;
+
+	epoll_init();
+	epoll_set_batch_size(batch);
+	epoll_set_dispatch_budget(budget);
+
+	for (i = 0; i < pair_count * 2; i++) {
+		int fd = pairs[i / 2][i % 2];
+
+		if (epoll_add_fd(fd, EPOLLIN | flags, pair_cb, NULL, NULL) < 0) {
+			printf("  %-24s fd %d rejected\n", what, fd);
+			epoll_run();
+			return;
+		}
+	}
+	for (i = 0; i < pair_count; i++) {
+		if (write(pairs[i][1], "t", 1) != 1)
+			return;
+	}
+
+	dispatched = 0;
+	task_runs = 0;
+	task_gap_max = 0;
+	start = task_last = now_sec();
+	mainloop_post(mainloop_default(), gap_task, NULL, NULL);
+	epoll_run();
+	printf("  %-24s batch %4u %8.2f Mevents/s, task every %7.1f us, %8.1f at most\n",
+			what, batch, dispatched / (now_sec() - start) / 1e6,
+			(now_sec() - start) * 1e6 / task_runs, task_gap_max * 1e6);
+
+	/* tokens still in flight */
+	for (i = 0; i < pair_count * 2; i++) {
+		char buf[64];
+
+		while (read(pairs[i / 2][i % 2], buf, sizeof(buf)) > 0)
+			;
+	}
+}
+
+/*
+ * The same ping-pong on a loop of each backend, with fd watches and
+ * with receivers, which io_uring serves with multishot recv into its
+ * provided buffers instead of readiness plus read.  The gap task shows
+ * what the dispatch budget does for the loop's own work on each.
+ */
+static void bench_backend(enum mainloop_backend backend, const char *what,
+			uint32_t flags, bool receiver, unsigned int budget)
+{
+	struct mainloop *loop = mainloop_new_backend(backend);
+	double start;
+	int i, err;
+
+	if (!loop || mainloop_get_backend(loop) != backend) {
+		printf("  %-24s unavailable\n", what);
+		mainloop_free(loop);
+		return;
+	}
+	mainloop_set_dispatch_budget(loop, budget);
+
+	for (i = 0; i < pair_count * 2; i++) {
+		int fd = pairs[i / 2][i % 2];
+
+		if (receiver)
+			err = mainloop_add_receiver(loop, fd, pair_recv_cb,
+								NULL, NULL);
+		else
+			err = mainloop_add_fd(loop, fd, EPOLLIN | flags,
+							pair_cb, NULL, NULL);
+		if (err < 0) {
+			printf("  %-24s fd %d rejected\n", what, fd);
+			mainloop_free(loop);
+			return;
+		}
+	}
+	for (i = 0; i < pair_count; i++) {
+		if (write(pairs[i][1], "t", 1) != 1)
+			return;
+	}
+
+	dispatched = 0;
+	task_runs = 0;
+	task_gap_max = 0;
+	start = task_last = now_sec();
+	mainloop_post(loop, gap_task, NULL, NULL);
+	mainloop_run(loop);
+	printf("  %-24s %8.2f Mevents/s, task every %7.1f us, %8.1f at most\n",
+			what, dispatched / (now_sec() - start) / 1e6,
+			(now_sec() - start) * 1e6 / task_runs, task_gap_max * 1e6);
+
+	mainloop_free(loop);
+
+	for (i = 0; i < pair_count * 2; i++) {
+		char buf[64];
+
+		while (read(pairs[i / 2][i % 2], buf, sizeof(buf)) > 0)
+			;
+	}
+}
+
+/*
+ * Timeouts: 100k idle timers spread over a second, each handled the way
+ * connection idle timers are -- armed, pushed back once, then either
+ * cancelled or left to fire.
+ */
+static int timer_ids[TIMER_COUNT];
+static double timer_due[TIMER_COUNT];
+static int timers_left;
+static double timer_start;
+static double timer_late;
+
+static void timer_cb(int id, void *user_data)
+{
+	long i = (long) user_data;
+	/* the first ones are due before the loop even starts */
+	double due = timer_due[i] > timer_start ? timer_due[i] : timer_start;
+	double late = now_sec() - due;
+
+	if (late > timer_late)
+		timer_late = late;
+
+	epoll_remove_timeout(id);
+	if (!--timers_left)
+		epoll_quit();
+}
+
+static void bench_timeouts(void)
+{
+	unsigned int r = 1;
+	double start;
+	long i;
+
+	epoll_init();
+
+	start = now_sec();
+	for (i = 0; i < TIMER_COUNT; i++) {
+		timer_ids[i] = epoll_add_timeout(TIMER_SPAN * 10, timer_cb,
+							(void *) i, NULL);
+		if (timer_ids[i] < 0) {
+			printf("  add failed at %ld\n", i);
+			epoll_run();
+			return;
+		}
+	}
+	printf("  %-24s %8.1f ns/op\n", "add", (now_sec() - start) * 1e9 / TIMER_COUNT);
+
+	start = now_sec();
+	for (i = 0; i < TIMER_COUNT; i++) {
+		unsigned int msec;
+
+		r = r * 1103515245 + 12345;
+		msec = 1 + (r >> 8) % TIMER_SPAN;
+		timer_due[i] = now_sec() + msec / 1e3;
+		epoll_modify_timeout(timer_ids[i], msec);
+	}
+	printf("  %-24s %8.1f ns/op\n", "modify", (now_sec() - start) * 1e9 / TIMER_COUNT);
+
+	start = now_sec();
+	for (i = 0; i < TIMER_COUNT; i += 2)
+		epoll_remove_timeout(timer_ids[i]);
+	printf("  %-24s %8.1f ns/op\n", "remove", (now_sec() - start) * 1e9 / (TIMER_COUNT / 2));
+
+	timers_left = TIMER_COUNT / 2;
+	timer_late = 0;
+	timer_start = now_sec();
+	epoll_run();
+	printf("  %-24s %d fired in %.2f s, %.2f ms late at worst\n", "expire",
+			TIMER_COUNT / 2 - timers_left, now_sec() - timer_start,
+			timer_late * 1e3);
+}
+
+/*
+ * Reactor group: tasks posted from the main thread to the loops, then
+ * connections accepted on one loop and handed out, or accepted by every
+ * loop on its own SO_REUSEPORT socket.
+ */
+static int tasks_done;
+static int conns[REACTORS];
+static struct reactor_group *group;
+
+static void post_task(void *user_data)
+{
+	__atomic_fetch_add(&tasks_done, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_post(void)
+{
+	double start;
+	int i;
+
+	tasks_done = 0;
+	start = now_sec();
+	for (i = 0; i < POST_COUNT; i++)
+		mainloop_post(reactor_group_next(group), post_task, NULL, NULL);
+	while (__atomic_load_n(&tasks_done, __ATOMIC_RELAXED) < POST_COUNT)
+		sched_yield();
+	printf("  %-24s %8.2f Mtasks/s\n", "mainloop_post",
+			POST_COUNT / (now_sec() - start) / 1e6);
+}
+
+static void conn_accepted(struct mainloop *loop, int fd, void *user_data)
+{
+	int i;
+
+	for (i = 0; i < REACTORS; i++) {
+		if (reactor_group_loop(group, i) == loop)
+			__atomic_fetch_add(&conns[i], 1, __ATOMIC_RELAXED);
+	}
+	close(fd);
+}
+
+static void bench_accept(const char *what, struct sockaddr_in *addr)
+{
+	double start;
+	int i, done;
+
+	memset(conns, 0, sizeof(conns));
+	start = now_sec();
+	for (i = 0; i < CONN_COUNT; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+			perror("connect");
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+	do {
+		sched_yield();
+		for (i = 0, done = 0; i < REACTORS; i++)
+			done += __atomic_load_n(&conns[i], __ATOMIC_RELAXED);
+	} while (done < CONN_COUNT);
+
+	printf("  %-24s %8.0f conn/s, per loop", what,
+			CONN_COUNT / (now_sec() - start));
+	for (i = 0; i < REACTORS; i++)
+		printf(" %d", conns[i]);
+	printf("\n");
+}
+
+static void bench_reactors(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd, on = 1;
+
+	group = reactor_group_new(REACTORS, true);
+	if (!group || reactor_group_start(group) < 0) {
+		printf("  reactor group unavailable\n");
+		return;
+	}
+	bench_post();
+	reactor_group_stop(group);
+
+	/* a shared listener accepted by the first loop */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+				listen(fd, SOMAXCONN) < 0 ||
+				getsockname(fd, (struct sockaddr *) &addr, &len) < 0 ||
+				reactor_group_accept(group, fd, conn_accepted, NULL) < 0) {
+		perror("listen");
+		return;
+	}
+	reactor_group_start(group);
+	bench_accept("accept + handoff", &addr);
+	reactor_group_free(group);
+	close(fd);
+
+	/* one SO_REUSEPORT listener per loop, on a port picked by the kernel */
+	group = reactor_group_new(REACTORS, true);
+	addr.sin_port = 0;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+				getsockname(fd, (struct sockaddr *) &addr, &len) < 0 ||
+				reactor_group_listen(group, (struct sockaddr *) &addr,
+						sizeof(addr), conn_accepted, NULL) < 0) {
+		perror("SO_REUSEPORT");
+		close(fd);
+		reactor_group_free(group);
+		return;
+	}
+	close(fd);
+	reactor_group_start(group);
+	bench_accept("SO_REUSEPORT", &addr);
+	reactor_group_free(group);
+}
+
+int main(int argc, char *argv[])
+{
+	if (make_pairs() < 0)
+		return EXIT_FAILURE;
+
+	printf("%d socketpairs, one token each, %d events:\n", pair_count,
+								EVENT_COUNT);
+	bench_loop("level-triggered", 10, 0, 0);
+	bench_loop("level-triggered", 64, 0, 0);
+	bench_loop("level-triggered", 1024, 0, 0);
+	bench_loop("edge-triggered", 64, 0, EPOLLET);
+	bench_loop("edge-triggered", 1024, 0, EPOLLET);
+	bench_loop("edge, budget 16", 1024, 16, EPOLLET);
+	bench_loop("level, budget 16", 1024, 16, 0);
+
+	printf("epoll vs io_uring, same %d events:\n", EVENT_COUNT);
+	bench_backend(MAINLOOP_BACKEND_EPOLL, "epoll level", 0, false, 0);
+	bench_backend(MAINLOOP_BACKEND_URING, "io_uring level", 0, false, 0);
+	bench_backend(MAINLOOP_BACKEND_EPOLL, "epoll edge", EPOLLET, false, 0);
+	bench_backend(MAINLOOP_BACKEND_URING, "io_uring edge", EPOLLET, false, 0);
+	bench_backend(MAINLOOP_BACKEND_EPOLL, "epoll receiver", 0, true, 0);
+	bench_backend(MAINLOOP_BACKEND_URING, "io_uring receiver", 0, true, 0);
+	bench_backend(MAINLOOP_BACKEND_EPOLL, "epoll, budget 16", 0, false, 16);
+	bench_backend(MAINLOOP_BACKEND_URING, "io_uring, budget 16", 0, false, 16);
+	bench_backend(MAINLOOP_BACKEND_URING, "io_uring recv, budget 16", 0, true, 16);
+
+	printf("%d timeouts, one timerfd:\n", TIMER_COUNT);
+	bench_timeouts();
+
+	printf("%d reactors:\n", REACTORS);
+	bench_reactors();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <fifo.h>
+
+#define FIFO_SIZE   (64 * 1024)
+#define CHUNK_SIZE  1024
+#define TOTAL_BYTES (512ULL * 1024 * 1024)
+
+#define REC_SIZE    64
+#define REC_COUNT   1024
+#define TOTAL_RECS  (4 * 1024 * 1024)
+#define MAX_WORKERS 4
+
+#define CHECK_BYTES (64 * 1024 * 1024)
+#define CHECK_RECS  (256 * 1024)	/* per producer */
+#define CHECK_SIZE  64			/* small, so the ring wraps and fills often */
+
+enum {
+    BENCH_KFIFO_MUTEX = 0,
+    BENCH_KFIFO_SPIN,
+    BENCH_KFIFO_LOCKLESS,
+    BENCH_KFIFO_SPSC,
+    BENCH_KFIFO_MPMC,
+};
+
+static const char *bench_name[] = {
+    "kfifo + pthread mutex",
+    "kfifo + spinlock",
+    "kfifo lockless (1r/1w)",
+    "kfifo_spsc",
+    "kfifo_mpmc",
+};
+
+struct bench_ctx {
+    int kind;
+    pthread_mutex_t mutex;
+    spinlock_t spin;
+    struct kfifo *kfifo;
+    struct kfifo_spsc *spsc;
+    struct kfifo_mpmc *mpmc;
+    unsigned int unit;			/* bytes moved per call */
+    unsigned long long per_thread;	/* bytes moved per worker */
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int bench_put(struct bench_ctx *ctx, unsigned char *buf, unsigned int len)
+{
+    unsigned int ret;
+
+    switch (ctx->kind) {
+    case BENCH_KFIFO_MUTEX:
+        pthread_mutex_lock(&ctx->mutex);
+        /* records must go in whole when several producers share the fifo */
+        ret = __kfifo_len(ctx->kfifo) + len <= ctx->kfifo->size ?
+            __kfifo_put(ctx->kfifo, buf, len) : 0;
+        pthread_mutex_unlock(&ctx->mutex);
+        return ret;
+    case BENCH_KFIFO_SPIN:
+    case BENCH_KFIFO_LOCKLESS:
+        return kfifo_put(ctx->kfifo, buf, len);
+    case BENCH_KFIFO_SPSC:
+        return kfifo_spsc_put(ctx->spsc, buf, len);
+    default:
+        return kfifo_mpmc_put(ctx->mpmc, buf) ? len : 0;
+    }
+}
+
+static unsigned int bench_get(struct bench_ctx *ctx, unsigned char *buf, unsigned int len)
+{
+    unsigned int ret;
+
+    switch (ctx->kind) {
+    case BENCH_KFIFO_MUTEX:
+        pthread_mutex_lock(&ctx->mutex);
+        ret = __kfifo_len(ctx->kfifo) >= len ? __kfifo_get(ctx->kfifo, buf, len) : 0;
+        pthread_mutex_unlock(&ctx->mutex);
+        return ret;
+    case BENCH_KFIFO_SPIN:
+    case BENCH_KFIFO_LOCKLESS:
+        return kfifo_get(ctx->kfifo, buf, len);
+    case BENCH_KFIFO_SPSC:
+        return kfifo_spsc_get(ctx->spsc, buf, len);
+    default:
+        return kfifo_mpmc_get(ctx->mpmc, buf) ? len : 0;
+    }
+}
+
+static void *producer(void *arg)
+{
+    struct bench_ctx *ctx = (struct bench_ctx *) arg;
+    unsigned char buf[CHUNK_SIZE];
+    unsigned long long done = 0;
+
+    memset(buf, 0x5a, sizeof(buf));
+    while (done < ctx->per_thread) {
+        unsigned int n = bench_put(ctx, buf, ctx->unit);
+        if (!n)
+            sched_yield();
+        done += n;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct bench_ctx *ctx = (struct bench_ctx *) arg;
+    unsigned char buf[CHUNK_SIZE];
+    unsigned long long done = 0;
+
+    while (done < ctx->per_thread) {
+        unsigned int n = bench_get(ctx, buf, ctx->unit);
+        if (!n)
+            sched_yield();
+        done += n;
+    }
+    return NULL;
+}
+
+/*
+ * run_bench - moves data through one fifo flavour with 'workers'
+ * producers and as many consumers, returns elapsed seconds
+ */
+static double run_bench(struct bench_ctx *ctx, int workers)
+{
+    pthread_t prod[MAX_WORKERS], cons[MAX_WORKERS];
+    double start;
+    int i;
+
+    start = now_sec();
+    for (i = 0; i < workers; i++) {
+        pthread_create(&cons[i], NULL, consumer, ctx);
+        pthread_create(&prod[i], NULL, producer, ctx);
+    }
+    for (i = 0; i < workers; i++) {
+        pthread_join(prod[i], NULL);
+        pthread_join(cons[i], NULL);
+    }
+    return now_sec() - start;
+}
+
+static void bench_stream(int kind)
+{
+    struct bench_ctx ctx;
+    double secs;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.kind = kind;
+    ctx.unit = CHUNK_SIZE;
+    ctx.per_thread = TOTAL_BYTES;
+    pthread_mutex_init(&ctx.mutex, NULL);
+    if (kind == BENCH_KFIFO_SPSC)
+        ctx.spsc = kfifo_spsc_alloc(FIFO_SIZE);
+    else
+        ctx.kfifo = kfifo_alloc(FIFO_SIZE, kind == BENCH_KFIFO_SPIN ? &ctx.spin : NULL);
+
+    secs = run_bench(&ctx, 1);
+    printf("  %-26s %8.1f MB/s\n", bench_name[kind], TOTAL_BYTES / secs / (1024 * 1024));
+
+    if (ctx.spsc)
+        kfifo_spsc_free(ctx.spsc);
+    if (ctx.kfifo)
+        kfifo_free(ctx.kfifo);
+    pthread_mutex_destroy(&ctx.mutex);
+}
+
+static void bench_records(int kind, int workers)
+{
+    struct bench_ctx ctx;
+    double secs;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.kind = kind;
+    ctx.unit = REC_SIZE;
+    ctx.per_thread = (unsigned long long) TOTAL_RECS / workers * REC_SIZE;
+    pthread_mutex_init(&ctx.mutex, NULL);
+    if (kind == BENCH_KFIFO_MPMC)
+        ctx.mpmc = kfifo_mpmc_alloc(REC_COUNT, REC_SIZE);
+    else
+        ctx.kfifo = kfifo_alloc(REC_COUNT * REC_SIZE, NULL);
+
+    secs = run_bench(&ctx, workers);
+    printf("  %-26s %dP/%dC %8.2f Mrec/s\n", bench_name[kind], workers, workers,
+           TOTAL_RECS / secs / 1e6);
+
+    if (ctx.mpmc)
+        kfifo_mpmc_free(ctx.mpmc);
+    if (ctx.kfifo)
+        kfifo_free(ctx.kfifo);
+    pthread_mutex_destroy(&ctx.mutex);
+}
+
+/*
+ * check_spsc - one producer streams a byte pattern in chunks of varying
+ * size, the consumer has to read it back without a gap or a repeat
+ */
+static void *check_spsc_producer(void *arg)
+{
+    struct kfifo_spsc *fifo = (struct kfifo_spsc *) arg;
+    unsigned char buf[CHUNK_SIZE];
+    unsigned long long sent = 0;
+    unsigned int len = 1, i, n;
+
+    while (sent < CHECK_BYTES) {
+        len = (len * 7 + 3) % CHUNK_SIZE + 1;
+        for (i = 0; i < len; i++)
+            buf[i] = (sent + i) % 251;
+        n = kfifo_spsc_put(fifo, buf, len);
+        if (!n)
+            sched_yield();
+        sent += n;
+    }
+    return NULL;
+}
+
+static int check_spsc(void)
+{
+    struct kfifo_spsc *fifo = kfifo_spsc_alloc(CHECK_SIZE * 16);
+    unsigned char buf[CHUNK_SIZE];
+    unsigned long long got = 0;
+    unsigned int len = 1, i, n;
+    pthread_t prod;
+    int ret = 0;
+
+    pthread_create(&prod, NULL, check_spsc_producer, fifo);
+    while (got < CHECK_BYTES) {
+        len = (len * 5 + 1) % CHUNK_SIZE + 1;
+        n = kfifo_spsc_get(fifo, buf, len);
+        if (!n)
+            sched_yield();
+        for (i = 0; i < n && !ret; i++) {
+            if (buf[i] != (got + i) % 251) {
+                printf("  kfifo_spsc: byte %llu is %u, expected %u\n", got + i,
+                       buf[i], (unsigned int) ((got + i) % 251));
+                ret = -1;
+            }
+        }
+        got += n;
+    }
+    pthread_join(prod, NULL);
+    kfifo_spsc_free(fifo);
+
+    return ret;
+}
+
+/*
+ * check_mpmc - every producer puts its own sequence of records; each one
+ * has to come out exactly once, and a consumer has to see the records
+ * of one producer in the order they were put
+ */
+struct check_rec {
+    unsigned int producer;
+    unsigned int seq;
+};
+
+struct check_ctx {
+    struct kfifo_mpmc *mpmc;
+    unsigned int producers;
+    unsigned int total;
+    unsigned int taken;			/* records dequeued so far */
+    unsigned char *seen;		/* times each record was dequeued */
+    int failed;
+};
+
+struct check_worker {
+    pthread_t thread;
+    struct check_ctx *ctx;
+    unsigned int id;
+};
+
+static void *check_mpmc_producer(void *arg)
+{
+    struct check_worker *w = (struct check_worker *) arg;
+    struct check_rec rec;
+
+    rec.producer = w->id;
+    for (rec.seq = 0; rec.seq < CHECK_RECS; rec.seq++) {
+        while (!kfifo_mpmc_put(w->ctx->mpmc, &rec))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *check_mpmc_consumer(void *arg)
+{
+    struct check_worker *w = (struct check_worker *) arg;
+    struct check_ctx *ctx = w->ctx;
+    unsigned int next[MAX_WORKERS] = { 0 };	/* lowest seq still to come */
+    struct check_rec rec;
+
+    while (__atomic_load_n(&ctx->taken, __ATOMIC_RELAXED) < ctx->total) {
+        if (!kfifo_mpmc_get(ctx->mpmc, &rec)) {
+            sched_yield();
+            continue;
+        }
+        __atomic_fetch_add(&ctx->taken, 1, __ATOMIC_RELAXED);
+
+        if (rec.producer >= ctx->producers || rec.seq >= CHECK_RECS ||
+            rec.seq < next[rec.producer]) {
+            if (!__atomic_exchange_n(&ctx->failed, 1, __ATOMIC_RELAXED))
+                printf("  kfifo_mpmc: consumer %u got record %u/%u out of order\n",
+                       w->id, rec.producer, rec.seq);
+            continue;
+        }
+        next[rec.producer] = rec.seq + 1;
+        __atomic_fetch_add(&ctx->seen[rec.producer * CHECK_RECS + rec.seq], 1,
+                           __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int check_mpmc(unsigned int workers)
+{
+    struct check_worker prod[MAX_WORKERS], cons[MAX_WORKERS];
+    struct check_ctx ctx;
+    unsigned int i, lost = 0, repeated = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.mpmc = kfifo_mpmc_alloc(CHECK_SIZE, sizeof(struct check_rec));
+    ctx.producers = workers;
+    ctx.total = workers * CHECK_RECS;
+    ctx.seen = (unsigned char *) calloc(ctx.total, 1);
+    if (!ctx.seen) {
+        kfifo_mpmc_free(ctx.mpmc);
+        return -1;
+    }
+
+    for (i = 0; i < workers; i++) {
+        cons[i].ctx = prod[i].ctx = &ctx;
+        cons[i].id = prod[i].id = i;
+        pthread_create(&cons[i].thread, NULL, check_mpmc_consumer, &cons[i]);
+        pthread_create(&prod[i].thread, NULL, check_mpmc_producer, &prod[i]);
+    }
+    for (i = 0; i < workers; i++) {
+        pthread_join(prod[i].thread, NULL);
+        pthread_join(cons[i].thread, NULL);
+    }
+
+    for (i = 0; i < ctx.total; i++) {
+        if (ctx.seen[i] == 0)
+            lost++;
+        else if (ctx.seen[i] > 1)
+            repeated++;
+    }
+    if (lost || repeated)
+        printf("  kfifo_mpmc %uP/%uC: %u records lost, %u dequeued twice\n",
+               workers, workers, lost, repeated);
+
+    free(ctx.seen);
+    kfifo_mpmc_free(ctx.mpmc);
+
+    return (lost || repeated || ctx.failed) ? -1 : 0;
+}
+
+/*
+ * bench_relay - /dev/zero -> fifo -> /dev/null, either bouncing through
+ * a stack buffer on both sides or reading/writing the ring in place
+ */
+static void bench_relay(int zero_copy)
+{
+    struct kfifo *fifo = kfifo_alloc(FIFO_SIZE, NULL);
+    unsigned char buf[FIFO_SIZE / 2];
+    unsigned long long moved = 0;
+    int in_fd = open("/dev/zero", O_RDONLY);
+    int out_fd = open("/dev/null", O_WRONLY);
+    double start = now_sec();
+
+    while (moved < TOTAL_BYTES) {
+        ssize_t n;
+
+        if (zero_copy) {
+            kfifo_fill_fd(fifo, in_fd, sizeof(buf));
+            n = kfifo_drain_fd(fifo, out_fd, sizeof(buf));
+        } else {
+            n = read(in_fd, buf, fifo->size - kfifo_len(fifo) < sizeof(buf) ?
+                     fifo->size - kfifo_len(fifo) : sizeof(buf));
+            if (n > 0)
+                kfifo_put(fifo, buf, n);
+            n = kfifo_get(fifo, buf, sizeof(buf));
+            if (n > 0)
+                n = write(out_fd, buf, n);
+        }
+        if (n > 0)
+            moved += n;
+    }
+    printf("  %-26s %8.1f MB/s\n", zero_copy ? "fill_fd/drain_fd" : "read+put/get+write",
+           moved / (now_sec() - start) / (1024 * 1024));
+
+    close(in_fd);
+    close(out_fd);
+    kfifo_free(fifo);
+}
+
+/*
+ * bench_wrap - put/get of MTU-sized packets that keep straddling the end
+ * of a small ring, the case where a plain kfifo splits every memcpy
+ */
+static void bench_wrap(int mirrored)
+{
+    struct kfifo *fifo;
+    unsigned char buf[1500];
+    unsigned long long moved = 0;
+    double start;
+
+    fifo = mirrored ? kfifo_alloc_mirrored(4096, NULL) : kfifo_alloc(4096, NULL);
+    if (!fifo) {
+        printf("  %-26s unavailable\n", "mirrored kfifo");
+        return;
+    }
+
+    memset(buf, 0x5a, sizeof(buf));
+    start = now_sec();
+    while (moved < TOTAL_BYTES) {
+        __kfifo_put(fifo, buf, sizeof(buf));
+        moved += __kfifo_get(fifo, buf, sizeof(buf));
+    }
+    printf("  %-26s %8.1f MB/s\n", mirrored ? "mirrored kfifo" : "kfifo",
+           moved / (now_sec() - start) / (1024 * 1024));
+
+    kfifo_free(fifo);
+}
+
+int main(int argc, char *argv[])
+{
+    int workers;
+
+    if (check_spsc() < 0 || check_mpmc(1) < 0 || check_mpmc(2) < 0 ||
+        check_mpmc(MAX_WORKERS) < 0)
+        return EXIT_FAILURE;
+
+    printf("byte stream, 1 producer / 1 consumer, %d byte chunks:\n", CHUNK_SIZE);
+    bench_stream(BENCH_KFIFO_MUTEX);
+    bench_stream(BENCH_KFIFO_SPIN);
+    bench_stream(BENCH_KFIFO_LOCKLESS);
+    bench_stream(BENCH_KFIFO_SPSC);
+
+    printf("%d byte records:\n", REC_SIZE);
+    for (workers = 1; workers <= MAX_WORKERS; workers *= 2) {
+        bench_records(BENCH_KFIFO_MUTEX, workers);
+        bench_records(BENCH_KFIFO_MPMC, workers);
+    }
+
+    printf("fd relay through a kfifo:\n");
+    bench_relay(0);
+    bench_relay(1);
+
+    printf("1500 byte put/get on a 4k ring:\n");
+    bench_wrap(0);
+    bench_wrap(1);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "epoll_loop.h"
+#include "happy_connect.h"
+
+#define CONNECTS	10		/* one after the other, per case */
+#define FANOUT		100		/* at once on one loop */
+#define ATTEMPT_TIMEOUT	1000
+
+static struct sockaddr_in good_addr;
+static struct sockaddr_in6 stalled_addr;
+static struct addrinfo good_ai, stalled_ai;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int listen_on(struct sockaddr *addr, socklen_t len, int backlog)
+{
+	int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+
+	if (fd < 0 || bind(fd, addr, len) < 0 || listen(fd, backlog) < 0 ||
+			getsockname(fd, addr, &len) < 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static void good_accept(int fd, void *user_data)
+{
+	close(fd);
+}
+
+/*
+ * A listener whose accept queue is full and never drained: the kernel
+ * drops further SYNs, so connecting to it hangs in SYN retransmits, like
+ * a host behind a path that black-holes packets.
+ */
+static void stall_listener(void)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		struct pollfd pfd;
+		int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+		connect(fd, (struct sockaddr *) &stalled_addr, sizeof(stalled_addr));
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 100) == 0) {
+			close(fd);
+			return;
+		}
+	}
+
+	printf("could not fill the accept queue\n");
+	exit(EXIT_FAILURE);
+}
+
+/* What a blocking client does: one address after the other. */
+static int connect_sequential(const struct addrinfo *ai)
+{
+	for (; ai; ai = ai->ai_next) {
+		struct pollfd pfd;
+		socklen_t len = sizeof(int);
+		int fd, err = 0;
+
+		fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+						errno != EINPROGRESS) {
+			close(fd);
+			continue;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, ATTEMPT_TIMEOUT) == 1 &&
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+			!err)
+			return fd;
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+struct race {
+	struct mainloop *loop;
+	int pending;
+	int failed;
+};
+
+static void race_done(int fd, int err, void *user_data)
+{
+	struct race *race = user_data;
+
+	if (fd < 0)
+		race->failed++;
+	else
+		close(fd);
+
+	if (--race->pending == 0)
+		mainloop_quit(race->loop);
+}
+
+/* count connects started together, returns when all have finished */
+static int connect_happy(struct mainloop *loop, const struct addrinfo *ai,
+					unsigned int delay, int count)
+{
+	struct race race = { loop, 0, 0 };
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!happy_connect_start(loop, ai, delay, ATTEMPT_TIMEOUT,
+							race_done, &race))
+			race.failed++;
+		else
+			race.pending++;
+	}
+
+	if (race.pending)
+		mainloop_run(loop);
+
+	return race.failed;
+}
+
+static void bench(struct mainloop *loop, const char *what,
+					const struct addrinfo *ai)
+{
+	double start;
+	int i, failed = 0;
+
+	printf("%s:\n", what);
+
+	start = now_sec();
+	for (i = 0; i < CONNECTS; i++) {
+		int fd = connect_sequential(ai);
+
+		if (fd < 0)
+			failed++;
+		else
+			close(fd);
+	}
+	printf("  %-28s %9.3f ms/connect, %d failed\n", "sequential",
+			(now_sec() - start) * 1e3 / CONNECTS, failed);
+
+	start = now_sec();
+	failed = 0;
+	for (i = 0; i < CONNECTS; i++)
+		failed += connect_happy(loop, ai, HAPPY_CONNECT_ATTEMPT_DELAY, 1);
+	printf("  %-28s %9.3f ms/connect, %d failed\n", "happy eyeballs, 250ms delay",
+			(now_sec() - start) * 1e3 / CONNECTS, failed);
+
+	start = now_sec();
+	failed = 0;
+	for (i = 0; i < CONNECTS; i++)
+		failed += connect_happy(loop, ai, HAPPY_CONNECT_MIN_DELAY, 1);
+	printf("  %-28s %9.3f ms/connect, %d failed\n", "happy eyeballs, 100ms delay",
+			(now_sec() - start) * 1e3 / CONNECTS, failed);
+
+	start = now_sec();
+	failed = connect_happy(loop, ai, HAPPY_CONNECT_ATTEMPT_DELAY, FANOUT);
+	printf("  %-28s %9.3f ms for all %d, %d failed\n", "happy eyeballs, fan-out",
+			(now_sec() - start) * 1e3, FANOUT, failed);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mainloop *loop;
+	int good_fd, stalled_fd;
+
+	good_addr.sin_family = AF_INET;
+	good_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	good_fd = listen_on((struct sockaddr *) &good_addr, sizeof(good_addr),
+								SOMAXCONN);
+
+	stalled_addr.sin6_family = AF_INET6;
+	stalled_addr.sin6_addr = in6addr_loopback;
+	stalled_fd = listen_on((struct sockaddr *) &stalled_addr,
+						sizeof(stalled_addr), 0);
+	stall_listener();
+
+	good_ai.ai_family = AF_INET;
+	good_ai.ai_socktype = SOCK_STREAM;
+	good_ai.ai_addr = (struct sockaddr *) &good_addr;
+	good_ai.ai_addrlen = sizeof(good_addr);
+
+	stalled_ai.ai_family = AF_INET6;
+	stalled_ai.ai_socktype = SOCK_STREAM;
+	stalled_ai.ai_addr = (struct sockaddr *) &stalled_addr;
+	stalled_ai.ai_addrlen = sizeof(stalled_addr);
+
+	loop = mainloop_new();
+	fcntl(good_fd, F_SETFL, O_NONBLOCK);
+	mainloop_add_acceptor(loop, good_fd, good_accept, NULL, NULL);
+
+	/* only the good address */
+	bench(loop, "IPv4 listener", &good_ai);
+
+	/* the resolver puts IPv6 first, and its path is broken */
+	stalled_ai.ai_next = &good_ai;
+	bench(loop, "IPv6 stalled, then IPv4", &stalled_ai);
+
+	mainloop_remove_fd(loop, good_fd);
+	mainloop_free(loop);
+	close(good_fd);
+	close(stalled_fd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hash.h"
+
+#define KEY_COUNT (1000 * 1000)
+#define KEY_LEN   48
+
+#define MT_OPS     (2 * 1000 * 1000)	/* per thread */
+#define MT_SHARDS  64
+#define MT_MAX_THREADS 8
+
+static char (*keys)[KEY_LEN];
+static char (*misses)[KEY_LEN];
+static pthread_mutex_t ht_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, double start, int ops)
+{
+	printf("  %-20s %8.1f ns/op\n", what, (now_sec() - start) * 1e9 / ops);
+}
+
+/* URL-like keys, the typical content of the crawler's blacklist */
+static void make_keys(void)
+{
+	int i;
+
+	keys = malloc(sizeof(*keys) * KEY_COUNT);
+	misses = malloc(sizeof(*misses) * KEY_COUNT);
+	for (i = 0; i < KEY_COUNT; i++) {
+		snprintf(keys[i], KEY_LEN, "http://host%d.example.com/p/%d.html", i % 977, i);
+		snprintf(misses[i], KEY_LEN, "http://host%d.example.com/q/%d.html", i % 977, i);
+	}
+}
+
+struct mt_ctx {
+	struct hash_table *ht;		/* single table under ht_lock */
+	struct sharded_hash_table *sht;	/* or a sharded table */
+	int seed;
+};
+
+/* 90% lookups, 10% updates over the whole key set */
+static void *mt_worker(void *arg)
+{
+	struct mt_ctx *ctx = arg;
+	unsigned int r = ctx->seed;
+	int i;
+
+	for (i = 0; i < MT_OPS; i++) {
+		char *key;
+
+		r = r * 1103515245 + 12345;
+		key = keys[(r >> 8) % KEY_COUNT];
+		if (ctx->sht) {
+			if ((r & 0xff) < 26)
+				sharded_hash_table_put(ctx->sht, key, key);
+			else
+				sharded_hash_table_get(ctx->sht, key);
+		} else {
+			pthread_mutex_lock(&ht_lock);
+			if ((r & 0xff) < 26)
+				hash_table_put(ctx->ht, key, key);
+			else
+				hash_table_get(ctx->ht, key);
+			pthread_mutex_unlock(&ht_lock);
+		}
+	}
+	return NULL;
+}
+
+static void bench_threads(int sharded)
+{
+	struct mt_ctx ctx[MT_MAX_THREADS];
+	pthread_t tid[MT_MAX_THREADS];
+	struct hash_table *ht = NULL;
+	struct sharded_hash_table *sht = NULL;
+	int threads, i;
+
+	if (sharded)
+		sht = make_sharded_string_hash_table(KEY_COUNT, MT_SHARDS);
+	else
+		ht = make_string_hash_table(KEY_COUNT);
+	for (i = 0; i < KEY_COUNT; i++) {
+		if (sht)
+			sharded_hash_table_put(sht, keys[i], keys[i]);
+		else
+			hash_table_put(ht, keys[i], keys[i]);
+	}
+
+	for (threads = 1; threads <= MT_MAX_THREADS; threads *= 2) {
+		double start = now_sec();
+
+		for (i = 0; i < threads; i++) {
+			ctx[i].ht = ht;
+			ctx[i].sht = sht;
+			ctx[i].seed = i + 1;
+			pthread_create(&tid[i], NULL, mt_worker, &ctx[i]);
+		}
+		for (i = 0; i < threads; i++)
+			pthread_join(tid[i], NULL);
+
+		printf("  %-20s %d thread(s) %8.2f Mops/s\n",
+		       sharded ? "sharded rwlocks" : "single mutex", threads,
+		       (double) MT_OPS * threads / (now_sec() - start) / 1e6);
+	}
+
+	if (sht)
+		sharded_hash_table_destroy(sht);
+	else
+		hash_table_destroy(ht);
+}
+
+/*
+ * Worst case of a single put while the table grows from empty, which is
+ * where a stop-the-world rehash shows up.
+ */
+static void bench_put_latency(void)
+{
+	struct hash_table *ht = make_string_hash_table(0);
+	double worst = 0, total = 0;
+	int i;
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		double start = now_sec(), t;
+
+		hash_table_put(ht, keys[i], keys[i]);
+		t = now_sec() - start;
+		total += t;
+		if (t > worst)
+			worst = t;
+	}
+	printf("  %-20s %8.1f ns avg, %.1f us worst\n", "timed put",
+	       total * 1e9 / KEY_COUNT, worst * 1e6);
+
+	hash_table_destroy(ht);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hash_table *ht;
+	double start;
+	int i, found = 0;
+
+	make_keys();
+	ht = make_string_hash_table(0);
+
+	printf("%d string keys:\n", KEY_COUNT);
+	start = now_sec();
+	for (i = 0; i < KEY_COUNT; i++)
+		hash_table_put(ht, keys[i], keys[i]);
+	report("put (growing)", start, KEY_COUNT);
+	bench_put_latency();
+
+	start = now_sec();
+	for (i = 0; i < KEY_COUNT; i++)
+		found += hash_table_get(ht, keys[i]) == keys[i];
+	report("get hit", start, KEY_COUNT);
+
+	start = now_sec();
+	for (i = 0; i < KEY_COUNT; i++)
+		found += hash_table_contains(ht, misses[i]);
+	report("get miss", start, KEY_COUNT);
+
+	start = now_sec();
+	for (i = 0; i < KEY_COUNT; i += 2)
+		hash_table_remove(ht, keys[i]);
+	report("remove", start, KEY_COUNT / 2);
+
+	start = now_sec();
+	for (i = 0; i < KEY_COUNT; i++)
+		found += hash_table_contains(ht, keys[i]);
+	report("get 50% hit", start, KEY_COUNT);
+
+	if (found != KEY_COUNT + KEY_COUNT / 2 || hash_table_count(ht) != KEY_COUNT / 2)
+		printf("mismatch: found %d, count %d\n", found, hash_table_count(ht));
+
+	hash_table_destroy(ht);
+
+	printf("%d threads max, 90%% get / 10%% put:\n", MT_MAX_THREADS);
+	bench_threads(0);
+	bench_threads(1);
+
+	free(keys);
+	free(misses);
+	return 0;
+}
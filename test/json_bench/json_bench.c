@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cJSON.h>
+
+#define MESSAGES	(200 * 1000)
+#define DEVICES		2000		/* in the registry document */
+#define SAMPLES		20000		/* numbers in the telemetry document */
+#define CORPUS_PASSES	40
+#define LOOKUPS		(20 * 1000 * 1000)	/* members walked per unindexed bench */
+
+/* A control-plane message as the daemons exchange them */
+static const char message[] =
+	"{\"id\": 48213, \"type\": \"set_config\", \"source\": \"ctl-2\", "
+	"\"target\": {\"device\": \"gw-0041\", \"slot\": 3, \"port\": \"eth1\"}, "
+	"\"timestamp\": 1697040000.125, \"ack\": true, \"retry\": null, "
+	"\"config\": {\"mtu\": 1500, \"vlan\": [10, 20, 30, 40], "
+	"\"qos\": {\"class\": \"gold\", \"weight\": 0.75, \"burst\": 65536}, "
+	"\"name\": \"uplink \\\"north\\\"\", \"enabled\": false}, "
+	"\"tags\": [\"prod\", \"edge\", \"rack-12\", \"\\u00e9t\\u00e9\"]}";
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A device registry: a large array of small objects */
+static char *make_registry(void)
+{
+	size_t size = DEVICES * 256, len = 0;
+	char *json = malloc(size);
+	int i;
+
+	len += snprintf(json + len, size - len, "{\"devices\": [");
+	for (i = 0; i < DEVICES; i++)
+		len += snprintf(json + len, size - len,
+			"%s{\"serial\": \"SN%08d\", \"model\": \"gw-%d\", \"fw\": \"2.%d.%d\", "
+			"\"uptime\": %d, \"load\": %.3f, \"online\": %s, \"ports\": [%d, %d]}",
+			i ? ", " : "", i * 7919, i % 17, i % 5, i % 11, i * 31,
+			(i % 100) / 100.0, i % 3 ? "true" : "false", i % 48, (i + 1) % 48);
+	snprintf(json + len, size - len, "]}");
+
+	return json;
+}
+
+/* Telemetry: arrays of readings, integers and decimals */
+static char *make_telemetry(void)
+{
+	size_t size = SAMPLES * 32, len = 0;
+	char *json = malloc(size);
+	int i;
+
+	len += snprintf(json + len, size - len, "{\"sensor\": \"temp-7\", \"samples\": [");
+	for (i = 0; i < SAMPLES; i++) {
+		if (i % 4)
+			len += snprintf(json + len, size - len, ",%.2f", 20 + (i % 1000) / 37.0);
+		else
+			len += snprintf(json + len, size - len, "%s%d", i ? "," : "", i * 13);
+	}
+	snprintf(json + len, size - len, "], \"scale\": 1.5e-3}");
+
+	return json;
+}
+
+/* Log lines shipped as JSON: long strings, an escape here and there */
+static char *make_log_lines(void)
+{
+	size_t size = DEVICES * 256, len = 0;
+	char *json = malloc(size);
+	int i;
+
+	len += snprintf(json + len, size - len, "[");
+	for (i = 0; i < DEVICES; i++)
+		len += snprintf(json + len, size - len,
+			"%s{\"level\": \"info\", \"msg\": \"connection %d from 10.0.%d.%d "
+			"accepted on port 8443, handshake completed in %d ms%s, "
+			"session resumed from the ticket cache\"}",
+			i ? ", " : "", i, i / 256 % 256, i % 256, i % 90,
+			i % 8 ? "" : " (client said \\\"hello\\\")");
+	snprintf(json + len, size - len, "]");
+
+	return json;
+}
+
+static void report(const char *what, const char *json, long count, double start)
+{
+	double secs = now_sec() - start;
+
+	printf("  %-28s %8.0f ns/parse %8.1f MB/s\n", what, secs * 1e9 / count,
+				strlen(json) * count / secs / 1e6);
+}
+
+/* What callers do now: parse, read a field, cJSON_Delete() */
+static void bench_default(const char *what, const char *json, long count)
+{
+	double start = now_sec();
+	long i;
+
+	for (i = 0; i < count; i++) {
+		cJSON *root = cJSON_Parse(json);
+
+		if (!root || !root->child) {
+			printf("  %s: parse failed\n", what);
+			exit(EXIT_FAILURE);
+		}
+		cJSON_Delete(root);
+	}
+	report(what, json, count, start);
+}
+
+static void bench_arena(const char *what, cJSON_Arena *arena, const char *json, long count)
+{
+	double start = now_sec();
+	long i;
+
+	for (i = 0; i < count; i++) {
+		cJSON *root = cJSON_ParseInArena(arena, json, NULL, 0);
+
+		if (!root || !root->child) {
+			printf("  %s: parse failed\n", what);
+			exit(EXIT_FAILURE);
+		}
+		cJSON_ResetArena(arena);
+	}
+	report(what, json, count, start);
+}
+
+/*
+ * In situ the input is clobbered, every parse works on a fresh copy of it
+ * like on a message just read into a buffer; the copy is timed too.
+ */
+static void bench_in_situ(const char *what, cJSON_Arena *arena, const char *json, long count)
+{
+	size_t size = strlen(json) + 1;
+	char *work = malloc(size);
+	double start = now_sec();
+	long i;
+
+	for (i = 0; i < count; i++) {
+		cJSON *root;
+
+		memcpy(work, json, size);
+		root = cJSON_ParseInSitu(work, arena, NULL, 0);
+		if (!root || !root->child) {
+			printf("  %s: parse failed\n", what);
+			exit(EXIT_FAILURE);
+		}
+		if (arena)
+			cJSON_ResetArena(arena);
+		else
+			cJSON_Delete(root);
+	}
+	report(what, json, count, start);
+	free(work);
+}
+
+/* The fast number path has to give strtod's double, bit for bit */
+static int check_numbers(void)
+{
+	static const char *numbers[] = {
+		"0", "-0", "1", "-1", "12345678901234567", "9007199254740993",
+		"18446744073709551617", "0.1", "0.3", "-2.5e-3", "1e22", "1e23",
+		"123.456e-10", "4.9e-324", "1.7976931348623157e308", "0.000001",
+		"3.141592653589793", "2.2250738585072014e-308", "1E+2", "007",
+	};
+	char text[64];
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(numbers) / sizeof(numbers[0]) + 100000; i++) {
+		const char *number = text;
+		double expected, parsed;
+		cJSON *item;
+
+		if (i < sizeof(numbers) / sizeof(numbers[0]))
+			number = numbers[i];
+		else if (i % 3 == 0)
+			snprintf(text, sizeof(text), "%.17g", (i * 2654435761u) / 1e6);
+		else if (i % 3 == 1)
+			snprintf(text, sizeof(text), "%.*f", i % 9, (double) i * 1.37);
+		else
+			snprintf(text, sizeof(text), "%de%d", (int) (i * 40503u % 100000), i % 45 - 22);
+
+		expected = strtod(number, NULL);
+		item = cJSON_Parse(number);
+		parsed = item ? item->valuedouble : -1;
+		if (!item || memcmp(&parsed, &expected, sizeof(double))) {
+			printf("number %s parsed as %.17g, strtod gives %.17g\n", number,
+								parsed, expected);
+			ret = -1;
+		}
+		cJSON_Delete(item);
+	}
+
+	return ret;
+}
+
+/* The arena tree must print as the heap one, and survive being mutated */
+static int check_arena(cJSON_Arena *arena, const char *json)
+{
+	cJSON *heap = cJSON_Parse(json);
+	cJSON *tree = cJSON_ParseInArena(arena, json, NULL, 1);
+	char *a, *b;
+	int ret = 0;
+
+	a = cJSON_PrintUnformatted(heap);
+	b = cJSON_PrintUnformatted(tree);
+	if (!a || !b || strcmp(a, b)) {
+		printf("arena tree differs:\n%s\n%s\n", a, b);
+		ret = -1;
+	}
+	free(a);
+	free(b);
+
+	/* heap items in an arena tree, arena items in a heap tree */
+	cJSON_AddItemToObject(tree, "added", cJSON_CreateString("heap"));
+	cJSON_ReplaceItemInObject(tree, "type", cJSON_CreateNumber(1));
+	cJSON_AddItemToObject(heap, "moved", cJSON_DetachItemFromObject(tree, "config"));
+	cJSON_AddItemToObject(heap, "copy", cJSON_Duplicate(cJSON_GetObjectItem(tree, "tags"), 1));
+	cJSON_DeleteItemFromObject(tree, "target");
+	cJSON_Delete(tree);
+	cJSON_ResetArena(arena);
+	cJSON_Delete(heap);
+
+	if (cJSON_ParseInArena(arena, "{\"broken\": [1, 2", NULL, 0) != NULL) {
+		printf("arena parse of broken input succeeded\n");
+		ret = -1;
+	}
+	cJSON_ResetArena(arena);
+
+	return ret;
+}
+
+/* Strings decoded in place must read as copied ones, escapes included */
+static int check_in_situ(cJSON_Arena *arena, const char *json)
+{
+	char *work = strdup(json);
+	cJSON *heap = cJSON_Parse(json);
+	cJSON *tree = cJSON_ParseInSitu(work, arena, NULL, 1);
+	char *a, *b;
+	int ret = 0;
+
+	a = cJSON_PrintUnformatted(heap);
+	b = cJSON_PrintUnformatted(tree);
+	if (!a || !b || strcmp(a, b)) {
+		printf("in situ tree differs:\n%s\n%s\n", a, b);
+		ret = -1;
+	}
+	free(a);
+	free(b);
+
+	cJSON_AddItemToObject(tree, "added", cJSON_CreateString("heap"));
+	cJSON_AddItemToObject(heap, "copy", cJSON_Duplicate(cJSON_GetObjectItem(tree, "config"), 1));
+	cJSON_AddItemToObject(heap, "moved", cJSON_DetachItemFromObject(tree, "tags"));
+	cJSON_Delete(heap);
+	if (arena)
+		cJSON_ResetArena(arena);
+	cJSON_Delete(tree);
+	free(work);
+
+	return ret;
+}
+
+/* A failed parse in situ must not free names that point into the input */
+static int check_in_situ_broken(cJSON_Arena *arena)
+{
+	static const char *broken[] = {
+		"{\"key\" 1}",			/* missing colon */
+		"{\"key\":x}",			/* bad value */
+		"{\"k\\u0065y\":}",			/* bad value, escaped name */
+		"{\"key\":\"v\",\"list\":[1, 2",	/* truncated */
+		"{\"key\":{\"inner\":\"v\"",	/* truncated inside */
+		"{\"key\"",				/* truncated after a name */
+	};
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+		char *work = strdup(broken[i]);
+
+		if (cJSON_ParseInSitu(work, arena, NULL, 1) != NULL) {
+			printf("in situ parse of %s succeeded\n", broken[i]);
+			ret = -1;
+		}
+		if (arena)
+			cJSON_ResetArena(arena);
+		free(work);
+	}
+
+	return ret;
+}
+
+/* Every lookup of the indexed tree must find what a scan finds */
+static int same_lookups(cJSON *plain, cJSON *indexed, int members)
+{
+	cJSON *a, *b;
+	char key[32];
+	int i, size = cJSON_GetArraySize(plain);
+
+	if (cJSON_GetArraySize(indexed) != size)
+		return -1;
+	for (i = -1; i <= size; i++) {
+		a = cJSON_GetArrayItem(plain, i);
+		b = cJSON_GetArrayItem(indexed, i);
+		if ((a == NULL) != (b == NULL) || (a && a->valueint != b->valueint))
+			return -1;
+	}
+	for (i = 0; i < members + 2; i++) {
+		snprintf(key, sizeof(key), i % 2 ? "Key-%d" : "KEY-%d", i);
+		a = cJSON_GetObjectItem(plain, key);
+		b = cJSON_GetObjectItem(indexed, key);
+		if ((a == NULL) != (b == NULL) || (a && a->valueint != b->valueint))
+			return -1;
+		key[1] = 'e';
+		key[2] = 'y';
+		a = cJSON_GetObjectItemCaseSensitive(plain, key);
+		b = cJSON_GetObjectItemCaseSensitive(indexed, key);
+		if ((a == NULL) != (b == NULL) || (a && a->valueint != b->valueint))
+			return -1;
+	}
+	return 0;
+}
+
+static int check_index(void)
+{
+	cJSON *plain = cJSON_CreateObject(), *indexed, *reference, *array, *copy, *small;
+	char key[32];
+	int i, ret = 0;
+
+	/* names differing in case only, the first one has to win */
+	for (i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), i % 3 ? "Key-%d" : "key-%d", i % 150);
+		cJSON_AddNumberToObject(plain, key, i);
+	}
+	indexed = cJSON_Duplicate(plain, 1);
+	if (!cJSON_EnableIndex(indexed, 1) || same_lookups(plain, indexed, 200) < 0) {
+		printf("indexed object differs\n");
+		ret = -1;
+	}
+
+	/* the same changes to both, the index has to follow */
+	for (i = 0; i < 300; i++) {
+		snprintf(key, sizeof(key), "Key-%d", 200 + i);
+		cJSON_AddNumberToObject(plain, key, 1000 + i);
+		cJSON_AddNumberToObject(indexed, key, 1000 + i);
+		if (i % 50 == 0 && same_lookups(plain, indexed, 500) < 0) {
+			printf("indexed object differs after adding %d\n", i);
+			ret = -1;
+		}
+	}
+	cJSON_DeleteItemFromObject(plain, "Key-4");
+	cJSON_DeleteItemFromObject(indexed, "Key-4");
+	cJSON_ReplaceItemInObject(plain, "key-3", cJSON_CreateNumber(-3));
+	cJSON_ReplaceItemInObject(indexed, "key-3", cJSON_CreateNumber(-3));
+	cJSON_InsertItemInArray(plain, 7, cJSON_DetachItemFromObject(plain, "Key-400"));
+	cJSON_InsertItemInArray(indexed, 7, cJSON_DetachItemFromObject(indexed, "Key-400"));
+	cJSON_DeleteItemFromArray(plain, 0);
+	cJSON_DeleteItemFromArray(indexed, 0);
+	if (same_lookups(plain, indexed, 500) < 0) {
+		printf("indexed object differs after changes\n");
+		ret = -1;
+	}
+	/* the changes rebuilt the index, lookups only read it */
+	copy = cJSON_Duplicate(indexed, 1);
+	if (!indexed->index || !copy || !copy->index) {
+		printf("index not rebuilt after changes\n");
+		ret = -1;
+	}
+	cJSON_Delete(copy);
+
+	/* too small for an index until appending reaches CJSON_INDEX_MIN */
+	small = cJSON_CreateArray();
+	cJSON_EnableIndex(small, 0);
+	for (i = 0; i < CJSON_INDEX_MIN; i++) {
+		if (small->index) {
+			printf("index built below CJSON_INDEX_MIN\n");
+			ret = -1;
+		}
+		cJSON_AddItemToArray(small, cJSON_CreateNumber(i));
+	}
+	if (!small->index || cJSON_GetArrayItem(small, CJSON_INDEX_MIN - 1)->valueint != CJSON_INDEX_MIN - 1) {
+		printf("index not built at CJSON_INDEX_MIN\n");
+		ret = -1;
+	}
+	cJSON_Delete(small);
+
+	/* a reference sees the list, never a stale index */
+	array = cJSON_CreateArray();
+	cJSON_AddItemReferenceToArray(array, indexed);
+	reference = cJSON_GetArrayItem(array, 0);
+	cJSON_AddNumberToObject(plain, "Key-600", 600);
+	cJSON_AddNumberToObject(indexed, "Key-600", 600);
+	if (cJSON_EnableIndex(reference, 0) || same_lookups(plain, reference, 500) < 0 ||
+	    !cJSON_GetObjectItem(reference, "key-600")) {
+		printf("reference to an indexed object differs\n");
+		ret = -1;
+	}
+	cJSON_Delete(array);
+	cJSON_Delete(plain);
+	cJSON_Delete(indexed);
+
+	return ret;
+}
+
+static void report_lookups(const char *what, long count, double start)
+{
+	printf("  %-28s %8.1f ns/lookup\n", what, (now_sec() - start) * 1e9 / count);
+}
+
+/* Random keys and positions of one parsed object and array of members */
+static void bench_lookup(int members)
+{
+	char (*keys)[16] = malloc(members * sizeof(*keys));
+	char *text = malloc(members * 32 + 2), *end = text;
+	long scans = LOOKUPS / members < 1000 ? 1000 : LOOKUPS / members;
+	long lookups = 1000 * 1000, count, i;
+	cJSON *object, *array, *item;
+	int indexed;
+	double start;
+
+	for (i = 0; i < members; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "gw-%08ld", i * 7919);
+		end += sprintf(end, "%c\"%s\": %ld", i ? ',' : '{', keys[i], i);
+	}
+	strcpy(end, "}");
+	object = cJSON_Parse(text);
+	for (i = 0, end = text; i < members; i++)
+		end += sprintf(end, "%c%ld", i ? ',' : '[', i);
+	strcpy(end, "]");
+	array = cJSON_Parse(text);
+	free(text);
+
+	printf("%d members:\n", members);
+	for (indexed = 0; indexed < 2; indexed++) {
+		count = indexed ? lookups : scans;
+		if (indexed) {
+			start = now_sec();
+			cJSON_EnableIndex(object, 0);
+			cJSON_EnableIndex(array, 0);
+			printf("  %-28s %8.1f us\n", "cJSON_EnableIndex", (now_sec() - start) * 1e6);
+		}
+
+		start = now_sec();
+		for (i = 0; i < count; i++) {
+			item = cJSON_GetObjectItem(object, keys[(i * 2654435761u) % members]);
+			if (!item || item->valueint != (i * 2654435761u) % members)
+				exit(EXIT_FAILURE);
+		}
+		report_lookups(indexed ? "GetObjectItem, indexed" : "GetObjectItem", count, start);
+
+		start = now_sec();
+		for (i = 0; i < count; i++)
+			if (!cJSON_GetObjectItemCaseSensitive(object, keys[(i * 2654435761u) % members]))
+				exit(EXIT_FAILURE);
+		report_lookups(indexed ? "...CaseSensitive, indexed" : "...CaseSensitive", count, start);
+
+		start = now_sec();
+		for (i = 0; i < count; i++) {
+			item = cJSON_GetArrayItem(array, (i * 2654435761u) % members);
+			if (!item || item->valueint != (i * 2654435761u) % members)
+				exit(EXIT_FAILURE);
+		}
+		report_lookups(indexed ? "GetArrayItem, indexed" : "GetArrayItem", count, start);
+	}
+
+	cJSON_Delete(object);
+	cJSON_Delete(array);
+	free(keys);
+}
+
+int main(int argc, char *argv[])
+{
+	static char buffer[16 * 1024];
+	cJSON_Arena *grown = cJSON_CreateArena(NULL, 0);
+	cJSON_Arena *fixed = cJSON_CreateArena(buffer, sizeof(buffer));
+	char *registry = make_registry();
+	char *telemetry = make_telemetry();
+	char *log_lines = make_log_lines();
+	char *pretty;
+	int ret = EXIT_SUCCESS;
+
+	if (!grown || !fixed) {
+		printf("cJSON_CreateArena failed\n");
+		return EXIT_FAILURE;
+	}
+
+	if (check_arena(grown, message) < 0 || check_arena(fixed, message) < 0 ||
+	    check_in_situ(NULL, message) < 0 || check_in_situ(grown, message) < 0 ||
+	    check_in_situ(NULL, registry) < 0 || check_in_situ(NULL, log_lines) < 0 ||
+	    check_in_situ_broken(NULL) < 0 || check_in_situ_broken(grown) < 0 ||
+	    check_numbers() < 0 || check_index() < 0)
+		ret = EXIT_FAILURE;
+
+	printf("message, %zu bytes:\n", strlen(message));
+	bench_default("cJSON_Parse + Delete", message, MESSAGES);
+	bench_arena("arena, grown", grown, message, MESSAGES);
+	bench_arena("arena, caller buffer", fixed, message, MESSAGES);
+	bench_in_situ("in situ", NULL, message, MESSAGES);
+	bench_in_situ("in situ, arena", fixed, message, MESSAGES);
+
+	printf("registry, %zu bytes:\n", strlen(registry));
+	bench_default("cJSON_Parse + Delete", registry, MESSAGES / DEVICES * 4);
+	bench_arena("arena, grown", grown, registry, MESSAGES / DEVICES * 4);
+	bench_in_situ("in situ", NULL, registry, MESSAGES / DEVICES * 4);
+	bench_in_situ("in situ, arena", grown, registry, MESSAGES / DEVICES * 4);
+
+	/* indented the way cJSON_Print() writes config files */
+	{
+		cJSON *root = cJSON_Parse(registry);
+		pretty = cJSON_Print(root);
+		cJSON_Delete(root);
+	}
+
+	printf("corpus, cJSON_Parse + Delete:\n");
+	bench_default("registry", registry, CORPUS_PASSES);
+	bench_default("registry, printed", pretty, CORPUS_PASSES);
+	bench_default("telemetry numbers", telemetry, CORPUS_PASSES);
+	bench_default("log lines", log_lines, CORPUS_PASSES);
+
+	printf("lookups, cJSON_EnableIndex:\n");
+	bench_lookup(10);
+	bench_lookup(1000);
+	bench_lookup(100 * 1000);
+
+	cJSON_DeleteArena(grown);
+	cJSON_DeleteArena(fixed);
+	free(registry);
+	free(telemetry);
+	free(log_lines);
+	free(pretty);
+
+	return ret;
+}
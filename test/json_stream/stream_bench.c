@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cJSON.h>
+#include <json_stream.h>
+
+#define DEVICES		50000		/* ~9 MB of registry */
+#define CHUNK		4096		/* what a read() from the socket gives */
+
+static const char *path = "/tmp/stream_bench.json";
+
+/* cJSON's memory, through its hooks */
+static size_t held, peak;
+
+static void *count_malloc(size_t size)
+{
+	size_t *p = malloc(size + sizeof(size_t));
+
+	if (!p)
+		return NULL;
+	*p = size;
+	held += size;
+	if (held > peak)
+		peak = held;
+	return p + 1;
+}
+
+static void count_free(void *ptr)
+{
+	size_t *p = ptr;
+
+	if (!p)
+		return;
+	held -= p[-1];
+	free(p - 1);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_registry(void)
+{
+	FILE *f = fopen(path, "w");
+	int i;
+
+	fprintf(f, "{\"version\": 3, \"devices\": [");
+	for (i = 0; i < DEVICES; i++)
+		fprintf(f, "%s{\"serial\": \"SN%08d\", \"model\": \"gw-%d\", \"fw\": \"2.%d.%d\", "
+			"\"uptime\": %d, \"load\": %.3f, \"online\": %s, \"ports\": [%d, %d], "
+			"\"site\": {\"name\": \"rack-%d\", \"geo\": [48.%04d, 11.%04d]}}",
+			i ? ", " : "", i * 7919, i % 17, i % 5, i % 11, i * 31,
+			(i % 100) / 100.0, i % 3 ? "true" : "false", i % 48, (i + 1) % 48,
+			i % 300, i % 9973, i % 7919);
+	fprintf(f, "], \"generated\": \"2023-10-12T08:00:00Z\"}\n");
+	fclose(f);
+}
+
+/* What callers do now: the whole body in memory, then the whole tree */
+static cJSON *read_and_parse(size_t *body_size)
+{
+	int fd = open(path, O_RDONLY);
+	size_t size = CHUNK, len = 0;
+	char *body = cJSON_malloc(size);
+	cJSON *root;
+	ssize_t n;
+
+	for (;;) {
+		if (size - len < CHUNK + 1) {
+			char *bigger = cJSON_malloc(size * 2);
+
+			memcpy(bigger, body, len);
+			cJSON_free(body);
+			body = bigger;
+			size *= 2;
+		}
+		n = read(fd, body + len, CHUNK);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	body[len] = '\0';
+
+	root = cJSON_Parse(body);
+	cJSON_free(body);
+	*body_size = len;
+	return root;
+}
+
+/* Feeds the file in socket sized chunks */
+static int feed_file(int (*feed)(void *, const void *, size_t), void *parser)
+{
+	char chunk[CHUNK];
+	int fd = open(path, O_RDONLY);
+	ssize_t n;
+	int ret = 0;
+
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+		if ((ret = feed(parser, chunk, n)) < 0)
+			break;
+	close(fd);
+	return ret;
+}
+
+static int stream_feed(void *parser, const void *data, size_t len)
+{
+	return json_stream_feed(parser, data, len);
+}
+
+static int select_feed(void *parser, const void *data, size_t len)
+{
+	return json_select_feed(parser, data, len);
+}
+
+static int count_event(const json_event_t *event, void *user_data)
+{
+	(*(long *) user_data)++;
+	return 0;
+}
+
+struct devices {
+	cJSON *expected;	/* the devices array of a full parse */
+	cJSON *next;
+	long count;
+	int mismatch;
+	size_t largest;		/* held for one device at most */
+};
+
+static int on_device(const char *path, cJSON *item, void *user_data)
+{
+	struct devices *devices = user_data;
+
+	if (held > devices->largest)
+		devices->largest = held;
+	if (devices->expected && !strcmp(path, "devices.*")) {
+		if (!devices->next || !cJSON_Compare(item, devices->next, 1))
+			devices->mismatch = 1;
+		devices->next = devices->next ? devices->next->next : NULL;
+	}
+	devices->count++;
+	cJSON_Delete(item);
+	return 0;
+}
+
+/* Events as text, to compare feeding in pieces with feeding at once */
+static int log_event(const json_event_t *event, void *user_data)
+{
+	char *log = user_data;
+	size_t len = strlen(log);
+
+	snprintf(log + len, 8192 - len, "%d:%d:%s|", event->type, event->depth,
+						event->text ? event->text : "");
+	return 0;
+}
+
+static int parse_all(const char *json, size_t piece, char *log, size_t max_token, int max_depth)
+{
+	json_stream_t *stream = json_stream_new(log_event, log, max_token, max_depth);
+	size_t len = strlen(json), i;
+	int ret = 0;
+
+	log[0] = '\0';
+	for (i = 0; i < len && ret == 0; i += piece)
+		ret = json_stream_feed(stream, json + i, len - i < piece ? len - i : piece);
+	if (ret == 0)
+		ret = json_stream_finish(stream);
+	if (ret < 0)
+		ret = -errno;
+	json_stream_free(stream);
+	return ret;
+}
+
+static int check_conformance(void)
+{
+	static const char *good[] = {
+		"[]", "{}", "1 2 \"three\"", "-0.5e+3", "0", "[-0, 1E2, 0.25]",
+		" [ {\"a\": [true, false, null], \"\": {}} ] ",
+		"\"\\ud83d\\ude00 \\u00e9 \\\"\\\\\\/\\b\\f\\n\\r\\t\"",
+		"{\"id\": 48213, \"config\": {\"vlan\": [10, 20], \"name\": \"uplink \\\"north\\\"\"}}",
+	};
+	static const char *bad[] = {
+		"", "[1,]", "{\"a\" 1}", "{\"a\":1,}", "[01]", "1.", "-", "1e", "\"\\x\"",
+		"[", "{\"a\":", "\"\\ud800\"", "\"\\udc00\"", "\"\\ud800\\u0041\"",
+		"\"tab\there\"", "tru", "nul", "{}}", "[1 2]", "{1: 2}", "\"open",
+	};
+	static char whole[8192], pieces[8192];
+	char deep[80];
+	unsigned int i;
+	int ret = 0, err;
+
+	for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+		int a = parse_all(good[i], 1 << 20, whole, 0, 0);
+		int b = parse_all(good[i], 1, pieces, 0, 0);
+
+		if (a || b || strcmp(whole, pieces)) {
+			printf("good %s: %d %d\n  %s\n  %s\n", good[i], a, b, whole, pieces);
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+		if ((err = parse_all(bad[i], 1, whole, 0, 0)) != -EINVAL) {
+			printf("bad %s: %d\n", bad[i], err);
+			ret = -1;
+		}
+
+	/* the limits */
+	memset(deep, '[', 40);
+	memset(deep + 40, ']', 40);
+	deep[sizeof(deep) - 1] = '\0';
+	if (parse_all(deep, 3, whole, 0, 39) != -ENOBUFS ||
+	    parse_all("\"0123456789abcdef\"", 3, whole, 16, 0) != 0 ||
+	    parse_all("\"0123456789abcdefg\"", 3, whole, 16, 0) != -ENOBUFS) {
+		printf("limits not kept\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int keep_item(const char *path, cJSON *item, void *user_data)
+{
+	cJSON_AddItemToArray(user_data, item);
+	return 0;
+}
+
+/* Paths by name, index and wildcard give what a full parse has there */
+static int check_select(void)
+{
+	static const char doc[] =
+		"{\"id\": 7, \"config\": {\"vlan\": [10, 20, 30], \"qos\": {\"class\": \"gold\"}}, "
+		"\"tags\": [\"a\", {\"b\": [1, {\"c\": null}]}]}";
+	static const char expected[] =
+		"[{\"id\":7,\"config\":{\"vlan\":[10,20,30],\"qos\":{\"class\":\"gold\"}},"
+		"\"tags\":[\"a\",{\"b\":[1,{\"c\":null}]}]},20,\"gold\",[1,{\"c\":null}]]";
+	const char *paths[] = { "", "config.vlan.1", "config.*.class", "*.1.b" };
+	cJSON *found = cJSON_CreateArray();
+	unsigned int i;
+	char *printed;
+	int ret = 0;
+
+	/* one path at a time, in the order of the paths */
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		json_select_t *select = json_select_new(&paths[i], 1, keep_item, found, 0, 0);
+
+		if (json_select_feed(select, doc, sizeof(doc) - 1) < 0 ||
+		    json_select_finish(select) < 0)
+			ret = -1;
+		json_select_free(select);
+	}
+
+	printed = cJSON_PrintUnformatted(found);
+	if (ret < 0 || strcmp(printed, expected)) {
+		printf("json_select gave %s\n", printed);
+		ret = -1;
+	}
+	cJSON_free(printed);
+	cJSON_Delete(found);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	cJSON_Hooks hooks = { count_malloc, count_free };
+	const char *paths[] = { "devices.*", "version" };
+	struct devices devices = { NULL, NULL, 0, 0, 0 };
+	json_select_t *select;
+	json_stream_t *stream;
+	size_t body;
+	long events = 0;
+	cJSON *root;
+	double start;
+	int ret = EXIT_SUCCESS;
+
+	if (check_conformance() < 0 || check_select() < 0)
+		ret = EXIT_FAILURE;
+
+	cJSON_InitHooks(&hooks);
+	write_registry();
+
+	start = now_sec();
+	root = read_and_parse(&body);
+	printf("%d devices, %zu bytes in %d byte chunks:\n", DEVICES, body, CHUNK);
+	printf("  %-26s %6.1f ms, %7.1f MB held at most\n", "read all + cJSON_Parse",
+				(now_sec() - start) * 1e3, peak / 1e6);
+
+	start = now_sec();
+	stream = json_stream_new(count_event, &events, 0, 0);
+	if (feed_file(stream_feed, stream) < 0 || json_stream_finish(stream) < 0) {
+		printf("json_stream failed at %lu: %s\n", json_stream_offset(stream),
+							strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+	printf("  %-26s %6.1f ms, %7.1f KB held, %ld events\n", "json_stream events",
+				(now_sec() - start) * 1e3,
+				(CHUNK + JSON_STREAM_MAX_TOKEN) / 1e3, events);
+	json_stream_free(stream);
+
+	/* the same devices as the full parse, one at a time */
+	devices.expected = cJSON_GetObjectItem(root, "devices");
+	devices.next = devices.expected ? devices.expected->child : NULL;
+	select = json_select_new(paths, 2, on_device, &devices, 0, 0);
+	if (feed_file(select_feed, select) < 0 || json_select_finish(select) < 0 ||
+	    devices.count != DEVICES + 1 || devices.mismatch) {
+		printf("json_select: %ld items, %s\n", devices.count,
+				devices.mismatch ? "differ" : strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+	json_select_free(select);
+	cJSON_Delete(root);
+
+	devices.expected = NULL;
+	devices.count = 0;
+	devices.largest = 0;
+	start = now_sec();
+	select = json_select_new(paths, 2, on_device, &devices, 0, 0);
+	feed_file(select_feed, select);
+	json_select_finish(select);
+	printf("  %-26s %6.1f ms, %7.1f KB held + %zu bytes a device\n",
+				"json_select devices.*", (now_sec() - start) * 1e3,
+				(CHUNK + JSON_STREAM_MAX_TOKEN) / 1e3, devices.largest);
+	json_select_free(select);
+
+	unlink(path);
+	return ret;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <mutex.h>
+#include <rwlock_util.h>
+
+#define OPS		(2 * 1000 * 1000)	/* over all threads */
+#define MAX_THREADS	64
+
+/* What the locks protect: a little shared state, one line apart */
+static struct {
+	long counter;
+	long table[8];
+} __attribute__((aligned(64))) shared;
+
+static pthread_mutex_t plain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static adaptive_mutex_t adaptive = ADAPTIVE_MUTEX_INITIALIZER;
+static pthread_rwlock_t plain_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static percpu_rwlock_t percpu;
+
+static int write_every;			/* 1 write in this many ops */
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A short critical section, like popping a freelist */
+static inline void update(long i)
+{
+	shared.counter++;
+	shared.table[i & 7] += i;
+}
+
+static inline long lookup(long i)
+{
+	return shared.table[i & 7] + shared.table[(i + 3) & 7];
+}
+
+static void *pthread_mutex_thread(void *arg)
+{
+	long i, ops = (long) arg;
+
+	for (i = 0; i < ops; i++) {
+		pthread_mutex_lock(&plain_mutex);
+		update(i);
+		pthread_mutex_unlock(&plain_mutex);
+	}
+	return NULL;
+}
+
+static void *adaptive_mutex_thread(void *arg)
+{
+	long i, ops = (long) arg;
+
+	for (i = 0; i < ops; i++) {
+		adaptive_mutex_lock(&adaptive);
+		update(i);
+		adaptive_mutex_unlock(&adaptive);
+	}
+	return NULL;
+}
+
+static void *pthread_rwlock_thread(void *arg)
+{
+	long i, ops = (long) arg, sum = 0;
+
+	for (i = 0; i < ops; i++) {
+		if (i % write_every == 0) {
+			pthread_rwlock_wrlock(&plain_rwlock);
+			update(i);
+		} else {
+			pthread_rwlock_rdlock(&plain_rwlock);
+			sum += lookup(i);
+		}
+		pthread_rwlock_unlock(&plain_rwlock);
+	}
+	return (void *) sum;
+}
+
+static void *percpu_rwlock_thread(void *arg)
+{
+	long i, ops = (long) arg, sum = 0;
+	int slot;
+
+	for (i = 0; i < ops; i++) {
+		if (i % write_every == 0) {
+			percpu_rwlock_wrlock(&percpu);
+			update(i);
+			percpu_rwlock_wrunlock(&percpu);
+		} else {
+			slot = percpu_rwlock_rdlock(&percpu);
+			sum += lookup(i);
+			percpu_rwlock_rdunlock(&percpu, slot);
+		}
+	}
+	return (void *) sum;
+}
+
+/* Runs OPS split over threads; checks no update got lost. */
+static int run(const char *what, void *(*func)(void *), int threads, long writes)
+{
+	pthread_t tids[MAX_THREADS];
+	long i, ops = OPS / threads;
+	double start, secs;
+
+	memset(&shared, 0, sizeof(shared));
+
+	start = now_sec();
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, func, (void *) ops);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	secs = now_sec() - start;
+
+	printf("  %-16s %2d threads %9.0f ops/s %6.1f ns/op\n", what, threads,
+				ops * threads / secs, secs * 1e9 / (ops * threads));
+
+	if (shared.counter != writes * threads) {
+		printf("  %s lost updates: %ld, expected %ld\n", what,
+						shared.counter, writes * threads);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+	int reads[] = { 95, 99 };
+	unsigned int t, r;
+	int err = 0;
+
+	percpu_rwlock_init(&percpu);
+
+	printf("mutex, short critical section:\n");
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		long ops = OPS / threads[t];
+
+		err |= run("pthread_mutex", pthread_mutex_thread, threads[t], ops);
+		err |= run("adaptive_mutex", adaptive_mutex_thread, threads[t], ops);
+	}
+
+	for (r = 0; r < sizeof(reads) / sizeof(reads[0]); r++) {
+		write_every = 100 / (100 - reads[r]);
+		printf("rwlock, %d%% reads:\n", reads[r]);
+		for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			long ops = OPS / threads[t];
+			long writes = (ops + write_every - 1) / write_every;
+
+			err |= run("pthread_rwlock", pthread_rwlock_thread, threads[t],
+									writes);
+			err |= run("percpu_rwlock", percpu_rwlock_thread, threads[t],
+									writes);
+		}
+	}
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <log_util.h>
+
+/*
+ * Print the lines of a log written by log_async_start_mode() in
+ * LOG_ASYNC_BINARY mode: log_decode [file], standard input without one.
+ */
+int main(int argc, char *argv[])
+{
+	int fd = STDIN_FILENO;
+	int lines;
+
+	if (argc > 1) {
+		fd = open(argv[1], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	lines = log_binary_decode(fd, stdout);
+	if (lines < 0) {
+		perror("log_binary_decode");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
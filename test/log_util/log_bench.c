@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <log_util.h>
+
+#define LOG_TAG		"bench"
+#define MESSAGES	(200 * 1000)	/* per thread */
+#define BURST		250		/* then a pause, rings need not drop */
+#define PAUSE		1000		/* us */
+#define MAX_THREADS	8
+
+static const char *log_path = "/tmp/log_bench.log";
+static const char *bin_path = "/tmp/log_bench.bin";
+static const char *out_path = "/tmp/log_bench.out";
+
+static long caller_cpu_ns;
+
+static long cpu_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * A hot path logging a constant format and a few integers, in bursts
+ * the flusher can keep up with.  Only the CPU time of the calls counts.
+ */
+static void *log_thread(void *arg)
+{
+	long id = (long) arg;
+	long cpu = 0;
+	int i, j;
+
+	for (i = 0; i < MESSAGES; i += BURST) {
+		long start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+
+		for (j = i; j < i + BURST; j++)
+			ALOGI("conn %ld read %d bytes, queue %d, state %d",
+						id, j & 0xfff, j % 97, j & 3);
+
+		cpu += cpu_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+		usleep(PAUSE);
+	}
+
+	__atomic_add_fetch(&caller_cpu_ns, cpu, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void run(const char *what, int threads)
+{
+	pthread_t tids[MAX_THREADS];
+	log_stats_t before, after;
+	long i, cpu;
+
+	log_get_stats(&before);
+	caller_cpu_ns = 0;
+
+	cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, log_thread, (void *) i);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+	log_get_stats(&after);
+
+	/* the rest of the process is mostly the flusher */
+	printf("  %-24s %d threads, callers %5.0f ns/message, all %5.0f ns", what,
+			threads, (double) caller_cpu_ns / MESSAGES / threads,
+			(double) cpu / MESSAGES / threads);
+	if (after.lines != before.lines)
+		printf(", %lu dropped, %.0f lines/write",
+			after.dropped - before.dropped,
+			(double) (after.lines - before.lines) /
+			(after.writes - before.writes ? after.writes - before.writes : 1));
+	printf("\n");
+}
+
+/* All threads counts through the sink in mode; returns the lines queued. */
+static unsigned long session(const char *what, const char *path, int mode)
+{
+	int threads[] = { 1, 4, MAX_THREADS };
+	struct stat st_start, st_end;
+	log_stats_t before, after;
+	unsigned int t;
+
+	stat(path, &st_start);
+	log_get_stats(&before);
+	if (log_async_start_mode(path, mode) < 0) {
+		perror("log_async_start_mode");
+		exit(EXIT_FAILURE);
+	}
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+		run(what, threads[t]);
+	log_async_stop();
+
+	/* everything not dropped must have reached the file */
+	log_get_stats(&after);
+	stat(path, &st_end);
+	if ((unsigned long) (st_end.st_size - st_start.st_size) !=
+						after.bytes - before.bytes)
+		printf("  file grew %ld bytes, flusher wrote %lu\n",
+				(long) (st_end.st_size - st_start.st_size),
+				after.bytes - before.bytes);
+
+	return after.lines - before.lines;
+}
+
+/* Conversions the flusher and the decoder have to print as the caller would. */
+static void log_samples(void)
+{
+	char name[] = "not a literal %d";
+	/* volatile, or gcc folds it and warns about the "(null)" case */
+	const char * volatile null = NULL;
+
+	info("int %d %i %5u %-4x| %#o %c %hd %hhu", -1, 42, 7u, 0xab, 8, 'z',
+						(short) -2, (unsigned char) 300);
+	info("long %ld %lu %lld %llx %zu %jd", -3L, 4UL, -5LL, 0xfeedULL,
+					sizeof(long), (intmax_t) 6);
+	info("double %f %.2f %e %g %10.3f %Lf", 1.5, 3.14159, 1e-9, 2.5e10,
+						-0.25, (long double) 0.5);
+	info("string %s %10s %-6s| %.3s %.*s %s", "abc", "right", "left",
+					"truncated", 4, "starred", null);
+	info("star %*d %-*d| %.*f %*.*f", 6, 1, 4, 2, 2, 2.718, 8, 1, 9.87);
+	errno = ENOENT;
+	info("percent %% %p %m", (void *) 0x1234);
+	info("%s", name);
+	info(name, 1);
+	ALOGW("tagged %s", "line");
+}
+
+/* The lines of path, without the time ALOG* puts in front. */
+static char *read_lines(const char *path)
+{
+	static char text[3][4096];
+	static int n;
+	char *buf = text[n++ % 3], *p, *t;
+	FILE *f = fopen(path, "r");
+	size_t len = 0;
+
+	buf[0] = '\0';
+	if (!f)
+		return buf;
+	len = fread(buf, 1, sizeof(text[0]) - 1, f);
+	buf[len] = '\0';
+	fclose(f);
+
+	/* "[bench(123)_WARNING 12:34:56.789] " -> "[bench(123)_WARNING] " */
+	while ((p = strstr(buf, "_WARNING ")) && (t = strchr(p, ']')))
+		memmove(p + 8, t, strlen(t) + 1);
+
+	return buf;
+}
+
+/* The three modes, and the decoder, must print the same lines. */
+static int check_modes(void)
+{
+	char *text, *deferred, *decoded;
+	FILE *out;
+	int fd, lines;
+
+	unlink(log_path);
+	log_async_start_mode(log_path, LOG_ASYNC_TEXT);
+	log_samples();
+	log_async_stop();
+	text = read_lines(log_path);
+
+	unlink(log_path);
+	log_async_start_mode(log_path, LOG_ASYNC_DEFERRED);
+	log_samples();
+	log_async_stop();
+	deferred = read_lines(log_path);
+
+	unlink(bin_path);
+	log_async_start_mode(bin_path, LOG_ASYNC_BINARY);
+	log_samples();
+	log_async_stop();
+	fd = open(bin_path, O_RDONLY);
+	out = fopen(out_path, "w");
+	lines = log_binary_decode(fd, out);
+	fclose(out);
+	close(fd);
+	decoded = read_lines(out_path);
+
+	if (lines != 9 || strcmp(text, deferred) || strcmp(text, decoded)) {
+		printf("modes differ, %d lines decoded\n--- text\n%s--- deferred\n%s"
+				"--- decoded\n%s", lines, text, deferred, decoded);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads[] = { 1, 4, MAX_THREADS };
+	int saved_stderr = dup(STDERR_FILENO);
+	unsigned long queued;
+	unsigned int t;
+	long cpu;
+	FILE *out;
+	int fd, lines;
+
+	if (argc > 1)
+		log_path = argv[1];
+
+	/* the synchronous path writes to stderr, point it at the log file */
+	fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(log_path);
+		return EXIT_FAILURE;
+	}
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+
+	printf("%d messages per thread into %s:\n", MESSAGES, log_path);
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+		run("fprintf(stderr)", threads[t]);
+
+	session("async, formatted", log_path, LOG_ASYNC_TEXT);
+	session("async, deferred", log_path, LOG_ASYNC_DEFERRED);
+
+	unlink(bin_path);
+	queued = session("async, binary", bin_path, LOG_ASYNC_BINARY);
+
+	/* the offline side of the binary records */
+	fd = open(bin_path, O_RDONLY);
+	out = fopen("/dev/null", "w");
+	cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+	lines = log_binary_decode(fd, out);
+	printf("  %-24s %d lines, %.0f ns/line\n", "log_binary_decode", lines,
+			(double) (cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu) / (lines > 0 ? lines : 1));
+	fclose(out);
+	close(fd);
+	if (lines < 0 || (unsigned long) lines != queued)
+		printf("  decoded %d lines, %lu were queued\n", lines, queued);
+
+	log_set_level(LOG_WARNING);
+	run("level off", 1);
+	log_set_level(DEFAULT_LOG_LEVEL);
+
+	dup2(saved_stderr, STDERR_FILENO);
+
+	if (check_modes() < 0)
+		return EXIT_FAILURE;
+
+	unlink(log_path);
+	unlink(bin_path);
+	unlink(out_path);
+
+	return EXIT_SUCCESS;
+}
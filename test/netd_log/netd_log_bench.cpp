@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define LOG_TAG		"NetlinkEvent"
+
+#include "../../src/netlink/log.h"
+
+#define ROUNDS		(100 * 1000)	/* of the call sites below */
+#define BURST		50		/* rounds, then a pause */
+#define PAUSE		1000		/* us */
+
+static const char *log_path = "/tmp/netd_log_bench.log";
+static const char *bin_path = "/tmp/netd_log_bench.bin";
+
+/* What src/netlink/log.cpp and src/objthread/log.cpp did before. */
+static void old_sys_debug(int level, const char *tag, int line_num, const char *fmt, ...)
+{
+	static const char *level_string[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+	char buf[512] = { 0 };
+	struct timeval tv;
+	struct tm *tm;
+	va_list ap;
+
+	if (level > DEFAULT_LOG_LEVEL || level < 0)
+		return;
+
+	va_start(ap, fmt);
+	gettimeofday(&tv, NULL);
+	tm = localtime((time_t *) &tv.tv_sec);
+	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	if (strstr(buf, "%s") != NULL) {
+		fprintf(stderr, "WARNING, xa_debug() called with '%%s' formatted string [%s]!", buf);
+		goto exit;
+	}
+
+	fprintf(stderr, "[%s(%d)_%s %02d:%02d:%02d.%d] %s\n", tag, line_num, level_string[level],
+			tm->tm_hour, tm->tm_min, tm->tm_sec, (int) tv.tv_usec, buf);
+	fflush(stderr);
+exit:
+	va_end(ap);
+}
+
+#define OLD_ALOGD(x...)	old_sys_debug(LOG_DEBUG, LOG_TAG, __LINE__, x)
+#define OLD_SLOGE(x...)	old_sys_debug(LOG_ERROR, LOG_TAG, __LINE__, x)
+
+/* Calls as NetlinkEvent, ClatdController and RefBase make them. */
+#define CALL_SITES(logd, loge, i) do { \
+		logd("ifi->ifi_flags=%x", (i) * 0x1003); \
+		loge("parseIfAddrMessage on incorrect message type 0x%x\n", (i) & 0xff); \
+		loge("Unknown address family %d\n", (i) % 11); \
+		logd("Stopping clatd pid=%d on %s", 1000 + (i), "wlan0"); \
+		logd("incStrong of %p from %p: cnt=%d", (void *) &log_path, \
+					(void *) &bin_path, (i) & 7); \
+	} while (0)
+#define SITES		5
+
+static long cpu_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void report(const char *what, long caller, long all)
+{
+	printf("  %-24s callers %5.0f ns/call, all %5.0f ns\n", what,
+			(double) caller / ROUNDS / SITES, (double) all / ROUNDS / SITES);
+}
+
+/* Only the CPU time of the calls counts for the callers. */
+static void run(const char *what, bool old)
+{
+	long caller = 0, all = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+	int i, j;
+
+	for (i = 0; i < ROUNDS; i += BURST) {
+		long start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+
+		for (j = i; j < i + BURST; j++) {
+			if (old)
+				CALL_SITES(OLD_ALOGD, OLD_SLOGE, j);
+			else
+				CALL_SITES(ALOGD, SLOGE, j);
+		}
+
+		caller += cpu_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+		usleep(PAUSE);
+	}
+
+	report(what, caller, cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - all);
+}
+
+static void session(const char *what, const char *path, int mode)
+{
+	log_stats_t before, after;
+
+	log_get_stats(&before);
+	if (log_async_start_mode(path, mode) < 0) {
+		perror("log_async_start_mode");
+		exit(EXIT_FAILURE);
+	}
+	run(what, false);
+	log_async_stop();
+	log_get_stats(&after);
+
+	if (after.dropped != before.dropped)
+		printf("  %lu lines dropped\n", after.dropped - before.dropped);
+}
+
+int main(int argc, char *argv[])
+{
+	int saved_stderr = dup(STDERR_FILENO);
+	int fd;
+
+	/* the synchronous paths write to stderr, point it at the log file */
+	fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(log_path);
+		return EXIT_FAILURE;
+	}
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+
+	printf("%d rounds of %d netd log calls:\n", ROUNDS, SITES);
+	run("old log.cpp", true);
+	run("sys_debug_ext", false);
+	session("async, formatted", log_path, LOG_ASYNC_TEXT);
+	session("async, deferred", log_path, LOG_ASYNC_DEFERRED);
+	unlink(bin_path);
+	session("async, binary", bin_path, LOG_ASYNC_BINARY);
+
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	unlink(log_path);
+	unlink(bin_path);
+
+	return EXIT_SUCCESS;
+}
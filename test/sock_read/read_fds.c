@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <sockets.h>
+#include <log_util.h>
+
+#define MESSAGES	(200 * 1000)
+#define MSG_LEN		64
+#define PAIRS		2000		/* enough to push fds past FD_SETSIZE */
+#define ROUNDS		50
+
+static long bytes_read;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_read(void *buf, size_t len)
+{
+	bytes_read += len;
+}
+
+static void count_fd_read(int sockfd, void *buf, ssize_t len, void *user_data)
+{
+	if (len > 0)
+		bytes_read += len;
+	else
+		(*(int *) user_data)++;
+}
+
+/* What sock_read_loop() did before: select() and a cleared stack buffer. */
+static int select_read(int sockfd, socket_read_callback read_callback, int timeout)
+{
+	fd_set rfds;
+	struct timeval tv;
+	char buf[BUFSIZE] = {0};
+	int nr;
+
+	FD_ZERO(&rfds);
+	FD_SET(sockfd, &rfds);
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if (select(sockfd + 1, &rfds, NULL, NULL, &tv) > 0) {
+		memset(buf, 0, sizeof(buf));
+		nr = recv(sockfd, buf, BUFSIZE, 0);
+		if (nr <= 0)
+			return -1;
+		read_callback(buf, nr);
+	}
+
+	return 0;
+}
+
+/*
+ * One socket, one small message per call: the per-read overhead of
+ * select() and clearing the buffer against poll() into a reused one.
+ */
+static void bench_single(void)
+{
+	static char buf[BUFSIZE];
+	char msg[MSG_LEN];
+	double start;
+	int sv[2], i;
+
+	memset(msg, 'm', sizeof(msg));
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		perror("socketpair");
+		return;
+	}
+
+	bytes_read = 0;
+	start = now_sec();
+	for (i = 0; i < MESSAGES; i++) {
+		send(sv[0], msg, MSG_LEN, 0);
+		select_read(sv[1], count_read, 1000);
+	}
+	printf("  %-24s %8.0f ns/read\n", "select + memset",
+			(now_sec() - start) * 1e9 / MESSAGES);
+
+	start = now_sec();
+	for (i = 0; i < MESSAGES; i++) {
+		send(sv[0], msg, MSG_LEN, 0);
+		sock_read_loop(sv[1], count_read, 1000);
+	}
+	printf("  %-24s %8.0f ns/read\n", "sock_read_loop",
+			(now_sec() - start) * 1e9 / MESSAGES);
+
+	start = now_sec();
+	for (i = 0; i < MESSAGES; i++) {
+		send(sv[0], msg, MSG_LEN, 0);
+		sock_read_poll(sv[1], buf, sizeof(buf), count_read, 1000);
+	}
+	printf("  %-24s %8.0f ns/read\n", "sock_read_poll",
+			(now_sec() - start) * 1e9 / MESSAGES);
+
+	if (bytes_read != 3L * MESSAGES * MSG_LEN)
+		printf("  read %ld bytes, expected %ld\n",
+				bytes_read, 3L * MESSAGES * MSG_LEN);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/*
+ * PAIRS sockets, most of them numbered above FD_SETSIZE, all readable
+ * at once and serviced by a single sock_read_fds() call per round.
+ * Closing the writers must report every reader ended exactly once.
+ */
+static void bench_many(void)
+{
+	static struct pollfd pfds[PAIRS];
+	static int writers[PAIRS];
+	static char buf[BUFSIZE];
+	char msg[MSG_LEN];
+	int i, r, ended = 0, serviced = 0;
+	double start;
+
+	memset(msg, 'm', sizeof(msg));
+	for (i = 0; i < PAIRS; i++) {
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			return;
+		}
+		writers[i] = sv[0];
+		pfds[i].fd = sv[1];
+	}
+
+	bytes_read = 0;
+	start = now_sec();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < PAIRS; i++)
+			send(writers[i], msg, MSG_LEN, 0);
+		serviced += sock_read_fds(pfds, PAIRS, buf, sizeof(buf),
+					count_fd_read, &ended, 1000);
+	}
+	printf("  %-24s %8.0f ns/socket, highest fd %d\n", "sock_read_fds",
+			(now_sec() - start) * 1e9 / serviced, pfds[PAIRS - 1].fd);
+
+	for (i = 0; i < PAIRS; i++)
+		close(writers[i]);
+	while (sock_read_fds(pfds, PAIRS, buf, sizeof(buf),
+				count_fd_read, &ended, 100) > 0)
+		;
+
+	if (bytes_read != (long) ROUNDS * PAIRS * MSG_LEN || ended != PAIRS)
+		printf("  read %ld bytes, %d ended; expected %ld and %d\n",
+				bytes_read, ended, (long) ROUNDS * PAIRS * MSG_LEN,
+				PAIRS);
+
+	for (i = 0; i < PAIRS; i++)
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit rl;
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	printf("%d-byte messages, one read per call:\n", MSG_LEN);
+	bench_single();
+
+	printf("%d sockets, one call per round:\n", PAIRS);
+	bench_many();
+
+	return EXIT_SUCCESS;
+}
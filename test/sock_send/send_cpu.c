@@ -0,0 +1,199 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <sockets.h>
+
+#define HEADER		128
+#define BODY		(256 * 1024)
+#define TOTAL_MB	2048		/* sent per method */
+
+enum send_method {
+	SEND_COPY,
+	SEND_WRITEV,
+	SEND_SENDFILE,
+	SEND_ZEROCOPY,
+};
+
+static const char *method_names[] = {
+	"copy + send", "writev", "sendfile", "MSG_ZEROCOPY",
+};
+
+static char header[HEADER], body[BODY], message[HEADER + BODY];
+static int body_fd;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec(int who)
+{
+	struct rusage ru;
+
+	getrusage(who, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Drain the connection until the sender closes it. */
+static void *reader_thread(void *arg)
+{
+	int fd = (int) (long) arg;
+	static char buf[256 * 1024];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+
+	close(fd);
+	return NULL;
+}
+
+static int connect_pair(int *sender, pthread_t *reader)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int lfd, rfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(lfd, 1) < 0 ||
+			getsockname(lfd, (struct sockaddr *) &addr, &len) < 0)
+		return -1;
+
+	*sender = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(*sender, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		return -1;
+
+	rfd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (rfd < 0)
+		return -1;
+
+	return pthread_create(reader, NULL, reader_thread, (void *) (long) rfd);
+}
+
+/* One message: a small header followed by a large body. */
+static int send_message(int fd, enum send_method method, sock_zerocopy_t *zc)
+{
+	struct iovec iov[2];
+	off_t offset = 0;
+
+	switch (method) {
+	case SEND_COPY:
+		memcpy(message, header, HEADER);
+		memcpy(message + HEADER, body, BODY);
+		return sock_write_bytes(fd, message, HEADER + BODY) < 0 ? -1 : 0;
+	case SEND_WRITEV:
+		iov[0].iov_base = header;
+		iov[0].iov_len = HEADER;
+		iov[1].iov_base = body;
+		iov[1].iov_len = BODY;
+		return sock_writev_bytes(fd, iov, 2) < 0 ? -1 : 0;
+	case SEND_SENDFILE:
+		if (sock_write_bytes(fd, header, HEADER) < 0)
+			return -1;
+		return sock_sendfile(fd, body_fd, &offset, BODY) != BODY ? -1 : 0;
+	case SEND_ZEROCOPY:
+		if (sock_write_bytes(fd, header, HEADER) < 0 ||
+				sock_send_zerocopy(fd, body, BODY, zc) < 0)
+			return -1;
+		/* body is never rewritten, so collecting in passing will do */
+		return sock_zerocopy_reap(fd, zc, 0) < 0 ? -1 : 0;
+	}
+
+	return -1;
+}
+
+static void run(enum send_method method)
+{
+	long count = (long) TOTAL_MB * 1024 * 1024 / (HEADER + BODY);
+	double start, thread_cpu, self_cpu, secs, gb;
+	sock_zerocopy_t zc;
+	pthread_t reader;
+	long i;
+	int fd;
+
+	if (connect_pair(&fd, &reader) < 0) {
+		perror("connect");
+		return;
+	}
+
+	if (method == SEND_ZEROCOPY)
+		sock_zerocopy_init(fd, &zc);
+
+	start = now_sec();
+	thread_cpu = cpu_sec(RUSAGE_THREAD);
+	self_cpu = cpu_sec(RUSAGE_SELF);
+
+	for (i = 0; i < count; i++) {
+		if (send_message(fd, method, &zc) < 0) {
+			printf("  %-16s failed after %ld messages\n",
+					method_names[method], i);
+			break;
+		}
+	}
+
+	if (method == SEND_ZEROCOPY)
+		sock_zerocopy_reap(fd, &zc, 1);
+
+	thread_cpu = cpu_sec(RUSAGE_THREAD) - thread_cpu;
+	shutdown(fd, SHUT_WR);
+	pthread_join(reader, NULL);
+	self_cpu = cpu_sec(RUSAGE_SELF) - self_cpu;
+	secs = now_sec() - start;
+	close(fd);
+
+	gb = (double) i * (HEADER + BODY) / (1 << 30);
+	printf("  %-16s %6.2f GB/s %8.0f ms CPU/GB sender %8.0f ms CPU/GB total",
+			method_names[method], gb / secs,
+			thread_cpu * 1e3 / gb, self_cpu * 1e3 / gb);
+	if (method == SEND_ZEROCOPY)
+		printf(", %u sends %lu copied%s", zc.sent, zc.copied,
+				zc.enabled ? "" : " (unsupported)");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/send_cpu.XXXXXX";
+	int i;
+
+	memset(header, 'h', sizeof(header));
+	memset(body, 'b', sizeof(body));
+
+	/* the sendfile body, in the page cache */
+	body_fd = mkstemp(path);
+	if (body_fd < 0 || write(body_fd, body, BODY) != BODY) {
+		perror("body file");
+		return EXIT_FAILURE;
+	}
+	unlink(path);
+
+	printf("TCP over loopback, %d-byte header + %d-byte body messages, %d MB each:\n",
+				HEADER, BODY, TOTAL_MB);
+	for (i = SEND_COPY; i <= SEND_ZEROCOPY; i++)
+		run(i);
+
+	close(body_fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <sockets.h>
+
+#define SERVER_PORT	18765
+#define CONN_COUNT	10000
+#define CONN_WAVE	1000		/* connects queued before any is served */
+#define STREAMS		32
+#define STREAM_SECS	2
+#define CHUNK		(64 * 1024)
+#define ALLOC_COUNT	(1000 * 1000)
+
+void socket_tcp_server_epoll_test_entry();
+
+static struct sockaddr_in server_addr;
+static char chunk[CHUNK];
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(int rcvbuf)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+
+	if (fd < 0)
+		return -1;
+
+	/* must be set before connect to limit the window */
+	if (rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * The server acknowledges every read with "data received: <total>\n".
+ * Track the last complete total per connection.
+ */
+struct ack_parser {
+	long value;
+	long last;
+};
+
+static void ack_parse(struct ack_parser *p, const char *buf, ssize_t len)
+{
+	ssize_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9') {
+			p->value = p->value * 10 + buf[i] - '0';
+		} else if (buf[i] == '\n') {
+			p->last = p->value;
+			p->value = 0;
+		} else {
+			p->value = 0;
+		}
+	}
+}
+
+/* Wait up to msec for the server to acknowledge 'total' bytes. */
+static int wait_ack(int fd, struct ack_parser *p, long total, int msec)
+{
+	char buf[4096];
+
+	while (p->last < total) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		ssize_t n;
+
+		if (poll(&pfd, 1, msec) <= 0)
+			return -1;
+
+		n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n <= 0) {
+			if (n < 0 && errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		ack_parse(p, buf, n);
+	}
+
+	return 0;
+}
+
+/*
+ * Connection rate: waves of CONN_WAVE clients connect before any of
+ * them is served, so the listener sees a full backlog per edge; every
+ * client then sends one byte and waits for its acknowledgement.
+ */
+static void bench_connect(void)
+{
+	static int fds[CONN_WAVE];
+	int done = 0, failed = 0;
+	double start = now_sec();
+
+	while (done + failed < CONN_COUNT) {
+		int i, n = 0;
+
+		for (i = 0; i < CONN_WAVE; i++) {
+			fds[n] = connect_server(0);
+			if (fds[n] < 0)
+				failed++;
+			else
+				n++;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (send(fds[i], "x", 1, 0) != 1)
+				failed++;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct ack_parser p = { 0, 0 };
+
+			if (wait_ack(fds[i], &p, 1, 2000) < 0)
+				failed++;
+			else
+				done++;
+			close(fds[i]);
+		}
+	}
+
+	printf("  %-24s %8.0f conn/s, %d failed\n", "connect + first reply",
+			done / (now_sec() - start), failed);
+}
+
+/*
+ * Throughput: STREAMS connections send 64k chunks whenever writable
+ * and read their acknowledgements, for STREAM_SECS seconds.  Counted
+ * is what the server acknowledged.
+ */
+static void bench_streams(void)
+{
+	struct ack_parser acks[STREAMS];
+	int fds[STREAMS];
+	struct epoll_event ev, events[STREAMS];
+	double start, end;
+	long total = 0;
+	int epfd, i;
+
+	epfd = epoll_create1(0);
+	for (i = 0; i < STREAMS; i++) {
+		fds[i] = connect_server(0);
+		if (fds[i] < 0) {
+			printf("  streams: connect failed\n");
+			return;
+		}
+		sock_set_blocking(fds[i], SOCKET_NONBLOCK);
+		acks[i].value = acks[i].last = 0;
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.u32 = i;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+	}
+
+	start = now_sec();
+	end = start + STREAM_SECS;
+	while (now_sec() < end) {
+		int n = epoll_wait(epfd, events, STREAMS, 100);
+
+		for (i = 0; i < n; i++) {
+			int k = events[i].data.u32;
+			char buf[16384];
+			ssize_t nr;
+
+			if (events[i].events & EPOLLOUT)
+				send(fds[k], chunk, CHUNK, MSG_NOSIGNAL);
+
+			while ((nr = recv(fds[k], buf, sizeof(buf), 0)) > 0)
+				ack_parse(&acks[k], buf, nr);
+		}
+	}
+
+	for (i = 0; i < STREAMS; i++) {
+		total += acks[i].last;
+		close(fds[i]);
+	}
+	close(epfd);
+
+	printf("  %-24s %8.1f MB/s over %d connections\n", "streams",
+			total / (now_sec() - start) / 1e6, STREAMS);
+}
+
+/*
+ * Backpressure: a client which sends but never reads.  The server must
+ * stop reading it once its output queue is full instead of buffering
+ * without bound, stay responsive to others, and catch up once the
+ * client reads again.
+ */
+static void bench_backpressure(void)
+{
+	struct ack_parser p = { 0, 0 }, q = { 0, 0 };
+	long sent = 0;
+	double t;
+	int fd, other;
+
+	fd = connect_server(4096);
+	if (fd < 0)
+		return;
+	sock_set_blocking(fd, SOCKET_NONBLOCK);
+
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		ssize_t n;
+
+		if (poll(&pfd, 1, 500) <= 0)
+			break;
+		n = send(fd, chunk, CHUNK, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				continue;
+			break;
+		}
+		sent += n;
+	}
+	printf("  %-24s %8.1f MB sent before the server stopped reading\n",
+				"non-reading client", sent / 1e6);
+
+	t = now_sec();
+	other = connect_server(0);
+	if (other < 0 || send(other, "x", 1, 0) != 1 ||
+				wait_ack(other, &q, 1, 2000) < 0)
+		printf("  %-24s no reply\n", "other client");
+	else
+		printf("  %-24s %8.0f us to connect and get a reply\n",
+				"other client", (now_sec() - t) * 1e6);
+	if (other >= 0)
+		close(other);
+
+	t = now_sec();
+	if (wait_ack(fd, &p, sent, 10000) < 0)
+		printf("  %-24s stuck at %ld of %ld bytes\n", "resume", p.last, sent);
+	else
+		printf("  %-24s %8.0f ms until all %ld bytes were acknowledged\n",
+				"resume", (now_sec() - t) * 1e3, sent);
+	close(fd);
+}
+
+/*
+ * The allocation work of one accepted connection: from the pool with
+ * inline buffers, against the malloc'ed connection, sockaddr and host
+ * string get_connection() used before.
+ */
+static void bench_alloc(void)
+{
+	struct sockaddr_in sin = server_addr;
+	connection_pool_stats_t stats;
+	double start;
+	int i;
+
+	start = now_sec();
+	for (i = 0; i < ALLOC_COUNT; i++) {
+		connection_t *con = create_connection();
+
+		connection_set_peer(con, &sin, sizeof(sin));
+		clean_connection(con);
+	}
+	printf("  %-24s %8.1f ns/conn\n", "pooled",
+				(now_sec() - start) * 1e9 / ALLOC_COUNT);
+
+	start = now_sec();
+	for (i = 0; i < ALLOC_COUNT; i++) {
+		connection_t *con = malloc(sizeof(*con));
+
+		con->sin = malloc(sizeof(*con->sin));
+		memcpy(con->sin, &sin, sizeof(sin));
+		con->host = make_host(&sin.sin_addr);
+		free(con->host);
+		free(con->sin);
+		free(con);
+	}
+	printf("  %-24s %8.1f ns/conn\n", "malloc",
+				(now_sec() - start) * 1e9 / ALLOC_COUNT);
+
+	connection_pool_stats(&stats);
+	printf("  %-24s %lu slabs, %lu capacity, %lu in use, %lu allocs, %lu frees\n",
+			"pool", stats.slabs, stats.capacity, stats.in_use,
+			stats.allocs, stats.frees);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit rl;
+	int i;
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	init_network();
+	server_info.tcp_port = argc > 1 ? atoi(argv[1]) : SERVER_PORT;
+	socket_tcp_server_epoll_test_entry();
+
+	for (i = 0; i < 200 && server_info.tcp_running != SERVER_RUNNING; i++)
+		usleep(10 * 1000);
+	if (server_info.tcp_running != SERVER_RUNNING) {
+		printf("server did not come up\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_addr.sin_port = htons(server_info.tcp_port);
+	memset(chunk, 'x', sizeof(chunk));
+
+	printf("epoll TCP server on port %d:\n", server_info.tcp_port);
+	bench_connect();
+	bench_streams();
+	bench_backpressure();
+
+	printf("connection objects, %d:\n", ALLOC_COUNT);
+	bench_alloc();
+
+	server_info.tcp_running = SERVER_DYING;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <threads.h>
+#include <thread_pool.h>
+
+#define THREAD_TASKS	20000		/* thread_create() is slow */
+#define POOL_TASKS	(1000 * 1000)
+#define FUTURE_BATCH	1000
+#define FIB_N		24
+#define FIB_CUTOFF	12		/* below this a task computes inline */
+
+static long finished;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A short task: a little arithmetic, then count. */
+static void *count_task(void *arg)
+{
+	unsigned long i, x = (unsigned long) arg;
+
+	for (i = 0; i < 32; i++)
+		x = x * 31 + i;
+
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+	return (void *) x;
+}
+
+static void wait_finished(long count)
+{
+	while (__atomic_load_n(&finished, __ATOMIC_RELAXED) < count)
+		sched_yield();
+}
+
+static void report(const char *what, long tasks, double start)
+{
+	double secs = now_sec() - start;
+
+	printf("  %-34s %9.0f tasks/s %8.0f ns/task\n", what, tasks / secs,
+							secs * 1e9 / tasks);
+}
+
+/* What callers do now: one detached thread per task. */
+static void bench_thread_create(void)
+{
+	int saved_stdout = dup(STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	pthread_t tid;
+	double start;
+	long i;
+
+	/* thread_create() prints a line for every thread */
+	fflush(stdout);
+	dup2(devnull, STDOUT_FILENO);
+
+	__atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+	start = now_sec();
+	for (i = 0; i < THREAD_TASKS; i++)
+		thread_create(&tid, count_task, (void *) i);
+	wait_finished(THREAD_TASKS);
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(devnull);
+
+	report("thread_create", THREAD_TASKS, start);
+}
+
+static void bench_submit(thread_pool_t *pool)
+{
+	double start;
+	long i;
+
+	__atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+	start = now_sec();
+	for (i = 0; i < POOL_TASKS; i++)
+		thread_pool_submit(pool, count_task, (void *) i, NULL, NULL);
+	wait_finished(POOL_TASKS);
+	report("thread_pool_submit", POOL_TASKS, start);
+}
+
+static void bench_futures(thread_pool_t *pool)
+{
+	thread_future_t *futures[FUTURE_BATCH];
+	double start;
+	long i, j;
+
+	__atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+	start = now_sec();
+	for (i = 0; i < POOL_TASKS; i += FUTURE_BATCH) {
+		for (j = 0; j < FUTURE_BATCH; j++)
+			futures[j] = thread_pool_async(pool, count_task,
+							(void *) (i + j));
+		for (j = 0; j < FUTURE_BATCH; j++)
+			thread_future_wait(futures[j]);
+	}
+	report("thread_pool_async + wait", POOL_TASKS, start);
+}
+
+static long fib_serial(long n)
+{
+	return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+static thread_pool_t *fib_pool;
+static long fib_tasks;
+
+/* Fork/join: every call above the cutoff forks one half as a task. */
+static void *fib_task(void *arg)
+{
+	long n = (long) arg, a, b;
+	thread_future_t *f;
+
+	__atomic_add_fetch(&fib_tasks, 1, __ATOMIC_RELAXED);
+	if (n < FIB_CUTOFF)
+		return (void *) fib_serial(n);
+
+	f = thread_pool_async(fib_pool, fib_task, (void *) (n - 1));
+	b = (long) fib_task((void *) (n - 2));
+	a = (long) thread_future_wait(f);
+
+	return (void *) (a + b);
+}
+
+int main(int argc, char *argv[])
+{
+	int workers[] = { 1, 4, 0 };
+	unsigned int w;
+
+	printf("short tasks:\n");
+	bench_thread_create();
+
+	for (w = 0; w < sizeof(workers) / sizeof(workers[0]); w++) {
+		thread_pool_t *pool = thread_pool_new(workers[w]);
+		char what[64];
+		double start;
+		long fib, i;
+
+		if (!pool) {
+			perror("thread_pool_new");
+			return EXIT_FAILURE;
+		}
+
+		printf("%d workers:\n", thread_pool_workers(pool));
+		bench_submit(pool);
+		bench_futures(pool);
+
+		fib_pool = pool;
+		fib_tasks = 0;
+		start = now_sec();
+		fib = (long) thread_future_wait(thread_pool_async(pool, fib_task,
+							(void *) FIB_N));
+		snprintf(what, sizeof(what), "fork/join fib(%d)", FIB_N);
+		report(what, fib_tasks, start);
+		if (fib != fib_serial(FIB_N))
+			printf("  fib(%d) = %ld, expected %ld\n", FIB_N, fib,
+							fib_serial(FIB_N));
+
+		/* graceful: what is queued still runs */
+		__atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+		for (i = 0; i < 100000; i++)
+			thread_pool_submit(pool, count_task, NULL, NULL, NULL);
+		thread_pool_destroy(pool);
+		i = __atomic_load_n(&finished, __ATOMIC_RELAXED);
+		if (i != 100000)
+			printf("  %ld of 100000 tasks ran before destroy returned\n", i);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <sockets.h>
+
+#define BASE_PORT	18800
+#define CLIENT_SOCKS	8		/* distinct source ports for SO_REUSEPORT */
+#define WINDOW		32		/* datagrams in flight per client socket */
+#define PAYLOAD		64
+#define RUN_SECS	2
+
+void socket_udp_server_test_entry();
+void socket_udp_server_batch_entry(int workers);
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Every client socket keeps WINDOW datagrams in flight, sent with one
+ * sendmmsg and collected with recvmmsg, so the client costs about what
+ * the batched server costs.  A window with no echo for 50ms counts as
+ * lost and is sent again.
+ */
+static void run_clients(const char *what, int port)
+{
+	static char payload[PAYLOAD], bufs[WINDOW][PAYLOAD];
+	struct mmsghdr out[WINDOW], in[WINDOW];
+	struct iovec out_iov[WINDOW], in_iov[WINDOW];
+	struct pollfd pfds[CLIENT_SOCKS];
+	int outstanding[CLIENT_SOCKS];
+	double last_echo[CLIENT_SOCKS];
+	struct sockaddr_in addr;
+	long echoed = 0, lost = 0;
+	double start, end;
+	int i, s;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	memset(out, 0, sizeof(out));
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < WINDOW; i++) {
+		out_iov[i].iov_base = payload;
+		out_iov[i].iov_len = PAYLOAD;
+		out[i].msg_hdr.msg_iov = &out_iov[i];
+		out[i].msg_hdr.msg_iovlen = 1;
+		in_iov[i].iov_base = bufs[i];
+		in_iov[i].iov_len = PAYLOAD;
+		in[i].msg_hdr.msg_iov = &in_iov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (s = 0; s < CLIENT_SOCKS; s++) {
+		pfds[s].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		pfds[s].events = POLLIN;
+		if (pfds[s].fd < 0 ||
+			connect(pfds[s].fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			perror("client socket");
+			return;
+		}
+		outstanding[s] = 0;
+	}
+
+	start = now_sec();
+	end = start + RUN_SECS;
+	while (now_sec() < end) {
+		double now = now_sec();
+
+		for (s = 0; s < CLIENT_SOCKS; s++) {
+			int n;
+
+			if (outstanding[s] && now - last_echo[s] > 0.05) {
+				lost += outstanding[s];
+				outstanding[s] = 0;
+			}
+
+			if (!outstanding[s]) {
+				n = sendmmsg(pfds[s].fd, out, WINDOW, 0);
+				if (n > 0)
+					outstanding[s] = n;
+				last_echo[s] = now;
+			}
+
+			n = recvmmsg(pfds[s].fd, in, WINDOW, MSG_DONTWAIT, NULL);
+			if (n > 0) {
+				echoed += n;
+				outstanding[s] -= n;
+				if (outstanding[s] < 0)
+					outstanding[s] = 0;
+				last_echo[s] = now;
+			}
+		}
+
+		poll(pfds, CLIENT_SOCKS, 1);
+	}
+
+	for (s = 0; s < CLIENT_SOCKS; s++)
+		close(pfds[s].fd);
+
+	printf("  %-24s %8.0f kpps echoed, %ld lost\n", what,
+			echoed / (now_sec() - start) / 1e3, lost);
+}
+
+static int wait_running(void)
+{
+	int i;
+
+	for (i = 0; i < 200 && server_info.udp_running != SERVER_RUNNING; i++)
+		usleep(10 * 1000);
+
+	return server_info.udp_running == SERVER_RUNNING ? 0 : -1;
+}
+
+static void stop_server(void)
+{
+	server_info.udp_running = SERVER_DYING;
+	/* both server kinds wait at most 100ms at a time */
+	usleep(300 * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	int workers = argc > 1 ? atoi(argv[1]) : 4;
+
+	init_network();
+
+	printf("UDP echo over loopback, %d-byte datagrams, %d client sockets:\n",
+				PAYLOAD, CLIENT_SOCKS);
+
+	server_info.udp_port = BASE_PORT;
+	socket_udp_server_test_entry();
+	if (wait_running() == 0)
+		run_clients("recvfrom/sendto", BASE_PORT);
+	stop_server();
+
+	server_info.udp_port = BASE_PORT + 1;
+	socket_udp_server_batch_entry(1);
+	if (wait_running() == 0)
+		run_clients("recvmmsg/sendmmsg", BASE_PORT + 1);
+	stop_server();
+
+	server_info.udp_port = BASE_PORT + 2;
+	socket_udp_server_batch_entry(workers);
+	if (wait_running() == 0) {
+		char what[32];
+
+		snprintf(what, sizeof(what), "%d SO_REUSEPORT workers", workers);
+		run_clients(what, BASE_PORT + 2);
+	}
+	stop_server();
+
+	return EXIT_SUCCESS;
+}